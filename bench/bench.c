@@ -0,0 +1,155 @@
+/* clock_gettime */
+#define _POSIX_C_SOURCE 199309L
+
+#include <stdio.h>   /* printf, fprintf, stderr */
+#include <stdlib.h>  /* free, atoi, exit, EXIT_SUCCESS, EXIT_FAILURE */
+#include <string.h>  /* strcmp, strrchr */
+#include <stdbool.h> /* bool, true, false */
+#include <time.h>    /* clock_gettime, struct timespec, CLOCK_MONOTONIC */
+#include <math.h>    /* sqrt */
+
+#include "avm/vm.h"
+#include "avm/fuse.h"
+#include "avm/jit.h"
+#include "avm/ir.h"
+#include "loader.h"
+
+/* Runs each program a number of times and reports the run time, without the
+ * loading. The executed instruction count comes from one extra run on the
+ * checked interpreter, so it does not depend on superinstructions.
+ *
+ * Usage: bench [-r REPEAT] [--jit | --ir] [--noFuse] FILES...
+ */
+
+#define DEFAULT_REPEAT 10
+
+enum mode {
+	MODE_INTERPRETER = 0,
+	MODE_JIT,
+	MODE_IR,
+};
+
+struct options {
+	int       repeat;
+	enum mode mode;
+	bool      fuse;
+};
+
+static double now_ms(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static struct inst *load(struct vm *p_vm, const char *p_path, struct options *p_opts) {
+	vm_init(p_vm);
+	if (!p_opts->fuse)
+		p_vm->fuse_rules = FUSE_NONE;
+
+	return vm_load_from_file(p_vm, p_path, false, false);
+}
+
+static word_t count_insts(const char *p_path, struct options *p_opts) {
+	struct vm    vm;
+	struct inst *program = load(&vm, p_path, p_opts);
+
+	word_t count = 0;
+	while (vm.ip < vm.program_size && !VM_HALT(&vm)) {
+		int ret = vm_exec_next_inst(&vm);
+		if (ret != ERR_OK)
+			vm_panic(&vm, ret);
+
+		++ count;
+	}
+
+	free(program);
+	vm_destroy(&vm);
+
+	return count;
+}
+
+static double run_once(const char *p_path, struct options *p_opts) {
+	struct vm    vm;
+	struct inst *program = load(&vm, p_path, p_opts);
+
+	double start = now_ms();
+	switch (p_opts->mode) {
+	case MODE_JIT: vm_run_jit(&vm); break;
+	case MODE_IR:  vm_run_ir(&vm);  break;
+
+	default: vm_run(&vm);
+	}
+	double time = now_ms() - start;
+
+	free(program);
+	vm_destroy(&vm);
+
+	return time;
+}
+
+static void bench(const char *p_path, struct options *p_opts) {
+	word_t insts = count_insts(p_path, p_opts);
+
+	double sum = 0, sum_sq = 0, min = 0;
+	for (int i = 0; i < p_opts->repeat; ++ i) {
+		double time = run_once(p_path, p_opts);
+
+		sum    += time;
+		sum_sq += time * time;
+		if (i == 0 || time < min)
+			min = time;
+	}
+
+	double mean     = sum / p_opts->repeat;
+	double variance = sum_sq / p_opts->repeat - mean * mean;
+	double stddev   = variance > 0? sqrt(variance) : 0;
+	double ns       = insts > 0? mean * 1000000.0 / insts : 0;
+
+	const char *name = strrchr(p_path, '/');
+	name = name == NULL? p_path : name + 1;
+
+	printf("%-14s %12llu %5i %10.2f %8.2f %6.1f%% %10.2f %8.3f %10.1f\n",
+	       name, (unsigned long long)insts, p_opts->repeat, mean, stddev,
+	       mean > 0? stddev / mean * 100 : 0, min, ns, ns > 0? 1000.0 / ns : 0);
+}
+
+int main(int p_argc, char **p_argv) {
+	struct options opts = {
+		.repeat = DEFAULT_REPEAT,
+		.mode   = MODE_INTERPRETER,
+		.fuse   = true,
+	};
+
+	int  first = p_argc;
+	bool modes = false; /* --jit and --ir together */
+	for (int i = 1; i < p_argc; ++ i) {
+		if (strcmp(p_argv[i], "-r") == 0 && i + 1 < p_argc)
+			opts.repeat = atoi(p_argv[++ i]);
+		else if (strcmp(p_argv[i], "--jit") == 0) {
+			modes    |= opts.mode == MODE_IR;
+			opts.mode = MODE_JIT;
+		} else if (strcmp(p_argv[i], "--ir") == 0) {
+			modes    |= opts.mode == MODE_JIT;
+			opts.mode = MODE_IR;
+		} else if (strcmp(p_argv[i], "--noFuse") == 0)
+			opts.fuse = false;
+		else {
+			first = i;
+			break;
+		}
+	}
+
+	if (first == p_argc || opts.repeat < 1 || modes) {
+		fprintf(stderr, "Usage: %s [-r REPEAT] [--jit | --ir] [--noFuse] FILES...\n", p_argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	printf("%-14s %12s %5s %10s %8s %7s %10s %8s %10s\n",
+	       "program", "insts", "runs", "mean ms", "stddev", "%", "min ms", "ns/inst", "Minst/s");
+
+	for (int i = first; i < p_argc; ++ i)
+		bench(p_argv[i], &opts);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,152 @@
+#ifndef AOT_H__HEADER_GUARD__
+#define AOT_H__HEADER_GUARD__
+
+/* Runtime of the C code written by `avm --emit-c`. The generated code keeps the
+ * stack pointer in a local variable and uses the vm for everything else, so it
+ * links against the same vm sources as the interpreter (file IO, shared
+ * libraries, dumps and panics).
+ *
+ * Any check that fails hands the execution over to the interpreter at the
+ * failing instruction, which runs it again and reports the error exactly like
+ * `avm` would. The macros expect `p_vm`, `stack` and `sp` to be in scope.
+ */
+
+#include <stdint.h>  /* uint8_t, uint64_t */
+#include <stdbool.h> /* bool, true, false */
+#include <string.h>  /* memcpy */
+
+#include "vm.h"
+#include "layout.h"
+#include "bytes.h"
+
+#define AOT_REGS \
+	value_t *stack = p_vm->stack; \
+	word_t   sp    = p_vm->sp; \
+	(void)stack
+
+#define AOT_TOP(P_N) stack[sp - (P_N) - 1]
+
+#define AOT_FALLBACK(P_IP) \
+	do { \
+		p_vm->ip = P_IP; \
+		p_vm->sp = sp; \
+		vm_run(p_vm); \
+		return; \
+	} while (0)
+
+#define AOT_NEED(P_IP, P_COUNT) \
+	if (sp < (word_t)(P_COUNT)) \
+		AOT_FALLBACK(P_IP)
+
+#define AOT_ROOM(P_IP) \
+	if (sp >= p_vm->stack_capacity) \
+		AOT_FALLBACK(P_IP)
+
+/* Checks stack_bounds.grow of a verified block, with AOT_NEED for the need */
+#define AOT_GROW(P_IP, P_GROW) \
+	if (sp + (word_t)(P_GROW) > p_vm->stack_capacity) \
+		AOT_FALLBACK(P_IP)
+
+#define AOT_PUSH(P_VALUE) stack[sp ++].u64 = P_VALUE
+
+#define AOT_BINARY(P_TYPE, P_OP) \
+	AOT_TOP(1).P_TYPE = AOT_TOP(1).P_TYPE P_OP AOT_TOP(0).P_TYPE; \
+	-- sp
+
+#define AOT_COMPARE(P_TYPE, P_OP) \
+	AOT_TOP(1).u64 = AOT_TOP(1).P_TYPE P_OP AOT_TOP(0).P_TYPE; \
+	-- sp
+
+#define AOT_DIVISION(P_IP, P_OP) \
+	if (AOT_TOP(0).u64 == 0) \
+		AOT_FALLBACK(P_IP); \
+\
+	AOT_BINARY(u64, P_OP)
+
+#define AOT_DUP(P_N) \
+	stack[sp].u64 = AOT_TOP(P_N).u64; \
+	++ sp
+
+#define AOT_SWAP(P_N) \
+	do { \
+		word_t tmp = AOT_TOP(0).u64; \
+		AOT_TOP(0).u64    = AOT_TOP(P_N).u64; \
+		AOT_TOP(P_N).u64 = tmp; \
+	} while (0)
+
+/* P_OPERAND is the vm_operand_index of the return address, for the interpreter */
+#define AOT_CALL(P_IP, P_OPERAND, P_LABEL) \
+	if (p_vm->cs >= p_vm->call_stack_capacity) \
+		AOT_FALLBACK(P_IP); \
+\
+	p_vm->call_stack[p_vm->cs ++] = (struct frame){(P_IP) + 1, P_OPERAND}; \
+	goto P_LABEL
+
+/* Jumps to `ret`, which dispatches on the return address in `ret_ip` */
+#define AOT_RET(P_IP) \
+	if (p_vm->cs <= 0) \
+		AOT_FALLBACK(P_IP); \
+\
+	ret_ip = p_vm->call_stack[-- p_vm->cs].ip; \
+	goto ret
+
+/* Same bounds check as vm_is_chunk_valid */
+#define AOT_READ(P_IP, P_SIZE) \
+	do { \
+		word_t addr = AOT_TOP(0).u64; \
+		if (addr >= p_vm->memory_size - (P_SIZE) + 1) \
+			AOT_FALLBACK(P_IP); \
+\
+		AOT_TOP(0).u64 = bytes_load(p_vm->memory + addr, P_SIZE, p_vm->little_endian); \
+	} while (0)
+
+#define AOT_WRITE(P_IP, P_SIZE) \
+	do { \
+		word_t addr = AOT_TOP(1).u64; \
+		if (addr >= p_vm->memory_size - (P_SIZE) + 1) \
+			AOT_FALLBACK(P_IP); \
+\
+		bytes_store(p_vm->memory + addr, AOT_TOP(0).u64, P_SIZE, p_vm->little_endian); \
+		sp -= 2; \
+	} while (0)
+
+#define AOT_HALT(P_IP) \
+	p_vm->ex   = stack[-- sp].u64; \
+	VM_SET_HALT(p_vm, HALT_PROGRAM); \
+	p_vm->ip   = (P_IP) + 1; \
+	p_vm->sp   = sp; \
+	return
+
+#define AOT_END(P_IP) \
+	p_vm->ip = P_IP; \
+	p_vm->sp = sp; \
+	return
+
+/* Instructions that are not translated are run by the interpreter */
+#define AOT_INTERPRET(P_IP) \
+	do { \
+		p_vm->ip = P_IP; \
+		p_vm->sp = sp; \
+\
+		int err = vm_exec_next_inst(p_vm); \
+		if (err != ERR_OK) \
+			vm_panic(p_vm, err); \
+\
+		sp = p_vm->sp; \
+	} while (0)
+
+/* Sets the vm up like vm_load_from_file, without reading or verifying anything */
+static inline void aot_load(struct vm *p_vm, const uint8_t *p_memory, word_t p_memory_size,
+                            struct inst *p_program, word_t p_program_size, word_t p_ep) {
+	vm_alloc_mem(p_vm, p_memory_size);
+	memcpy(p_vm->memory, p_memory, p_memory_size);
+
+	p_vm->program      = p_program;
+	p_vm->program_size = p_program_size;
+	p_vm->ip           = p_ep;
+
+	vm_layout(p_vm);
+	p_vm->code = p_vm->ops;
+}
+
+#endif
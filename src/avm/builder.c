@@ -0,0 +1,283 @@
+#include "builder.h"
+
+#define BUILDER_MIN_CAPACITY 64
+
+void builder_init(struct builder *p_builder) {
+	memset(p_builder, 0, sizeof(struct builder));
+}
+
+void builder_free(struct builder *p_builder) {
+	free(p_builder->program);
+	free(p_builder->memory);
+	free(p_builder->symbols);
+
+	builder_init(p_builder);
+}
+
+static word_t append(struct builder *p_builder, enum opcode p_op, value_t p_data) {
+	if (p_builder->err != ERR_OK)
+		return p_builder->size;
+
+	if (p_builder->size >= p_builder->capacity) {
+		word_t       capacity = p_builder->capacity * 2 + BUILDER_MIN_CAPACITY;
+		struct inst *program  = (struct inst*)realloc(p_builder->program,
+		                                              sizeof(struct inst) * capacity);
+		if (program == NULL) {
+			p_builder->err = ERR_OUT_OF_MEMORY;
+			return p_builder->size;
+		}
+
+		p_builder->program  = program;
+		p_builder->capacity = capacity;
+	}
+
+	word_t addr = p_builder->size ++;
+	p_builder->program[addr].op   = p_op;
+	p_builder->program[addr].data = p_data;
+
+	return addr;
+}
+
+word_t builder_emit(struct builder *p_builder, enum opcode p_op, word_t p_data) {
+	value_t data = {.u64 = p_data};
+	return append(p_builder, p_op, data);
+}
+
+word_t builder_emit_f64(struct builder *p_builder, enum opcode p_op, double p_data) {
+	value_t data = {.f64 = p_data};
+	return append(p_builder, p_op, data);
+}
+
+void builder_patch(struct builder *p_builder, word_t p_addr, word_t p_data) {
+	if (p_addr < p_builder->size)
+		p_builder->program[p_addr].data.u64 = p_data;
+}
+
+void builder_set_memory(struct builder *p_builder, const uint8_t *p_data, word_t p_size) {
+	if (p_builder->err != ERR_OK)
+		return;
+
+	uint8_t *memory = (uint8_t*)realloc(p_builder->memory, p_size > 0? p_size : 1);
+	if (memory == NULL) {
+		p_builder->err = ERR_OUT_OF_MEMORY;
+		return;
+	}
+
+	memcpy(memory, p_data, p_size);
+
+	p_builder->memory      = memory;
+	p_builder->memory_size = p_size;
+}
+
+void builder_set_entry_point(struct builder *p_builder, word_t p_addr) {
+	p_builder->entry_point = p_addr;
+}
+
+void builder_set_bss(struct builder *p_builder, word_t p_size) {
+	p_builder->bss_size = p_size;
+}
+
+void builder_set_little_endian(struct builder *p_builder, bool p_little_endian) {
+	p_builder->little_endian = p_little_endian;
+}
+
+void builder_set_stack_sizes(struct builder *p_builder, word_t p_stack, word_t p_call_stack) {
+	p_builder->stack_size      = p_stack;
+	p_builder->call_stack_size = p_call_stack;
+}
+
+void builder_add_symbol(struct builder *p_builder, const char *p_name, word_t p_addr,
+                        word_t p_size) {
+	if (p_builder->err != ERR_OK)
+		return;
+
+	size_t   name_size = strlen(p_name);
+	word_t   size      = p_builder->symbols_size + sizeof(struct file_symbol) + name_size;
+	uint8_t *symbols   = (uint8_t*)realloc(p_builder->symbols, size);
+	if (symbols == NULL) {
+		p_builder->err = ERR_OUT_OF_MEMORY;
+		return;
+	}
+
+	struct file_symbol *entry = (struct file_symbol*)(symbols + p_builder->symbols_size);
+	bytes_store(entry->addr,      p_addr,    sizeof(word_t), false);
+	bytes_store(entry->size,      p_size,    sizeof(word_t), false);
+	bytes_store(entry->name_size, name_size, sizeof(word_t), false);
+	memcpy(entry + 1, p_name, name_size);
+
+	p_builder->symbols      = symbols;
+	p_builder->symbols_size = size;
+}
+
+/* The checks of the loader, so that a built program and a written one fail
+   the same way */
+static enum err load_extras(const struct builder *p_builder, struct vm *p_vm) {
+	if (p_builder->bss_size > (word_t)-1 - p_builder->memory_size)
+		return vm_fail(p_vm, ERR_INVALID_EXECUTABLE, "The memory segment is too big");
+
+	enum err err = vm_alloc_zeroed_mem(p_vm, p_builder->memory_size + p_builder->bss_size);
+	if (err != ERR_OK)
+		return err;
+
+	if (p_builder->memory_size > 0)
+		memcpy(p_vm->memory, p_builder->memory, p_builder->memory_size);
+
+	p_vm->little_endian = p_builder->little_endian;
+
+	if (p_builder->stack_size > 0 || p_builder->call_stack_size > 0) {
+		word_t capacity      = p_builder->stack_size / sizeof(value_t);
+		word_t call_capacity = p_builder->call_stack_size / sizeof(word_t);
+		if (capacity > MAX_STACK_CAPACITY || call_capacity > MAX_STACK_CAPACITY ||
+		    (p_builder->stack_size > 0 && capacity == 0) ||
+		    (p_builder->call_stack_size > 0 && call_capacity == 0))
+			return vm_fail(p_vm, ERR_INVALID_EXECUTABLE, "Invalid stack size");
+
+		err = vm_alloc_stacks(p_vm, capacity > 0? capacity : p_vm->stack_capacity,
+		                      call_capacity > 0? call_capacity : p_vm->call_stack_capacity);
+		if (err != ERR_OK)
+			return err;
+	}
+
+	if (p_builder->symbols_size > 0) {
+		err = vm_load_symbols(p_vm, p_builder->symbols, p_builder->symbols_size);
+		if (err == ERR_INVALID_EXECUTABLE)
+			return vm_fail(p_vm, err, "Invalid symbol section");
+	}
+
+	return err;
+}
+
+enum err builder_load_program(const struct builder *p_builder, struct vm *p_vm,
+                              struct inst *p_program) {
+	if (p_builder->err != ERR_OK)
+		return vm_fail(p_vm, p_builder->err, "The program could not be built: %s",
+		               err_str(p_builder->err));
+
+	enum err err = load_extras(p_builder, p_vm);
+	if (err != ERR_OK)
+		return err;
+
+	return vm_load_from_mem(p_vm, p_program, p_builder->size, p_builder->entry_point);
+}
+
+enum err builder_load(struct builder *p_builder, struct vm *p_vm) {
+	return builder_load_program(p_builder, p_vm, p_builder->program);
+}
+
+static void write_word(FILE *p_file, word_t p_word) {
+	uint8_t bytes[sizeof(word_t)];
+	bytes_store(bytes, p_word, sizeof(word_t), false);
+
+	fwrite(bytes, 1, sizeof(bytes), p_file);
+}
+
+static void write_section(FILE *p_file, enum section_type p_type, word_t p_offset, word_t p_size) {
+	write_word(p_file, p_type);
+	write_word(p_file, p_offset);
+	write_word(p_file, p_size);
+}
+
+/* Zeros up to p_offset, the sections start on FILE_SECTION_ALIGN */
+static void write_padding(FILE *p_file, word_t *p_at, word_t p_offset) {
+	static const uint8_t zeros[0x100] = {0};
+
+	while (*p_at < p_offset) {
+		size_t size = p_offset - *p_at < sizeof(zeros)? p_offset - *p_at : sizeof(zeros);
+		fwrite(zeros, 1, size, p_file);
+
+		*p_at += size;
+	}
+}
+
+static word_t align_section(word_t p_at) {
+	return (p_at + FILE_SECTION_ALIGN - 1) / FILE_SECTION_ALIGN * FILE_SECTION_ALIGN;
+}
+
+bool builder_write(const struct builder *p_builder, FILE *p_file) {
+	if (p_builder->err != ERR_OK) {
+		errno = ENOMEM;
+		return false;
+	}
+
+	/* The sections with contents, in the order they are written */
+	struct {
+		enum section_type type;
+		word_t            size;
+		bool              present;
+	} contents[] = {
+		{SECTION_CODE,    p_builder->size * sizeof(struct inst), true},
+		{SECTION_DATA,    p_builder->memory_size,                p_builder->memory_size > 0},
+		{SECTION_SYMBOLS, p_builder->symbols_size,               p_builder->symbols_size > 0},
+	};
+
+	/* And the ones that only have a size */
+	struct {
+		enum section_type type;
+		word_t            size;
+	} sizes[] = {
+		{SECTION_BSS,        p_builder->bss_size},
+		{SECTION_STACK,      p_builder->stack_size},
+		{SECTION_CALL_STACK, p_builder->call_stack_size},
+		{SECTION_FLAGS,      p_builder->little_endian? FILE_FLAG_LITTLE_ENDIAN : 0},
+	};
+
+	word_t count = 0;
+	for (size_t i = 0; i < ARRAY_SIZE(contents); ++ i)
+		count += contents[i].present;
+
+	for (size_t i = 0; i < ARRAY_SIZE(sizes); ++ i)
+		count += sizes[i].size > 0;
+
+	struct file_header header;
+	memcpy(header.magic, "AVS", 3);
+	header.ver[0] = VERSION_MAJOR;
+	header.ver[1] = VERSION_MINOR;
+	header.ver[2] = VERSION_PATCH;
+	bytes_store(header.entry_point,   p_builder->entry_point, sizeof(word_t), false);
+	bytes_store(header.section_count, count,                  sizeof(word_t), false);
+
+	fwrite(&header, sizeof(header), 1, p_file);
+
+	word_t offsets[ARRAY_SIZE(contents)];
+	word_t at = align_section(sizeof(header) + count * sizeof(struct file_section));
+	for (size_t i = 0; i < ARRAY_SIZE(contents); ++ i) {
+		if (!contents[i].present)
+			continue;
+
+		offsets[i] = at;
+		at         = align_section(at + contents[i].size);
+
+		write_section(p_file, contents[i].type, offsets[i], contents[i].size);
+	}
+
+	for (size_t i = 0; i < ARRAY_SIZE(sizes); ++ i) {
+		if (sizes[i].size > 0)
+			write_section(p_file, sizes[i].type, 0, sizes[i].size);
+	}
+
+	at = sizeof(header) + count * sizeof(struct file_section);
+	write_padding(p_file, &at, offsets[0]);
+
+	for (word_t i = 0; i < p_builder->size; ++ i) {
+		uint8_t inst[sizeof(struct inst)];
+		inst[0] = p_builder->program[i].op;
+		bytes_store(inst + 1, p_builder->program[i].data.u64, sizeof(word_t), false);
+
+		fwrite(inst, 1, sizeof(inst), p_file);
+	}
+
+	at += contents[0].size;
+
+	const uint8_t *bytes[] = {NULL, p_builder->memory, p_builder->symbols};
+	for (size_t i = 1; i < ARRAY_SIZE(contents); ++ i) {
+		if (!contents[i].present)
+			continue;
+
+		write_padding(p_file, &at, offsets[i]);
+		fwrite(bytes[i], 1, contents[i].size, p_file);
+
+		at += contents[i].size;
+	}
+
+	return !ferror(p_file);
+}
@@ -0,0 +1,98 @@
+#ifndef BUILDER_H__HEADER_GUARD__
+#define BUILDER_H__HEADER_GUARD__
+
+#include <stdint.h>  /* uint8_t */
+#include <stdlib.h>  /* realloc, free */
+#include <string.h>  /* memcpy, memset, strlen */
+#include <stdio.h>   /* FILE, fwrite, ferror */
+#include <errno.h>   /* errno, ENOMEM */
+#include <stdbool.h> /* bool, true, false */
+
+#include "vm.h"
+#include "bytes.h"
+#include "symbols.h"
+
+/* Builds a program in memory, for code generators and tests. The program is
+ * loaded with vm_load_from_mem, without an executable on disk:
+ *
+ *   struct builder builder;
+ *   builder_init(&builder);
+ *
+ *   builder_emit(&builder, OP_PSH, 10);
+ *   word_t loop = builder_emit(&builder, OP_DEC, 0);
+ *   builder_emit(&builder, OP_DUP, 0);
+ *   builder_emit(&builder, OP_JNZ, loop);
+ *
+ *   if (builder_load(&builder, &vm) == ERR_OK)
+ *       vm_run(&vm);
+ *
+ *   vm_destroy(&vm);
+ *   builder_free(&builder);
+ *
+ * Nothing exits on an allocation failure. The builder keeps the error, ignores
+ * what comes after it and builder_load returns it, so the emits need no checks.
+ *
+ * builder_write writes the same program as a sectioned executable, with the
+ * symbols, the stack sizes and the flags.
+ */
+struct builder {
+	struct inst *program;
+	word_t       size, capacity;
+
+	uint8_t *memory; /* Initial memory of the vm */
+	word_t   memory_size;
+	word_t   bss_size;      /* Zeros after the memory */
+	bool     little_endian; /* See FILE_FLAG_LITTLE_ENDIAN */
+	word_t   entry_point;
+
+	uint8_t *symbols; /* The symbol section, struct file_symbol entries */
+	word_t   symbols_size;
+
+	word_t stack_size, call_stack_size; /* In bytes, 0 for the default */
+
+	enum err err; /* ERR_OUT_OF_MEMORY after an allocation failure */
+};
+
+void builder_init(struct builder *p_builder);
+void builder_free(struct builder *p_builder);
+
+/* Appends an instruction, p_data is its operand (0 if it has none). Returns
+   its address, which is what jumps and calls take */
+word_t builder_emit    (struct builder *p_builder, enum opcode p_op, word_t p_data);
+word_t builder_emit_f64(struct builder *p_builder, enum opcode p_op, double p_data);
+
+/* Sets the operand of an appended instruction, for jumps forward */
+void builder_patch(struct builder *p_builder, word_t p_addr, word_t p_data);
+
+/* Copies p_size bytes as the initial memory */
+void builder_set_memory(struct builder *p_builder, const uint8_t *p_data, word_t p_size);
+void builder_set_entry_point(struct builder *p_builder, word_t p_addr);
+
+/* Zero filled memory after the one of builder_set_memory, the bss section */
+void builder_set_bss(struct builder *p_builder, word_t p_size);
+
+/* The memory is big endian by default, like in an executable without flags */
+void builder_set_little_endian(struct builder *p_builder, bool p_little_endian);
+
+/* Sizes in bytes like the stack sections, 0 keeps the default */
+void builder_set_stack_sizes(struct builder *p_builder, word_t p_stack, word_t p_call_stack);
+
+/* Names the p_size instructions from p_addr. The ranges must not overlap, the
+   load fails otherwise */
+void builder_add_symbol(struct builder *p_builder, const char *p_name, word_t p_addr,
+                        word_t p_size);
+
+/* Loads the program, the memory, the stack sizes and the symbols into the vm.
+   The vm runs the instructions of the builder, so the builder is freed after
+   the vm and nothing is appended in between */
+enum err builder_load(struct builder *p_builder, struct vm *p_vm);
+
+/* Same, the vm runs p_program instead, a copy of the p_builder->size instructions */
+enum err builder_load_program(const struct builder *p_builder, struct vm *p_vm,
+                              struct inst *p_program);
+
+/* Writes a sectioned executable (struct file_header) to p_file, which is left
+   open. Returns false with errno set if it could not be written or built */
+bool builder_write(const struct builder *p_builder, FILE *p_file);
+
+#endif
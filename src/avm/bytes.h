@@ -0,0 +1,92 @@
+#ifndef BYTES_H__HEADER_GUARD__
+#define BYTES_H__HEADER_GUARD__
+
+#include <stdint.h>  /* uint8_t, uint16_t, uint32_t, uint64_t */
+#include <stdbool.h> /* bool, true, false */
+#include <string.h>  /* memcpy */
+
+#include "platform.h"
+
+/* Loads and stores of multi byte values in the vm memory, which is big endian
+ * unless the program asks for a little endian one (see FILE_FLAG_LITTLE_ENDIAN).
+ *
+ * A value is moved with a single load or store, unaligned, through memcpy, and
+ * its bytes are swapped when the order is not the one of the host. p_size is a
+ * constant at every use, so the switches fold away.
+ */
+
+#if defined(COMPILER_GCC) || defined(COMPILER_CLANG)
+#	define BYTES_SWAP16(P_X) __builtin_bswap16(P_X)
+#	define BYTES_SWAP32(P_X) __builtin_bswap32(P_X)
+#	define BYTES_SWAP64(P_X) __builtin_bswap64(P_X)
+
+#	define BYTES_HOST_LITTLE (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+#elif defined(COMPILER_MSVC)
+#	include <stdlib.h> /* _byteswap_ushort, _byteswap_ulong, _byteswap_uint64 */
+
+#	define BYTES_SWAP16(P_X) _byteswap_ushort(P_X)
+#	define BYTES_SWAP32(P_X) _byteswap_ulong(P_X)
+#	define BYTES_SWAP64(P_X) _byteswap_uint64(P_X)
+
+#	define BYTES_HOST_LITTLE true /* Every Windows target */
+#else
+#	define BYTES_BY_BYTE /* The order of the host is unknown */
+#endif
+
+#ifdef BYTES_BY_BYTE
+static inline uint64_t bytes_load(const uint8_t *p_bytes, int p_size, bool p_little) {
+	uint64_t value = 0;
+	for (int i = 0; i < p_size; ++ i)
+		value = value << 010 | p_bytes[p_little? p_size - i - 1 : i];
+
+	return value;
+}
+
+static inline void bytes_store(uint8_t *p_bytes, uint64_t p_value, int p_size, bool p_little) {
+	for (int i = p_size; i -- > 0;) {
+		p_bytes[p_little? p_size - i - 1 : i] = p_value;
+		p_value >>= 010;
+	}
+}
+#else
+static inline uint64_t bytes_load(const uint8_t *p_bytes, int p_size, bool p_little) {
+	bool     swap = p_little != BYTES_HOST_LITTLE;
+	uint16_t u16;
+	uint32_t u32;
+	uint64_t u64;
+
+	switch (p_size) {
+	case 1:  return *p_bytes;
+	case 2:  memcpy(&u16, p_bytes, 2); return swap? BYTES_SWAP16(u16) : u16;
+	case 4:  memcpy(&u32, p_bytes, 4); return swap? BYTES_SWAP32(u32) : u32;
+	default: memcpy(&u64, p_bytes, 8); return swap? BYTES_SWAP64(u64) : u64;
+	}
+}
+
+static inline void bytes_store(uint8_t *p_bytes, uint64_t p_value, int p_size, bool p_little) {
+	bool     swap = p_little != BYTES_HOST_LITTLE;
+	uint16_t u16  = p_value;
+	uint32_t u32  = p_value;
+	uint64_t u64  = p_value;
+
+	switch (p_size) {
+	case 1: *p_bytes = p_value; break;
+	case 2:
+		u16 = swap? BYTES_SWAP16(u16) : u16;
+		memcpy(p_bytes, &u16, 2);
+		break;
+
+	case 4:
+		u32 = swap? BYTES_SWAP32(u32) : u32;
+		memcpy(p_bytes, &u32, 4);
+		break;
+
+	default:
+		u64 = swap? BYTES_SWAP64(u64) : u64;
+		memcpy(p_bytes, &u64, 8);
+		break;
+	}
+}
+#endif
+
+#endif
@@ -6,8 +6,8 @@
 #define GITHUB_LINK "https://github.com/avm-collection/avm"
 
 #define VERSION_MAJOR 1
-#define VERSION_MINOR 14
-#define VERSION_PATCH 9
+#define VERSION_MINOR 33
+#define VERSION_PATCH 15
 
 #define ASCII_LOGO \
 	" __________________ \n" \
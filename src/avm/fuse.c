@@ -0,0 +1,159 @@
+#include "fuse.h"
+
+/* A rule is used by fuse_rules_from_pairs if its leading pair makes up at least
+   1/FUSE_HOT_PAIR_RATIO of the executed pairs */
+#define FUSE_HOT_PAIR_RATIO 1000
+
+#define MAX_SEQ_LEN 5
+
+struct rule {
+	enum fuse_rule rule;
+	enum opcode    fused;
+	enum opcode    seq[MAX_SEQ_LEN];
+	word_t         len;
+};
+
+/* Longer sequences go first, so they win over their prefixes */
+static const struct rule rules[] = {
+	{FUSE_LOOP_LES, OP_LOOP_LES, {OP_INC, OP_DUP, OP_PSH, OP_LES, OP_JNZ}, 5},
+
+	{FUSE_PSH_ADD, OP_PSH_ADD, {OP_PSH, OP_ADD}, 2},
+	{FUSE_PSH_SUB, OP_PSH_SUB, {OP_PSH, OP_SUB}, 2},
+	{FUSE_PSH_R64, OP_PSH_R64, {OP_PSH, OP_R64}, 2},
+	{FUSE_DUP_JNZ, OP_DUP_JNZ, {OP_DUP, OP_JNZ}, 2},
+
+	{FUSE_EQU_JNZ, OP_EQU_JNZ, {OP_EQU, OP_JNZ}, 2},
+	{FUSE_NEQ_JNZ, OP_NEQ_JNZ, {OP_NEQ, OP_JNZ}, 2},
+	{FUSE_GRT_JNZ, OP_GRT_JNZ, {OP_GRT, OP_JNZ}, 2},
+	{FUSE_GEQ_JNZ, OP_GEQ_JNZ, {OP_GEQ, OP_JNZ}, 2},
+	{FUSE_LES_JNZ, OP_LES_JNZ, {OP_LES, OP_JNZ}, 2},
+	{FUSE_LEQ_JNZ, OP_LEQ_JNZ, {OP_LEQ, OP_JNZ}, 2},
+};
+
+static bool matches(struct vm *p_vm, const struct rule *p_rule, word_t p_at) {
+	if (!(p_vm->fuse_rules & p_rule->rule) || p_at + p_rule->len > p_vm->program_size)
+		return false;
+
+	for (word_t i = 0; i < p_rule->len; ++ i) {
+		if (p_vm->program[p_at + i].op != p_rule->seq[i])
+			return false;
+	}
+
+	/* The loop header only works on the value it increments */
+	if (p_rule->rule == FUSE_LOOP_LES)
+		return p_vm->program[p_at + 1].data.u64 == 0;
+
+	return true;
+}
+
+void vm_fuse(struct vm *p_vm) {
+	p_vm->code = p_vm->ops;
+
+	/* The superinstructions skip the checks of the instructions they replace */
+	if (!p_vm->verified || p_vm->fuse_rules == FUSE_NONE)
+		return;
+
+	/* The program runs without superinstructions */
+	uint8_t *code = (uint8_t*)malloc(p_vm->program_size + 1);
+	if (code == NULL)
+		return;
+
+	memcpy(code, p_vm->ops, p_vm->program_size + 1);
+
+	/* Only the first instruction of a sequence is replaced, the rest stays as it
+	   is for jumps into the middle of the sequence */
+	for (word_t i = 0; i < p_vm->program_size;) {
+		word_t len = 1;
+		for (size_t j = 0; j < ARRAY_SIZE(rules); ++ j) {
+			if (matches(p_vm, &rules[j], i)) {
+				code[i] = rules[j].fused;
+				len        = rules[j].len;
+
+				break;
+			}
+		}
+
+		i += len;
+	}
+
+	p_vm->code = code;
+}
+
+void vm_run_recording_pairs(struct vm *p_vm, pairs_t *p_pairs) {
+	bool        has_prev = false;
+	word_t      prev_ip  = 0;
+	enum opcode prev_op  = OP_NOP;
+
+	while (p_vm->ip < p_vm->program_size && !VM_HALT(p_vm)) {
+		word_t      ip = p_vm->ip;
+		enum opcode op = p_vm->ops[ip];
+
+		/* Only instructions that follow each other in the code can be fused */
+		if (has_prev && prev_ip + 1 == ip)
+			++ (*p_pairs)[prev_op][op];
+
+		int ret = vm_exec_next_inst(p_vm);
+		if (ret != ERR_OK)
+			vm_panic(p_vm, ret);
+
+		has_prev = true;
+		prev_ip  = ip;
+		prev_op  = op;
+	}
+}
+
+bool pairs_write(pairs_t *p_pairs, const char *p_path) {
+	FILE *file = fopen(p_path, "w");
+	if (file == NULL)
+		return false;
+
+	for (size_t a = 0; a < 0x100; ++ a) {
+		for (size_t b = 0; b < 0x100; ++ b) {
+			if ((*p_pairs)[a][b] > 0)
+				fprintf(file, "%02X %02X %llu\n", (unsigned)a, (unsigned)b,
+				        (long long unsigned)(*p_pairs)[a][b]);
+		}
+	}
+
+	/* The errors of fprintf stay in the stream, fclose can still fail to flush it */
+	bool ok = !ferror(file);
+	return fclose(file) == 0 && ok;
+}
+
+bool pairs_read(pairs_t *p_pairs, const char *p_path) {
+	FILE *file = fopen(p_path, "r");
+	if (file == NULL)
+		return false;
+
+	/* Counts are added up, so histograms of several runs can be concatenated */
+	unsigned           a, b;
+	long long unsigned count;
+	int                read;
+	while ((read = fscanf(file, "%X %X %llu", &a, &b, &count)) == 3 && a < 0x100 && b < 0x100)
+		(*p_pairs)[a][b] += count;
+
+	/* Only the end of the file stops it, a malformed line fails the whole file */
+	bool ok = read == EOF && !ferror(file);
+	if (!ok && !ferror(file))
+		errno = EINVAL;
+
+	fclose(file);
+	return ok;
+}
+
+uint32_t fuse_rules_from_pairs(pairs_t *p_pairs) {
+	uint64_t total = 0;
+	for (size_t a = 0; a < 0x100; ++ a) {
+		for (size_t b = 0; b < 0x100; ++ b)
+			total += (*p_pairs)[a][b];
+	}
+
+	uint32_t fuse_rules = FUSE_NONE;
+	for (size_t i = 0; i < ARRAY_SIZE(rules); ++ i) {
+		uint64_t count = (*p_pairs)[rules[i].seq[0]][rules[i].seq[1]];
+		if (count > 0 && count * FUSE_HOT_PAIR_RATIO >= total)
+			fuse_rules |= rules[i].rule;
+	}
+
+	return fuse_rules;
+}
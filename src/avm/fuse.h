@@ -0,0 +1,53 @@
+#ifndef FUSE_H__HEADER_GUARD__
+#define FUSE_H__HEADER_GUARD__
+
+#include <stdint.h>  /* uint64_t, uint32_t */
+#include <stdio.h>   /* FILE, fopen, fclose, fprintf, fscanf, ferror, EOF */
+#include <stdlib.h>  /* malloc, calloc, free, exit, EXIT_FAILURE */
+#include <string.h>  /* memcpy */
+#include <stdbool.h> /* bool, true, false */
+#include <errno.h>   /* errno, EINVAL */
+
+#include "vm.h"
+
+/* Superinstruction rules, each one replaces a common instruction sequence with
+   one internal instruction */
+enum fuse_rule {
+	FUSE_LOOP_LES = 1 << 0,
+	FUSE_PSH_ADD  = 1 << 1,
+	FUSE_PSH_SUB  = 1 << 2,
+	FUSE_PSH_R64  = 1 << 3,
+	FUSE_DUP_JNZ  = 1 << 4,
+	FUSE_EQU_JNZ  = 1 << 5,
+	FUSE_NEQ_JNZ  = 1 << 6,
+	FUSE_GRT_JNZ  = 1 << 7,
+	FUSE_GEQ_JNZ  = 1 << 8,
+	FUSE_LES_JNZ  = 1 << 9,
+	FUSE_LEQ_JNZ  = 1 << 10,
+
+	FUSE_ALL  = (1 << 11) - 1,
+	FUSE_NONE = 0,
+};
+
+/* Opcode pairs executed one after another, pairs[FIRST][SECOND] */
+typedef uint64_t pairs_t[0x100][0x100];
+
+/* Creates p_vm->code from p_vm->ops of the verified program, replacing the
+   sequences enabled in p_vm->fuse_rules. Instructions keep their position, so
+   jumps into the middle of a sequence and error positions are unaffected */
+void vm_fuse(struct vm *p_vm);
+
+/* Runs the program on the checked interpreter while counting the opcode pairs
+   executed in sequence */
+void vm_run_recording_pairs(struct vm *p_vm, pairs_t *p_pairs);
+
+/* The histogram file has a line per pair, "FIRST SECOND COUNT" with the opcodes
+   in hexadecimal. Both return false with errno set on failure, EINVAL if the
+   file has a malformed line. pairs_read adds to the counts */
+bool pairs_write(pairs_t *p_pairs, const char *p_path);
+bool pairs_read(pairs_t *p_pairs, const char *p_path);
+
+/* Enables only the rules whose leading opcode pair is hot in the histogram */
+uint32_t fuse_rules_from_pairs(pairs_t *p_pairs);
+
+#endif
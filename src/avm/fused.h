@@ -0,0 +1,68 @@
+/* Superinstruction handlers, see fuse.c.
+ *
+ * Like handlers.h, this file is included in the body of a dispatch loop. Only
+ * the unchecked loop includes it, since superinstructions are only created for
+ * verified programs. The instructions of a sequence that follow the first one
+ * are still in the code, OPERAND(N) reads the operand N of the sequence. A
+ * handler that fails sets `ip` to the instruction of the sequence that failed.
+ */
+
+#define CMP_JNZ(P_OP, P_CMP) \
+	INST(P_OP) { \
+		bool cond = TOP(1).i64 P_CMP TOS.i64; \
+		DROP(2); \
+\
+		if (cond) \
+			JUMP(0); \
+\
+		++ IP; \
+	} NEXT();
+
+INST(OP_LOOP_LES)
+	++ TOS.u64;
+
+	if (TOS.i64 < OPERAND(1).i64)
+		JUMP(2);
+
+	IP += 4;
+
+	NEXT();
+
+INST(OP_PSH_ADD)
+	TOS.u64 += OPERAND(0).u64;
+	++ IP;
+
+	NEXT();
+
+INST(OP_PSH_SUB)
+	TOS.u64 -= OPERAND(0).u64;
+	++ IP;
+
+	NEXT();
+
+INST(OP_PSH_R64) {
+	PUSH(OPERAND(0).u64);
+	++ IP;
+
+	uint64_t data;
+	READ(64, data, OPERAND(0).u64);
+
+	TOS.u64 = data;
+} NEXT();
+
+INST(OP_DUP_JNZ) {
+	value_t value = OPERAND(0).u64 == 0? TOS : TOP(OPERAND(0).u64);
+	if (value.u64)
+		JUMP(1);
+
+	++ IP;
+} NEXT();
+
+CMP_JNZ(OP_EQU_JNZ, ==)
+CMP_JNZ(OP_NEQ_JNZ, !=)
+CMP_JNZ(OP_GRT_JNZ, >)
+CMP_JNZ(OP_GEQ_JNZ, >=)
+CMP_JNZ(OP_LES_JNZ, <)
+CMP_JNZ(OP_LEQ_JNZ, <=)
+
+#undef CMP_JNZ
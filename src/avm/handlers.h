@@ -0,0 +1,622 @@
+/* Instruction handlers, shared by every dispatch loop in vm.c.
+ *
+ * This file is not a regular header, it is included in the body of a dispatch
+ * loop which defines the following macros first:
+ *   INST(P_OP)   Start the handler of the opcode P_OP
+ *   NEXT()       Advance to the next instruction and dispatch it
+ *   BRANCH()     Same as NEXT(), but after a control transfer (return or
+ *                external function call)
+ *   JUMP(P_N)    Continue at the target in OPERAND(P_N), see layout.h
+ *   RETURN(P_FRAME) Continue at the return address of the call stack entry
+ *                   P_FRAME, with its operands
+ *   RAISE(P_ERR) Stop the execution with an error
+ *
+ *   STACK_ARGS_COUNT(P_COUNT)  Check that the stack has at least P_COUNT values
+ *   STACK_CAPACITY_CHECK()     Check that the stack has room for another value
+ *   INST_ACCESS_CHECK(P_ADDR)  Check that P_ADDR is a valid instruction address
+ *
+ *   READ(P_BITS, P_DATA, P_ADDR)  Read the P_BITS bit value at the memory
+ *                                 address P_ADDR into P_DATA
+ *   WRITE(P_BITS, P_DATA, P_ADDR) Write P_DATA at the memory address P_ADDR
+ *
+ * The registers and the stack are only accessed through these macros, so a
+ * loop can keep them in local variables:
+ *   IP, SP       The instruction and stack pointers (lvalues)
+ *   TOS          The value on top of the stack (value_t lvalue)
+ *   TOP(P_N)     The value P_N places below the top, P_N > 0 (value_t lvalue)
+ *   PUSH(P_WORD) Push a word
+ *   GROW()       Push a value to be set through TOS
+ *   DROP(P_N)    Pop P_N values
+ *   REDUCE(P_FIELD, P_VALUE) Replace the top two values with P_VALUE, which is
+ *                            stored in the P_FIELD member
+ *
+ *   SYNC()   Write the registers back into the vm before it is inspected or
+ *            passed to other code
+ *   RELOAD() Read them again after other code could have changed them
+ *
+ * The operands of the current instruction, and of the ones after it for a
+ * superinstruction, are read with OPERAND(P_N). The vm is available as `p_vm`.
+ */
+
+INST(OP_NOP) NEXT();
+
+INST(OP_PSH) STACK_CAPACITY_CHECK();
+	PUSH(OPERAND(0).u64);
+
+	NEXT();
+
+INST(OP_POP) STACK_ARGS_COUNT(1);
+	DROP(1);
+
+	NEXT();
+
+INST(OP_ADD) STACK_ARGS_COUNT(2);
+	REDUCE(u64, TOP(1).u64 + TOS.u64);
+
+	NEXT();
+
+INST(OP_SUB) STACK_ARGS_COUNT(2);
+	REDUCE(u64, TOP(1).u64 - TOS.u64);
+
+	NEXT();
+
+INST(OP_MUL) STACK_ARGS_COUNT(2);
+	REDUCE(u64, TOP(1).u64 * TOS.u64);
+
+	NEXT();
+
+INST(OP_DIV) STACK_ARGS_COUNT(2); {
+	word_t b = TOS.u64;
+	if (b == 0)
+		RAISE(ERR_DIV_BY_ZERO);
+
+	REDUCE(u64, TOP(1).u64 / b);
+} NEXT();
+
+INST(OP_MOD) STACK_ARGS_COUNT(2); {
+	word_t b = TOS.u64;
+	if (b == 0)
+		RAISE(ERR_DIV_BY_ZERO);
+
+	REDUCE(u64, TOP(1).u64 % b);
+} NEXT();
+
+INST(OP_INC) STACK_ARGS_COUNT(1);
+	++ TOS.u64;
+
+	NEXT();
+
+INST(OP_DEC) STACK_ARGS_COUNT(1);
+	-- TOS.u64;
+
+	NEXT();
+
+INST(OP_FAD) STACK_ARGS_COUNT(2);
+	REDUCE(f64, TOP(1).f64 + TOS.f64);
+
+	NEXT();
+
+INST(OP_FSB) STACK_ARGS_COUNT(2);
+	REDUCE(f64, TOP(1).f64 - TOS.f64);
+
+	NEXT();
+
+INST(OP_FMU) STACK_ARGS_COUNT(2);
+	REDUCE(f64, TOP(1).f64 * TOS.f64);
+
+	NEXT();
+
+INST(OP_FDI) STACK_ARGS_COUNT(2);
+	REDUCE(f64, TOP(1).f64 / TOS.f64);
+
+	NEXT();
+
+INST(OP_FIN) STACK_ARGS_COUNT(1);
+	++ TOS.f64;
+
+	NEXT();
+
+INST(OP_FDE) STACK_ARGS_COUNT(1);
+	-- TOS.f64;
+
+	NEXT();
+
+INST(OP_NEG) STACK_ARGS_COUNT(1);
+	TOS.i64 = -TOS.i64;
+
+	NEXT();
+
+INST(OP_NOT) STACK_ARGS_COUNT(1);
+	TOS.u64 = !TOS.u64;
+
+	NEXT();
+
+INST(OP_JMP) INST_ACCESS_CHECK(OPERAND(0).u64);
+	JUMP(0);
+
+INST(OP_JNZ) STACK_ARGS_COUNT(1);
+	if (TOS.u64) {
+		INST_ACCESS_CHECK(OPERAND(0).u64);
+
+		DROP(1);
+		JUMP(0);
+	}
+
+	DROP(1);
+
+	NEXT();
+
+INST(OP_EQU) STACK_ARGS_COUNT(2);
+	REDUCE(u64, TOP(1).i64 == TOS.i64);
+
+	NEXT();
+
+INST(OP_NEQ) STACK_ARGS_COUNT(2);
+	REDUCE(u64, TOP(1).i64 != TOS.i64);
+
+	NEXT();
+
+INST(OP_GRT) STACK_ARGS_COUNT(2);
+	REDUCE(u64, TOP(1).i64 > TOS.i64);
+
+	NEXT();
+
+INST(OP_GEQ) STACK_ARGS_COUNT(2);
+	REDUCE(u64, TOP(1).i64 >= TOS.i64);
+
+	NEXT();
+
+INST(OP_LES) STACK_ARGS_COUNT(2);
+	REDUCE(u64, TOP(1).i64 < TOS.i64);
+
+	NEXT();
+
+INST(OP_LEQ) STACK_ARGS_COUNT(2);
+	REDUCE(u64, TOP(1).i64 <= TOS.i64);
+
+	NEXT();
+
+INST(OP_UEQ) STACK_ARGS_COUNT(2);
+	REDUCE(u64, TOP(1).u64 == TOS.u64);
+
+	NEXT();
+
+INST(OP_UNE) STACK_ARGS_COUNT(2);
+	REDUCE(u64, TOP(1).u64 != TOS.u64);
+
+	NEXT();
+
+INST(OP_UGR) STACK_ARGS_COUNT(2);
+	REDUCE(u64, TOP(1).u64 > TOS.u64);
+
+	NEXT();
+
+INST(OP_UGQ) STACK_ARGS_COUNT(2);
+	REDUCE(u64, TOP(1).u64 >= TOS.u64);
+
+	NEXT();
+
+INST(OP_ULE) STACK_ARGS_COUNT(2);
+	REDUCE(u64, TOP(1).u64 == TOS.u64);
+
+	NEXT();
+
+INST(OP_ULQ) STACK_ARGS_COUNT(2);
+	REDUCE(u64, TOP(1).u64 <= TOS.u64);
+
+	NEXT();
+
+INST(OP_FEQ) STACK_ARGS_COUNT(2);
+	REDUCE(u64, TOP(1).f64 == TOS.f64);
+
+	NEXT();
+
+INST(OP_FNE) STACK_ARGS_COUNT(2);
+	REDUCE(u64, TOP(1).f64 != TOS.f64);
+
+	NEXT();
+
+INST(OP_FGR) STACK_ARGS_COUNT(2);
+	REDUCE(u64, TOP(1).f64 > TOS.f64);
+
+	NEXT();
+
+INST(OP_FGQ) STACK_ARGS_COUNT(2);
+	REDUCE(u64, TOP(1).f64 >= TOS.f64);
+
+	NEXT();
+
+INST(OP_FLE) STACK_ARGS_COUNT(2);
+	REDUCE(u64, TOP(1).f64 < TOS.f64);
+
+	NEXT();
+
+INST(OP_FLQ) STACK_ARGS_COUNT(2);
+	REDUCE(u64, TOP(1).f64 <= TOS.f64);
+
+	NEXT();
+
+INST(OP_CAL) INST_ACCESS_CHECK(OPERAND(0).u64);
+	if (p_vm->cs >= p_vm->call_stack_capacity)
+		RAISE(ERR_CALL_STACK_OVERFLOW);
+
+	/* The operands of the next instruction follow the target and its index */
+	p_vm->call_stack[p_vm->cs ++] = (struct frame){IP + 1, &OPERAND(2) - p_vm->operands};
+	PROFILE_CALL(OPERAND(0).u64);
+	JUMP(0);
+
+INST(OP_RET) {
+	if (p_vm->cs <= 0)
+		RAISE(ERR_CALL_STACK_UNDERFLOW);
+
+	struct frame frame = p_vm->call_stack[-- p_vm->cs];
+	PROFILE_RETURN();
+
+	RETURN(frame);
+}
+
+INST(OP_AND) STACK_ARGS_COUNT(2);
+	REDUCE(u64, TOP(1).u64 && TOS.u64);
+
+	NEXT();
+
+INST(OP_ORR) STACK_ARGS_COUNT(2);
+	REDUCE(u64, TOP(1).u64 || TOS.u64);
+
+	NEXT();
+
+INST(OP_DUP) STACK_ARGS_COUNT(vm_stack_args(OPERAND(0).u64, 1));
+	STACK_CAPACITY_CHECK();
+
+	GROW();
+	TOS.u64 = TOP(OPERAND(0).u64 + 1).u64;
+
+	NEXT();
+
+INST(OP_SWP) STACK_ARGS_COUNT(vm_stack_args(OPERAND(0).u64, 2)); {
+	word_t tmp = TOS.u64;
+	TOS.u64 = TOP(OPERAND(0).u64 + 1).u64;
+	TOP(OPERAND(0).u64 + 1).u64 = tmp;
+} NEXT();
+
+INST(OP_EMP) STACK_CAPACITY_CHECK();
+	GROW();
+	TOS.u64 = SP <= 0;
+
+	NEXT();
+
+INST(OP_SET) STACK_ARGS_COUNT(3); {
+	word_t  addr = TOP(2).u64;
+	uint8_t val  = TOP(1).u64;
+	word_t  size = TOS.u64;
+
+	if (!vm_is_chunk_valid(p_vm, addr, size))
+		RAISE(ERR_INVALID_MEM_ACCESS);
+
+	DROP(3);
+
+	memset(&p_vm->memory[addr], val, size);
+} NEXT();
+
+INST(OP_CPY) STACK_ARGS_COUNT(3); {
+	word_t to   = TOP(2).u64;
+	word_t from = TOP(1).u64;
+	word_t size = TOS.u64;
+
+	if (!vm_is_chunk_valid(p_vm, to, size) || !vm_is_chunk_valid(p_vm, from, size))
+		RAISE(ERR_INVALID_MEM_ACCESS);
+
+	DROP(3);
+
+	memcpy(&p_vm->memory[to], &p_vm->memory[from], size);
+} NEXT();
+
+INST(OP_R08) STACK_ARGS_COUNT(1); {
+	uint8_t data;
+	READ(8, data, TOS.u64);
+
+	TOS.u64 = data;
+} NEXT();
+
+INST(OP_R16) STACK_ARGS_COUNT(1); {
+	uint16_t data;
+	READ(16, data, TOS.u64);
+
+	TOS.u64 = data;
+} NEXT();
+
+INST(OP_R32) STACK_ARGS_COUNT(1); {
+	uint32_t data;
+	READ(32, data, TOS.u64);
+
+	TOS.u64 = data;
+} NEXT();
+
+INST(OP_R64) STACK_ARGS_COUNT(1); {
+	uint64_t data;
+	READ(64, data, TOS.u64);
+
+	TOS.u64 = data;
+} NEXT();
+
+INST(OP_W08) STACK_ARGS_COUNT(2);
+	WRITE(8, (uint8_t)TOS.u64, TOP(1).u64);
+	DROP(2);
+
+	NEXT();
+
+INST(OP_W16) STACK_ARGS_COUNT(2);
+	WRITE(16, (uint16_t)TOS.u64, TOP(1).u64);
+	DROP(2);
+
+	NEXT();
+
+INST(OP_W32) STACK_ARGS_COUNT(2);
+	WRITE(32, (uint32_t)TOS.u64, TOP(1).u64);
+	DROP(2);
+
+	NEXT();
+
+INST(OP_W64) STACK_ARGS_COUNT(2);
+	WRITE(64, (uint64_t)TOS.u64, TOP(1).u64);
+	DROP(2);
+
+	NEXT();
+
+INST(OP_OPE) STACK_ARGS_COUNT(3); {
+	word_t     addr = TOP(2).u64;
+	word_t     size = TOP(1).u64;
+	enum fmode mode = TOS.u64;
+
+	char name[size + 1];
+	vm_get_str(p_vm, name, addr, size);
+
+	DROP(2);
+
+	char mode_str[FMODE_STR_SIZE];
+	if (!fmode_to_str(mode, mode_str))
+		RAISE(ERR_INVALID_FMODE);
+
+	word_t   fd;
+	enum err ret = vm_alloc_fd(p_vm, &fd);
+	if (ret != ERR_OK)
+		RAISE(ret);
+
+	struct file *f = &p_vm->maps->files[fd];
+
+	f->mode = mode;
+	f->file = fopen(name, mode_str);
+	if (f->file == NULL) {
+		vm_release_fd(p_vm, fd);
+		fd = INVALID_DESCRIPTOR;
+	}
+
+	TOS.u64 = fd;
+
+	if (p_vm->stats != NULL)
+		++ p_vm->stats->opens;
+} NEXT();
+
+INST(OP_CLO) STACK_ARGS_COUNT(1); {
+	word_t fd = TOS.u64;
+	DROP(1);
+
+	if (!vm_is_fd_valid(p_vm, fd))
+		RAISE(ERR_INVALID_DESCRIPTOR);
+
+	fclose(p_vm->maps->files[fd].file);
+	vm_release_fd(p_vm, fd);
+} NEXT();
+
+INST(OP_WRF) STACK_ARGS_COUNT(2); {
+	word_t addr = TOP(2).u64;
+	word_t size = TOP(1).u64;
+	word_t fd   = TOS.u64;
+
+	if (!vm_is_chunk_valid(p_vm, addr, size))
+		RAISE(ERR_INVALID_MEM_ACCESS);
+	else if (!vm_is_fd_valid(p_vm, fd))
+		RAISE(ERR_INVALID_DESCRIPTOR);
+
+	DROP(2);
+
+	struct file *f = &p_vm->maps->files[fd];
+
+	size_t ret = fwrite(&p_vm->memory[addr], 1, size, f->file);
+	TOS.u64 = (word_t)(ret < 1);
+
+	if (p_vm->stats != NULL)
+		f->written += ret;
+} NEXT();
+
+INST(OP_RDF) STACK_ARGS_COUNT(3); {
+	word_t addr = TOP(2).u64;
+	word_t size = TOP(1).u64;
+	word_t fd   = TOS.u64;
+
+	if (!vm_is_chunk_valid(p_vm, addr, size))
+		RAISE(ERR_INVALID_MEM_ACCESS);
+	else if (!vm_is_fd_valid(p_vm, fd))
+		RAISE(ERR_INVALID_DESCRIPTOR);
+
+	DROP(2);
+
+	struct file *f = &p_vm->maps->files[fd];
+
+	size_t ret = fread(&p_vm->memory[addr], 1, size, f->file);
+	TOS.u64 = (word_t)(ret < 1);
+
+	if (p_vm->stats != NULL)
+		f->read += ret;
+} NEXT();
+
+INST(OP_SZF) STACK_ARGS_COUNT(1); {
+	word_t fd = TOS.u64;
+	if (!vm_is_fd_valid(p_vm, fd))
+		RAISE(ERR_INVALID_DESCRIPTOR);
+
+	struct file *f = &p_vm->maps->files[fd];
+
+	fseek(f->file, 0, SEEK_END);
+	TOS.u64 = ftell(f->file);
+	fseek(f->file, 0, SEEK_SET);
+} NEXT();
+
+INST(OP_FLU) STACK_ARGS_COUNT(1); {
+	word_t fd = TOS.u64;
+	DROP(1);
+
+	if (!vm_is_fd_valid(p_vm, fd))
+		RAISE(ERR_INVALID_DESCRIPTOR);
+
+	fflush(p_vm->maps->files[fd].file);
+} NEXT();
+
+INST(OP_BAN) STACK_ARGS_COUNT(2);
+	REDUCE(u64, TOP(1).u64 & TOS.u64);
+
+	NEXT();
+
+INST(OP_BOR) STACK_ARGS_COUNT(2);
+	REDUCE(u64, TOP(1).u64 | TOS.u64);
+
+	NEXT();
+
+INST(OP_BSR) STACK_ARGS_COUNT(2);
+	REDUCE(u64, TOP(1).u64 >> TOS.u64);
+
+	NEXT();
+
+INST(OP_BSL) STACK_ARGS_COUNT(2);
+	REDUCE(u64, TOP(1).u64 << TOS.u64);
+
+	NEXT();
+
+INST(OP_LOL) STACK_ARGS_COUNT(2); {
+	word_t addr = TOP(1).u64;
+	word_t size = TOS.u64;
+
+	char name[size + 1];
+	vm_get_str(p_vm, name, addr, size);
+
+	DROP(1);
+
+	word_t   ld;
+	enum err ret = vm_alloc_ld(p_vm, &ld);
+	if (ret != ERR_OK)
+		RAISE(ret);
+
+	struct lib *lib = &p_vm->maps->libs[ld];
+
+	lib->handle = dlopen(name, RTLD_NOW | RTLD_GLOBAL);
+	if (lib->handle == NULL) {
+		vm_release_ld(p_vm, ld);
+		ld = INVALID_DESCRIPTOR;
+	}
+
+	TOS.u64 = ld;
+
+	if (p_vm->stats != NULL)
+		++ p_vm->stats->loads;
+} NEXT();
+
+INST(OP_CLL) STACK_ARGS_COUNT(1); {
+	word_t ld = TOS.u64;
+	DROP(1);
+
+	if (!vm_is_ld_valid(p_vm, ld))
+		RAISE(ERR_INVALID_DESCRIPTOR);
+
+	dlclose(p_vm->maps->libs[ld].handle);
+	vm_release_ld(p_vm, ld);
+} NEXT();
+
+INST(OP_LLF) STACK_ARGS_COUNT(3); {
+	word_t addr = TOP(2).u64;
+	word_t size = TOP(1).u64;
+	word_t ld   = TOS.u64;
+
+	if (!vm_is_chunk_valid(p_vm, addr, size))
+		RAISE(ERR_INVALID_MEM_ACCESS);
+
+	char name[size + 1];
+	strncpy(name, (char*)&p_vm->memory[addr], size);
+	name[size] = 0;
+
+	DROP(2);
+
+	if (!vm_is_ld_valid(p_vm, ld))
+		RAISE(ERR_INVALID_DESCRIPTOR);
+
+	word_t   fnd;
+	enum err ret = vm_alloc_fnd(p_vm, ld, &fnd);
+	if (ret != ERR_OK)
+		RAISE(ret);
+
+	struct lib *lib  = &p_vm->maps->libs[ld];
+	external_t *func = &lib->funcs[fnd].func;
+
+	*(void**)func = dlsym(lib->handle, name);
+	if (*func == NULL) {
+		vm_release_fnd(p_vm, ld, fnd);
+		fnd = INVALID_DESCRIPTOR;
+	}
+
+	TOS.u64 = fnd;
+} NEXT();
+
+INST(OP_ULF) STACK_ARGS_COUNT(2); {
+	word_t fnd = TOP(1).u64;
+	word_t ld  = TOS.u64;
+	if (!vm_is_ld_valid(p_vm, ld) || !vm_is_fnd_valid(p_vm, ld, fnd))
+		RAISE(ERR_INVALID_DESCRIPTOR);
+
+	vm_release_fnd(p_vm, ld, fnd);
+
+	DROP(2);
+} NEXT();
+
+INST(OP_CLF) STACK_ARGS_COUNT(2); {
+	word_t fnd = TOP(1).u64;
+	word_t ld  = TOS.u64;
+
+	if (!vm_is_ld_valid(p_vm, ld) || !vm_is_fnd_valid(p_vm, ld, fnd))
+		RAISE(ERR_INVALID_DESCRIPTOR);
+
+	DROP(2);
+	SYNC();
+
+	enum err ret = vm_call_external(p_vm, p_vm->maps->libs[ld].funcs[fnd].func);
+	if (ret != ERR_OK)
+		RAISE(ret);
+
+	RELOAD();
+} BRANCH(); /* External functions can do anything to the stack */
+
+INST(OP_DMP)
+	SYNC();
+
+	putchar('\n');
+	vm_dump(p_vm, stdout);
+	fflush(stdout);
+
+	NEXT();
+
+INST(OP_PRT) STACK_ARGS_COUNT(1);
+	printf("%i\n", (int)TOS.i64);
+	DROP(1);
+
+	NEXT();
+
+INST(OP_FPR) STACK_ARGS_COUNT(1);
+	printf("%f\n", (float)TOS.f64);
+	DROP(1);
+
+	NEXT();
+
+INST(OP_HLT) STACK_ARGS_COUNT(1);
+	p_vm->ex   = TOS.u64;
+	VM_SET_HALT(p_vm, HALT_PROGRAM);
+	DROP(1);
+
+	NEXT();
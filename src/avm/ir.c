@@ -0,0 +1,774 @@
+#include "ir.h"
+
+/* Blocks with a wider slot range are not optimized */
+#define MAX_OPT_RANGE 0x10000
+
+/* DUP and SWP with bigger operands are run by the interpreter */
+#define MAX_STACK_OPERAND (INT32_MAX / 4)
+
+static const uint8_t binaries[0x100] = {
+	[OP_ADD] = IR_ADD, [OP_SUB] = IR_SUB, [OP_MUL] = IR_MUL, [OP_DIV] = IR_DIV, [OP_MOD] = IR_MOD,
+	[OP_FAD] = IR_FAD, [OP_FSB] = IR_FSB, [OP_FMU] = IR_FMU, [OP_FDI] = IR_FDI,
+	[OP_AND] = IR_AND, [OP_ORR] = IR_ORR,
+
+	[OP_EQU] = IR_EQU, [OP_NEQ] = IR_NEQ, [OP_GRT] = IR_GRT,
+	[OP_GEQ] = IR_GEQ, [OP_LES] = IR_LES, [OP_LEQ] = IR_LEQ,
+
+	[OP_UEQ] = IR_UEQ, [OP_UNE] = IR_UNE, [OP_UGR] = IR_UGR,
+	[OP_UGQ] = IR_UGQ, [OP_ULE] = IR_ULE, [OP_ULQ] = IR_ULQ,
+
+	[OP_FEQ] = IR_FEQ, [OP_FNE] = IR_FNE, [OP_FGR] = IR_FGR,
+	[OP_FGQ] = IR_FGQ, [OP_FLE] = IR_FLE, [OP_FLQ] = IR_FLQ,
+
+	[OP_BAN] = IR_BAN, [OP_BOR] = IR_BOR, [OP_BSR] = IR_BSR, [OP_BSL] = IR_BSL,
+};
+
+static const uint8_t memory_ops[0x100] = {
+	[OP_R08] = IR_R08, [OP_R16] = IR_R16, [OP_R32] = IR_R32, [OP_R64] = IR_R64,
+	[OP_W08] = IR_W08, [OP_W16] = IR_W16, [OP_W32] = IR_W32, [OP_W64] = IR_W64,
+};
+
+/* Instructions of the block being translated */
+struct block {
+	struct ir_inst *buf;
+	word_t          size, cap;
+	int32_t         lo, hi; /* Range of the slots used */
+};
+
+static void *alloc(size_t p_size) {
+	void *ptr = malloc(p_size);
+	if (ptr == NULL) {
+		VM_ERROR(stderr, "malloc() fail near "__FILE__":%i", __LINE__);
+		exit(EXIT_FAILURE);
+	}
+
+	return ptr;
+}
+
+static struct ir_inst *push_inst(struct ir_inst **p_buf, word_t *p_size, word_t *p_cap) {
+	if (*p_size >= *p_cap) {
+		*p_cap = *p_cap == 0? 0x100 : *p_cap * 2;
+		*p_buf = (struct ir_inst*)realloc(*p_buf, sizeof(struct ir_inst) * *p_cap);
+		if (*p_buf == NULL) {
+			VM_ERROR(stderr, "realloc() fail near "__FILE__":%i", __LINE__);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	struct ir_inst *inst = &(*p_buf)[(*p_size) ++];
+	memset(inst, 0, sizeof(*inst));
+
+	return inst;
+}
+
+static void touch(struct block *p_block, int32_t p_slot) {
+	if (p_slot < p_block->lo)
+		p_block->lo = p_slot;
+
+	if (p_slot > p_block->hi)
+		p_block->hi = p_slot;
+}
+
+static struct ir_inst *add(struct block *p_block, uint8_t p_op, word_t p_ip) {
+	struct ir_inst *inst = push_inst(&p_block->buf, &p_block->size, &p_block->cap);
+	inst->op = p_op;
+	inst->ip = p_ip;
+
+	return inst;
+}
+
+static struct ir_inst *add_op(struct block *p_block, uint8_t p_op, word_t p_ip,
+                              int32_t p_dst, int32_t p_a, int32_t p_b) {
+	struct ir_inst *inst = add(p_block, p_op, p_ip);
+	inst->dst = p_dst;
+	inst->a   = p_a;
+	inst->b   = p_b;
+
+	touch(p_block, p_dst);
+	touch(p_block, p_a);
+	touch(p_block, p_b);
+
+	return inst;
+}
+
+static struct ir_inst *add_imm(struct block *p_block, uint8_t p_op, word_t p_ip,
+                               int32_t p_dst, int32_t p_a, value_t p_value) {
+	struct ir_inst *inst = add_op(p_block, p_op, p_ip, p_dst, p_a, p_a);
+	inst->imm   = true;
+	inst->value = p_value;
+
+	return inst;
+}
+
+static struct ir_inst *add_end(struct block *p_block, uint8_t p_op, word_t p_ip, int32_t p_depth) {
+	struct ir_inst *inst = add(p_block, p_op, p_ip);
+	inst->depth = p_depth;
+
+	return inst;
+}
+
+static bool *find_leaders(struct vm *p_vm) {
+	bool *leaders = (bool*)alloc(sizeof(bool) * (p_vm->program_size + 1));
+	memset(leaders, 0, sizeof(bool) * (p_vm->program_size + 1));
+
+	leaders[0]         = true;
+	leaders[p_vm->ip]  = true;
+
+	for (word_t i = 0; i < p_vm->program_size; ++ i) {
+		struct inst *inst = &p_vm->program[i];
+
+		switch (inst->op) {
+		case OP_JMP: case OP_JNZ: case OP_CAL:
+			leaders[inst->data.u64] = true;
+			leaders[i + 1]          = true;
+			break;
+
+		case OP_RET: case OP_HLT: case OP_CLF:
+			leaders[i + 1] = true;
+			break;
+
+		default: break;
+		}
+	}
+
+	return leaders;
+}
+
+/* Naive translation, one slot per stack position */
+static void translate_block(struct vm *p_vm, const bool *p_leaders, word_t p_start,
+                            struct block *p_block) {
+	p_block->size = 0;
+	p_block->lo   = 0;
+	p_block->hi   = 0;
+
+	int32_t depth = 0;
+	for (word_t i = p_start; i < p_vm->program_size; ++ i) {
+		if (i != p_start && p_leaders[i])
+			break;
+
+		struct inst *inst = &p_vm->program[i];
+		word_t       data = inst->data.u64;
+
+		if (binaries[inst->op] != IR_NONE) {
+			add_op(p_block, binaries[inst->op], i, depth - 2, depth - 2, depth - 1);
+			-- depth;
+
+			continue;
+		}
+
+		value_t value;
+		switch (inst->op) {
+		case OP_NOP: break;
+
+		case OP_PSH: case OP_EMP:
+			value.u64 = inst->op == OP_PSH? data : 0;
+			add_imm(p_block, IR_MOV, i, depth, depth, value);
+			++ depth;
+			break;
+
+		case OP_POP: -- depth; break;
+
+		case OP_INC: case OP_DEC:
+			value.u64 = 1;
+			add_imm(p_block, inst->op == OP_INC? IR_ADD : IR_SUB, i, depth - 1, depth - 1, value);
+			break;
+
+		case OP_FIN: case OP_FDE:
+			value.f64 = 1;
+			add_imm(p_block, inst->op == OP_FIN? IR_FAD : IR_FSB, i, depth - 1, depth - 1, value);
+			break;
+
+		case OP_NEG: case OP_NOT:
+			add_op(p_block, inst->op == OP_NEG? IR_NEG : IR_NOT, i, depth - 1, depth - 1, depth - 1);
+			break;
+
+		case OP_DUP:
+			if (data > MAX_STACK_OPERAND)
+				goto exec;
+
+			add_op(p_block, IR_MOV, i, depth, depth, depth - 1 - (int32_t)data);
+			++ depth;
+			break;
+
+		case OP_SWP:
+			if (data > MAX_STACK_OPERAND)
+				goto exec;
+
+			add_op(p_block, IR_SWAP, i, depth - 1, depth - 1, depth - 2 - (int32_t)data);
+			break;
+
+		case OP_R08: case OP_R16: case OP_R32: case OP_R64:
+			add_op(p_block, memory_ops[inst->op], i, depth - 1, depth - 1, depth - 1);
+			break;
+
+		case OP_W08: case OP_W16: case OP_W32: case OP_W64:
+			add_op(p_block, memory_ops[inst->op], i, depth - 2, depth - 2, depth - 1);
+			depth -= 2;
+			break;
+
+		case OP_JMP: add_end(p_block, IR_JMP, i, depth)->target = data; return;
+		case OP_CAL: {
+			struct ir_inst *end = add_end(p_block, IR_CAL, i, depth);
+			end->target    = data;
+			end->value.u64 = vm_operand_index(p_vm, i + 1); /* Of the return address */
+		} return;
+
+		case OP_RET: add_end(p_block, IR_RET, i, depth); return;
+		case OP_CLF: add_end(p_block, IR_CLF, i, depth); return;
+
+		case OP_JNZ: {
+			struct ir_inst *end = add_end(p_block, IR_JNZ, i, depth - 1);
+			end->a      = depth - 1;
+			end->target = data;
+			touch(p_block, depth - 1);
+		} return;
+
+		case OP_HLT: {
+			struct ir_inst *end = add_end(p_block, IR_HLT, i, depth - 1);
+			end->a = depth - 1;
+			touch(p_block, depth - 1);
+		} return;
+
+		/* Memory chunks, file IO, shared libraries and debug output */
+		default:
+		exec:
+			add_end(p_block, IR_EXEC, i, depth);
+			touch(p_block, depth);
+			depth += vm_stack_delta(inst->op);
+		}
+	}
+
+	add_end(p_block, IR_NEXT, p_start, depth);
+	touch(p_block, depth);
+}
+
+static bool is_binary(uint8_t p_op) {
+	return p_op >= IR_ADD && p_op <= IR_BSL;
+}
+
+static bool reads_a(uint8_t p_op) {
+	return is_binary(p_op) || p_op == IR_NEG || p_op == IR_NOT || p_op == IR_JNZ || p_op == IR_HLT ||
+	       (p_op >= IR_R08 && p_op <= IR_W64);
+}
+
+static bool reads_b(uint8_t p_op) {
+	return is_binary(p_op) || p_op == IR_MOV || (p_op >= IR_W08 && p_op <= IR_W64);
+}
+
+static bool writes_dst(uint8_t p_op) {
+	return is_binary(p_op) || p_op == IR_NEG || p_op == IR_NOT || p_op == IR_MOV ||
+	       (p_op >= IR_R08 && p_op <= IR_R64);
+}
+
+/* Can be removed if the result is not used */
+static bool is_pure(uint8_t p_op) {
+	return writes_dst(p_op) && p_op != IR_DIV && p_op != IR_MOD && !(p_op >= IR_R08 && p_op <= IR_R64);
+}
+
+struct copy {
+	bool    valid, imm;
+	int32_t slot;
+	value_t value;
+};
+
+static void kill(struct copy *p_copies, int32_t p_range, int32_t p_slot) {
+	p_copies[p_slot].valid = false;
+	for (int32_t i = 0; i < p_range; ++ i) {
+		if (p_copies[i].valid && !p_copies[i].imm && p_copies[i].slot == p_slot)
+			p_copies[i].valid = false;
+	}
+}
+
+/* Forward copy propagation. Slots are offset by lo */
+static void propagate(struct block *p_block, int32_t p_range) {
+	struct copy *copies = (struct copy*)alloc(sizeof(struct copy) * p_range);
+	memset(copies, 0, sizeof(struct copy) * p_range);
+
+	int32_t lo = p_block->lo;
+	for (word_t i = 0; i < p_block->size; ++ i) {
+		struct ir_inst *inst = &p_block->buf[i];
+
+		if (reads_a(inst->op)) {
+			struct copy *copy = &copies[inst->a - lo];
+			if (copy->valid && !copy->imm)
+				inst->a = copy->slot + lo;
+		}
+
+		if (reads_b(inst->op) && !inst->imm) {
+			struct copy *copy = &copies[inst->b - lo];
+			if (copy->valid && copy->imm) {
+				inst->imm   = true;
+				inst->value = copy->value;
+			} else if (copy->valid)
+				inst->b = copy->slot + lo;
+		}
+
+		switch (inst->op) {
+		case IR_EXEC: case IR_CLF:
+			memset(copies, 0, sizeof(struct copy) * p_range);
+			break;
+
+		case IR_SWAP:
+			kill(copies, p_range, inst->a - lo);
+			kill(copies, p_range, inst->b - lo);
+			break;
+
+		case IR_MOV:
+			kill(copies, p_range, inst->dst - lo);
+
+			if (inst->imm) {
+				copies[inst->dst - lo].valid = true;
+				copies[inst->dst - lo].imm   = true;
+				copies[inst->dst - lo].value = inst->value;
+			} else if (inst->b != inst->dst) {
+				copies[inst->dst - lo].valid = true;
+				copies[inst->dst - lo].imm   = false;
+				copies[inst->dst - lo].slot  = inst->b - lo;
+			}
+			break;
+
+		default:
+			if (writes_dst(inst->op))
+				kill(copies, p_range, inst->dst - lo);
+		}
+	}
+
+	free(copies);
+}
+
+static void live_below(bool *p_live, int32_t p_lo, int32_t p_hi, int32_t p_depth, bool p_only) {
+	for (int32_t slot = p_lo; slot <= p_hi; ++ slot) {
+		if (slot < p_depth)
+			p_live[slot - p_lo] = true;
+		else if (p_only)
+			p_live[slot - p_lo] = false;
+	}
+}
+
+/* Backward pass, removes pure instructions whose result is never read. The
+   slots below the stack pointer at the end of the block are live */
+static void eliminate(struct block *p_block, int32_t p_range) {
+	bool *live = (bool*)alloc(sizeof(bool) * p_range);
+	memset(live, 0, sizeof(bool) * p_range);
+
+	int32_t lo = p_block->lo, hi = p_block->hi;
+	for (word_t i = p_block->size; i -- > 0;) {
+		struct ir_inst *inst = &p_block->buf[i];
+
+		switch (inst->op) {
+		case IR_NEXT: case IR_JMP: case IR_CAL: case IR_RET: case IR_CLF:
+			live_below(live, lo, hi, inst->depth, true);
+			continue;
+
+		case IR_JNZ:
+			live_below(live, lo, hi, inst->depth, true);
+			live[inst->a - lo] = true;
+			continue;
+
+		case IR_HLT:
+			live_below(live, lo, hi, lo, true);
+			live[inst->a - lo] = true;
+			continue;
+
+		case IR_EXEC:
+			live_below(live, lo, hi, inst->depth, false);
+			continue;
+
+		case IR_SWAP:
+			live[inst->a - lo] = true;
+			live[inst->b - lo] = true;
+			continue;
+
+		default: break;
+		}
+
+		if (writes_dst(inst->op)) {
+			if (!live[inst->dst - lo] && is_pure(inst->op)) {
+				inst->op = IR_NONE;
+				continue;
+			}
+
+			live[inst->dst - lo] = false;
+		}
+
+		if (reads_a(inst->op))
+			live[inst->a - lo] = true;
+
+		if (reads_b(inst->op) && !inst->imm)
+			live[inst->b - lo] = true;
+	}
+
+	free(live);
+}
+
+static void optimize(struct block *p_block) {
+	int64_t range = (int64_t)p_block->hi - p_block->lo + 1;
+	if (range > MAX_OPT_RANGE)
+		return;
+
+	propagate(p_block, range);
+	eliminate(p_block, range);
+}
+
+bool ir_translate(struct vm *p_vm, struct ir *p_ir) {
+	memset(p_ir, 0, sizeof(*p_ir));
+	if (!p_vm->verified)
+		return false;
+
+	word_t size = p_vm->program_size;
+	bool  *leaders = find_leaders(p_vm);
+
+	p_ir->blocks = (word_t*)alloc(sizeof(word_t) * (size + 1));
+	for (word_t i = 0; i <= size; ++ i)
+		p_ir->blocks[i] = NO_BLOCK;
+
+	struct block block;
+	memset(&block, 0, sizeof(block));
+
+	for (word_t i = 0; i < size; ++ i) {
+		if (!leaders[i])
+			continue;
+
+		p_ir->blocks[i] = p_ir->size;
+		push_inst(&p_ir->insts, &p_ir->size, &p_ir->cap)->op = IR_BLOCK;
+		p_ir->insts[p_ir->size - 1].ip = i;
+
+		translate_block(p_vm, leaders, i, &block);
+		optimize(&block);
+
+		for (word_t j = 0; j < block.size; ++ j) {
+			if (block.buf[j].op != IR_NONE)
+				*push_inst(&p_ir->insts, &p_ir->size, &p_ir->cap) = block.buf[j];
+		}
+	}
+
+	p_ir->blocks[size] = p_ir->size;
+	push_inst(&p_ir->insts, &p_ir->size, &p_ir->cap)->op = IR_END;
+	p_ir->insts[p_ir->size - 1].ip = size;
+
+	/* Bytecode targets to block indexes */
+	for (word_t i = 0; i < p_ir->size; ++ i) {
+		struct ir_inst *inst = &p_ir->insts[i];
+		if (inst->op == IR_JMP || inst->op == IR_JNZ || inst->op == IR_CAL)
+			inst->target = p_ir->blocks[inst->target];
+	}
+
+	free(block.buf);
+	free(leaders);
+
+	return true;
+}
+
+void ir_free(struct ir *p_ir) {
+	free(p_ir->insts);
+	free(p_ir->blocks);
+}
+
+#define R(P_SLOT) base[P_SLOT]
+#define B()       (inst->imm? inst->value : base[inst->b])
+
+/* Same dispatch as vm_run, see threaded.h */
+#ifdef USES_COMPUTED_GOTO
+#	define INST(P_OP) ir_##P_OP:
+#	define NEXT() \
+		do { \
+			inst = pc ++; \
+			goto *dispatch[inst->op]; \
+		} while (0)
+#else
+#	define INST(P_OP) case P_OP:
+#	define NEXT()     continue
+#endif
+
+#define SYNC() \
+	p_vm->sp = base - p_vm->stack
+
+/* vm_panic returns in embedded vms */
+#define FAIL(P_ERR) \
+	do { \
+		p_vm->ip = inst->ip; \
+		SYNC(); \
+		vm_panic(p_vm, P_ERR); \
+\
+		return; \
+	} while (0)
+
+#define BINARY(P_IR, P_TYPE, P_OP) \
+	INST(P_IR) \
+		R(inst->dst).P_TYPE = R(inst->a).P_TYPE P_OP B().P_TYPE; \
+		NEXT();
+
+#define COMPARE(P_IR, P_TYPE, P_OP) \
+	INST(P_IR) \
+		R(inst->dst).u64 = R(inst->a).P_TYPE P_OP B().P_TYPE; \
+		NEXT();
+
+#define DIVISION(P_IR, P_OP) \
+	INST(P_IR) { \
+		word_t b = B().u64; \
+		if (b == 0) \
+			FAIL(ERR_DIV_BY_ZERO); \
+\
+		R(inst->dst).u64 = R(inst->a).u64 P_OP b; \
+	} NEXT();
+
+#define READ(P_IR, P_FUNC, P_TYPE) \
+	INST(P_IR) { \
+		P_TYPE data; \
+		enum err ret = P_FUNC(p_vm, &data, R(inst->a).u64); \
+		if (ret != ERR_OK) \
+			FAIL(ret); \
+\
+		R(inst->dst).u64 = data; \
+	} NEXT();
+
+#define WRITE(P_IR, P_FUNC) \
+	INST(P_IR) { \
+		enum err ret = P_FUNC(p_vm, B().u64, R(inst->a).u64); \
+		if (ret != ERR_OK) \
+			FAIL(ret); \
+	} NEXT();
+
+#ifdef USES_COMPUTED_GOTO
+#	define HANDLER(P_OP) [P_OP] = &&ir_##P_OP
+
+#	pragma GCC diagnostic push
+#	pragma GCC diagnostic ignored "-Wpedantic"
+#endif
+
+static void run(struct vm *p_vm, struct ir *p_ir) {
+	value_t        *base = p_vm->stack + p_vm->sp;
+	struct ir_inst *pc   = &p_ir->insts[p_ir->blocks[p_vm->ip]];
+	struct ir_inst *inst;
+
+#ifdef USES_COMPUTED_GOTO
+	static void *dispatch[] = {
+		HANDLER(IR_NONE),
+		HANDLER(IR_ADD), HANDLER(IR_SUB), HANDLER(IR_MUL), HANDLER(IR_DIV), HANDLER(IR_MOD),
+		HANDLER(IR_FAD), HANDLER(IR_FSB), HANDLER(IR_FMU), HANDLER(IR_FDI),
+		HANDLER(IR_AND), HANDLER(IR_ORR),
+		HANDLER(IR_EQU), HANDLER(IR_NEQ), HANDLER(IR_GRT), HANDLER(IR_GEQ), HANDLER(IR_LES), HANDLER(IR_LEQ),
+		HANDLER(IR_UEQ), HANDLER(IR_UNE), HANDLER(IR_UGR), HANDLER(IR_UGQ), HANDLER(IR_ULE), HANDLER(IR_ULQ),
+		HANDLER(IR_FEQ), HANDLER(IR_FNE), HANDLER(IR_FGR), HANDLER(IR_FGQ), HANDLER(IR_FLE), HANDLER(IR_FLQ),
+		HANDLER(IR_BAN), HANDLER(IR_BOR), HANDLER(IR_BSR), HANDLER(IR_BSL),
+		HANDLER(IR_NEG), HANDLER(IR_NOT),
+		HANDLER(IR_MOV), HANDLER(IR_SWAP),
+		HANDLER(IR_R08), HANDLER(IR_R16), HANDLER(IR_R32), HANDLER(IR_R64),
+		HANDLER(IR_W08), HANDLER(IR_W16), HANDLER(IR_W32), HANDLER(IR_W64),
+		HANDLER(IR_EXEC),
+		HANDLER(IR_BLOCK), HANDLER(IR_NEXT), HANDLER(IR_JMP), HANDLER(IR_JNZ), HANDLER(IR_CAL),
+		HANDLER(IR_RET), HANDLER(IR_HLT), HANDLER(IR_CLF), HANDLER(IR_END),
+	};
+
+	NEXT();
+#else
+	for (;;) {
+		inst = pc ++;
+
+		switch (inst->op) {
+#endif
+
+	BINARY(IR_ADD, u64, +)
+	BINARY(IR_SUB, u64, -)
+	BINARY(IR_MUL, u64, *)
+	DIVISION(IR_DIV, /)
+	DIVISION(IR_MOD, %)
+
+	BINARY(IR_FAD, f64, +)
+	BINARY(IR_FSB, f64, -)
+	BINARY(IR_FMU, f64, *)
+	BINARY(IR_FDI, f64, /)
+
+	BINARY(IR_BAN, u64, &)
+	BINARY(IR_BOR, u64, |)
+	BINARY(IR_BSR, u64, >>)
+	BINARY(IR_BSL, u64, <<)
+
+	COMPARE(IR_AND, u64, &&)
+	COMPARE(IR_ORR, u64, ||)
+
+	COMPARE(IR_EQU, i64, ==)
+	COMPARE(IR_NEQ, i64, !=)
+	COMPARE(IR_GRT, i64, >)
+	COMPARE(IR_GEQ, i64, >=)
+	COMPARE(IR_LES, i64, <)
+	COMPARE(IR_LEQ, i64, <=)
+
+	COMPARE(IR_UEQ, u64, ==)
+	COMPARE(IR_UNE, u64, !=)
+	COMPARE(IR_UGR, u64, >)
+	COMPARE(IR_UGQ, u64, >=)
+	COMPARE(IR_ULE, u64, ==) /* Same as in handlers.h */
+	COMPARE(IR_ULQ, u64, <=)
+
+	COMPARE(IR_FEQ, f64, ==)
+	COMPARE(IR_FNE, f64, !=)
+	COMPARE(IR_FGR, f64, >)
+	COMPARE(IR_FGQ, f64, >=)
+	COMPARE(IR_FLE, f64, <)
+	COMPARE(IR_FLQ, f64, <=)
+
+	INST(IR_NEG)
+		R(inst->dst).u64 = -R(inst->a).u64;
+		NEXT();
+
+	INST(IR_NOT)
+		R(inst->dst).u64 = !R(inst->a).u64;
+		NEXT();
+
+	INST(IR_MOV)
+		R(inst->dst) = B();
+		NEXT();
+
+	INST(IR_SWAP) {
+		value_t tmp = R(inst->a);
+		R(inst->a)  = R(inst->b);
+		R(inst->b)  = tmp;
+	} NEXT();
+
+	READ(IR_R08, vm_read8,  uint8_t)
+	READ(IR_R16, vm_read16, uint16_t)
+	READ(IR_R32, vm_read32, uint32_t)
+	READ(IR_R64, vm_read64, uint64_t)
+
+	WRITE(IR_W08, vm_write8)
+	WRITE(IR_W16, vm_write16)
+	WRITE(IR_W32, vm_write32)
+	WRITE(IR_W64, vm_write64)
+
+	INST(IR_EXEC) {
+		p_vm->ip = inst->ip;
+		p_vm->sp = (base - p_vm->stack) + inst->depth;
+
+		int ret = vm_exec_next_inst(p_vm);
+		if (ret != ERR_OK) {
+			vm_panic(p_vm, ret);
+			return;
+		}
+	} NEXT();
+
+	INST(IR_BLOCK) {
+		word_t               sp     = base - p_vm->stack;
+		struct stack_bounds *bounds = &p_vm->bounds[inst->ip];
+
+		/* The checked interpreter reports the error */
+		if (sp < bounds->need || sp + bounds->grow > p_vm->stack_capacity) {
+			p_vm->ip = inst->ip;
+			SYNC();
+			vm_run(p_vm);
+
+			return;
+		}
+	} NEXT();
+
+	INST(IR_NEXT)
+		base += inst->depth;
+		NEXT();
+
+	INST(IR_JMP)
+		base += inst->depth;
+		pc    = &p_ir->insts[inst->target];
+		NEXT();
+
+	INST(IR_JNZ) {
+		bool cond = R(inst->a).u64 != 0;
+
+		base += inst->depth;
+		if (cond)
+			pc = &p_ir->insts[inst->target];
+	} NEXT();
+
+	INST(IR_CAL)
+		if (p_vm->cs >= p_vm->call_stack_capacity)
+			FAIL(ERR_CALL_STACK_OVERFLOW);
+
+		p_vm->call_stack[p_vm->cs ++] = (struct frame){inst->ip + 1, inst->value.u64};
+
+		base += inst->depth;
+		pc    = &p_ir->insts[inst->target];
+		NEXT();
+
+	INST(IR_RET) {
+		if (p_vm->cs <= 0)
+			FAIL(ERR_CALL_STACK_UNDERFLOW);
+
+		word_t ip = p_vm->call_stack[-- p_vm->cs].ip;
+
+		base += inst->depth;
+		if (ip > p_vm->program_size || p_ir->blocks[ip] == NO_BLOCK) {
+			/* External functions can change the call stack */
+			p_vm->ip = ip;
+			SYNC();
+			vm_run(p_vm);
+
+			return;
+		}
+
+		pc = &p_ir->insts[p_ir->blocks[ip]];
+	} NEXT();
+
+	INST(IR_HLT)
+		p_vm->ex   = R(inst->a).u64;
+		VM_SET_HALT(p_vm, HALT_PROGRAM);
+		p_vm->ip   = inst->ip + 1;
+
+		base += inst->depth;
+		SYNC();
+
+		return;
+
+	INST(IR_CLF) {
+		p_vm->ip = inst->ip;
+		p_vm->sp = (base - p_vm->stack) + inst->depth;
+
+		int ret = vm_exec_next_inst(p_vm);
+		if (ret != ERR_OK) {
+			vm_panic(p_vm, ret);
+			return;
+		}
+
+		base = p_vm->stack + p_vm->sp;
+	} NEXT();
+
+	INST(IR_END)
+		p_vm->ip = inst->ip;
+		SYNC();
+
+		return;
+
+	INST(IR_NONE)
+		NEXT();
+
+#ifndef USES_COMPUTED_GOTO
+		}
+	}
+#endif
+}
+
+#ifdef USES_COMPUTED_GOTO
+#	pragma GCC diagnostic pop
+#	undef HANDLER
+#endif
+
+#undef R
+#undef B
+#undef INST
+#undef NEXT
+#undef SYNC
+#undef FAIL
+#undef BINARY
+#undef COMPARE
+#undef DIVISION
+#undef READ
+#undef WRITE
+
+void vm_run_ir(struct vm *p_vm) {
+	struct ir ir;
+	if (p_vm->ip >= p_vm->program_size || VM_HALT(p_vm) || !ir_translate(p_vm, &ir)) {
+		vm_run(p_vm);
+		return;
+	}
+
+	run(p_vm, &ir);
+	ir_free(&ir);
+}
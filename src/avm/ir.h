@@ -0,0 +1,87 @@
+#ifndef IR_H__HEADER_GUARD__
+#define IR_H__HEADER_GUARD__
+
+#include <stdint.h>  /* uint8_t, int32_t, INT32_MAX */
+#include <stdbool.h> /* bool, true, false */
+#include <stdlib.h>  /* malloc, realloc, free, exit, EXIT_FAILURE */
+#include <string.h>  /* memset */
+
+#include "vm.h"
+#include "verify.h"
+#include "layout.h"
+
+/* Register IR. Each basic block of the bytecode is translated to three address
+ * instructions, where the registers are the stack slots relative to the stack
+ * pointer at the start of the block. The stack shuffles (PSH, POP, DUP, SWP,
+ * EMP) become moves, which are then removed by copy propagation and dead move
+ * elimination inside the block.
+ *
+ * Only verified programs are translated. The stack bounds are checked at the
+ * start of each block, and every instruction keeps the ip of the bytecode it
+ * came from, so errors are reported at the same ip as by the interpreter.
+ */
+enum ir_op {
+	IR_NONE = 0,
+
+	/* dst = a OP b */
+	IR_ADD, IR_SUB, IR_MUL, IR_DIV, IR_MOD,
+	IR_FAD, IR_FSB, IR_FMU, IR_FDI,
+	IR_AND, IR_ORR,
+	IR_EQU, IR_NEQ, IR_GRT, IR_GEQ, IR_LES, IR_LEQ,
+	IR_UEQ, IR_UNE, IR_UGR, IR_UGQ, IR_ULE, IR_ULQ,
+	IR_FEQ, IR_FNE, IR_FGR, IR_FGQ, IR_FLE, IR_FLQ,
+	IR_BAN, IR_BOR, IR_BSR, IR_BSL,
+
+	/* dst = OP a */
+	IR_NEG, IR_NOT,
+
+	IR_MOV,  /* dst = b */
+	IR_SWAP, /* a <-> b */
+
+	IR_R08, IR_R16, IR_R32, IR_R64, /* dst = memory[a] */
+	IR_W08, IR_W16, IR_W32, IR_W64, /* memory[a] = b */
+
+	IR_EXEC, /* Runs the bytecode instruction at ip with a values on the stack */
+
+	/* Block starts and ends. `depth` is the stack pointer at the end of the
+	   block, relative to the start */
+	IR_BLOCK, /* Checks the stack bounds of the block */
+	IR_NEXT,  /* Continues with the next block */
+	IR_JMP,   /* Jumps to the block `target` */
+	IR_JNZ,   /* Jumps to the block `target` if a is not 0 */
+	IR_CAL,
+	IR_RET,
+	IR_HLT,   /* Halts with a */
+	IR_CLF,   /* Runs CLF, the next block starts at the new stack pointer */
+	IR_END,   /* End of the program */
+};
+
+struct ir_inst {
+	uint8_t op;
+	bool    imm; /* b is `value` instead of a slot */
+	int32_t dst, a, b, depth;
+
+	value_t value;
+	word_t  target; /* Index of the target block instruction */
+	word_t  ip;     /* Bytecode instruction it came from */
+};
+
+struct ir {
+	struct ir_inst *insts;
+	word_t          size, cap;
+
+	word_t *blocks; /* IR_BLOCK index of each bytecode ip, NO_BLOCK if the ip
+	                   does not start a block */
+};
+
+#define NO_BLOCK (word_t)-1
+
+/* Translates the loaded program, returns false if it was not verified */
+bool ir_translate(struct vm *p_vm, struct ir *p_ir);
+void ir_free(struct ir *p_ir);
+
+/* Runs the program on the register IR, falls back to vm_run for programs that
+   are not verified */
+void vm_run_ir(struct vm *p_vm);
+
+#endif
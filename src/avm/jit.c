@@ -0,0 +1,948 @@
+/* MAP_ANONYMOUS */
+#define _DEFAULT_SOURCE
+
+#include "jit.h"
+
+#ifdef USES_JIT
+
+/* Returned by the compiled code when the interpreter has to take over */
+#define JIT_DEOPT -1
+
+#define NO_INDEX -1
+#define NO_STUB  (size_t)-1
+
+/* Room on the stack of the compiled code for the C functions it calls, above
+   one return address per call stack entry */
+#define JIT_C_STACK 0x800000
+
+/* Only hints for the stack mapping */
+#ifndef MAP_NORESERVE
+#	define MAP_NORESERVE 0
+#endif
+
+#ifndef MAP_STACK
+#	define MAP_STACK 0
+#endif
+
+/* Register use of the compiled code:
+ *   rbx  struct vm*
+ *   r12  p_vm->stack
+ *   r13  p_vm->sp, only written back when leaving the compiled code or calling
+ *        the interpreter
+ *   r14  p_vm->cs before an interpreted instruction
+ *   r15  host stack pointer at the entry, to leave from any call depth
+ *   rbp  native stack pointer around calls into C
+ *   rax, rcx, rdx, xmm0, xmm1 are scratch
+ *
+ * The top of the stack value N is at [r12 + r13 * 8 - 8 * (N + 1)]. AVM calls
+ * are native calls, the AVM call stack is still kept up to date for dumps and
+ * for the interpreter. The compiled code runs on its own stack, sized from the
+ * call stack capacity, so that a deep recursion can not overflow the host
+ * stack. Every instruction that could fail checks its operands
+ * first and hands the execution over to the interpreter on failure (deopt),
+ * which then runs the instruction again and reports the error.
+ */
+enum reg {
+	RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+	R8,  R9,  R10, R11, R12, R13, R14, R15,
+};
+
+enum cond {
+	CC_B  = 0x2, CC_AE = 0x3, CC_E = 0x4, CC_NE = 0x5, CC_BE = 0x6, CC_A = 0x7,
+	CC_P  = 0xA, CC_NP = 0xB, CC_L = 0xC, CC_GE = 0xD, CC_LE = 0xE, CC_G = 0xF,
+};
+
+struct mem {
+	int     base, index, scale;
+	int32_t disp;
+};
+
+struct fixup {
+	size_t at; /* Position of the rel32 */
+	word_t ip; /* Instruction it points to */
+};
+
+struct fixups {
+	struct fixup *buf;
+	size_t        size, cap;
+};
+
+struct jit {
+	struct vm *vm;
+
+	uint8_t *buf;
+	size_t   size, cap;
+
+	size_t *entries; /* Offset of the code of each instruction */
+	size_t *stubs;   /* Offset of the deopt stub of each instruction */
+	bool   *leaders; /* Instructions that control can be transferred to */
+
+	struct fixups jumps, deopts;
+
+	size_t exit, exit_sync, deopt;
+};
+
+static void *alloc(size_t p_size) {
+	void *ptr = malloc(p_size);
+	if (ptr == NULL) {
+		VM_ERROR(stderr, "malloc() fail near "__FILE__":%i", __LINE__);
+		exit(EXIT_FAILURE);
+	}
+
+	return ptr;
+}
+
+static void emit8(struct jit *p_jit, uint8_t p_byte) {
+	if (p_jit->size >= p_jit->cap) {
+		p_jit->cap = p_jit->cap == 0? 0x1000 : p_jit->cap * 2;
+		p_jit->buf = (uint8_t*)realloc(p_jit->buf, p_jit->cap);
+		if (p_jit->buf == NULL) {
+			VM_ERROR(stderr, "realloc() fail near "__FILE__":%i", __LINE__);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	p_jit->buf[p_jit->size ++] = p_byte;
+}
+
+static void emit32(struct jit *p_jit, uint32_t p_value) {
+	for (int i = 0; i < 4; ++ i)
+		emit8(p_jit, p_value >> (i * 8));
+}
+
+static void emit64(struct jit *p_jit, uint64_t p_value) {
+	for (int i = 0; i < 8; ++ i)
+		emit8(p_jit, p_value >> (i * 8));
+}
+
+static void patch32(struct jit *p_jit, size_t p_at, uint32_t p_value) {
+	for (int i = 0; i < 4; ++ i)
+		p_jit->buf[p_at + i] = p_value >> (i * 8);
+}
+
+static void add_fixup(struct fixups *p_fixups, size_t p_at, word_t p_ip) {
+	if (p_fixups->size >= p_fixups->cap) {
+		p_fixups->cap = p_fixups->cap == 0? 0x100 : p_fixups->cap * 2;
+		p_fixups->buf = (struct fixup*)realloc(p_fixups->buf, sizeof(struct fixup) * p_fixups->cap);
+		if (p_fixups->buf == NULL) {
+			VM_ERROR(stderr, "realloc() fail near "__FILE__":%i", __LINE__);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	p_fixups->buf[p_fixups->size].at = p_at;
+	p_fixups->buf[p_fixups->size].ip = p_ip;
+	++ p_fixups->size;
+}
+
+static bool fits8(int64_t p_value) {
+	return p_value >= INT8_MIN && p_value <= INT8_MAX;
+}
+
+static bool fits32(int64_t p_value) {
+	return p_value >= INT32_MIN && p_value <= INT32_MAX;
+}
+
+static void emit_rex(struct jit *p_jit, bool p_w, int p_reg, int p_index, int p_base) {
+	uint8_t rex = 0x40 | (p_w << 3) | ((p_reg & 8) >> 1) | ((p_base & 8) >> 3);
+	if (p_index != NO_INDEX)
+		rex |= (p_index & 8) >> 2;
+
+	if (rex != 0x40)
+		emit8(p_jit, rex);
+}
+
+static void emit_opcode(struct jit *p_jit, uint32_t p_op) {
+	if (p_op > 0xFF)
+		emit8(p_jit, p_op >> 8);
+
+	emit8(p_jit, p_op);
+}
+
+/* [prefix] [rex] op modrm [sib] [disp] */
+static void emit_op_mem(struct jit *p_jit, uint8_t p_prefix, bool p_w, uint32_t p_op,
+                        int p_reg, struct mem p_mem) {
+	if (p_prefix != 0)
+		emit8(p_jit, p_prefix);
+
+	emit_rex(p_jit, p_w, p_reg, p_mem.index, p_mem.base);
+	emit_opcode(p_jit, p_op);
+
+	int  base = p_mem.base & 7;
+	bool sib  = p_mem.index != NO_INDEX || base == RSP;
+
+	int mod;
+	if (p_mem.disp == 0 && base != RBP)
+		mod = 0;
+	else if (fits8(p_mem.disp))
+		mod = 1;
+	else
+		mod = 2;
+
+	emit8(p_jit, (mod << 6) | ((p_reg & 7) << 3) | (sib? 4 : base));
+	if (sib) {
+		int index = p_mem.index == NO_INDEX? 4 : p_mem.index & 7;
+		int scale = p_mem.scale == 8? 3 : 0;
+
+		emit8(p_jit, (scale << 6) | (index << 3) | base);
+	}
+
+	if (mod == 1)
+		emit8(p_jit, p_mem.disp);
+	else if (mod == 2)
+		emit32(p_jit, p_mem.disp);
+}
+
+static void emit_op_rr(struct jit *p_jit, uint8_t p_prefix, bool p_w, uint32_t p_op,
+                       int p_reg, int p_rm) {
+	if (p_prefix != 0)
+		emit8(p_jit, p_prefix);
+
+	emit_rex(p_jit, p_w, p_reg, NO_INDEX, p_rm);
+	emit_opcode(p_jit, p_op);
+	emit8(p_jit, 0xC0 | ((p_reg & 7) << 3) | (p_rm & 7));
+}
+
+/* Value N from the top of the stack, -1 is the first free slot */
+static struct mem slot(int64_t p_n) {
+	return (struct mem){.base = R12, .index = R13, .scale = 8, .disp = -8 * (p_n + 1)};
+}
+
+static struct mem field(size_t p_offset) {
+	return (struct mem){.base = RBX, .index = NO_INDEX, .scale = 1, .disp = p_offset};
+}
+
+#define FIELD(P_NAME) field(offsetof(struct vm, P_NAME))
+
+static void emit_load(struct jit *p_jit, int p_reg, struct mem p_mem) {
+	emit_op_mem(p_jit, 0, true, 0x8B, p_reg, p_mem); /* mov reg, [mem] */
+}
+
+static void emit_store(struct jit *p_jit, struct mem p_mem, int p_reg) {
+	emit_op_mem(p_jit, 0, true, 0x89, p_reg, p_mem); /* mov [mem], reg */
+}
+
+static void emit_mov_imm(struct jit *p_jit, int p_reg, uint64_t p_value) {
+	emit_rex(p_jit, p_value > UINT32_MAX, 0, NO_INDEX, p_reg);
+	emit8(p_jit, 0xB8 | (p_reg & 7));
+
+	if (p_value > UINT32_MAX)
+		emit64(p_jit, p_value); /* mov reg, imm64 */
+	else
+		emit32(p_jit, p_value); /* mov reg32, imm32 (zero extends) */
+}
+
+static void emit_store_imm(struct jit *p_jit, struct mem p_mem, uint64_t p_value) {
+	if (fits32((int64_t)p_value)) {
+		emit_op_mem(p_jit, 0, true, 0xC7, 0, p_mem); /* mov qword [mem], imm32 */
+		emit32(p_jit, p_value);
+	} else {
+		emit_mov_imm(p_jit, RDX, p_value);
+		emit_store(p_jit, p_mem, RDX);
+	}
+}
+
+static void emit_bswap(struct jit *p_jit, bool p_w, int p_reg) {
+	emit_rex(p_jit, p_w, 0, NO_INDEX, p_reg);
+	emit8(p_jit, 0x0F);
+	emit8(p_jit, 0xC8 | (p_reg & 7));
+}
+
+static void emit_sp_add(struct jit *p_jit, int8_t p_value) {
+	emit_op_rr(p_jit, 0, true, 0x83, 0, R13); /* add r13, imm8 */
+	emit8(p_jit, p_value);
+}
+
+static void emit_inc_sp(struct jit *p_jit) {
+	emit_op_rr(p_jit, 0, true, 0xFF, 0, R13); /* inc r13 */
+}
+
+static void emit_dec_sp(struct jit *p_jit) {
+	emit_op_rr(p_jit, 0, true, 0xFF, 1, R13); /* dec r13 */
+}
+
+static void emit_jcc_at(struct jit *p_jit, enum cond p_cc, size_t p_to) {
+	emit8(p_jit, 0x0F);
+	emit8(p_jit, 0x80 | p_cc);
+	emit32(p_jit, p_to - (p_jit->size + 4));
+}
+
+static void emit_jmp_at(struct jit *p_jit, size_t p_to) {
+	emit8(p_jit, 0xE9);
+	emit32(p_jit, p_to - (p_jit->size + 4));
+}
+
+/* Jump or call (0xE9/0xE8) to the code of an instruction */
+static void emit_branch(struct jit *p_jit, uint8_t p_op, word_t p_ip) {
+	emit8(p_jit, p_op);
+	add_fixup(&p_jit->jumps, p_jit->size, p_ip);
+	emit32(p_jit, 0);
+}
+
+static void emit_jcc(struct jit *p_jit, enum cond p_cc, word_t p_ip) {
+	emit8(p_jit, 0x0F);
+	emit8(p_jit, 0x80 | p_cc);
+	add_fixup(&p_jit->jumps, p_jit->size, p_ip);
+	emit32(p_jit, 0);
+}
+
+/* Leave to the interpreter at instruction p_ip */
+static void emit_deopt_if(struct jit *p_jit, enum cond p_cc, word_t p_ip) {
+	emit8(p_jit, 0x0F);
+	emit8(p_jit, 0x80 | p_cc);
+	add_fixup(&p_jit->deopts, p_jit->size, p_ip);
+	emit32(p_jit, 0);
+}
+
+static void emit_deopt(struct jit *p_jit, word_t p_ip) {
+	emit8(p_jit, 0xE9);
+	add_fixup(&p_jit->deopts, p_jit->size, p_ip);
+	emit32(p_jit, 0);
+}
+
+/* Verified programs are only checked where control is transferred to */
+static void emit_need(struct jit *p_jit, word_t p_ip, int32_t p_count) {
+	if (p_jit->vm->verified)
+		return;
+
+	emit_op_rr(p_jit, 0, true, 0x81, 7, R13); /* cmp r13, imm32 */
+	emit32(p_jit, p_count);
+	emit_deopt_if(p_jit, CC_B, p_ip);
+}
+
+static void emit_room(struct jit *p_jit, word_t p_ip) {
+	if (p_jit->vm->verified)
+		return;
+
+	emit_op_rr(p_jit, 0, true, 0x81, 7, R13); /* cmp r13, imm32 */
+	emit32(p_jit, p_jit->vm->stack_capacity);
+	emit_deopt_if(p_jit, CC_AE, p_ip);
+}
+
+static void emit_bounds_check(struct jit *p_jit, word_t p_ip) {
+	struct stack_bounds *bounds = &p_jit->vm->bounds[p_ip];
+
+	emit_mov_imm(p_jit, RAX, bounds->need);
+	emit_op_rr(p_jit, 0, true, 0x39, RAX, R13); /* cmp r13, rax */
+	emit_deopt_if(p_jit, CC_B, p_ip);
+
+	emit_mov_imm(p_jit, RAX, bounds->grow);
+	emit_op_rr(p_jit, 0, true, 0x01, R13, RAX); /* add rax, r13 */
+	emit_op_rr(p_jit, 0, true, 0x81, 7, RAX);   /* cmp rax, imm32 */
+	emit32(p_jit, p_jit->vm->stack_capacity);
+	emit_deopt_if(p_jit, CC_A, p_ip);
+}
+
+static void emit_call_c(struct jit *p_jit, uint64_t p_addr) {
+	emit_op_rr(p_jit, 0, true, 0x89, RSP, RBP); /* mov rbp, rsp */
+	emit_op_rr(p_jit, 0, true, 0x83, 4, RSP);   /* and rsp, -16 */
+	emit8(p_jit, 0xF0);
+	emit_op_rr(p_jit, 0, true, 0x89, RBX, RDI); /* mov rdi, rbx */
+	emit_mov_imm(p_jit, RAX, p_addr);
+	emit8(p_jit, 0xFF);                         /* call rax */
+	emit8(p_jit, 0xD0);
+	emit_op_rr(p_jit, 0, true, 0x89, RBP, RSP); /* mov rsp, rbp */
+}
+
+/* Runs a single instruction on the interpreter */
+static void emit_interpret(struct jit *p_jit, word_t p_ip) {
+	emit_store_imm(p_jit, FIELD(ip), p_ip);
+	emit_store(p_jit, FIELD(sp), R13);
+	emit_load(p_jit, R14, FIELD(cs));
+
+	emit_call_c(p_jit, (uint64_t)(uintptr_t)vm_exec_next_inst);
+
+	emit8(p_jit, 0x85); /* test eax, eax */
+	emit8(p_jit, 0xC0);
+	emit_jcc_at(p_jit, CC_NE, p_jit->exit);
+
+	emit_load(p_jit, R13, FIELD(sp));
+
+	/* eax is 0, the registers are already written back */
+	emit_op_mem(p_jit, 0, false, 0x80, 7, FIELD(halt)); /* cmp byte [halt], 0 */
+	emit8(p_jit, 0);
+	emit_jcc_at(p_jit, CC_NE, p_jit->exit);
+
+	/* The native return addresses would not match the call stack anymore */
+	emit_op_mem(p_jit, 0, true, 0x3B, R14, FIELD(cs)); /* cmp r14, [cs] */
+	emit_deopt_if(p_jit, CC_NE, p_ip + 1);
+}
+
+/* rax = address of a P_SIZE bytes chunk, deopt if it is out of bounds.
+   Same check as vm_is_chunk_valid */
+static void emit_chunk_check(struct jit *p_jit, word_t p_ip, int p_size) {
+	emit_load(p_jit, RCX, FIELD(memory_size));
+	if (p_size > 1) {
+		emit_op_rr(p_jit, 0, true, 0x83, 5, RCX); /* sub rcx, imm8 */
+		emit8(p_jit, p_size - 1);
+	}
+
+	emit_op_rr(p_jit, 0, true, 0x39, RCX, RAX); /* cmp rax, rcx */
+	emit_deopt_if(p_jit, CC_AE, p_ip);
+
+	emit_load(p_jit, RCX, FIELD(memory));
+}
+
+static struct mem memory_at_rax(void) {
+	return (struct mem){.base = RCX, .index = RAX, .scale = 1, .disp = 0};
+}
+
+/* top 1 = top 1 OP top 0 */
+static void emit_binary(struct jit *p_jit, word_t p_ip, uint8_t p_op) {
+	emit_need(p_jit, p_ip, 2);
+	emit_load(p_jit, RAX, slot(0));
+	emit_op_mem(p_jit, 0, true, p_op, RAX, slot(1));
+	emit_dec_sp(p_jit);
+}
+
+/* al = condition, store it as the new top after popping 2 */
+static void emit_store_bool(struct jit *p_jit) {
+	emit_op_rr(p_jit, 0, false, 0x0FB6, RAX, RAX); /* movzx eax, al */
+	emit_store(p_jit, slot(1), RAX);
+	emit_dec_sp(p_jit);
+}
+
+static void emit_setcc(struct jit *p_jit, enum cond p_cc, int p_reg) {
+	emit_op_rr(p_jit, 0, false, 0x0F90 | p_cc, 0, p_reg);
+}
+
+static void emit_compare(struct jit *p_jit, word_t p_ip, enum cond p_cc) {
+	emit_need(p_jit, p_ip, 2);
+	emit_load(p_jit, RAX, slot(1));
+	emit_op_mem(p_jit, 0, true, 0x3B, RAX, slot(0)); /* cmp rax, [top 0] */
+	emit_setcc(p_jit, p_cc, RAX);
+	emit_store_bool(p_jit);
+}
+
+static void emit_logic(struct jit *p_jit, word_t p_ip, uint8_t p_op) {
+	emit_need(p_jit, p_ip, 2);
+	emit_load(p_jit, RAX, slot(1));
+	emit_op_rr(p_jit, 0, true, 0x85, RAX, RAX); /* test rax, rax */
+	emit_setcc(p_jit, CC_NE, RAX);
+	emit_load(p_jit, RCX, slot(0));
+	emit_op_rr(p_jit, 0, true, 0x85, RCX, RCX); /* test rcx, rcx */
+	emit_setcc(p_jit, CC_NE, RCX);
+	emit_op_rr(p_jit, 0, false, p_op, RCX, RAX); /* and/or al, cl */
+	emit_store_bool(p_jit);
+}
+
+static void emit_float_binary(struct jit *p_jit, word_t p_ip, uint8_t p_op) {
+	emit_need(p_jit, p_ip, 2);
+	emit_op_mem(p_jit, 0xF2, false, 0x0F10,        0, slot(1)); /* movsd xmm0, [top 1] */
+	emit_op_mem(p_jit, 0xF2, false, 0x0F00 | p_op, 0, slot(0)); /* OPsd xmm0, [top 0] */
+	emit_op_mem(p_jit, 0xF2, false, 0x0F11,        0, slot(1)); /* movsd [top 1], xmm0 */
+	emit_dec_sp(p_jit);
+}
+
+static void emit_float_step(struct jit *p_jit, word_t p_ip, uint8_t p_op) {
+	emit_need(p_jit, p_ip, 1);
+	emit_mov_imm(p_jit, RAX, 0x3FF0000000000000); /* 1.0 */
+	emit_op_rr(p_jit, 0x66, true, 0x0F6E, 1, RAX);  /* movq xmm1, rax */
+	emit_op_mem(p_jit, 0xF2, false, 0x0F10, 0, slot(0));
+	emit_op_rr(p_jit, 0xF2, false, 0x0F00 | p_op, 0, 1);
+	emit_op_mem(p_jit, 0xF2, false, 0x0F11, 0, slot(0));
+}
+
+/* ucomisd a, b with a = top P_A, b = top P_B */
+static void emit_float_compare(struct jit *p_jit, word_t p_ip, int p_a, int p_b,
+                               enum cond p_cc, enum cond p_cc2, uint8_t p_op) {
+	emit_need(p_jit, p_ip, 2);
+	emit_op_mem(p_jit, 0xF2, false, 0x0F10, 0, slot(p_a));
+	emit_op_mem(p_jit, 0x66, false, 0x0F2E, 0, slot(p_b));
+	emit_setcc(p_jit, p_cc, RAX);
+
+	/* == and != also have to look at the parity flag for NaNs */
+	if (p_op != 0) {
+		emit_setcc(p_jit, p_cc2, RCX);
+		emit_op_rr(p_jit, 0, false, p_op, RCX, RAX);
+	}
+
+	emit_store_bool(p_jit);
+}
+
+static void emit_read(struct jit *p_jit, word_t p_ip, int p_size) {
+	emit_need(p_jit, p_ip, 1);
+	emit_load(p_jit, RAX, slot(0));
+	emit_chunk_check(p_jit, p_ip, p_size);
+
+	/* The memory is big endian, unless the program asked for little endian */
+	bool swap = !p_jit->vm->little_endian;
+	switch (p_size) {
+	case 1: emit_op_mem(p_jit, 0, false, 0x0FB6, RAX, memory_at_rax()); break;
+	case 2:
+		emit_op_mem(p_jit, 0, false, 0x0FB7, RAX, memory_at_rax());
+		if (swap) {
+			emit_op_rr(p_jit, 0x66, false, 0xC1, 1, RAX); /* ror ax, 8 */
+			emit8(p_jit, 8);
+		}
+		break;
+
+	case 4:
+		emit_op_mem(p_jit, 0, false, 0x8B, RAX, memory_at_rax());
+		if (swap)
+			emit_bswap(p_jit, false, RAX);
+		break;
+
+	case 8:
+		emit_op_mem(p_jit, 0, true, 0x8B, RAX, memory_at_rax());
+		if (swap)
+			emit_bswap(p_jit, true, RAX);
+		break;
+	}
+
+	emit_store(p_jit, slot(0), RAX);
+}
+
+static void emit_write(struct jit *p_jit, word_t p_ip, int p_size) {
+	emit_need(p_jit, p_ip, 2);
+	emit_load(p_jit, RAX, slot(1));
+	emit_chunk_check(p_jit, p_ip, p_size);
+	emit_load(p_jit, RDX, slot(0));
+
+	bool swap = !p_jit->vm->little_endian;
+	switch (p_size) {
+	case 1: emit_op_mem(p_jit, 0, false, 0x88, RDX, memory_at_rax()); break;
+	case 2:
+		if (swap) {
+			emit_op_rr(p_jit, 0x66, false, 0xC1, 1, RDX); /* ror dx, 8 */
+			emit8(p_jit, 8);
+		}
+		emit_op_mem(p_jit, 0x66, false, 0x89, RDX, memory_at_rax());
+		break;
+
+	case 4:
+		if (swap)
+			emit_bswap(p_jit, false, RDX);
+		emit_op_mem(p_jit, 0, false, 0x89, RDX, memory_at_rax());
+		break;
+
+	case 8:
+		if (swap)
+			emit_bswap(p_jit, true, RDX);
+		emit_op_mem(p_jit, 0, true, 0x89, RDX, memory_at_rax());
+		break;
+	}
+
+	emit_sp_add(p_jit, -2);
+}
+
+static void emit_division(struct jit *p_jit, word_t p_ip, int p_result) {
+	emit_need(p_jit, p_ip, 2);
+	emit_load(p_jit, RCX, slot(0));
+	emit_op_rr(p_jit, 0, true, 0x85, RCX, RCX); /* test rcx, rcx */
+	emit_deopt_if(p_jit, CC_E, p_ip);
+	emit_load(p_jit, RAX, slot(1));
+	emit_op_rr(p_jit, 0, false, 0x31, RDX, RDX); /* xor edx, edx */
+	emit_op_rr(p_jit, 0, true, 0xF7, 6, RCX);    /* div rcx */
+	emit_store(p_jit, slot(1), p_result);
+	emit_dec_sp(p_jit);
+}
+
+static void emit_inst(struct jit *p_jit, word_t p_ip) {
+	struct inst *inst = &p_jit->vm->program[p_ip];
+	word_t       size = p_jit->vm->program_size;
+	word_t       data = inst->data.u64;
+
+	switch (inst->op) {
+	case OP_NOP: break;
+
+	case OP_PSH:
+		emit_room(p_jit, p_ip);
+		emit_store_imm(p_jit, slot(-1), data);
+		emit_inc_sp(p_jit);
+		break;
+
+	case OP_POP:
+		emit_need(p_jit, p_ip, 1);
+		emit_dec_sp(p_jit);
+		break;
+
+	case OP_ADD: emit_binary(p_jit, p_ip, 0x01); break;
+	case OP_SUB: emit_binary(p_jit, p_ip, 0x29); break;
+	case OP_BAN: emit_binary(p_jit, p_ip, 0x21); break;
+	case OP_BOR: emit_binary(p_jit, p_ip, 0x09); break;
+
+	case OP_MUL:
+		emit_need(p_jit, p_ip, 2);
+		emit_load(p_jit, RAX, slot(1));
+		emit_op_mem(p_jit, 0, true, 0x0FAF, RAX, slot(0)); /* imul rax, [top 0] */
+		emit_store(p_jit, slot(1), RAX);
+		emit_dec_sp(p_jit);
+		break;
+
+	case OP_DIV: emit_division(p_jit, p_ip, RAX); break;
+	case OP_MOD: emit_division(p_jit, p_ip, RDX); break;
+
+	case OP_INC: case OP_DEC: case OP_NEG:
+		emit_need(p_jit, p_ip, 1);
+		if (inst->op == OP_NEG)
+			emit_op_mem(p_jit, 0, true, 0xF7, 3, slot(0));
+		else
+			emit_op_mem(p_jit, 0, true, 0xFF, inst->op == OP_INC? 0 : 1, slot(0));
+		break;
+
+	case OP_NOT:
+		emit_need(p_jit, p_ip, 1);
+		emit_op_rr(p_jit, 0, false, 0x31, RAX, RAX);   /* xor eax, eax */
+		emit_op_mem(p_jit, 0, true, 0x83, 7, slot(0)); /* cmp qword [top 0], 0 */
+		emit8(p_jit, 0);
+		emit_setcc(p_jit, CC_E, RAX);
+		emit_store(p_jit, slot(0), RAX);
+		break;
+
+	case OP_BSR: case OP_BSL:
+		emit_need(p_jit, p_ip, 2);
+		emit_load(p_jit, RCX, slot(0));
+		emit_op_mem(p_jit, 0, true, 0xD3, inst->op == OP_BSR? 5 : 4, slot(1)); /* shr/shl [top 1], cl */
+		emit_dec_sp(p_jit);
+		break;
+
+	case OP_FAD: emit_float_binary(p_jit, p_ip, 0x58); break;
+	case OP_FSB: emit_float_binary(p_jit, p_ip, 0x5C); break;
+	case OP_FMU: emit_float_binary(p_jit, p_ip, 0x59); break;
+	case OP_FDI: emit_float_binary(p_jit, p_ip, 0x5E); break;
+	case OP_FIN: emit_float_step(p_jit, p_ip, 0x58); break;
+	case OP_FDE: emit_float_step(p_jit, p_ip, 0x5C); break;
+
+	case OP_EQU: case OP_UEQ: emit_compare(p_jit, p_ip, CC_E);  break;
+	case OP_NEQ: case OP_UNE: emit_compare(p_jit, p_ip, CC_NE); break;
+	case OP_GRT: emit_compare(p_jit, p_ip, CC_G);  break;
+	case OP_GEQ: emit_compare(p_jit, p_ip, CC_GE); break;
+	case OP_LES: emit_compare(p_jit, p_ip, CC_L);  break;
+	case OP_LEQ: emit_compare(p_jit, p_ip, CC_LE); break;
+	case OP_UGR: emit_compare(p_jit, p_ip, CC_A);  break;
+	case OP_UGQ: emit_compare(p_jit, p_ip, CC_AE); break;
+	case OP_ULE: emit_compare(p_jit, p_ip, CC_E);  break; /* Same as in handlers.h */
+	case OP_ULQ: emit_compare(p_jit, p_ip, CC_BE); break;
+
+	case OP_FEQ: emit_float_compare(p_jit, p_ip, 1, 0, CC_E,  CC_NP, 0x20); break;
+	case OP_FNE: emit_float_compare(p_jit, p_ip, 1, 0, CC_NE, CC_P,  0x08); break;
+	case OP_FGR: emit_float_compare(p_jit, p_ip, 1, 0, CC_A,  CC_A,  0);    break;
+	case OP_FGQ: emit_float_compare(p_jit, p_ip, 1, 0, CC_AE, CC_AE, 0);    break;
+	case OP_FLE: emit_float_compare(p_jit, p_ip, 0, 1, CC_A,  CC_A,  0);    break;
+	case OP_FLQ: emit_float_compare(p_jit, p_ip, 0, 1, CC_AE, CC_AE, 0);    break;
+
+	case OP_AND: emit_logic(p_jit, p_ip, 0x20); break;
+	case OP_ORR: emit_logic(p_jit, p_ip, 0x08); break;
+
+	case OP_JMP:
+		if (data >= size)
+			emit_deopt(p_jit, p_ip);
+		else
+			emit_branch(p_jit, 0xE9, data);
+		break;
+
+	case OP_JNZ:
+		emit_need(p_jit, p_ip, 1);
+		emit_load(p_jit, RAX, slot(0));
+		if (data >= size) {
+			emit_op_rr(p_jit, 0, true, 0x85, RAX, RAX);
+			emit_deopt_if(p_jit, CC_NE, p_ip);
+			emit_dec_sp(p_jit);
+		} else {
+			emit_dec_sp(p_jit);
+			emit_op_rr(p_jit, 0, true, 0x85, RAX, RAX);
+			emit_jcc(p_jit, CC_NE, data);
+		}
+		break;
+
+	case OP_CAL:
+		if (data >= size) {
+			emit_deopt(p_jit, p_ip);
+			break;
+		}
+
+		emit_load(p_jit, RAX, FIELD(cs));
+		emit_op_rr(p_jit, 0, true, 0x81, 7, RAX); /* cmp rax, imm32 */
+		emit32(p_jit, p_jit->vm->call_stack_capacity);
+		emit_deopt_if(p_jit, CC_AE, p_ip);
+
+		/* rcx = the entry, frames are 16 bytes */
+		emit_load(p_jit, RCX, FIELD(call_stack));
+		emit_op_rr(p_jit, 0, true, 0x89, RAX, RDX); /* mov rdx, rax */
+		emit_op_rr(p_jit, 0, true, 0xC1, 4, RDX);   /* shl rdx, 4 */
+		emit8(p_jit, 4);
+		emit_op_rr(p_jit, 0, true, 0x01, RDX, RCX); /* add rcx, rdx */
+
+		emit_store_imm(p_jit, (struct mem){.base = RCX, .index = NO_INDEX, .scale = 1,
+		                                   .disp = offsetof(struct frame, ip)}, p_ip + 1);
+		emit_store_imm(p_jit, (struct mem){.base = RCX, .index = NO_INDEX, .scale = 1,
+		                                   .disp = offsetof(struct frame, operand)},
+		               vm_operand_index(p_jit->vm, p_ip + 1));
+		emit_op_rr(p_jit, 0, true, 0xFF, 0, RAX); /* inc rax */
+		emit_store(p_jit, FIELD(cs), RAX);
+
+		emit_branch(p_jit, 0xE8, data);
+		break;
+
+	case OP_RET:
+		emit_load(p_jit, RAX, FIELD(cs));
+		emit_op_rr(p_jit, 0, true, 0x85, RAX, RAX);
+		emit_deopt_if(p_jit, CC_E, p_ip);
+		emit_op_rr(p_jit, 0, true, 0xFF, 1, RAX); /* dec rax */
+		emit_store(p_jit, FIELD(cs), RAX);
+		emit8(p_jit, 0xC3);                       /* ret */
+		break;
+
+	case OP_DUP:
+		if (data >= INT32_MAX / 8 - 1) {
+			emit_interpret(p_jit, p_ip);
+			break;
+		}
+
+		emit_need(p_jit, p_ip, data + 1);
+		emit_room(p_jit, p_ip);
+		emit_load(p_jit, RAX, slot(data));
+		emit_store(p_jit, slot(-1), RAX);
+		emit_inc_sp(p_jit);
+		break;
+
+	case OP_SWP:
+		if (data >= INT32_MAX / 8 - 2) {
+			emit_interpret(p_jit, p_ip);
+			break;
+		}
+
+		emit_need(p_jit, p_ip, data + 2);
+		emit_load(p_jit, RAX, slot(0));
+		emit_load(p_jit, RCX, slot(data + 1));
+		emit_store(p_jit, slot(0), RCX);
+		emit_store(p_jit, slot(data + 1), RAX);
+		break;
+
+	case OP_EMP:
+		emit_room(p_jit, p_ip);
+		emit_store_imm(p_jit, slot(-1), 0);
+		emit_inc_sp(p_jit);
+		break;
+
+	case OP_R08: emit_read(p_jit, p_ip, 1); break;
+	case OP_R16: emit_read(p_jit, p_ip, 2); break;
+	case OP_R32: emit_read(p_jit, p_ip, 4); break;
+	case OP_R64: emit_read(p_jit, p_ip, 8); break;
+
+	case OP_W08: emit_write(p_jit, p_ip, 1); break;
+	case OP_W16: emit_write(p_jit, p_ip, 2); break;
+	case OP_W32: emit_write(p_jit, p_ip, 4); break;
+	case OP_W64: emit_write(p_jit, p_ip, 8); break;
+
+	case OP_HLT:
+		emit_need(p_jit, p_ip, 1);
+		emit_dec_sp(p_jit);
+		emit_load(p_jit, RAX, slot(-1));
+		emit_store(p_jit, FIELD(ex), RAX);
+		emit_op_mem(p_jit, 0, false, 0xC6, 0, FIELD(halt)); /* mov byte [halt], HALT_PROGRAM */
+		emit8(p_jit, HALT_PROGRAM);
+		emit_mov_imm(p_jit, RAX, p_ip + 1);
+		emit_jmp_at(p_jit, p_jit->exit_sync);
+		break;
+
+	/* Memory chunks, file IO, shared libraries and debug output */
+	default: emit_interpret(p_jit, p_ip);
+	}
+}
+
+static void mark_leaders(struct jit *p_jit) {
+	struct vm *vm = p_jit->vm;
+
+	memset(p_jit->leaders, 0, sizeof(bool) * (vm->program_size + 1));
+	p_jit->leaders[vm->ip] = true;
+
+	for (word_t i = 0; i < vm->program_size; ++ i) {
+		struct inst *inst = &vm->program[i];
+
+		switch (inst->op) {
+		case OP_JMP: case OP_JNZ:
+			if (inst->data.u64 < vm->program_size)
+				p_jit->leaders[inst->data.u64] = true;
+			break;
+
+		/* Returns and external functions come back to the next instruction */
+		case OP_CAL:
+			if (inst->data.u64 < vm->program_size)
+				p_jit->leaders[inst->data.u64] = true;
+
+			p_jit->leaders[i + 1] = true;
+			break;
+
+		case OP_CLF: p_jit->leaders[i + 1] = true; break;
+
+		default: break;
+		}
+	}
+}
+
+static void emit_prologue(struct jit *p_jit) {
+	static const int saved[] = {RBX, RBP, R12, R13, R14, R15};
+
+	for (size_t i = 0; i < ARRAY_SIZE(saved); ++ i) {
+		emit_rex(p_jit, false, 0, NO_INDEX, saved[i]);
+		emit8(p_jit, 0x50 | (saved[i] & 7)); /* push */
+	}
+
+	emit_op_rr(p_jit, 0, true, 0x89, RDI, RBX); /* mov rbx, rdi */
+	emit_op_rr(p_jit, 0, true, 0x89, RSP, R15); /* mov r15, rsp */
+	emit_op_rr(p_jit, 0, true, 0x89, RSI, RSP); /* mov rsp, rsi */
+	emit_load(p_jit, R12, FIELD(stack));
+	emit_load(p_jit, R13, FIELD(sp));
+
+	emit_branch(p_jit, 0xE9, p_jit->vm->ip);
+
+	/* exit: return eax */
+	p_jit->exit = p_jit->size;
+	emit_op_rr(p_jit, 0, true, 0x89, R15, RSP); /* mov rsp, r15 */
+	for (size_t i = ARRAY_SIZE(saved); i -- > 0;) {
+		emit_rex(p_jit, false, 0, NO_INDEX, saved[i]);
+		emit8(p_jit, 0x58 | (saved[i] & 7)); /* pop */
+	}
+
+	emit8(p_jit, 0xC3);
+
+	/* exit_sync: write back ip = rax and sp, return ERR_OK */
+	p_jit->exit_sync = p_jit->size;
+	emit_store(p_jit, FIELD(ip), RAX);
+	emit_store(p_jit, FIELD(sp), R13);
+	emit_op_rr(p_jit, 0, false, 0x31, RAX, RAX);
+	emit_jmp_at(p_jit, p_jit->exit);
+
+	/* deopt: write back ip = rax and sp, return JIT_DEOPT */
+	p_jit->deopt = p_jit->size;
+	emit_store(p_jit, FIELD(ip), RAX);
+	emit_store(p_jit, FIELD(sp), R13);
+	emit_mov_imm(p_jit, RAX, (uint32_t)JIT_DEOPT);
+	emit_jmp_at(p_jit, p_jit->exit);
+}
+
+static void link_fixups(struct jit *p_jit) {
+	for (size_t i = 0; i < p_jit->jumps.size; ++ i) {
+		struct fixup *fixup = &p_jit->jumps.buf[i];
+		patch32(p_jit, fixup->at, p_jit->entries[fixup->ip] - (fixup->at + 4));
+	}
+
+	for (size_t i = 0; i < p_jit->deopts.size; ++ i) {
+		struct fixup *fixup = &p_jit->deopts.buf[i];
+
+		if (p_jit->stubs[fixup->ip] == NO_STUB) {
+			p_jit->stubs[fixup->ip] = p_jit->size;
+
+			emit_mov_imm(p_jit, RAX, fixup->ip);
+			emit_jmp_at(p_jit, p_jit->deopt);
+		}
+
+		patch32(p_jit, fixup->at, p_jit->stubs[fixup->ip] - (fixup->at + 4));
+	}
+}
+
+static void *jit_compile(struct vm *p_vm, size_t *p_size) {
+	struct jit jit;
+	memset(&jit, 0, sizeof(jit));
+
+	word_t size = p_vm->program_size;
+
+	jit.vm      = p_vm;
+	jit.entries = (size_t*)alloc(sizeof(size_t) * (size + 1));
+	jit.stubs   = (size_t*)alloc(sizeof(size_t) * (size + 1));
+	jit.leaders = (bool*)alloc(sizeof(bool) * (size + 1));
+
+	for (word_t i = 0; i <= size; ++ i)
+		jit.stubs[i] = NO_STUB;
+
+	mark_leaders(&jit);
+	emit_prologue(&jit);
+
+	for (word_t i = 0; i < size; ++ i) {
+		jit.entries[i] = jit.size;
+		if (p_vm->verified && jit.leaders[i])
+			emit_bounds_check(&jit, i);
+
+		emit_inst(&jit, i);
+	}
+
+	/* Falling off the end of the program */
+	jit.entries[size] = jit.size;
+	emit_mov_imm(&jit, RAX, size);
+	emit_jmp_at(&jit, jit.exit_sync);
+
+	link_fixups(&jit);
+
+	void *code = mmap(NULL, jit.size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (code != MAP_FAILED) {
+		memcpy(code, jit.buf, jit.size);
+
+		if (mprotect(code, jit.size, PROT_READ | PROT_EXEC) != 0) {
+			munmap(code, jit.size);
+			code = MAP_FAILED;
+		}
+	}
+
+	*p_size = jit.size;
+
+	free(jit.buf);
+	free(jit.entries);
+	free(jit.stubs);
+	free(jit.leaders);
+	free(jit.jumps.buf);
+	free(jit.deopts.buf);
+
+	return code == MAP_FAILED? NULL : code;
+}
+
+/* The stack of the compiled code, with a guard page below it. Returns its top,
+   or NULL */
+static uint8_t *alloc_jit_stack(struct vm *p_vm, size_t *p_size) {
+	size_t page = sysconf(_SC_PAGESIZE);
+	size_t size = (p_vm->call_stack_capacity * sizeof(word_t) + JIT_C_STACK + page - 1) /
+	              page * page + page;
+
+	uint8_t *stack = (uint8_t*)mmap(NULL, size, PROT_READ | PROT_WRITE,
+	                                MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK,
+	                                -1, 0);
+	if (stack == MAP_FAILED)
+		return NULL;
+
+	if (mprotect(stack, page, PROT_NONE) != 0) {
+		munmap(stack, size);
+		return NULL;
+	}
+
+	*p_size = size;
+	return stack + size;
+}
+
+void vm_run_jit(struct vm *p_vm) {
+	/* Native returns only match AVM returns if the calls happened in the jit */
+	if (p_vm->ip >= p_vm->program_size || VM_HALT(p_vm) || p_vm->cs > 0) {
+		vm_run(p_vm);
+		return;
+	}
+
+	size_t   size, stack_size;
+	void    *code  = jit_compile(p_vm, &size);
+	uint8_t *stack = code == NULL? NULL : alloc_jit_stack(p_vm, &stack_size);
+	if (stack == NULL) {
+		if (code != NULL)
+			munmap(code, size);
+
+		VM_WARN(stderr, "Failed to map the jit code, using the interpreter");
+		vm_run(p_vm);
+		return;
+	}
+
+	int (*entry)(struct vm*, uint8_t*);
+	*(void**)&entry = code;
+
+	int ret = entry(p_vm, stack);
+	munmap(code, size);
+	munmap(stack - stack_size, stack_size);
+
+	if (ret == JIT_DEOPT)
+		vm_run(p_vm);
+	else if (ret != ERR_OK)
+		vm_panic(p_vm, ret);
+}
+#else
+void vm_run_jit(struct vm *p_vm) {
+	VM_WARN(stderr, "The jit is not supported on this platform, using the interpreter");
+	vm_run(p_vm);
+}
+#endif
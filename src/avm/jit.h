@@ -0,0 +1,28 @@
+#ifndef JIT_H__HEADER_GUARD__
+#define JIT_H__HEADER_GUARD__
+
+#include <stdint.h>  /* uint8_t, int32_t, int64_t, uint64_t */
+#include <stddef.h>  /* size_t, offsetof */
+#include <stdbool.h> /* bool, true, false */
+#include <stdlib.h>  /* malloc, realloc, free */
+#include <string.h>  /* memcpy, memset */
+
+#include "vm.h"
+#include "layout.h"
+
+#if defined(__x86_64__) && (defined(PLATFORM_LINUX) || defined(PLATFORM_UNIX) || \
+                            defined(PLATFORM_APPLE))
+#	define USES_JIT
+
+#	include <sys/mman.h> /* mmap, mprotect, munmap */
+#	include <unistd.h>   /* sysconf, _SC_PAGESIZE */
+#endif
+
+/* Compiles the loaded program to x86-64 machine code and runs it. Instructions
+   the jit can not compile are run by the interpreter. On any runtime error the
+   execution is handed back to the interpreter at the failing instruction, so
+   errors are reported exactly like without the jit. Falls back to vm_run if the
+   jit is not supported */
+void vm_run_jit(struct vm *p_vm);
+
+#endif
@@ -0,0 +1,157 @@
+/* MAP_ANONYMOUS, MAP_NORESERVE, MAP_HUGETLB, MADV_HUGEPAGE, madvise, syscall */
+#define _DEFAULT_SOURCE
+
+#include "large.h"
+#include "sandbox.h"
+
+#ifdef USES_LARGE_MEMORY
+#include <unistd.h>      /* sysconf, syscall, _SC_PAGESIZE */
+#include <sys/syscall.h> /* SYS_mbind */
+#include <errno.h>       /* errno */
+
+/* From linux/mempolicy.h. mbind is called directly, so that libnuma is not
+   needed */
+#define LARGE_MPOL_BIND       2
+#define LARGE_MPOL_INTERLEAVE 3
+
+#define DEFAULT_HUGE_PAGE_SIZE 0x200000
+
+static size_t huge_page_size(void) {
+	size_t size = DEFAULT_HUGE_PAGE_SIZE;
+
+	FILE *file = fopen("/proc/meminfo", "r");
+	if (file == NULL)
+		return size;
+
+	char line[128];
+	while (fgets(line, sizeof(line), file) != NULL) {
+		long long unsigned kb;
+		if (sscanf(line, "Hugepagesize: %llu kB", &kb) == 1) {
+			size = kb * 1024;
+			break;
+		}
+	}
+
+	fclose(file);
+	return size;
+}
+
+/* p_hugetlb for a MAP_HUGETLB mapping, which is huge pages already */
+static enum err place(struct vm *p_vm, void *p_addr, size_t p_size, bool p_hugetlb) {
+	const struct large_memory *large = p_vm->large;
+
+	/* Only a hint, the kernel can have them disabled */
+	if (large->huge_pages != HUGE_PAGES_NONE && !p_hugetlb)
+		madvise(p_addr, p_size, MADV_HUGEPAGE);
+
+	if (large->numa == NUMA_DEFAULT)
+		return ERR_OK;
+
+	unsigned long mask[LARGE_MAX_NODES / 8 / sizeof(unsigned long)];
+	for (size_t i = 0; i < ARRAY_SIZE(mask); ++ i)
+		mask[i] = large->nodes >> (i * 8 * sizeof(unsigned long));
+
+	int mode = large->numa == NUMA_BIND? LARGE_MPOL_BIND : LARGE_MPOL_INTERLEAVE;
+	if (syscall(SYS_mbind, p_addr, p_size, mode, mask, LARGE_MAX_NODES + 1, 0) != 0)
+		return vm_fail(p_vm, ERR_OUT_OF_MEMORY, "mbind() fail on nodes 0x%llx: %s",
+		               (long long unsigned)large->nodes, strerror(errno));
+
+	return ERR_OK;
+}
+
+enum err large_place(struct vm *p_vm, void *p_addr, size_t p_size) {
+	return place(p_vm, p_addr, p_size, false);
+}
+
+void large_copy(uint8_t *p_dest, const uint8_t *p_src, size_t p_size) {
+	size_t page = sysconf(_SC_PAGESIZE);
+	for (size_t at = 0; at < p_size; at += page) {
+		const uint8_t *src  = p_src + at;
+		size_t         size = p_size - at < page? p_size - at : page;
+
+		if (src[0] != 0 || memcmp(src, src + 1, size - 1) != 0)
+			memcpy(p_dest + at, src, size);
+	}
+}
+
+enum err large_resize(struct vm *p_vm, word_t p_bytes) {
+	bool   hugetlb = p_vm->large->huge_pages == HUGE_PAGES_EXPLICIT;
+	size_t page    = hugetlb? huge_page_size() : (size_t)sysconf(_SC_PAGESIZE);
+	if (p_bytes > (size_t)-1 - page)
+		return vm_fail(p_vm, ERR_OUT_OF_MEMORY, "The memory can not be %llu bytes",
+		               (long long unsigned)p_bytes);
+
+	/* Never empty, mmap can not map 0 bytes */
+	size_t size = p_bytes > 0? (p_bytes + page - 1) / page * page : page;
+
+	/* The huge pages are reserved, so that a shortage fails here and not on the
+	   access that needs one */
+	int      flags   = MAP_PRIVATE | MAP_ANONYMOUS | (hugetlb? MAP_HUGETLB : MAP_NORESERVE);
+	uint8_t *mapping = (uint8_t*)mmap(NULL, size, PROT_READ | PROT_WRITE, flags, -1, 0);
+	if (mapping == MAP_FAILED && hugetlb)
+		return vm_fail(p_vm, ERR_OUT_OF_MEMORY,
+		               "Not enough huge pages for %llu bytes, see /proc/sys/vm/nr_hugepages",
+		               (long long unsigned)size);
+	else if (mapping == MAP_FAILED)
+		return vm_fail(p_vm, ERR_OUT_OF_MEMORY, "mmap() fail near "__FILE__":%i", __LINE__);
+
+	/* Before the first touch, which places the pages */
+	enum err err = place(p_vm, mapping, size, hugetlb);
+	if (err != ERR_OK) {
+		munmap(mapping, size);
+		return err;
+	}
+
+	if (p_vm->memory != NULL)
+		large_copy(mapping, p_vm->memory, p_bytes < p_vm->memory_size? p_bytes : p_vm->memory_size);
+
+	if (p_vm->mapping != NULL)
+		munmap(p_vm->mapping, p_vm->mapping_size);
+	else
+		free(p_vm->memory);
+
+	p_vm->memory       = mapping;
+	p_vm->memory_size  = p_bytes;
+	p_vm->mapping      = mapping;
+	p_vm->mapping_size = size;
+
+	return ERR_OK;
+}
+
+enum err vm_large_memory(struct vm *p_vm, const struct large_memory *p_large) {
+	/* Already there, the loads keep p_vm->large only if they reserved the memory
+	   with it */
+	if (p_vm->large == p_large && p_vm->mapping != NULL)
+		return ERR_OK;
+
+	const struct large_memory *prev = p_vm->large;
+	p_vm->large = p_large;
+
+	enum err err = p_vm->sandbox? sandbox_resize(p_vm, p_vm->memory_size) :
+	               large_resize(p_vm, p_vm->memory_size);
+	if (err != ERR_OK)
+		p_vm->large = prev;
+
+	return err;
+}
+#else
+enum err vm_large_memory(struct vm *p_vm, const struct large_memory *p_large) {
+	(void)p_large;
+	return vm_fail(p_vm, ERR_OUT_OF_MEMORY, "Large memories are not supported on this platform");
+}
+
+enum err large_resize(struct vm *p_vm, word_t p_bytes) {
+	(void)p_bytes;
+	return vm_large_memory(p_vm, p_vm->large);
+}
+
+enum err large_place(struct vm *p_vm, void *p_addr, size_t p_size) {
+	(void)p_addr;
+	(void)p_size;
+	return vm_large_memory(p_vm, p_vm->large);
+}
+
+void large_copy(uint8_t *p_dest, const uint8_t *p_src, size_t p_size) {
+	memcpy(p_dest, p_src, p_size);
+}
+#endif
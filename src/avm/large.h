@@ -0,0 +1,71 @@
+#ifndef LARGE_H__HEADER_GUARD__
+#define LARGE_H__HEADER_GUARD__
+
+#include <stdint.h>  /* uint64_t */
+#include <stdbool.h> /* bool, true, false */
+
+#include "vm.h"
+
+/* Large memories. The memory is reserved with mmap instead of being allocated,
+ * and its pages are only committed when the program touches them, so the
+ * resident size follows what the program uses rather than the size it
+ * declares. The reservation can be backed by huge pages, to cut the page
+ * faults and the TLB misses, and placed on chosen NUMA nodes instead of the
+ * node that touches a page first.
+ *
+ *   struct large_memory large = {.huge_pages = HUGE_PAGES_TRANSPARENT};
+ *
+ *   vm_load_from_file(&vm, path, ...);
+ *   vm_large_memory(&vm, &large);
+ *   vm_run(&vm);
+ *
+ * The options are kept in p_vm->large, they must outlive the vm. A memory that
+ * grows later (see vm_alloc_mem) gets the same placement. Loading another
+ * program can replace the memory, vm_large_memory is called again after it.
+ * Works with a sandbox (see sandbox.h), which then takes transparent huge pages
+ * instead of explicit ones.
+ */
+
+#if defined(USES_MMAP) && defined(PLATFORM_LINUX)
+#	define USES_LARGE_MEMORY
+#endif
+
+#define LARGE_MAX_NODES 64 /* The nodes are a bit mask */
+
+enum huge_pages {
+	HUGE_PAGES_NONE = 0,
+	HUGE_PAGES_TRANSPARENT, /* madvise(MADV_HUGEPAGE), when the kernel has them */
+	HUGE_PAGES_EXPLICIT,    /* MAP_HUGETLB, from the pages reserved in
+	                           /proc/sys/vm/nr_hugepages */
+};
+
+enum numa_policy {
+	NUMA_DEFAULT = 0, /* First touch */
+	NUMA_BIND,        /* Only on the nodes */
+	NUMA_INTERLEAVE,  /* Page by page over the nodes */
+};
+
+struct large_memory {
+	enum huge_pages  huge_pages;
+	enum numa_policy numa;
+	uint64_t         nodes; /* Bit n for node n, for NUMA_BIND and NUMA_INTERLEAVE */
+};
+
+/* Moves the memory into a reservation placed with p_large. Fails if it is not
+   supported on this platform, if there are not enough explicit huge pages or
+   if the nodes can not be used */
+enum err vm_large_memory(struct vm *p_vm, const struct large_memory *p_large);
+
+/* Replaces the reservation with one of p_bytes, keeping the memory, for
+   vm_alloc_mem */
+enum err large_resize(struct vm *p_vm, word_t p_bytes);
+
+/* Applies the huge pages and the NUMA policy of p_vm->large to p_size bytes of
+   a new mapping, before anything is written to it. For the sandbox */
+enum err large_place(struct vm *p_vm, void *p_addr, size_t p_size);
+
+/* Copies p_size bytes, leaving out the zero pages of p_src. p_dest is zero
+   filled and lazily committed, so they are not committed */
+void large_copy(uint8_t *p_dest, const uint8_t *p_src, size_t p_size);
+
+#endif
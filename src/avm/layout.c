@@ -0,0 +1,91 @@
+#include "layout.h"
+
+enum err vm_layout(struct vm *p_vm) {
+	vm_layout_free(p_vm);
+
+	word_t size  = p_vm->program_size;
+	word_t spans = size / OPERAND_MAP_SPAN + 1;
+
+	word_t count = 0;
+	for (word_t i = 0; i < size; ++ i)
+		count += vm_operand_count(p_vm->program[i].op);
+
+	/* Never empty, so a NULL pointer always means no layout */
+	p_vm->ops         = (uint8_t*)malloc(size + 1);
+	p_vm->operands    = (value_t*)malloc(sizeof(value_t) * (count + 1));
+	p_vm->operand_map = (struct operand_map*)malloc(sizeof(struct operand_map) * spans);
+	if (p_vm->ops == NULL || p_vm->operands == NULL || p_vm->operand_map == NULL) {
+		vm_layout_free(p_vm);
+		return vm_fail(p_vm, ERR_OUT_OF_MEMORY, "malloc() fail near "__FILE__":%i", __LINE__);
+	}
+
+	memset(p_vm->operand_map, 0, sizeof(struct operand_map) * spans);
+
+	count = 0;
+	for (word_t i = 0; i < size; ++ i) {
+		struct inst        *inst = &p_vm->program[i];
+		struct operand_map *map  = &p_vm->operand_map[i / OPERAND_MAP_SPAN];
+
+		if (i % OPERAND_MAP_SPAN == 0)
+			map->first = count;
+
+		p_vm->ops[i] = inst->op;
+		if (vm_operand_count(inst->op) > 0) {
+			map->has_operand |= (uint64_t)1 << (i % OPERAND_MAP_SPAN);
+			p_vm->operands[count ++] = inst->data;
+		}
+
+		if (vm_has_target(inst->op)) {
+			map->has_target |= (uint64_t)1 << (i % OPERAND_MAP_SPAN);
+			p_vm->operands[count ++].u64 = 0;
+		}
+	}
+
+	if (size % OPERAND_MAP_SPAN == 0)
+		p_vm->operand_map[spans - 1].first = count;
+
+	/* The map is complete now, resolve the targets. Invalid targets are caught
+	   before their index is used */
+	for (word_t i = 0; i < size; ++ i) {
+		struct inst *inst = &p_vm->program[i];
+		if (!vm_has_target(inst->op))
+			continue;
+
+		value_t *operands = &p_vm->operands[vm_operand_index(p_vm, i)];
+		operands[1].u64 = inst->data.u64 <= size? vm_operand_index(p_vm, inst->data.u64) : 0;
+	}
+
+	p_vm->ops[size] = OP_NOP;
+
+	return ERR_OK;
+}
+
+void vm_layout_free(struct vm *p_vm) {
+	/* A cached image is unmapped as a whole */
+	if (p_vm->image == NULL) {
+		if (p_vm->code != NULL && p_vm->code != p_vm->ops)
+			free(p_vm->code);
+
+		if (p_vm->ops != NULL)
+			free(p_vm->ops);
+
+		if (p_vm->operands != NULL)
+			free(p_vm->operands);
+
+		if (p_vm->operand_map != NULL)
+			free(p_vm->operand_map);
+	}
+
+	p_vm->code        = NULL;
+	p_vm->ops         = NULL;
+	p_vm->operands    = NULL;
+	p_vm->operand_map = NULL;
+}
+
+value_t vm_operand(struct vm *p_vm, word_t p_ip) {
+	value_t value = {0};
+	if (vm_operand_count(p_vm->ops[p_ip]) > 0)
+		value = p_vm->operands[vm_operand_index(p_vm, p_ip)];
+
+	return value;
+}
@@ -0,0 +1,99 @@
+#ifndef LAYOUT_H__HEADER_GUARD__
+#define LAYOUT_H__HEADER_GUARD__
+
+#include <stdint.h>  /* uint8_t, uint64_t */
+#include <stdbool.h> /* bool, true, false */
+#include <stdlib.h>  /* malloc, free, exit, EXIT_FAILURE */
+#include <string.h>  /* memset */
+
+#include "vm.h"
+
+/* Instruction layout the interpreters run on. The packed program is split into
+ * a dense opcode stream (p_vm->ops, one byte per instruction) and an aligned
+ * array with the operands of only the instructions that have one
+ * (p_vm->operands), in program order.
+ *
+ * Running straight through the code, the operands are read in order. Jumps
+ * and calls have a second operand, the index of the first operand at their
+ * target. After a return or an external function call, the index is looked up
+ * in p_vm->operand_map, which has an entry for every OPERAND_MAP_SPAN
+ * instructions.
+ */
+
+#define OPERAND_MAP_SPAN 64
+
+struct operand_map {
+	uint64_t has_operand; /* Bit N is set if the instruction N of the span has
+	                         an operand */
+	uint64_t has_target;  /* And if it has a target, which takes a second one */
+	word_t   first;       /* Index of the first operand of the span */
+};
+
+/* Operands of an instruction, superinstructions have those of the whole
+   sequence they replace */
+static inline word_t vm_operand_count(uint8_t p_op) {
+	switch (p_op) {
+	case OP_PSH: case OP_DUP: case OP_SWP:
+	case OP_PSH_ADD: case OP_PSH_SUB: case OP_PSH_R64:
+		return 1;
+
+	/* Target and its operand index */
+	case OP_JMP: case OP_JNZ: case OP_CAL:
+	case OP_EQU_JNZ: case OP_NEQ_JNZ: case OP_GRT_JNZ:
+	case OP_GEQ_JNZ: case OP_LES_JNZ: case OP_LEQ_JNZ:
+		return 2;
+
+	case OP_DUP_JNZ:  return 3;
+	case OP_LOOP_LES: return 4; /* DUP, PSH and JNZ */
+
+	default: return 0;
+	}
+}
+
+/* Instructions a superinstruction replaces, 1 for the other opcodes */
+static inline word_t vm_inst_count(uint8_t p_op) {
+	switch (p_op) {
+	case OP_PSH_ADD: case OP_PSH_SUB: case OP_PSH_R64: case OP_DUP_JNZ:
+	case OP_EQU_JNZ: case OP_NEQ_JNZ: case OP_GRT_JNZ:
+	case OP_GEQ_JNZ: case OP_LES_JNZ: case OP_LEQ_JNZ:
+		return 2;
+
+	case OP_LOOP_LES: return 5;
+
+	default: return 1;
+	}
+}
+
+static inline bool vm_has_target(uint8_t p_op) {
+	return p_op == OP_JMP || p_op == OP_JNZ || p_op == OP_CAL;
+}
+
+/* Baseline x86-64 has no popcount instruction, so the builtin would be a
+   library call */
+static inline word_t count_bits(uint64_t p_bits) {
+	p_bits = p_bits - ((p_bits >> 1) & 0x5555555555555555);
+	p_bits = (p_bits & 0x3333333333333333) + ((p_bits >> 2) & 0x3333333333333333);
+	p_bits = (p_bits + (p_bits >> 4)) & 0x0F0F0F0F0F0F0F0F;
+
+	return (p_bits * 0x0101010101010101) >> 070;
+}
+
+/* Index of the first operand at or after the instruction at p_ip, p_ip can be
+   up to the program size */
+static inline word_t vm_operand_index(struct vm *p_vm, word_t p_ip) {
+	struct operand_map *map  = &p_vm->operand_map[p_ip / OPERAND_MAP_SPAN];
+	uint64_t            mask = ((uint64_t)1 << (p_ip % OPERAND_MAP_SPAN)) - 1;
+
+	return map->first + count_bits(map->has_operand & mask) +
+	       count_bits(map->has_target & mask);
+}
+
+/* Builds p_vm->ops, p_vm->operands and p_vm->operand_map from p_vm->program.
+   Fails only if there is no memory, see vm_fail */
+enum err vm_layout(struct vm *p_vm);
+void vm_layout_free(struct vm *p_vm);
+
+/* Operand of the instruction at p_ip, 0 if it has none */
+value_t vm_operand(struct vm *p_vm, word_t p_ip);
+
+#endif
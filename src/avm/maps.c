@@ -0,0 +1,176 @@
+#include "maps.h"
+
+void maps_init(struct maps *p_maps) {
+	memset(p_maps, 0, sizeof(struct maps));
+
+	p_maps->files      = p_maps->inline_files;
+	p_maps->files_size = MAPS_INLINE_FILES;
+
+	p_maps->files[0].file = stdin;
+	p_maps->files[0].mode = FMODE_READ;
+
+	p_maps->files[1].file = stdout;
+	p_maps->files[1].mode = FMODE_WRITE;
+
+	p_maps->files[2].file = stderr;
+	p_maps->files[2].mode = FMODE_WRITE;
+
+	p_maps->free_files = INVALID_DESCRIPTOR;
+	for (word_t fd = MAPS_INLINE_FILES; fd -- > 3;) {
+		p_maps->files[fd].next = p_maps->free_files;
+		p_maps->free_files     = fd;
+	}
+
+	p_maps->free_libs = INVALID_DESCRIPTOR;
+
+	p_maps->max_files = DEFAULT_MAX_FILES;
+	p_maps->max_libs  = DEFAULT_MAX_LIBS;
+	p_maps->max_funcs = DEFAULT_MAX_FUNCS;
+}
+
+void maps_free(struct maps *p_maps) {
+	for (word_t ld = 0; ld < p_maps->libs_size; ++ ld)
+		free(p_maps->libs[ld].funcs);
+
+	if (p_maps->files != p_maps->inline_files)
+		free(p_maps->files);
+
+	free(p_maps->libs);
+}
+
+void maps_close(struct maps *p_maps) {
+	for (word_t fd = 3; fd < p_maps->files_size; ++ fd) {
+		if (p_maps->files[fd].file != NULL)
+			fclose(p_maps->files[fd].file);
+	}
+
+	for (word_t ld = 0; ld < p_maps->libs_size; ++ ld) {
+		if (p_maps->libs[ld].handle != NULL)
+			dlclose(p_maps->libs[ld].handle);
+	}
+}
+
+/* Grows a table of p_elem sized entries, zeroing the new ones. A table at
+   p_inline is not on the heap, it is copied */
+static enum err grow(void **p_table, word_t *p_size, size_t p_elem, word_t p_max,
+                     void *p_inline, enum err p_full) {
+	word_t size = *p_size;
+	if (size >= p_max)
+		return p_full;
+
+	word_t new_size = size < MAPS_MIN_GROW? MAPS_MIN_GROW : size * 2;
+	if (new_size > p_max)
+		new_size = p_max;
+
+	void *table;
+	if (*p_table == p_inline) {
+		table = malloc(new_size * p_elem);
+		if (table != NULL && size > 0)
+			memcpy(table, p_inline, size * p_elem);
+	} else
+		table = realloc(*p_table, new_size * p_elem);
+
+	if (table == NULL)
+		return ERR_OUT_OF_MEMORY;
+
+	memset((uint8_t*)table + size * p_elem, 0, (new_size - size) * p_elem);
+
+	*p_table = table;
+	*p_size  = new_size;
+
+	return ERR_OK;
+}
+
+/* The new descriptors are pushed from the last, so the lowest is taken first */
+#define PUSH_FREE(P_TABLE, P_FREE, P_FROM, P_TO) \
+	for (word_t i = (P_TO); i -- > (P_FROM);) { \
+		(P_TABLE)[i].next = (P_FREE); \
+		(P_FREE)          = i; \
+	}
+
+enum err vm_alloc_fd(struct vm *p_vm, word_t *p_fd) {
+	struct maps *maps = p_vm->maps;
+	if (maps->free_files == INVALID_DESCRIPTOR) {
+		word_t   size = maps->files_size;
+		enum err err  = grow((void**)&maps->files, &maps->files_size, sizeof(struct file),
+		                     maps->max_files, maps->inline_files, ERR_MAX_FILES_OPEN);
+		if (err != ERR_OK)
+			return err;
+
+		PUSH_FREE(maps->files, maps->free_files, size, maps->files_size);
+	}
+
+	*p_fd            = maps->free_files;
+	maps->free_files = maps->files[*p_fd].next;
+
+	return ERR_OK;
+}
+
+enum err vm_alloc_ld(struct vm *p_vm, word_t *p_ld) {
+	struct maps *maps = p_vm->maps;
+	if (maps->free_libs == INVALID_DESCRIPTOR) {
+		word_t   size = maps->libs_size;
+		enum err err  = grow((void**)&maps->libs, &maps->libs_size, sizeof(struct lib),
+		                     maps->max_libs, NULL, ERR_MAX_LIBS_OPEN);
+		if (err != ERR_OK)
+			return err;
+
+		for (word_t ld = size; ld < maps->libs_size; ++ ld)
+			maps->libs[ld].free_funcs = INVALID_DESCRIPTOR;
+
+		PUSH_FREE(maps->libs, maps->free_libs, size, maps->libs_size);
+	}
+
+	*p_ld           = maps->free_libs;
+	maps->free_libs = maps->libs[*p_ld].next;
+
+	return ERR_OK;
+}
+
+enum err vm_alloc_fnd(struct vm *p_vm, word_t p_ld, word_t *p_fnd) {
+	struct lib *lib = &p_vm->maps->libs[p_ld];
+	if (lib->free_funcs == INVALID_DESCRIPTOR) {
+		word_t   size = lib->funcs_size;
+		enum err err  = grow((void**)&lib->funcs, &lib->funcs_size, sizeof(struct lib_func),
+		                     p_vm->maps->max_funcs, NULL, ERR_MAX_FUNCS_LOADED);
+		if (err != ERR_OK)
+			return err;
+
+		PUSH_FREE(lib->funcs, lib->free_funcs, size, lib->funcs_size);
+	}
+
+	*p_fnd          = lib->free_funcs;
+	lib->free_funcs = lib->funcs[*p_fnd].next;
+
+	return ERR_OK;
+}
+
+void vm_release_fd(struct vm *p_vm, word_t p_fd) {
+	struct maps *maps = p_vm->maps;
+
+	maps->files[p_fd].file = NULL;
+	maps->files[p_fd].next = maps->free_files;
+	maps->free_files       = p_fd;
+}
+
+void vm_release_ld(struct vm *p_vm, word_t p_ld) {
+	struct maps *maps = p_vm->maps;
+	struct lib  *lib  = &maps->libs[p_ld];
+
+	free(lib->funcs);
+	lib->funcs      = NULL;
+	lib->funcs_size = 0;
+	lib->free_funcs = INVALID_DESCRIPTOR;
+
+	lib->handle     = NULL;
+	lib->next       = maps->free_libs;
+	maps->free_libs = p_ld;
+}
+
+void vm_release_fnd(struct vm *p_vm, word_t p_ld, word_t p_fnd) {
+	struct lib *lib = &p_vm->maps->libs[p_ld];
+
+	lib->funcs[p_fnd].func = NULL;
+	lib->funcs[p_fnd].next = lib->free_funcs;
+	lib->free_funcs        = p_fnd;
+}
@@ -0,0 +1,90 @@
+#ifndef MAPS_H__HEADER_GUARD__
+#define MAPS_H__HEADER_GUARD__
+
+#include <stdint.h> /* uint64_t */
+#include <stdlib.h> /* malloc, realloc, free */
+#include <string.h> /* memset, memcpy */
+#include <stdio.h>  /* FILE, stdin, stdout, stderr, fclose */
+#include <dlfcn.h>  /* dlclose */
+
+#include "vm.h"
+
+/* Tables of the files, libraries and external functions a program opens. They
+ * grow when they are full, up to the limits in struct maps, and the closed
+ * descriptors are kept in free lists, so opening and closing take constant
+ * time. Descriptors 0, 1 and 2 (stdin, stdout and stderr) and a few more files
+ * fit in the struct itself, the libraries and the functions are only allocated
+ * when a program loads them.
+ *
+ * The limits can be changed after vm_init, before the first program runs:
+ *
+ *   vm.maps->max_files = 0x1000;
+ *
+ * A file limit below MAPS_INLINE_FILES has no effect.
+ */
+
+#define MAPS_INLINE_FILES 8
+#define MAPS_MIN_GROW     8
+#define MAPS_MAX_LIMIT    0x1000000
+
+#define DEFAULT_MAX_FILES 0x10000
+#define DEFAULT_MAX_LIBS  0x400
+#define DEFAULT_MAX_FUNCS 0x1000
+
+struct file {
+	FILE      *file; /* NULL if the descriptor is free */
+	enum fmode mode;
+	word_t     next; /* Next free descriptor */
+
+	uint64_t read, written; /* Bytes read by RDF and written by WRF if there are
+	                           stats, see stats.h. Kept when the descriptor is
+	                           closed */
+};
+
+struct lib_func {
+	external_t func; /* NULL if the descriptor is free */
+	word_t     next;
+};
+
+struct lib {
+	void   *handle; /* NULL if the descriptor is free */
+	word_t  next;
+
+	struct lib_func *funcs;
+	word_t           funcs_size, free_funcs;
+};
+
+/* The free lists end with INVALID_DESCRIPTOR */
+struct maps {
+	struct file *files;
+	word_t       files_size, free_files;
+
+	struct lib *libs;
+	word_t      libs_size, free_libs;
+
+	word_t max_files, max_libs, max_funcs;
+
+	struct file inline_files[MAPS_INLINE_FILES]; /* files until it grows */
+};
+
+void maps_init(struct maps *p_maps);
+void maps_free(struct maps *p_maps);
+
+/* Closes the files and the libraries that are still open, except for stdin,
+   stdout and stderr */
+void maps_close(struct maps *p_maps);
+
+/* Take a free descriptor, the caller opens the file, library or function. Return
+   ERR_MAX_FILES_OPEN, ERR_MAX_LIBS_OPEN or ERR_MAX_FUNCS_LOADED at the limit and
+   ERR_OUT_OF_MEMORY if the table can not grow */
+enum err vm_alloc_fd (struct vm *p_vm, word_t *p_fd);
+enum err vm_alloc_ld (struct vm *p_vm, word_t *p_ld);
+enum err vm_alloc_fnd(struct vm *p_vm, word_t p_ld, word_t *p_fnd);
+
+/* Free a descriptor the caller closed. Releasing a library releases its
+   functions */
+void vm_release_fd (struct vm *p_vm, word_t p_fd);
+void vm_release_ld (struct vm *p_vm, word_t p_ld);
+void vm_release_fnd(struct vm *p_vm, word_t p_ld, word_t p_fnd);
+
+#endif
@@ -0,0 +1,116 @@
+#include "profile.h"
+
+static uint64_t *alloc_counters(word_t p_size) {
+	/* Never empty, so that an empty program still has counters */
+	uint64_t *counters = (uint64_t*)calloc(p_size + 1, sizeof(uint64_t));
+	if (counters == NULL) {
+		VM_ERROR(stderr, "calloc() fail near "__FILE__":%i", __LINE__);
+		exit(EXIT_FAILURE);
+	}
+
+	return counters;
+}
+
+static word_t add_node(struct profile *p_profile, word_t p_func, word_t p_parent) {
+	if (p_profile->nodes_count >= p_profile->nodes_capacity) {
+		p_profile->nodes_capacity = p_profile->nodes_capacity * 2 + 64;
+		p_profile->nodes = (struct call_node*)realloc(p_profile->nodes,
+		                   sizeof(struct call_node) * p_profile->nodes_capacity);
+		if (p_profile->nodes == NULL) {
+			VM_ERROR(stderr, "realloc() fail near "__FILE__":%i", __LINE__);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	word_t node = p_profile->nodes_count ++;
+	p_profile->nodes[node] = (struct call_node){
+		.func    = p_func,
+		.parent  = p_parent,
+		.child   = CALL_ROOT,
+		.sibling = CALL_ROOT,
+		.self    = 0,
+		.calls   = 0,
+	};
+
+	return node;
+}
+
+void profile_init(struct profile *p_profile, word_t p_size) {
+	p_profile->counts = alloc_counters(p_size);
+	p_profile->taken  = alloc_counters(p_size);
+	p_profile->size   = p_size;
+
+	p_profile->nodes          = NULL;
+	p_profile->nodes_count    = 0;
+	p_profile->nodes_capacity = 0;
+	p_profile->node           = add_node(p_profile, 0, CALL_ROOT);
+	p_profile->steps          = 0;
+	p_profile->fused          = 0;
+	p_profile->mark           = 0;
+	p_profile->peak_sp        = 0;
+	p_profile->peak_cs        = 0;
+
+	p_profile->nodes[CALL_ROOT].calls = 1;
+}
+
+void profile_free(struct profile *p_profile) {
+	free(p_profile->counts);
+	free(p_profile->taken);
+	free(p_profile->nodes);
+
+	p_profile->counts = NULL;
+	p_profile->taken  = NULL;
+	p_profile->nodes  = NULL;
+}
+
+void profile_peaks(struct profile *p_profile, word_t p_sp, word_t p_cs) {
+	if (p_sp > p_profile->peak_sp)
+		p_profile->peak_sp = p_sp;
+
+	if (p_cs > p_profile->peak_cs)
+		p_profile->peak_cs = p_cs;
+}
+
+void profile_flush(struct profile *p_profile) {
+	p_profile->nodes[p_profile->node].self += p_profile->steps - p_profile->mark;
+	p_profile->mark = p_profile->steps;
+}
+
+word_t profile_child(struct profile *p_profile, word_t p_parent, word_t p_func) {
+	/* The children are few, except in programs that call through many
+	   different paths */
+	word_t prev = CALL_ROOT, node = p_profile->nodes[p_parent].child;
+	for (; node != CALL_ROOT; prev = node, node = p_profile->nodes[node].sibling) {
+		if (p_profile->nodes[node].func == p_func)
+			break;
+	}
+
+	if (node == CALL_ROOT) {
+		node = add_node(p_profile, p_func, p_parent);
+
+		p_profile->nodes[node].sibling   = p_profile->nodes[p_parent].child;
+		p_profile->nodes[p_parent].child = node;
+	} else if (prev != CALL_ROOT) {
+		/* Move to the front, calls from a loop find it first the next time */
+		p_profile->nodes[prev].sibling   = p_profile->nodes[node].sibling;
+		p_profile->nodes[node].sibling   = p_profile->nodes[p_parent].child;
+		p_profile->nodes[p_parent].child = node;
+	}
+
+	return node;
+}
+
+void profile_call(struct profile *p_profile, word_t p_func) {
+	profile_flush(p_profile);
+
+	p_profile->node = profile_child(p_profile, p_profile->node, p_func);
+	++ p_profile->nodes[p_profile->node].calls;
+}
+
+void profile_return(struct profile *p_profile) {
+	profile_flush(p_profile);
+
+	/* A return from the entry point stays in it, RET panics there anyway */
+	if (p_profile->node != CALL_ROOT)
+		p_profile->node = p_profile->nodes[p_profile->node].parent;
+}
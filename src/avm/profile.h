@@ -0,0 +1,68 @@
+#ifndef PROFILE_H__HEADER_GUARD__
+#define PROFILE_H__HEADER_GUARD__
+
+#include <stdint.h>  /* uint64_t */
+#include <stdlib.h>  /* calloc, realloc, free, exit, EXIT_FAILURE */
+
+#include "vm.h"
+
+#define CALL_ROOT 0 /* The call node of the entry point */
+
+/* Node of the calling context tree. Every distinct chain of calls from the
+   entry point has its own node, so recursion makes one node per depth */
+struct call_node {
+	word_t   func;    /* Address of the called function */
+	word_t   parent;
+	word_t   child;   /* First child, CALL_ROOT if none */
+	word_t   sibling; /* Next child of the parent, CALL_ROOT if none */
+	uint64_t self;    /* Instructions executed in the function itself */
+	uint64_t calls;
+};
+
+/* Execution counters of vm_run_profiled. The profiled interpreter is a separate
+   copy of the checked threaded loop, so the other loops do not pay for it */
+struct profile {
+	uint64_t *counts; /* Executions of each instruction */
+	uint64_t *taken;  /* Jumps taken by each instruction, a JNZ that does not
+	                     jump is counted in counts only */
+	word_t    size;
+
+	/* CAL and RET move between the call nodes, the instructions executed since
+	   the last move are added to the node that is left */
+	struct call_node *nodes;
+	word_t            nodes_count, nodes_capacity;
+	word_t            node;  /* Current node */
+	uint64_t          steps; /* Executed instructions */
+	uint64_t          fused; /* Of those, the ones executed by superinstructions
+	                            after their first, see vm_run_counted */
+	uint64_t          mark;  /* steps when the current node was entered */
+
+	word_t peak_sp, peak_cs; /* Largest stack and call stack sizes */
+};
+
+void profile_init(struct profile *p_profile, word_t p_size);
+void profile_free(struct profile *p_profile);
+
+/* Node of p_func called from p_parent, added if it is not in the tree yet */
+word_t profile_child(struct profile *p_profile, word_t p_parent, word_t p_func);
+
+/* Called after CAL has pushed the return address and after RET has popped it */
+void profile_call(struct profile *p_profile, word_t p_func);
+void profile_return(struct profile *p_profile);
+
+/* Keeps the larger peaks, the loops call it when they are left */
+void profile_peaks(struct profile *p_profile, word_t p_sp, word_t p_cs);
+
+/* Adds the instructions executed since the last call or return to the current
+   node, before the nodes are read */
+void profile_flush(struct profile *p_profile);
+
+/* Runs the program on the checked interpreter, counting into p_vm->profile */
+void vm_run_profiled(struct vm *p_vm);
+
+/* Runs the program on the fast interpreter, only counting the executed
+   instructions into p_vm->profile->steps. The dispatches are steps - fused.
+   Programs the verifier did not accept run on vm_run_profiled */
+void vm_run_counted(struct vm *p_vm);
+
+#endif
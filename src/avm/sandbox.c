@@ -0,0 +1,153 @@
+/* sigaction, siginfo_t, sigsetjmp, siglongjmp, MAP_ANONYMOUS, MAP_NORESERVE */
+#define _DEFAULT_SOURCE
+
+#include "sandbox.h"
+#include "large.h"
+
+#ifdef USES_SANDBOX
+#include <signal.h> /* sigaction, sigemptyset, siginfo_t, SIGSEGV, SIGBUS, SA_SIGINFO */
+#include <setjmp.h> /* sigjmp_buf, sigsetjmp, siglongjmp */
+#include <unistd.h> /* sysconf, _SC_PAGESIZE */
+
+/* Run of the current thread, the runs of different threads are independent */
+struct sandbox_frame {
+	sigjmp_buf            jmp;
+	struct vm            *vm;
+	struct sandbox_frame *prev; /* An external function can run another vm */
+};
+
+static _Thread_local struct sandbox_frame *frame = NULL;
+
+static struct sigaction previous_segv, previous_bus;
+
+static void on_fault(int p_sig, siginfo_t *p_info, void *p_ctx) {
+	if (frame != NULL) {
+		uint8_t *addr  = (uint8_t*)p_info->si_addr;
+		uint8_t *start = (uint8_t*)frame->vm->mapping;
+
+		if (addr >= start && addr < start + frame->vm->mapping_size)
+			siglongjmp(frame->jmp, 1);
+	}
+
+	/* Not an access of a sandbox */
+	struct sigaction *previous = p_sig == SIGSEGV? &previous_segv : &previous_bus;
+	if (previous->sa_flags & SA_SIGINFO)
+		previous->sa_sigaction(p_sig, p_info, p_ctx);
+	else if (previous->sa_handler != SIG_DFL && previous->sa_handler != SIG_IGN)
+		previous->sa_handler(p_sig);
+	else {
+		/* The access faults again when the handler returns, and kills the
+		   process like it would have without it */
+		signal(p_sig, SIG_DFL);
+	}
+}
+
+static void install_handler(void) {
+	struct sigaction sa;
+	if (sigaction(SIGSEGV, NULL, &sa) == 0 && (sa.sa_flags & SA_SIGINFO) &&
+	    sa.sa_sigaction == on_fault)
+		return;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_sigaction = on_fault;
+	sa.sa_flags     = SA_SIGINFO;
+	sigemptyset(&sa.sa_mask);
+
+	sigaction(SIGSEGV, &sa, &previous_segv);
+	sigaction(SIGBUS,  &sa, &previous_bus);
+}
+
+enum err sandbox_resize(struct vm *p_vm, word_t p_bytes) {
+	if (p_bytes > SANDBOX_SPAN)
+		return vm_fail(p_vm, ERR_OUT_OF_MEMORY, "The memory of a sandbox is at most %llu bytes",
+		               (long long unsigned)SANDBOX_SPAN);
+
+	/* The memory ends at the guard pages, the bytes before it in its first
+	   page are never reached */
+	size_t page = sysconf(_SC_PAGESIZE);
+	size_t used = (p_bytes + page - 1) / page * page;
+	size_t size = used + SANDBOX_SPAN + page;
+
+	uint8_t *mapping = (uint8_t*)mmap(NULL, size, PROT_NONE,
+	                                  MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (mapping == MAP_FAILED)
+		return vm_fail(p_vm, ERR_OUT_OF_MEMORY, "mmap() fail near "__FILE__":%i", __LINE__);
+
+	if (used > 0 && mprotect(mapping, used, PROT_READ | PROT_WRITE) != 0) {
+		munmap(mapping, size);
+		return vm_fail(p_vm, ERR_OUT_OF_MEMORY, "mprotect() fail near "__FILE__":%i", __LINE__);
+	}
+
+	/* The placement of a large memory, before the pages are touched */
+	if (p_vm->large != NULL && used > 0) {
+		enum err err = large_place(p_vm, mapping, used);
+		if (err != ERR_OK) {
+			munmap(mapping, size);
+			return err;
+		}
+	}
+
+	uint8_t *memory = mapping + used - p_bytes;
+	word_t   kept   = p_bytes < p_vm->memory_size? p_bytes : p_vm->memory_size;
+	if (p_vm->memory != NULL && p_vm->large != NULL)
+		large_copy(memory, p_vm->memory, kept);
+	else if (p_vm->memory != NULL)
+		memcpy(memory, p_vm->memory, kept);
+
+	if (p_vm->mapping != NULL)
+		munmap(p_vm->mapping, p_vm->mapping_size);
+	else
+		free(p_vm->memory);
+
+	p_vm->memory       = memory;
+	p_vm->memory_size  = p_bytes;
+	p_vm->mapping      = mapping;
+	p_vm->mapping_size = size;
+	p_vm->sandbox      = true;
+
+	return ERR_OK;
+}
+
+enum err vm_sandbox(struct vm *p_vm) {
+	if (p_vm->sandbox)
+		return ERR_OK;
+
+	enum err err = sandbox_resize(p_vm, p_vm->memory_size);
+	if (err == ERR_OK)
+		install_handler();
+
+	return err;
+}
+
+bool sandbox_run(struct vm *p_vm, void (*p_run)(struct vm*)) {
+	struct sandbox_frame current;
+	current.vm   = p_vm;
+	current.prev = frame;
+
+	/* The signal mask is saved, SIGSEGV is blocked in the handler */
+	if (sigsetjmp(current.jmp, 1) != 0) {
+		frame = current.prev;
+		return false;
+	}
+
+	frame = &current;
+	p_run(p_vm);
+	frame = current.prev;
+
+	return true;
+}
+#else
+enum err vm_sandbox(struct vm *p_vm) {
+	return vm_fail(p_vm, ERR_INVALID_MEM_ACCESS, "Sandboxed memory is not supported on this platform");
+}
+
+enum err sandbox_resize(struct vm *p_vm, word_t p_bytes) {
+	(void)p_bytes;
+	return vm_sandbox(p_vm);
+}
+
+bool sandbox_run(struct vm *p_vm, void (*p_run)(struct vm*)) {
+	p_run(p_vm);
+	return true;
+}
+#endif
@@ -0,0 +1,52 @@
+#ifndef SANDBOX_H__HEADER_GUARD__
+#define SANDBOX_H__HEADER_GUARD__
+
+#include <stdint.h>  /* uint8_t */
+#include <stdbool.h> /* bool, true, false */
+
+#include "vm.h"
+
+/* Sandboxed memory. The memory is moved to the start of a reserved region,
+ * right before SANDBOX_SPAN bytes of inaccessible guard pages, so that every
+ * address below SANDBOX_SPAN either is in the memory or faults. The larger
+ * addresses are translated to SANDBOX_SPAN, which faults too, with a
+ * conditional move instead of a branch.
+ *
+ * The fast interpreter then reads and writes the memory without checking the
+ * addresses. A fault in the region is caught by a SIGSEGV handler and becomes
+ * ERR_INVALID_MEM_ACCESS at the instruction that made it, which the
+ * interpreter stores in p_vm->ip before every access. The other interpreters
+ * still check the addresses, the memory size is the same.
+ *
+ *   vm_load_from_file(&vm, path, ...);
+ *   vm_sandbox(&vm);
+ *   vm_run(&vm);
+ *
+ * The handler is installed for the whole process by the first vm_sandbox, and
+ * passes the faults outside of a sandbox on to the previous handler. Loading
+ * another program can replace the memory, vm_sandbox is called again after it.
+ */
+
+#if defined(USES_MMAP) && defined(USES_COMPUTED_GOTO)
+#	define USES_SANDBOX
+#endif
+
+#define SANDBOX_SPAN ((word_t)1 << 32) /* Largest sandboxed memory */
+
+/* Moves the memory into a sandbox, see p_vm->sandbox. Fails if the memory is
+   larger than SANDBOX_SPAN or if it is not supported on this platform */
+enum err vm_sandbox(struct vm *p_vm);
+
+/* Replaces the sandbox with one of p_bytes, keeping the memory, for
+   vm_alloc_mem */
+enum err sandbox_resize(struct vm *p_vm, word_t p_bytes);
+
+/* Runs p_run in the sandbox of the vm. Returns false if it made an invalid
+   access, with p_vm->ip at the instruction */
+bool sandbox_run(struct vm *p_vm, void (*p_run)(struct vm*));
+
+static inline uint8_t *sandbox_at(struct vm *p_vm, word_t p_addr) {
+	return p_vm->memory + (p_addr < SANDBOX_SPAN? p_addr : SANDBOX_SPAN);
+}
+
+#endif
@@ -0,0 +1,25 @@
+/* clock_gettime */
+#define _POSIX_C_SOURCE 199309L
+
+#include "stats.h"
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+enum err vm_call_external(struct vm *p_vm, external_t p_func) {
+	struct vm_stats *stats = p_vm->stats;
+	if (stats == NULL)
+		return p_func(p_vm);
+
+	uint64_t start = now_ns();
+	enum err ret   = p_func(p_vm);
+
+	++ stats->calls;
+	stats->call_ns += now_ns() - start;
+
+	return ret;
+}
@@ -0,0 +1,24 @@
+#ifndef STATS_H__HEADER_GUARD__
+#define STATS_H__HEADER_GUARD__
+
+#include <stdint.h> /* uint64_t */
+#include <time.h>   /* clock_gettime, struct timespec, CLOCK_MONOTONIC */
+
+#include "vm.h"
+
+/* Resource counters kept by the handlers when p_vm->stats is set. Only the
+   file and library instructions count, they are slow anyway. The bytes read and
+   written are counted per descriptor, in struct file (see maps.h) */
+struct vm_stats {
+	uint64_t opens;   /* OPE */
+	uint64_t loads;   /* LOL */
+	uint64_t calls;   /* CLF */
+	uint64_t call_ns; /* Time spent in external functions */
+
+	enum err panic; /* Error vm_panic exits with, ERR_OK if it was not called */
+};
+
+/* Calls an external function for CLF, timing it if there are stats */
+enum err vm_call_external(struct vm *p_vm, external_t p_func);
+
+#endif
@@ -0,0 +1,119 @@
+#include "symbols.h"
+
+static word_t read_word(const uint8_t *p_bytes) {
+	word_t word = 0;
+	for (size_t i = 0; i < sizeof(word_t); ++ i)
+		word = word << 010 | p_bytes[i];
+
+	return word;
+}
+
+static int by_addr(const void *p_a, const void *p_b) {
+	const struct symbol *a = (const struct symbol*)p_a, *b = (const struct symbol*)p_b;
+	return a->addr < b->addr? -1 : a->addr > b->addr;
+}
+
+enum err vm_load_symbols(struct vm *p_vm, const uint8_t *p_bytes, word_t p_size) {
+	vm_free_symbols(p_vm);
+
+	/* Count the entries first, the names are copied into one allocation */
+	word_t count = 0, names_size = 0;
+	for (word_t at = 0; at < p_size; ++ count) {
+		if (p_size - at < sizeof(struct file_symbol))
+			return ERR_INVALID_EXECUTABLE;
+
+		word_t name_size = read_word(((const struct file_symbol*)(p_bytes + at))->name_size);
+		at += sizeof(struct file_symbol);
+
+		if (name_size > p_size - at)
+			return ERR_INVALID_EXECUTABLE;
+
+		at         += name_size;
+		names_size += name_size + 1;
+	}
+
+	struct symbol *symbols = (struct symbol*)malloc(sizeof(struct symbol) * (count + 1));
+	char          *names   = (char*)malloc(names_size + 1);
+	if (symbols == NULL || names == NULL) {
+		free(symbols);
+		free(names);
+
+		return vm_fail(p_vm, ERR_OUT_OF_MEMORY, "malloc() fail near "__FILE__":%i", __LINE__);
+	}
+
+	char *name = names;
+	for (word_t i = 0, at = 0; i < count; ++ i) {
+		const struct file_symbol *entry = (const struct file_symbol*)(p_bytes + at);
+		word_t name_size = read_word(entry->name_size);
+
+		symbols[i].addr = read_word(entry->addr);
+		symbols[i].size = read_word(entry->size);
+		symbols[i].name = name;
+
+		at += sizeof(struct file_symbol);
+		memcpy(name, p_bytes + at, name_size);
+		name[name_size] = '\0';
+
+		at   += name_size;
+		name += name_size + 1;
+	}
+
+	qsort(symbols, count, sizeof(struct symbol), by_addr);
+
+	for (word_t i = 1; i < count; ++ i) {
+		if (symbols[i].addr - symbols[i - 1].addr < symbols[i - 1].size) {
+			free(symbols);
+			free(names);
+
+			return ERR_INVALID_EXECUTABLE;
+		}
+	}
+
+	p_vm->symbols       = symbols;
+	p_vm->symbols_count = count;
+	p_vm->symbol_names  = names;
+
+	return ERR_OK;
+}
+
+void vm_free_symbols(struct vm *p_vm) {
+	if (p_vm->symbols != NULL)
+		free(p_vm->symbols);
+
+	if (p_vm->symbol_names != NULL)
+		free(p_vm->symbol_names);
+
+	p_vm->symbols       = NULL;
+	p_vm->symbols_count = 0;
+	p_vm->symbol_names  = NULL;
+}
+
+const struct symbol *vm_symbol_at(struct vm *p_vm, word_t p_ip) {
+	/* Last symbol that starts at or before p_ip */
+	word_t low = 0, high = p_vm->symbols_count;
+	while (low < high) {
+		word_t mid = low + (high - low) / 2;
+
+		if (p_vm->symbols[mid].addr <= p_ip)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+
+	if (low == 0)
+		return NULL;
+
+	const struct symbol *symbol = &p_vm->symbols[low - 1];
+	return p_ip - symbol->addr < symbol->size? symbol : NULL;
+}
+
+void vm_print_symbol(struct vm *p_vm, FILE *p_file, word_t p_ip) {
+	const struct symbol *symbol = vm_symbol_at(p_vm, p_ip);
+	if (symbol == NULL)
+		return;
+
+	if (p_ip == symbol->addr)
+		fprintf(p_file, " <%s>", symbol->name);
+	else
+		fprintf(p_file, " <%s+0x%llX>", symbol->name, (long long unsigned)(p_ip - symbol->addr));
+}
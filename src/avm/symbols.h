@@ -0,0 +1,29 @@
+#ifndef SYMBOLS_H__HEADER_GUARD__
+#define SYMBOLS_H__HEADER_GUARD__
+
+#include <stdint.h>  /* uint8_t */
+#include <stdbool.h> /* bool, true, false */
+#include <stdlib.h>  /* malloc, free, qsort, exit, EXIT_FAILURE */
+#include <string.h>  /* memcpy */
+
+#include "vm.h"
+
+/* Function names from the symbol section of an executable, see struct
+   file_symbol. Sorted by address, the ranges do not overlap */
+struct symbol {
+	word_t      addr, size; /* First instruction and instruction count */
+	const char *name;
+};
+
+/* Loads the symbol section. Returns ERR_INVALID_EXECUTABLE if it is malformed,
+   without calling vm_fail */
+enum err vm_load_symbols(struct vm *p_vm, const uint8_t *p_bytes, word_t p_size);
+void vm_free_symbols(struct vm *p_vm);
+
+/* Symbol whose range contains p_ip, NULL if there is none */
+const struct symbol *vm_symbol_at(struct vm *p_vm, word_t p_ip);
+
+/* Prints " <name+0xOFFSET>" if p_ip has a symbol */
+void vm_print_symbol(struct vm *p_vm, FILE *p_file, word_t p_ip);
+
+#endif
@@ -0,0 +1,497 @@
+/* Threaded code dispatch loop, included by vm.c.
+ *
+ * Defines `static void THREADED_NAME(struct vm *p_vm)`. Every handler ends with
+ * its own copy of the dispatch jump, so each opcode gets its own (much better
+ * predicted) indirect branch.
+ *
+ * With THREADED_UNCHECKED defined, the per instruction stack and instruction
+ * access checks are left out. The program must have been accepted by
+ * vm_verify, and the stack is only checked against the verifier bounds after
+ * control transfers. If that check fails, the execution continues in
+ * THREADED_FALLBACK, which reports the error at the exact instruction. The
+ * unchecked loop runs p_vm->code, which can contain superinstructions.
+ *
+ * `arg` points to the operands of the current instruction (see layout.h). It
+ * moves forward by the operand count of each handler's opcode, which is a
+ * constant there. Jumps take it from their operands, and it is looked up
+ * again after returns and external function calls.
+ *
+ * The registers live in local variables for the whole run, and the value on
+ * top of the stack is kept out of the stack array, in `tos`. The array slot
+ * below it is stale until SYNC() writes everything back into the vm, which is
+ * done before a dump, an external function call, a panic and when the loop
+ * returns. Popping the last value reads the slot below the stack, which
+ * vm_init allocates for this.
+ *
+ * With THREADED_PROFILE defined, every instruction and every taken jump is
+ * counted into p_vm->profile (see profile.h), and calls and returns move
+ * through its calling context tree. Only for the checked loop.
+ *
+ * With THREADED_COUNT defined, the executed instructions are counted in a
+ * register and added to p_vm->profile->steps when the loop is left. Meant for
+ * the unchecked loop, with the profiled loop as the fallback.
+ *
+ * Both also keep the peak stack and call stack sizes, in registers that are
+ * written to p_vm->profile when the loop is left.
+ *
+ * With THREADED_TRACE defined, every instruction is recorded into the ring
+ * buffer p_vm->trace (see trace.h) before it is executed. Only for the checked
+ * loop, so the trace has the instructions of the program.
+ *
+ * With THREADED_SANDBOX defined, the memory is read and written without
+ * checking the addresses, the memory must be in a sandbox (see sandbox.h) and
+ * the loop run through sandbox_run. Only ip is written back before an access,
+ * a fault leaves the loop without a SYNC.
+ */
+
+#ifdef THREADED_UNCHECKED
+#	define CODE p_vm->code
+#else
+#	define CODE p_vm->ops
+#endif
+
+/* RECORD is run for every instruction, invalid opcodes included */
+#ifdef THREADED_PROFILE
+#	define RECORD(P_OP) ++ counts[ip]; ++ profile->steps;
+#	define COUNT_TAKEN() ++ taken[ip]
+#	define PROFILE_CALL(P_FUNC) \
+		do { \
+			profile_call(profile, P_FUNC); \
+			TRACK_PEAK(peak_cs, p_vm->cs); \
+		} while (0)
+#	define PROFILE_RETURN() profile_return(profile)
+#	define SAVE_COUNTS() profile_peaks(profile, peak_sp, peak_cs)
+#elif defined(THREADED_COUNT)
+/* The second addition is a constant, 0 for everything but superinstructions */
+#	define RECORD(P_OP) ++ steps; fused += vm_inst_count(P_OP) - 1;
+#	define COUNT_TAKEN()
+#	define PROFILE_CALL(P_FUNC) TRACK_PEAK(peak_cs, p_vm->cs)
+#	define PROFILE_RETURN()
+#	define SAVE_COUNTS() \
+		do { \
+			p_vm->profile->steps += steps + fused; \
+			p_vm->profile->fused += fused; \
+			profile_peaks(p_vm->profile, peak_sp, peak_cs); \
+		} while (0)
+#elif defined(THREADED_TRACE)
+#	define RECORD(P_OP) \
+		entry = &entries[recorded ++ & mask]; \
+		entry->ip_op = (uint64_t)ip << 8 | (P_OP); \
+		entry->tos   = sp > 0? tos.u64 : 0;
+#	define COUNT_TAKEN()
+#	define PROFILE_CALL(P_FUNC)
+#	define PROFILE_RETURN()
+#	define SAVE_COUNTS() p_vm->trace->recorded = recorded
+#else
+#	define RECORD(P_OP)
+#	define COUNT_TAKEN()
+#	define PROFILE_CALL(P_FUNC)
+#	define PROFILE_RETURN()
+#	define SAVE_COUNTS()
+#endif
+
+#define INST(P_OP) inst_##P_OP: op = P_OP; RECORD(P_OP)
+
+#if defined(THREADED_PROFILE) || defined(THREADED_COUNT)
+#	define TRACK_PEAK(P_PEAK, P_VALUE) \
+		do { \
+			if ((P_VALUE) > P_PEAK) \
+				P_PEAK = P_VALUE; \
+		} while (0)
+#else
+#	define TRACK_PEAK(P_PEAK, P_VALUE)
+#endif
+
+#define DISPATCH() \
+	do { \
+		op = code[ip]; \
+		goto *dispatch[op]; \
+	} while (0)
+#define NEXT() \
+	do { \
+		arg += vm_operand_count(op); \
+		if (UNLIKELY(++ ip >= size || VM_HALT(p_vm))) \
+			goto leave; \
+\
+		DISPATCH(); \
+	} while (0)
+#define SEEK() arg = p_vm->operands + vm_operand_index(p_vm, ip)
+#define GO_TO(P_N) \
+	do { \
+		ip  = arg[P_N].u64; \
+		arg = p_vm->operands + arg[(P_N) + 1].u64; \
+	} while (0)
+/* The call stack entry has the operands, see struct frame */
+#define RESUME(P_FRAME) \
+	do { \
+		ip  = (P_FRAME).ip; \
+		arg = p_vm->operands + (P_FRAME).operand; \
+	} while (0)
+#define RAISE(P_ERR) \
+	do { \
+		err = P_ERR; \
+		goto panic; \
+	} while (0)
+
+#define OPERAND(P_N) arg[P_N]
+
+#define IP           ip
+#define SP           sp
+#define TOS          tos
+#define TOP(P_N)     stack[sp - (P_N) - 1]
+#define PUSH(P_WORD) \
+	do { \
+		GROW(); \
+		tos.u64 = P_WORD; \
+	} while (0)
+#define GROW() \
+	do { \
+		stack[sp - 1] = tos; \
+		++ sp; \
+		TRACK_PEAK(peak_sp, sp); \
+	} while (0)
+#define DROP(P_N) \
+	do { \
+		sp -= P_N; \
+		tos = stack[sp - 1]; \
+	} while (0)
+#define REDUCE(P_FIELD, P_VALUE) \
+	do { \
+		tos.P_FIELD = P_VALUE; \
+		-- sp; \
+	} while (0)
+
+#define SYNC() \
+	do { \
+		stack[sp - 1] = tos; \
+		p_vm->ip = ip; \
+		p_vm->sp = sp; \
+	} while (0)
+#define RELOAD() \
+	do { \
+		ip       = p_vm->ip; \
+		sp       = p_vm->sp; \
+		size     = p_vm->program_size; \
+		capacity = p_vm->stack_capacity; \
+		code     = CODE; \
+		stack    = p_vm->stack; \
+		tos      = stack[sp - 1]; \
+		TRACK_PEAK(peak_sp, sp); \
+	} while (0)
+
+#ifdef THREADED_UNCHECKED
+#	define STACK_FITS() \
+		(sp >= p_vm->bounds[ip].need && sp + p_vm->bounds[ip].grow <= capacity)
+
+#	define BRANCH() \
+		do { \
+			if (UNLIKELY(++ ip >= size || VM_HALT(p_vm))) \
+				goto leave; \
+			else if (!STACK_FITS()) \
+				goto fallback; \
+\
+			SEEK(); \
+			DISPATCH(); \
+		} while (0)
+
+#	define JUMP(P_N) \
+		do { \
+			GO_TO(P_N); \
+			if (UNLIKELY(VM_HALT(p_vm))) \
+				goto leave; \
+			else if (!STACK_FITS()) \
+				goto fallback; \
+\
+			DISPATCH(); \
+		} while (0)
+
+#	define RETURN(P_FRAME) \
+		do { \
+			RESUME(P_FRAME); \
+			if (UNLIKELY(ip >= size || VM_HALT(p_vm))) \
+				goto leave; \
+			else if (!STACK_FITS()) \
+				goto fallback; \
+\
+			DISPATCH(); \
+		} while (0)
+
+#	define STACK_ARGS_COUNT(P_COUNT)
+#	define STACK_CAPACITY_CHECK()
+#	define INST_ACCESS_CHECK(P_ADDR)
+#else
+#	define BRANCH() \
+		do { \
+			if (UNLIKELY(++ ip >= size || VM_HALT(p_vm))) \
+				goto leave; \
+\
+			SEEK(); \
+			DISPATCH(); \
+		} while (0)
+
+#	define JUMP(P_N) \
+		do { \
+			COUNT_TAKEN(); \
+			GO_TO(P_N); \
+			if (UNLIKELY(VM_HALT(p_vm))) \
+				goto leave; \
+\
+			DISPATCH(); \
+		} while (0)
+
+#	define RETURN(P_FRAME) \
+		do { \
+			RESUME(P_FRAME); \
+			if (UNLIKELY(ip >= size || VM_HALT(p_vm))) \
+				goto leave; \
+\
+			DISPATCH(); \
+		} while (0)
+
+#	define STACK_ARGS_COUNT(P_COUNT) \
+		if (sp < P_COUNT) \
+			RAISE(ERR_STACK_UNDERFLOW)
+
+#	define STACK_CAPACITY_CHECK() \
+		if (sp >= capacity) \
+			RAISE(ERR_STACK_OVERFLOW)
+
+#	define INST_ACCESS_CHECK(P_ADDR) \
+		if ((P_ADDR) >= size) \
+			RAISE(ERR_INVALID_INST_ACCESS)
+#endif
+
+#ifdef THREADED_SANDBOX
+#	define READ(P_BITS, P_DATA, P_ADDR) \
+		do { \
+			p_vm->ip = ip; \
+			P_DATA   = bytes_load(sandbox_at(p_vm, P_ADDR), (P_BITS) / 8, p_vm->little_endian); \
+		} while (0)
+#	define WRITE(P_BITS, P_DATA, P_ADDR) \
+		do { \
+			p_vm->ip = ip; \
+			bytes_store(sandbox_at(p_vm, P_ADDR), P_DATA, (P_BITS) / 8, p_vm->little_endian); \
+		} while (0)
+#else
+#	define READ(P_BITS, P_DATA, P_ADDR) \
+		do { \
+			enum err ret = vm_read##P_BITS(p_vm, &(P_DATA), P_ADDR); \
+			if (ret != ERR_OK) \
+				RAISE(ret); \
+		} while (0)
+#	define WRITE(P_BITS, P_DATA, P_ADDR) \
+		do { \
+			enum err ret = vm_write##P_BITS(p_vm, P_DATA, P_ADDR); \
+			if (ret != ERR_OK) \
+				RAISE(ret); \
+		} while (0)
+#endif
+
+#define HANDLER(P_OP) [P_OP] = &&inst_##P_OP
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+#pragma GCC diagnostic ignored "-Woverride-init"
+
+static void THREADED_NAME(struct vm *p_vm) {
+	static void *dispatch[0x100] = {
+		[0 ... 0xFF] = &&invalid,
+
+		HANDLER(OP_NOP),
+		HANDLER(OP_PSH),
+		HANDLER(OP_POP),
+		HANDLER(OP_ADD),
+		HANDLER(OP_SUB),
+		HANDLER(OP_MUL),
+		HANDLER(OP_DIV),
+		HANDLER(OP_MOD),
+		HANDLER(OP_INC),
+		HANDLER(OP_DEC),
+		HANDLER(OP_FAD),
+		HANDLER(OP_FSB),
+		HANDLER(OP_FMU),
+		HANDLER(OP_FDI),
+		HANDLER(OP_FIN),
+		HANDLER(OP_FDE),
+		HANDLER(OP_NEG),
+		HANDLER(OP_NOT),
+		HANDLER(OP_JMP),
+		HANDLER(OP_JNZ),
+		HANDLER(OP_EQU),
+		HANDLER(OP_NEQ),
+		HANDLER(OP_GRT),
+		HANDLER(OP_GEQ),
+		HANDLER(OP_LES),
+		HANDLER(OP_LEQ),
+		HANDLER(OP_UEQ),
+		HANDLER(OP_UNE),
+		HANDLER(OP_UGR),
+		HANDLER(OP_UGQ),
+		HANDLER(OP_ULE),
+		HANDLER(OP_ULQ),
+		HANDLER(OP_FEQ),
+		HANDLER(OP_FNE),
+		HANDLER(OP_FGR),
+		HANDLER(OP_FGQ),
+		HANDLER(OP_FLE),
+		HANDLER(OP_FLQ),
+		HANDLER(OP_CAL),
+		HANDLER(OP_RET),
+		HANDLER(OP_AND),
+		HANDLER(OP_ORR),
+		HANDLER(OP_DUP),
+		HANDLER(OP_SWP),
+		HANDLER(OP_EMP),
+		HANDLER(OP_SET),
+		HANDLER(OP_CPY),
+		HANDLER(OP_R08),
+		HANDLER(OP_R16),
+		HANDLER(OP_R32),
+		HANDLER(OP_R64),
+		HANDLER(OP_W08),
+		HANDLER(OP_W16),
+		HANDLER(OP_W32),
+		HANDLER(OP_W64),
+		HANDLER(OP_OPE),
+		HANDLER(OP_CLO),
+		HANDLER(OP_WRF),
+		HANDLER(OP_RDF),
+		HANDLER(OP_SZF),
+		HANDLER(OP_FLU),
+		HANDLER(OP_BAN),
+		HANDLER(OP_BOR),
+		HANDLER(OP_BSR),
+		HANDLER(OP_BSL),
+		HANDLER(OP_LOL),
+		HANDLER(OP_CLL),
+		HANDLER(OP_LLF),
+		HANDLER(OP_ULF),
+		HANDLER(OP_CLF),
+		HANDLER(OP_DMP),
+		HANDLER(OP_PRT),
+		HANDLER(OP_FPR),
+		HANDLER(OP_HLT),
+
+#ifdef THREADED_UNCHECKED
+		HANDLER(OP_LOOP_LES),
+		HANDLER(OP_PSH_ADD),
+		HANDLER(OP_PSH_SUB),
+		HANDLER(OP_PSH_R64),
+		HANDLER(OP_DUP_JNZ),
+		HANDLER(OP_EQU_JNZ),
+		HANDLER(OP_NEQ_JNZ),
+		HANDLER(OP_GRT_JNZ),
+		HANDLER(OP_GEQ_JNZ),
+		HANDLER(OP_LES_JNZ),
+		HANDLER(OP_LEQ_JNZ),
+#endif
+	};
+
+	uint8_t  op;
+	enum err err;
+
+	if (p_vm->ip >= p_vm->program_size || VM_HALT(p_vm))
+		return;
+
+	word_t   ip, sp, size, capacity;
+	uint8_t *code;
+	value_t *stack, tos, *arg;
+#ifdef THREADED_PROFILE
+	struct profile *profile = p_vm->profile;
+	uint64_t       *counts  = profile->counts, *taken = profile->taken;
+#elif defined(THREADED_COUNT)
+	uint64_t steps = 0, fused = 0;
+#elif defined(THREADED_TRACE)
+	struct trace_entry *entries  = p_vm->trace->entries, *entry;
+	word_t              mask     = p_vm->trace->mask;
+	uint64_t            recorded = p_vm->trace->recorded;
+#endif
+#if defined(THREADED_PROFILE) || defined(THREADED_COUNT)
+	word_t peak_sp = 0, peak_cs = p_vm->cs;
+#endif
+	RELOAD();
+	SEEK();
+
+#ifdef THREADED_UNCHECKED
+	if (!STACK_FITS())
+		goto fallback;
+#endif
+
+	DISPATCH();
+
+#include "handlers.h"
+
+#ifdef THREADED_UNCHECKED
+#	include "fused.h"
+#endif
+
+invalid:
+	op = CODE[ip];
+	RECORD(op);
+
+	err = ERR_INVALID_INST;
+
+panic:
+	SYNC();
+	SAVE_COUNTS();
+	vm_panic(p_vm, err);
+	return;
+
+leave:
+	SYNC();
+	SAVE_COUNTS();
+	return;
+
+#ifdef THREADED_UNCHECKED
+fallback:
+	SYNC();
+	SAVE_COUNTS();
+	THREADED_FALLBACK(p_vm);
+#endif
+}
+
+#pragma GCC diagnostic pop
+
+#undef CODE
+#undef INST
+#undef RECORD
+#undef COUNT_TAKEN
+#undef PROFILE_CALL
+#undef PROFILE_RETURN
+#undef SAVE_COUNTS
+#undef TRACK_PEAK
+#undef DISPATCH
+#undef SEEK
+#undef GO_TO
+#undef RESUME
+#undef JUMP
+#undef RETURN
+#undef OPERAND
+#undef NEXT
+#undef BRANCH
+#undef RAISE
+#undef IP
+#undef SP
+#undef TOS
+#undef TOP
+#undef PUSH
+#undef GROW
+#undef DROP
+#undef REDUCE
+#undef SYNC
+#undef RELOAD
+#undef STACK_FITS
+#undef STACK_ARGS_COUNT
+#undef STACK_CAPACITY_CHECK
+#undef INST_ACCESS_CHECK
+#undef READ
+#undef WRITE
+#undef HANDLER
+
+#undef THREADED_NAME
+#undef THREADED_UNCHECKED
+#undef THREADED_FALLBACK
+#undef THREADED_PROFILE
+#undef THREADED_COUNT
+#undef THREADED_TRACE
+#undef THREADED_SANDBOX
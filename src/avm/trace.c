@@ -0,0 +1,30 @@
+#include "trace.h"
+
+void trace_init(struct trace *p_trace, word_t p_size) {
+	word_t size = 1;
+	while (size < p_size)
+		size <<= 1;
+
+	p_trace->entries = (struct trace_entry*)malloc(size * sizeof(struct trace_entry));
+	if (p_trace->entries == NULL) {
+		VM_ERROR(stderr, "malloc() fail near "__FILE__":%i", __LINE__);
+		exit(EXIT_FAILURE);
+	}
+
+	p_trace->mask     = size - 1;
+	p_trace->recorded = 0;
+}
+
+void trace_free(struct trace *p_trace) {
+	free(p_trace->entries);
+	p_trace->entries = NULL;
+}
+
+word_t trace_length(struct trace *p_trace) {
+	return p_trace->recorded > p_trace->mask? p_trace->mask + 1 : p_trace->recorded;
+}
+
+struct trace_entry *trace_at(struct trace *p_trace, word_t p_i) {
+	uint64_t first = p_trace->recorded - trace_length(p_trace);
+	return &p_trace->entries[(first + p_i) & p_trace->mask];
+}
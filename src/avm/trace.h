@@ -0,0 +1,41 @@
+#ifndef TRACE_H__HEADER_GUARD__
+#define TRACE_H__HEADER_GUARD__
+
+#include <stdint.h> /* uint64_t */
+#include <stdlib.h> /* malloc, free, exit, EXIT_FAILURE */
+
+#include "vm.h"
+
+#define TRACE_DEFAULT_SIZE 0x10000    /* Entries, 1 MiB */
+#define TRACE_MAX_SIZE     0x10000000 /* 4 GiB */
+
+/* Executed instruction. The opcode is in the low byte of ip_op and the address
+   above it, which leaves 56 bits for the address */
+struct trace_entry {
+	uint64_t ip_op;
+	uint64_t tos; /* Top of the stack before the instruction, 0 if it is empty */
+};
+
+/* Ring buffer of the last executed instructions, filled by vm_run_traced. The
+   oldest entry is at recorded & mask once the buffer has wrapped */
+struct trace {
+	struct trace_entry *entries;
+	word_t              mask;     /* Size - 1, the size is a power of two */
+	uint64_t            recorded; /* Instructions ever recorded */
+};
+
+/* p_size is rounded up to a power of two */
+void trace_init(struct trace *p_trace, word_t p_size);
+void trace_free(struct trace *p_trace);
+
+/* Entries in the buffer */
+word_t trace_length(struct trace *p_trace);
+
+/* Entry p_i of the buffer, from the oldest */
+struct trace_entry *trace_at(struct trace *p_trace, word_t p_i);
+
+/* Runs the program on the checked interpreter, recording every instruction
+   into p_vm->trace */
+void vm_run_traced(struct vm *p_vm);
+
+#endif
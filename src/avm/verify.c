@@ -0,0 +1,195 @@
+#include "verify.h"
+
+/* How an instruction uses the stack */
+struct effect {
+	bool    valid;
+	uint8_t need;  /* Values read from the stack */
+	int8_t  delta; /* Change of the stack pointer */
+	bool    ends;  /* Does not continue with the next instruction, or leaves the
+	                  stack in an unknown state (external functions) */
+};
+
+#define EFFECT(P_NEED, P_DELTA) {.valid = true, .need = P_NEED, .delta = P_DELTA}
+#define ENDS(P_NEED, P_DELTA)   {.valid = true, .need = P_NEED, .delta = P_DELTA, .ends = true}
+
+static const struct effect effects[0x100] = {
+	[OP_NOP] = EFFECT(0, 0),
+
+	[OP_PSH] = EFFECT(0,  1),
+	[OP_POP] = EFFECT(1, -1),
+
+	[OP_ADD] = EFFECT(2, -1),
+	[OP_SUB] = EFFECT(2, -1),
+
+	[OP_MUL] = EFFECT(2, -1),
+	[OP_DIV] = EFFECT(2, -1),
+	[OP_MOD] = EFFECT(2, -1),
+
+	[OP_INC] = EFFECT(1, 0),
+	[OP_DEC] = EFFECT(1, 0),
+
+	[OP_FAD] = EFFECT(2, -1),
+	[OP_FSB] = EFFECT(2, -1),
+
+	[OP_FMU] = EFFECT(2, -1),
+	[OP_FDI] = EFFECT(2, -1),
+
+	[OP_FIN] = EFFECT(1, 0),
+	[OP_FDE] = EFFECT(1, 0),
+
+	[OP_NEG] = EFFECT(1, 0),
+	[OP_NOT] = EFFECT(1, 0),
+
+	[OP_JMP] = ENDS(0, 0),
+	[OP_JNZ] = EFFECT(1, -1),
+
+	[OP_CAL] = ENDS(0, 0),
+	[OP_RET] = ENDS(0, 0),
+
+	[OP_AND] = EFFECT(2, -1),
+	[OP_ORR] = EFFECT(2, -1),
+
+	[OP_EQU] = EFFECT(2, -1),
+	[OP_NEQ] = EFFECT(2, -1),
+	[OP_GRT] = EFFECT(2, -1),
+	[OP_GEQ] = EFFECT(2, -1),
+	[OP_LES] = EFFECT(2, -1),
+	[OP_LEQ] = EFFECT(2, -1),
+
+	[OP_UEQ] = EFFECT(2, -1),
+	[OP_UNE] = EFFECT(2, -1),
+	[OP_UGR] = EFFECT(2, -1),
+	[OP_UGQ] = EFFECT(2, -1),
+	[OP_ULE] = EFFECT(2, -1),
+	[OP_ULQ] = EFFECT(2, -1),
+
+	[OP_FEQ] = EFFECT(2, -1),
+	[OP_FNE] = EFFECT(2, -1),
+	[OP_FGR] = EFFECT(2, -1),
+	[OP_FGQ] = EFFECT(2, -1),
+	[OP_FLE] = EFFECT(2, -1),
+	[OP_FLQ] = EFFECT(2, -1),
+
+	[OP_DUP] = EFFECT(0, 1), /* Needs depend on the operand */
+	[OP_SWP] = EFFECT(0, 0),
+	[OP_EMP] = EFFECT(0, 1),
+	[OP_SET] = EFFECT(3, -3),
+	[OP_CPY] = EFFECT(3, -3),
+
+	[OP_R08] = EFFECT(1, 0),
+	[OP_R16] = EFFECT(1, 0),
+	[OP_R32] = EFFECT(1, 0),
+	[OP_R64] = EFFECT(1, 0),
+
+	[OP_W08] = EFFECT(2, -2),
+	[OP_W16] = EFFECT(2, -2),
+	[OP_W32] = EFFECT(2, -2),
+	[OP_W64] = EFFECT(2, -2),
+
+	[OP_OPE] = EFFECT(3, -2),
+	[OP_CLO] = EFFECT(1, -1),
+	[OP_WRF] = EFFECT(3, -2),
+	[OP_RDF] = EFFECT(3, -2),
+	[OP_SZF] = EFFECT(1, 0),
+	[OP_FLU] = EFFECT(1, -1),
+
+	[OP_BAN] = EFFECT(2, -1),
+	[OP_BOR] = EFFECT(2, -1),
+	[OP_BSR] = EFFECT(2, -1),
+	[OP_BSL] = EFFECT(2, -1),
+
+	[OP_LOL] = EFFECT(2, -1),
+	[OP_CLL] = EFFECT(1, -1),
+	[OP_LLF] = EFFECT(3, -2),
+	[OP_ULF] = EFFECT(2, -2),
+	[OP_CLF] = ENDS(2, -2),
+
+	[OP_DMP] = EFFECT(0, 0),
+	[OP_PRT] = EFFECT(1, -1),
+	[OP_FPR] = EFFECT(1, -1),
+
+	[OP_HLT] = ENDS(1, -1),
+};
+
+static uint32_t saturate(int64_t p_value) {
+	if (p_value < 0)
+		return 0;
+	else if (p_value > UINT32_MAX)
+		return UINT32_MAX;
+	else
+		return p_value;
+}
+
+/* The operands are unsigned, a cast of the large ones to the signed need
+   would make them negative */
+static uint32_t stack_args(word_t p_operand, word_t p_extra) {
+	word_t args = vm_stack_args(p_operand, p_extra);
+	return args > UINT32_MAX? UINT32_MAX : args;
+}
+
+int vm_stack_delta(enum opcode p_op) {
+	return effects[p_op].delta;
+}
+
+bool vm_verify(struct vm *p_vm) {
+	if (p_vm->bounds != NULL) {
+		free(p_vm->bounds);
+		p_vm->bounds = NULL;
+	}
+
+	struct stack_bounds *bounds = (struct stack_bounds*)malloc(sizeof(struct stack_bounds) *
+	                                                           (p_vm->program_size + 1));
+	/* The checked interpreter needs no bounds */
+	if (bounds == NULL)
+		return false;
+
+	/* Falling off the end of the program stops it */
+	bounds[p_vm->program_size].need = 0;
+	bounds[p_vm->program_size].grow = 0;
+
+	/* Walk backwards, so the bounds of each instruction include the bounds of the
+	   code it falls through to, up to the next control transfer */
+	for (word_t i = p_vm->program_size; i -- > 0;) {
+		struct inst         *inst   = &p_vm->program[i];
+		const struct effect *effect = &effects[inst->op];
+
+		if (!effect->valid) {
+			free(bounds);
+			return false;
+		}
+
+		int64_t need;
+		switch (inst->op) {
+		case OP_JMP: case OP_JNZ: case OP_CAL:
+			if (inst->data.u64 >= p_vm->program_size) {
+				free(bounds);
+				return false;
+			}
+
+			need = effect->need;
+			break;
+
+		case OP_DUP: need = stack_args(inst->data.u64, 1); break;
+		case OP_SWP: need = stack_args(inst->data.u64, 2); break;
+
+		default: need = effect->need;
+		}
+
+		int64_t grow = effect->delta > 0? effect->delta : 0;
+		if (!effect->ends) {
+			struct stack_bounds *next = &bounds[i + 1];
+
+			if ((int64_t)next->need - effect->delta > need)
+				need = (int64_t)next->need - effect->delta;
+
+			if ((int64_t)next->grow + effect->delta > grow)
+				grow = (int64_t)next->grow + effect->delta;
+		}
+
+		bounds[i].need = saturate(need);
+		bounds[i].grow = saturate(grow);
+	}
+
+	p_vm->bounds = bounds;
+	return true;
+}
@@ -0,0 +1,25 @@
+#ifndef VERIFY_H__HEADER_GUARD__
+#define VERIFY_H__HEADER_GUARD__
+
+#include <stdint.h>  /* uint32_t, int8_t, uint8_t, UINT32_MAX */
+#include <stdbool.h> /* bool, true, false */
+#include <stdlib.h>  /* malloc, free, exit, EXIT_FAILURE */
+
+#include "vm.h"
+
+/* Checks the loaded program and computes its stack bounds. Returns true if the
+   program can run on the unchecked interpreter: every opcode is known and every
+   jump and call target is inside the program */
+bool vm_verify(struct vm *p_vm);
+
+/* Change of the stack pointer by an instruction with a known opcode, except
+   for CLF which leaves it to the external function */
+int vm_stack_delta(enum opcode p_op);
+
+/* Values a DUP or a SWP takes, p_extra more than its operand. It does not wrap
+   around, so an operand of 2^64 - 1 still needs more values than the stack has */
+static inline word_t vm_stack_args(word_t p_operand, word_t p_extra) {
+	return p_operand > (word_t)-1 - p_extra? (word_t)-1 : p_operand + p_extra;
+}
+
+#endif
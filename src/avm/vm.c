@@ -1,4 +1,23 @@
+/* mprotect, sysconf, MAP_ANONYMOUS, MAP_NORESERVE */
+#define _DEFAULT_SOURCE
+
 #include "vm.h"
+#include "verify.h"
+#include "fuse.h"
+#include "layout.h"
+#include "profile.h"
+#include "symbols.h"
+#include "stats.h"
+#include "trace.h"
+#include "maps.h"
+#include "sandbox.h"
+#include "large.h"
+#include "bytes.h"
+
+/* Not in vm.h, jit.c has a function named link */
+#ifdef USES_MMAP
+#	include <unistd.h> /* sysconf, _SC_PAGESIZE */
+#endif
 
 const char *err_to_str[] = {
 	[ERR_OK]                   = "OK",
@@ -15,757 +34,467 @@ const char *err_to_str[] = {
 	[ERR_INVALID_DESCRIPTOR]   = "Invalid descriptor",
 	[ERR_MAX_LIBS_OPEN]        = "Reached max limit of libraries open",
 	[ERR_MAX_FUNCS_LOADED]     = "Reached max limit of functions loaded",
+	[ERR_OUT_OF_MEMORY]        = "Out of memory",
+	[ERR_INVALID_EXECUTABLE]   = "Invalid executable",
+	[ERR_CANNOT_READ]          = "Could not read the executable",
 };
 
-#define FMODE_STR_SIZE 4
-
-char *fmode_to_str(enum fmode p_fmode) {
-	char *str = (char*)malloc(FMODE_STR_SIZE);
-	if (str == NULL) {
-		VM_ERROR(stderr, "malloc() fail near "__FILE__":%i", __LINE__);
-		exit(EXIT_FAILURE);
-	}
+const char *err_str(enum err p_err) {
+	return err_to_str[p_err];
+}
 
-	memset(str, 0, FMODE_STR_SIZE);
+bool fmode_to_str(enum fmode p_fmode, char *p_str) {
+	memset(p_str, 0, FMODE_STR_SIZE);
 
 	if ((p_fmode & FMODE_READ) && (p_fmode & FMODE_WRITE)) {
-		str[0] = p_fmode & FMODE_APPEND? 'r' : 'w';
+		p_str[0] = p_fmode & FMODE_APPEND? 'r' : 'w';
 
 		int next = 1;
 		if (p_fmode & FMODE_BINARY) {
-			str[next] = 'b';
+			p_str[next] = 'b';
 			++ next;
 		}
 
-		str[next] = '+';
+		p_str[next] = '+';
 	} else {
 		if (p_fmode & FMODE_READ)
-			str[0] = 'r';
+			p_str[0] = 'r';
 		else if (p_fmode & FMODE_APPEND)
-			str[0] = 'a';
+			p_str[0] = 'a';
 		else if (p_fmode & FMODE_WRITE)
-			str[0] = 'w';
-		else {
-			free(str);
-
-			return NULL;
-		}
+			p_str[0] = 'w';
+		else
+			return false;
 
 		if (p_fmode & FMODE_BINARY)
-			str[1] = 'b';
+			p_str[1] = 'b';
 	}
 
-	return str;
+	return true;
 }
 
-void vm_init(struct vm *p_vm) {
-	memset(p_vm, 0, sizeof(struct vm));
+#ifdef USES_MMAP
+/* Reserves p_below + p_size bytes between two guard pages, and returns the
+   address p_below bytes in. The end of the stack is right at the upper guard
+   page, so a push past it faults instead of overwriting the heap */
+static void *alloc_stack(size_t p_below, size_t p_size) {
+	size_t page = sysconf(_SC_PAGESIZE);
+	size_t size = (p_below + p_size + page - 1) / page * page;
 
-	p_vm->stack = (value_t*)malloc(STACK_SIZE_BYTES);
-	if (p_vm->stack == NULL) {
-		VM_ERROR(stderr, "malloc() fail near "__FILE__":%i", __LINE__);
-		exit(EXIT_FAILURE);
-	}
+	/* Nothing is committed until the program reaches it */
+	uint8_t *mapping = (uint8_t*)mmap(NULL, size + 2 * page, PROT_NONE,
+	                                  MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (mapping == MAP_FAILED)
+		return NULL;
 
-	p_vm->call_stack = (word_t*)malloc(CALL_STACK_SIZE_BYTES);
-	if (p_vm->call_stack == NULL) {
-		VM_ERROR(stderr, "malloc() fail near "__FILE__":%i", __LINE__);
-		exit(EXIT_FAILURE);
+	if (mprotect(mapping + page, size, PROT_READ | PROT_WRITE) != 0) {
+		munmap(mapping, size + 2 * page);
+		return NULL;
 	}
 
-	p_vm->maps = (struct maps*)malloc(sizeof(*p_vm->maps));
-	if (p_vm->maps == NULL) {
-		VM_ERROR(stderr, "malloc() fail near "__FILE__":%i", __LINE__);
-		exit(EXIT_FAILURE);
-	}
-	memset(p_vm->maps, 0, sizeof(*p_vm->maps));
+	return mapping + page + size - p_size;
+}
 
-	p_vm->maps->files[0].file = stdin;
-	p_vm->maps->files[0].mode = FMODE_READ;
+static void free_stack(void *p_stack, size_t p_below, size_t p_size) {
+	if (p_stack == NULL)
+		return;
 
-	p_vm->maps->files[1].file = stdout;
-	p_vm->maps->files[1].mode = FMODE_WRITE;
+	size_t page = sysconf(_SC_PAGESIZE);
+	size_t size = (p_below + p_size + page - 1) / page * page;
 
-	p_vm->maps->files[2].file = stderr;
-	p_vm->maps->files[2].mode = FMODE_WRITE;
+	munmap((uint8_t*)p_stack + p_size - size - page, size + 2 * page);
 }
-
-void vm_alloc_mem(struct vm *p_vm, word_t p_bytes) {
-	p_vm->memory_size = p_bytes;
-
-	if (p_vm->memory == NULL) {
-		p_vm->memory = (uint8_t*)malloc(p_bytes);
-		if (p_vm->memory == NULL) {
-			VM_ERROR(stderr, "malloc() fail near "__FILE__":%i", __LINE__);
-			exit(EXIT_FAILURE);
-		}
-	} else {
-		p_vm->memory = (uint8_t*)realloc(p_vm->memory, p_bytes);
-		if (p_vm->memory == NULL) {
-			VM_ERROR(stderr, "realloc() fail near "__FILE__":%i", __LINE__);
-			exit(EXIT_FAILURE);
-		}
-	}
+#else
+static void *alloc_stack(size_t p_below, size_t p_size) {
+	uint8_t *stack = (uint8_t*)malloc(p_below + p_size);
+	return stack == NULL? NULL : stack + p_below;
 }
 
-void vm_destroy(struct vm *p_vm) {
-	free(p_vm->stack);
-	free(p_vm->call_stack);
-	free(p_vm->maps);
+static void free_stack(void *p_stack, size_t p_below, size_t p_size) {
+	(void)p_size;
 
-	if (p_vm->memory != NULL)
-		free(p_vm->memory);
+	if (p_stack != NULL)
+		free((uint8_t*)p_stack - p_below);
 }
+#endif
 
-#define STACK_ARGS_COUNT(P_COUNT) \
-	if (p_vm->sp < P_COUNT) \
-		return ERR_STACK_UNDERFLOW
-
-int vm_exec_next_inst(struct vm *p_vm) {
-	struct inst *inst = &p_vm->program[p_vm->ip];
-
-	switch (inst->op) {
-	case OP_NOP: break;
-
-	case OP_PSH:
-		if (p_vm->sp >= STACK_CAPACITY)
-			return ERR_STACK_OVERFLOW;
-
-		p_vm->stack[p_vm->sp ++].u64 = inst->data.u64;
-
-		break;
-
-	case OP_POP: STACK_ARGS_COUNT(1);
-		-- p_vm->sp;
-
-		break;
-
-	case OP_ADD: STACK_ARGS_COUNT(2);
-		vm_stack_top(p_vm, 1)->u64 += vm_stack_top(p_vm, 0)->u64;
-		-- p_vm->sp;
-
-		break;
-
-	case OP_SUB: STACK_ARGS_COUNT(2);
-		vm_stack_top(p_vm, 1)->u64 -= vm_stack_top(p_vm, 0)->u64;
-		-- p_vm->sp;
-
-		break;
-
-	case OP_MUL: STACK_ARGS_COUNT(2);
-		vm_stack_top(p_vm, 1)->u64 *= vm_stack_top(p_vm, 0)->u64;
-		-- p_vm->sp;
-
-		break;
-
-	case OP_DIV: STACK_ARGS_COUNT(2); {
-		word_t b = vm_stack_top(p_vm, 0)->u64;
-		if (b == 0)
-			return ERR_DIV_BY_ZERO;
-
-		vm_stack_top(p_vm, 1)->u64 /= b;
-		-- p_vm->sp;
-	} break;
-
-	case OP_MOD: STACK_ARGS_COUNT(2);
-		word_t b = vm_stack_top(p_vm, 0)->u64;
-		if (b == 0)
-			return ERR_DIV_BY_ZERO;
-
-		vm_stack_top(p_vm, 1)->u64 %= b;
-		-- p_vm->sp;
-
-		break;
-
-	case OP_INC: STACK_ARGS_COUNT(1);
-		++ vm_stack_top(p_vm, 0)->u64;
-
-		break;
-
-	case OP_DEC: STACK_ARGS_COUNT(1);
-		-- vm_stack_top(p_vm, 0)->u64;
-
-		break;
-
-	case OP_FAD: STACK_ARGS_COUNT(2);
-		vm_stack_top(p_vm, 1)->f64 += vm_stack_top(p_vm, 0)->f64;
-		-- p_vm->sp;
-
-		break;
-
-	case OP_FSB: STACK_ARGS_COUNT(2);
-		vm_stack_top(p_vm, 1)->f64 -= vm_stack_top(p_vm, 0)->f64;
-		-- p_vm->sp;
-
-		break;
-
-	case OP_FMU: STACK_ARGS_COUNT(2);
-		vm_stack_top(p_vm, 1)->f64 *= vm_stack_top(p_vm, 0)->f64;
-		-- p_vm->sp;
-
-		break;
-
-	case OP_FDI: STACK_ARGS_COUNT(2);
-		vm_stack_top(p_vm, 1)->f64 /= vm_stack_top(p_vm, 0)->f64;
-		-- p_vm->sp;
-
-		break;
-
-	case OP_FIN: STACK_ARGS_COUNT(1);
-		++ vm_stack_top(p_vm, 0)->f64;
-
-		break;
-
-	case OP_FDE: STACK_ARGS_COUNT(1);
-		-- vm_stack_top(p_vm, 0)->f64;
+/* The slot below the stack is read when the threaded loops pop the last value,
+   see threaded.h */
+#define STACK_BELOW sizeof(value_t)
 
-		break;
+enum err vm_alloc_stacks(struct vm *p_vm, word_t p_capacity, word_t p_call_capacity) {
+	if (p_capacity == 0 || p_capacity > MAX_STACK_CAPACITY ||
+	    p_call_capacity == 0 || p_call_capacity > MAX_STACK_CAPACITY)
+		return vm_fail(p_vm, ERR_INVALID_EXECUTABLE, "Stack sizes must be from 1 to %llu values",
+		               (long long unsigned)MAX_STACK_CAPACITY);
 
-	case OP_NEG: STACK_ARGS_COUNT(1);
-		vm_stack_top(p_vm, 0)->i64 = -vm_stack_top(p_vm, 0)->i64;
+	value_t      *stack      = (value_t*)alloc_stack(STACK_BELOW, p_capacity * sizeof(value_t));
+	struct frame *call_stack = (struct frame*)alloc_stack(0, p_call_capacity * sizeof(struct frame));
+	if (stack == NULL || call_stack == NULL) {
+		free_stack(stack, STACK_BELOW, p_capacity * sizeof(value_t));
+		free_stack(call_stack, 0, p_call_capacity * sizeof(struct frame));
 
-		break;
-
-	case OP_NOT: STACK_ARGS_COUNT(1);
-		vm_stack_top(p_vm, 0)->u64 = !vm_stack_top(p_vm, 0)->u64;
-
-		break;
-
-	case OP_JMP:
-		if (inst->data.u64 >= p_vm->program_size)
-			return ERR_INVALID_INST_ACCESS;
-
-		p_vm->ip = inst->data.u64 - 1;
-
-		break;
-
-	case OP_JNZ: STACK_ARGS_COUNT(1);
-		if (vm_stack_top(p_vm, 0)->u64) {
-			if (inst->data.u64 >= p_vm->program_size)
-				return ERR_INVALID_INST_ACCESS;
-
-			p_vm->ip = inst->data.u64 - 1;
-		}
-
-		-- p_vm->sp;
-
-		break;
-
-	case OP_EQU: STACK_ARGS_COUNT(2);
-		vm_stack_top(p_vm, 1)->u64 = vm_stack_top(p_vm, 1)->i64 == vm_stack_top(p_vm, 0)->i64;
-		-- p_vm->sp;
-
-		break;
-
-	case OP_NEQ: STACK_ARGS_COUNT(2);
-		vm_stack_top(p_vm, 1)->u64 = vm_stack_top(p_vm, 1)->i64 != vm_stack_top(p_vm, 0)->i64;
-		-- p_vm->sp;
-
-		break;
-
-	case OP_GRT: STACK_ARGS_COUNT(2);
-		vm_stack_top(p_vm, 1)->u64 = vm_stack_top(p_vm, 1)->i64 > vm_stack_top(p_vm, 0)->i64;
-		-- p_vm->sp;
-
-		break;
-
-	case OP_GEQ: STACK_ARGS_COUNT(2);
-		vm_stack_top(p_vm, 1)->u64 = vm_stack_top(p_vm, 1)->i64 >= vm_stack_top(p_vm, 0)->i64;
-		-- p_vm->sp;
-
-		break;
-
-	case OP_LES: STACK_ARGS_COUNT(2);
-		vm_stack_top(p_vm, 1)->u64 = vm_stack_top(p_vm, 1)->i64 < vm_stack_top(p_vm, 0)->i64;
-		-- p_vm->sp;
-
-		break;
-
-	case OP_LEQ: STACK_ARGS_COUNT(2);
-		vm_stack_top(p_vm, 1)->u64 = vm_stack_top(p_vm, 1)->i64 <= vm_stack_top(p_vm, 0)->i64;
-		-- p_vm->sp;
-
-		break;
-
-	case OP_UEQ: STACK_ARGS_COUNT(2);
-		vm_stack_top(p_vm, 1)->u64 = vm_stack_top(p_vm, 1)->u64 == vm_stack_top(p_vm, 0)->u64;
-		-- p_vm->sp;
-
-		break;
-
-	case OP_UNE: STACK_ARGS_COUNT(2);
-		vm_stack_top(p_vm, 1)->u64 = vm_stack_top(p_vm, 1)->u64 != vm_stack_top(p_vm, 0)->u64;
-		-- p_vm->sp;
-
-		break;
-
-	case OP_UGR: STACK_ARGS_COUNT(2);
-		vm_stack_top(p_vm, 1)->u64 = vm_stack_top(p_vm, 1)->u64 > vm_stack_top(p_vm, 0)->u64;
-		-- p_vm->sp;
-
-		break;
-
-	case OP_UGQ: STACK_ARGS_COUNT(2);
-		vm_stack_top(p_vm, 1)->u64 = vm_stack_top(p_vm, 1)->u64 >= vm_stack_top(p_vm, 0)->u64;
-		-- p_vm->sp;
-
-		break;
-
-	case OP_ULE: STACK_ARGS_COUNT(2);
-		vm_stack_top(p_vm, 1)->u64 = vm_stack_top(p_vm, 1)->u64 == vm_stack_top(p_vm, 0)->u64;
-		-- p_vm->sp;
-
-		break;
-
-	case OP_ULQ: STACK_ARGS_COUNT(2);
-		vm_stack_top(p_vm, 1)->u64 = vm_stack_top(p_vm, 1)->u64 <= vm_stack_top(p_vm, 0)->u64;
-		-- p_vm->sp;
-
-		break;
-
-	case OP_FEQ: STACK_ARGS_COUNT(2);
-		vm_stack_top(p_vm, 1)->u64 = vm_stack_top(p_vm, 1)->f64 == vm_stack_top(p_vm, 0)->f64;
-		-- p_vm->sp;
+		return vm_fail(p_vm, ERR_OUT_OF_MEMORY, "Could not allocate the stacks near "__FILE__":%i",
+		               __LINE__);
+	}
 
-		break;
+	free_stack(p_vm->stack, STACK_BELOW, p_vm->stack_capacity * sizeof(value_t));
+	free_stack(p_vm->call_stack, 0, p_vm->call_stack_capacity * sizeof(struct frame));
 
-	case OP_FNE: STACK_ARGS_COUNT(2);
-		vm_stack_top(p_vm, 1)->u64 = vm_stack_top(p_vm, 1)->f64 != vm_stack_top(p_vm, 0)->f64;
-		-- p_vm->sp;
+	p_vm->stack      = stack;
+	p_vm->call_stack = call_stack;
+	p_vm->sp         = 0;
+	p_vm->cs         = 0;
 
-		break;
+	p_vm->stack_capacity      = p_capacity;
+	p_vm->call_stack_capacity = p_call_capacity;
 
-	case OP_FGR: STACK_ARGS_COUNT(2);
-		vm_stack_top(p_vm, 1)->u64 = vm_stack_top(p_vm, 1)->f64 > vm_stack_top(p_vm, 0)->f64;
-		-- p_vm->sp;
+	p_vm->stack[-1].u64 = 0;
 
-		break;
+	return ERR_OK;
+}
 
-	case OP_FGQ: STACK_ARGS_COUNT(2);
-		vm_stack_top(p_vm, 1)->u64 = vm_stack_top(p_vm, 1)->f64 >= vm_stack_top(p_vm, 0)->f64;
-		-- p_vm->sp;
+/* p_vm is zeroed, except for the embedded flag */
+static enum err alloc_vm(struct vm *p_vm) {
+	p_vm->maps = (struct maps*)malloc(sizeof(struct maps));
+	if (p_vm->maps == NULL)
+		return vm_fail(p_vm, ERR_OUT_OF_MEMORY, "malloc() fail near "__FILE__":%i", __LINE__);
 
-		break;
+	enum err err = vm_alloc_stacks(p_vm, STACK_SIZE_BYTES / sizeof(value_t),
+	                               CALL_STACK_SIZE_BYTES / sizeof(word_t));
+	if (err != ERR_OK) {
+		free(p_vm->maps);
+		return err;
+	}
 
-	case OP_FLE: STACK_ARGS_COUNT(2);
-		vm_stack_top(p_vm, 1)->u64 = vm_stack_top(p_vm, 1)->f64 < vm_stack_top(p_vm, 0)->f64;
-		-- p_vm->sp;
+	maps_init(p_vm->maps);
 
-		break;
+	p_vm->fuse_rules = FUSE_ALL;
 
-	case OP_FLQ: STACK_ARGS_COUNT(2);
-		vm_stack_top(p_vm, 1)->u64 = vm_stack_top(p_vm, 1)->f64 <= vm_stack_top(p_vm, 0)->f64;
-		-- p_vm->sp;
+	return ERR_OK;
+}
 
-		break;
+void vm_init(struct vm *p_vm) {
+	memset(p_vm, 0, sizeof(struct vm));
+	alloc_vm(p_vm);
+}
 
-	case OP_CAL:
-		if (inst->data.u64 >= p_vm->program_size)
-			return ERR_INVALID_INST_ACCESS;
-		else if (p_vm->cs >= CALL_STACK_CAPACITY)
-			return ERR_CALL_STACK_OVERFLOW;
+enum err vm_init_embedded(struct vm *p_vm) {
+	memset(p_vm, 0, sizeof(struct vm));
+	p_vm->embedded = true;
 
-		p_vm->call_stack[p_vm->cs ++] = p_vm->ip + 1;
-		p_vm->ip = inst->data.u64 - 1;
+	return alloc_vm(p_vm);
+}
 
-		break;
+static void unmap(struct vm *p_vm) {
+#ifdef USES_MMAP
+	munmap(p_vm->mapping, p_vm->mapping_size);
+#endif
 
-	case OP_RET:
-		if (p_vm->cs <= 0)
-			return ERR_CALL_STACK_UNDERFLOW;
+	p_vm->mapping      = NULL;
+	p_vm->mapping_size = 0;
+	p_vm->sandbox      = false;
+	p_vm->large        = NULL;
+}
 
-		p_vm->ip = p_vm->call_stack[-- p_vm->cs] - 1;
+enum err vm_alloc_mem(struct vm *p_vm, word_t p_bytes) {
+	if (p_vm->sandbox)
+		return sandbox_resize(p_vm, p_bytes);
+	else if (p_vm->large != NULL)
+		return large_resize(p_vm, p_bytes);
 
-		break;
+	/* A mapped memory segment can not grow, so it is copied */
+	if (p_vm->mapping != NULL) {
+		uint8_t *memory = (uint8_t*)malloc(p_bytes);
+		if (memory == NULL)
+			return vm_fail(p_vm, ERR_OUT_OF_MEMORY, "malloc() fail near "__FILE__":%i", __LINE__);
 
-	case OP_AND: STACK_ARGS_COUNT(2);
-		vm_stack_top(p_vm, 1)->u64 = vm_stack_top(p_vm, 1)->u64 && vm_stack_top(p_vm, 0)->u64;
-		-- p_vm->sp;
+		memcpy(memory, p_vm->memory, p_bytes < p_vm->memory_size? p_bytes : p_vm->memory_size);
+		unmap(p_vm);
 
-		break;
+		p_vm->memory      = memory;
+		p_vm->memory_size = p_bytes;
 
-	case OP_ORR: STACK_ARGS_COUNT(2);
-		vm_stack_top(p_vm, 1)->u64 = vm_stack_top(p_vm, 1)->u64 || vm_stack_top(p_vm, 0)->u64;
-		-- p_vm->sp;
+		return ERR_OK;
+	}
 
-		break;
+	/* The old memory stays if it can not be resized. Never empty, realloc could
+	   free it */
+	uint8_t *memory = (uint8_t*)realloc(p_vm->memory, p_bytes > 0? p_bytes : 1);
+	if (memory == NULL)
+		return vm_fail(p_vm, ERR_OUT_OF_MEMORY, "realloc() fail near "__FILE__":%i", __LINE__);
 
-	case OP_DUP: STACK_ARGS_COUNT(inst->data.u64 + 1);
-		if (p_vm->sp >= STACK_CAPACITY)
-			return ERR_STACK_OVERFLOW;
+	p_vm->memory      = memory;
+	p_vm->memory_size = p_bytes;
 
-		++ p_vm->sp;
-		vm_stack_top(p_vm, 0)->u64 = vm_stack_top(p_vm, inst->data.u64 + 1)->u64;
+	return ERR_OK;
+}
 
-		break;
+enum err vm_alloc_zeroed_mem(struct vm *p_vm, word_t p_bytes) {
+	/* Nothing is kept, so nothing is copied into the new mapping */
+	if (p_vm->sandbox || p_vm->large != NULL) {
+		p_vm->memory_size = 0;
+		return vm_alloc_mem(p_vm, p_bytes);
+	}
 
-	case OP_SWP: STACK_ARGS_COUNT(inst->data.u64 + 2); {
-		word_t tmp = vm_stack_top(p_vm, 0)->u64;
-		vm_stack_top(p_vm, 0)->u64 = vm_stack_top(p_vm, inst->data.u64 + 1)->u64;
-		vm_stack_top(p_vm, inst->data.u64 + 1)->u64 = tmp;
-	} break;
+	enum err err = vm_alloc_mem(p_vm, p_bytes);
+	if (err == ERR_OK)
+		memset(p_vm->memory, 0, p_bytes);
 
-	case OP_EMP:
-		if (p_vm->sp >= STACK_CAPACITY)
-			return ERR_STACK_OVERFLOW;
+	return err;
+}
 
-		++ p_vm->sp;
-		vm_stack_top(p_vm, 0)->u64 = p_vm->sp <= 0;
+void vm_destroy(struct vm *p_vm) {
+	/* What the program left open, the process of an embedded vm goes on */
+	if (p_vm->embedded)
+		maps_close(p_vm->maps);
 
-		break;
+	free_stack(p_vm->stack, STACK_BELOW, p_vm->stack_capacity * sizeof(value_t));
+	free_stack(p_vm->call_stack, 0, p_vm->call_stack_capacity * sizeof(struct frame));
 
-	case OP_SET: STACK_ARGS_COUNT(3); {
-		word_t  addr = vm_stack_top(p_vm, 2)->u64;
-		uint8_t val  = vm_stack_top(p_vm, 1)->u64;
-		word_t  size = vm_stack_top(p_vm, 0)->u64;
+	maps_free(p_vm->maps);
+	free(p_vm->maps);
 
-		if (!vm_is_chunk_valid(p_vm, addr, size))
-			return ERR_INVALID_MEM_ACCESS;
+	if (p_vm->mapping != NULL)
+		unmap(p_vm);
+	else if (p_vm->memory != NULL)
+		free(p_vm->memory);
 
-		p_vm->sp -= 3;
+	if (p_vm->bounds != NULL && p_vm->image == NULL)
+		free(p_vm->bounds);
 
-		memset(&p_vm->memory[addr], val, size);
-	} break;
+	vm_layout_free(p_vm);
+	vm_free_symbols(p_vm);
 
-	case OP_CPY: STACK_ARGS_COUNT(3); {
-		word_t to   = vm_stack_top(p_vm, 2)->u64;
-		word_t from = vm_stack_top(p_vm, 1)->u64;
-		word_t size = vm_stack_top(p_vm, 0)->u64;
+#ifdef USES_MMAP
+	if (p_vm->image != NULL)
+		munmap(p_vm->image, p_vm->image_size);
+#endif
+}
 
-		if (!vm_is_chunk_valid(p_vm, to, size) || !vm_is_chunk_valid(p_vm, from, size))
-			return ERR_INVALID_MEM_ACCESS;
+#define INST(P_OP)   case P_OP:
+#define NEXT()       break
+#define BRANCH()     break
+#define JUMP(P_N)    { p_vm->ip = OPERAND(P_N).u64 - 1; break; }
+#define RETURN(P_FRAME) { p_vm->ip = (P_FRAME).ip - 1; break; }
+#define RAISE(P_ERR) return P_ERR
 
-		p_vm->sp -= 3;
+/* vm_run_profiled follows the calls itself */
+#define PROFILE_CALL(P_FUNC)
+#define PROFILE_RETURN()
 
-		memcpy(&p_vm->memory[to], &p_vm->memory[from], size);
-	} break;
+#define OPERAND(P_N) p_vm->operands[vm_operand_index(p_vm, p_vm->ip) + (P_N)]
 
-	case OP_R08: STACK_ARGS_COUNT(1); {
-		word_t addr = vm_stack_top(p_vm, 0)->u64;
+#define IP           p_vm->ip
+#define SP           p_vm->sp
+#define TOS          p_vm->stack[p_vm->sp - 1]
+#define TOP(P_N)     p_vm->stack[p_vm->sp - (P_N) - 1]
+#define PUSH(P_WORD) p_vm->stack[p_vm->sp ++].u64 = P_WORD
+#define GROW()       ++ p_vm->sp
+#define DROP(P_N)    p_vm->sp -= P_N
+#define REDUCE(P_FIELD, P_VALUE) \
+	do { \
+		TOP(1).P_FIELD = P_VALUE; \
+		-- p_vm->sp; \
+	} while (0)
 
-		uint8_t data;
-		enum err ret = vm_read8(p_vm, &data, addr);
-		if (ret != ERR_OK)
-			return ret;
+#define SYNC()
+#define RELOAD()
 
-		vm_stack_top(p_vm, 0)->u64 = data;
-	} break;
+#define STACK_ARGS_COUNT(P_COUNT) \
+	if (p_vm->sp < P_COUNT) \
+		RAISE(ERR_STACK_UNDERFLOW)
+
+#define STACK_CAPACITY_CHECK() \
+	if (p_vm->sp >= p_vm->stack_capacity) \
+		RAISE(ERR_STACK_OVERFLOW)
+
+#define INST_ACCESS_CHECK(P_ADDR) \
+	if ((P_ADDR) >= p_vm->program_size) \
+		RAISE(ERR_INVALID_INST_ACCESS)
+
+#define READ(P_BITS, P_DATA, P_ADDR) \
+	do { \
+		enum err ret = vm_read##P_BITS(p_vm, &(P_DATA), P_ADDR); \
+		if (ret != ERR_OK) \
+			RAISE(ret); \
+	} while (0)
+
+#define WRITE(P_BITS, P_DATA, P_ADDR) \
+	do { \
+		enum err ret = vm_write##P_BITS(p_vm, P_DATA, P_ADDR); \
+		if (ret != ERR_OK) \
+			RAISE(ret); \
+	} while (0)
 
-	case OP_R16: STACK_ARGS_COUNT(1); {
-		word_t addr = vm_stack_top(p_vm, 0)->u64;
+int vm_exec_next_inst(struct vm *p_vm) {
+	switch (p_vm->ops[p_vm->ip]) {
+#include "handlers.h"
 
-		uint16_t data;
-		enum err ret = vm_read16(p_vm, &data, addr);
-		if (ret != ERR_OK)
-			return ret;
+	default: return ERR_INVALID_INST;
+	};
 
-		vm_stack_top(p_vm, 0)->u64 = data;
-	} break;
+	++ p_vm->ip;
 
-	case OP_R32: STACK_ARGS_COUNT(1); {
-		word_t addr = vm_stack_top(p_vm, 0)->u64;
+	return ERR_OK;
+}
 
-		uint32_t data;
-		enum err ret = vm_read32(p_vm, &data, addr);
-		if (ret != ERR_OK)
-			return ret;
+#undef INST
+#undef NEXT
+#undef BRANCH
+#undef JUMP
+#undef RETURN
+#undef RAISE
+#undef PROFILE_CALL
+#undef PROFILE_RETURN
+#undef OPERAND
+#undef IP
+#undef SP
+#undef TOS
+#undef TOP
+#undef PUSH
+#undef GROW
+#undef DROP
+#undef REDUCE
+#undef SYNC
+#undef RELOAD
+#undef STACK_ARGS_COUNT
+#undef STACK_CAPACITY_CHECK
+#undef INST_ACCESS_CHECK
+#undef READ
+#undef WRITE
+
+enum err vm_load_from_mem(struct vm *p_vm, struct inst *p_program, word_t p_size, word_t p_ep) {
+	p_vm->program      = p_program;
+	p_vm->program_size = p_size;
+	p_vm->ip           = p_ep;
 
-		vm_stack_top(p_vm, 0)->u64 = data;
-	} break;
+	p_vm->verified = vm_verify(p_vm);
 
-	case OP_R64: STACK_ARGS_COUNT(1); {
-		word_t addr = vm_stack_top(p_vm, 0)->u64;
+	enum err err = vm_layout(p_vm);
+	if (err != ERR_OK)
+		return err;
 
-		uint64_t data;
-		enum err ret = vm_read64(p_vm, &data, addr);
-		if (ret != ERR_OK)
-			return ret;
+#ifdef USES_COMPUTED_GOTO
+	vm_fuse(p_vm);
+#else
+	p_vm->code = p_vm->ops;
+#endif
 
-		vm_stack_top(p_vm, 0)->u64 = data;
-	} break;
+	return ERR_OK;
+}
 
-	case OP_W08: STACK_ARGS_COUNT(2); {
-		word_t  addr = vm_stack_top(p_vm, 1)->u64;
-		uint8_t data = vm_stack_top(p_vm, 0)->u64;
+#ifdef USES_COMPUTED_GOTO
+#define THREADED_NAME run_checked
+#include "threaded.h"
 
-		enum err ret = vm_write8(p_vm, data, addr);
-		if (ret != ERR_OK)
-			return ret;
+/* Programs accepted by the verifier run without the per instruction checks */
+#define THREADED_NAME      run_verified
+#define THREADED_UNCHECKED
+#define THREADED_FALLBACK  run_checked
+#include "threaded.h"
 
-		p_vm->sp -= 2;
-	} break;
+/* Same, for a memory in a sandbox */
+#define THREADED_NAME      run_sandboxed
+#define THREADED_UNCHECKED
+#define THREADED_SANDBOX
+#define THREADED_FALLBACK  run_checked
+#include "threaded.h"
 
-	case OP_W16: STACK_ARGS_COUNT(2); {
-		word_t   addr = vm_stack_top(p_vm, 1)->u64;
-		uint16_t data = vm_stack_top(p_vm, 0)->u64;
+#define THREADED_NAME    run_profiled
+#define THREADED_PROFILE
+#include "threaded.h"
 
-		enum err ret = vm_write16(p_vm, data, addr);
-		if (ret != ERR_OK)
-			return ret;
+/* Only counts the executed instructions, see vm_run_counted */
+#define THREADED_NAME      run_counted
+#define THREADED_UNCHECKED
+#define THREADED_COUNT
+#define THREADED_FALLBACK  run_profiled
+#include "threaded.h"
 
-		p_vm->sp -= 2;
-	} break;
+#define THREADED_NAME  run_traced
+#define THREADED_TRACE
+#include "threaded.h"
 
-	case OP_W32: STACK_ARGS_COUNT(2); {
-		word_t   addr = vm_stack_top(p_vm, 1)->u64;
-		uint32_t data = vm_stack_top(p_vm, 0)->u64;
+void vm_run(struct vm *p_vm) {
+	if (p_vm->verified && p_vm->sandbox) {
+		if (!sandbox_run(p_vm, run_sandboxed))
+			vm_panic(p_vm, ERR_INVALID_MEM_ACCESS);
+	} else if (p_vm->verified)
+		run_verified(p_vm);
+	else
+		run_checked(p_vm);
+}
 
-		enum err ret = vm_write32(p_vm, data, addr);
-		if (ret != ERR_OK)
-			return ret;
+void vm_run_profiled(struct vm *p_vm) {
+	p_vm->profile->nodes[CALL_ROOT].func = p_vm->ip;
+	run_profiled(p_vm);
+}
 
-		p_vm->sp -= 2;
-	} break;
+void vm_run_counted(struct vm *p_vm) {
+	p_vm->profile->nodes[CALL_ROOT].func = p_vm->ip;
 
-	case OP_W64: STACK_ARGS_COUNT(2); {
-		word_t   addr = vm_stack_top(p_vm, 1)->u64;
-		uint64_t data = vm_stack_top(p_vm, 0)->u64;
+	if (p_vm->verified)
+		run_counted(p_vm);
+	else
+		run_profiled(p_vm);
+}
 
-		enum err ret = vm_write64(p_vm, data, addr);
+void vm_run_traced(struct vm *p_vm) {
+	run_traced(p_vm);
+}
+#else
+void vm_run(struct vm *p_vm) {
+	while (p_vm->ip < p_vm->program_size && !VM_HALT(p_vm)) {
+		int ret = vm_exec_next_inst(p_vm);
 		if (ret != ERR_OK)
-			return ret;
-
-		p_vm->sp -= 2;
-	} break;
-
-	case OP_OPE: STACK_ARGS_COUNT(3); {
-		word_t     addr = vm_stack_top(p_vm, 2)->u64;
-		word_t     size = vm_stack_top(p_vm, 1)->u64;
-		enum fmode mode = vm_stack_top(p_vm, 0)->u64;
-
-		char name[size + 1];
-		vm_get_str(p_vm, name, addr, size);
-
-		p_vm->sp -= 2;
-
-		word_t fd = vm_get_free_fd(p_vm);
-		if (fd == INVALID_DESCRIPTOR)
-			return ERR_MAX_FILES_OPEN;
-
-		struct file *f = &p_vm->maps->files[fd];
-
-		char *mode_str = fmode_to_str(mode);
-		if (mode_str == NULL)
-			return ERR_INVALID_FMODE;
-
-		f->mode = mode;
-		f->file = fopen(name, mode_str);
-		vm_stack_top(p_vm, 0)->u64 = f->file == NULL? INVALID_DESCRIPTOR : fd;
-
-		free(mode_str);
-	} break;
-
-	case OP_CLO: STACK_ARGS_COUNT(1); {
-		word_t fd = p_vm->stack[-- p_vm->sp].u64;
-		if (!vm_is_fd_valid(p_vm, fd))
-			return ERR_INVALID_DESCRIPTOR;
-
-		struct file *f = &p_vm->maps->files[fd];
-
-		fclose(f->file);
-		f->file = NULL;
-	} break;
-
-	case OP_WRF: STACK_ARGS_COUNT(2); {
-		word_t addr = vm_stack_top(p_vm, 2)->u64;
-		word_t size = vm_stack_top(p_vm, 1)->u64;
-		word_t fd   = vm_stack_top(p_vm, 0)->u64;
-
-		if (!vm_is_chunk_valid(p_vm, addr, size))
-			return ERR_INVALID_MEM_ACCESS;
-		else if (!vm_is_fd_valid(p_vm, fd))
-			return ERR_INVALID_DESCRIPTOR;
-
-		p_vm->sp -= 2;
-
-		size_t ret = fwrite(&p_vm->memory[addr], 1, size, p_vm->maps->files[fd].file);
-		vm_stack_top(p_vm, 0)->u64 = (word_t)(ret < 1);
-	} break;
-
-	case OP_RDF: STACK_ARGS_COUNT(3); {
-		word_t addr = vm_stack_top(p_vm, 2)->u64;
-		word_t size = vm_stack_top(p_vm, 1)->u64;
-		word_t fd   = vm_stack_top(p_vm, 0)->u64;
-
-		if (!vm_is_chunk_valid(p_vm, addr, size))
-			return ERR_INVALID_MEM_ACCESS;
-		else if (!vm_is_fd_valid(p_vm, fd))
-			return ERR_INVALID_DESCRIPTOR;
-
-		p_vm->sp -= 2;
-
-		size_t ret = fread(&p_vm->memory[addr], 1, size, p_vm->maps->files[fd].file);
-		vm_stack_top(p_vm, 0)->u64 = (word_t)(ret < 1);
-	} break;
-
-	case OP_SZF: STACK_ARGS_COUNT(1); {
-		word_t fd = vm_stack_top(p_vm, 0)->u64;
-		if (!vm_is_fd_valid(p_vm, fd))
-			return ERR_INVALID_DESCRIPTOR;
-
-		struct file *f = &p_vm->maps->files[fd];
-
-		fseek(f->file, 0, SEEK_END);
-		vm_stack_top(p_vm, 0)->u64 = ftell(f->file);
-		fseek(f->file, 0, SEEK_SET);
-	} break;
-
-	case OP_FLU: STACK_ARGS_COUNT(1); {
-		word_t fd = p_vm->stack[-- p_vm->sp].u64;
-		if (!vm_is_fd_valid(p_vm, fd))
-			return ERR_INVALID_DESCRIPTOR;
-
-		fflush(p_vm->maps->files[fd].file);
-	} break;
-
-	case OP_BAN: STACK_ARGS_COUNT(2);
-		vm_stack_top(p_vm, 1)->u64 &= vm_stack_top(p_vm, 0)->u64;
-		-- p_vm->sp;
-
-		break;
-
-	case OP_BOR: STACK_ARGS_COUNT(2);
-		vm_stack_top(p_vm, 1)->u64 |= vm_stack_top(p_vm, 0)->u64;
-		-- p_vm->sp;
-
-		break;
-
-	case OP_BSR: STACK_ARGS_COUNT(2);
-		vm_stack_top(p_vm, 1)->u64 >>= vm_stack_top(p_vm, 0)->u64;
-		-- p_vm->sp;
-
-		break;
-
-	case OP_BSL: STACK_ARGS_COUNT(2);
-		vm_stack_top(p_vm, 1)->u64 <<= vm_stack_top(p_vm, 0)->u64;
-		-- p_vm->sp;
-
-		break;
-
-	case OP_LOL: STACK_ARGS_COUNT(2); {
-		word_t addr = vm_stack_top(p_vm, 1)->u64;
-		word_t size = vm_stack_top(p_vm, 0)->u64;
-
-		char name[size + 1];
-		vm_get_str(p_vm, name, addr, size);
-
-		-- p_vm->sp;
-
-		word_t ld = vm_get_free_ld(p_vm);
-		if (ld == INVALID_DESCRIPTOR)
-			return ERR_MAX_FILES_OPEN;
-
-		struct lib *lib = &p_vm->maps->libs[ld];
-
-		lib->handle = dlopen(name, RTLD_NOW | RTLD_GLOBAL);
-		vm_stack_top(p_vm, 0)->u64 = lib->handle == NULL? INVALID_DESCRIPTOR : ld;
-	} break;
-
-	case OP_CLL: STACK_ARGS_COUNT(1); {
-		word_t ld = p_vm->stack[-- p_vm->sp].u64;
-		if (!vm_is_ld_valid(p_vm, ld))
-			return ERR_INVALID_DESCRIPTOR;
-
-		struct lib *lib = &p_vm->maps->libs[ld];
-
-		dlclose(lib->handle);
-		lib->handle = NULL;
-		memset(lib->funcs, 0, sizeof(lib->funcs));
-	} break;
-
-	case OP_LLF: STACK_ARGS_COUNT(3); {
-		word_t addr = vm_stack_top(p_vm, 2)->u64;
-		word_t size = vm_stack_top(p_vm, 1)->u64;
-		word_t ld   = vm_stack_top(p_vm, 0)->u64;
-
-		if (!vm_is_chunk_valid(p_vm, addr, size))
-			return ERR_INVALID_MEM_ACCESS;
-
-		char name[size + 1];
-		strncpy(name, (char*)&p_vm->memory[addr], size);
-		name[size] = 0;
-
-		p_vm->sp -= 2;
-
-		word_t fnd = vm_get_free_fnd(p_vm, ld);
-		if (fnd == INVALID_DESCRIPTOR)
-			return ERR_MAX_FUNCS_LOADED;
-
-		external_t *func = &p_vm->maps->libs[ld].funcs[fnd];
-
-		*(void**)func = dlsym(p_vm->maps->libs[ld].handle, name);
-		vm_stack_top(p_vm, 0)->u64 = *func == NULL? INVALID_DESCRIPTOR : fnd;
-	} break;
-
-	case OP_ULF: STACK_ARGS_COUNT(2); {
-		word_t fnd = vm_stack_top(p_vm, 1)->u64;
-		word_t ld  = vm_stack_top(p_vm, 0)->u64;
-		if (!vm_is_ld_valid(p_vm, ld) || !vm_is_fnd_valid(p_vm, ld, fnd))
-			return ERR_INVALID_DESCRIPTOR;
-
-		p_vm->maps->libs[ld].funcs[fnd] = NULL;
-
-		p_vm->sp -= 2;
-	} break;
-
-	case OP_CLF: STACK_ARGS_COUNT(2); {
-		word_t fnd = vm_stack_top(p_vm, 1)->u64;
-		word_t ld  = vm_stack_top(p_vm, 0)->u64;
+			vm_panic(p_vm, ret);
+	}
+}
 
-		if (!vm_is_ld_valid(p_vm, ld) || !vm_is_fnd_valid(p_vm, ld, fnd))
-			return ERR_INVALID_DESCRIPTOR;
+void vm_run_profiled(struct vm *p_vm) {
+	struct profile *profile = p_vm->profile;
+	profile->nodes[CALL_ROOT].func = p_vm->ip;
 
-		p_vm->sp -= 2;
+	while (p_vm->ip < p_vm->program_size && !VM_HALT(p_vm)) {
+		word_t ip = p_vm->ip;
+		++ profile->counts[ip];
+		++ profile->steps;
 
-		enum err ret = p_vm->maps->libs[ld].funcs[fnd](p_vm);
+		int ret = vm_exec_next_inst(p_vm);
 		if (ret != ERR_OK)
-			return ret;
-	} break;
-
-	case OP_DMP:
-		putchar('\n');
-		vm_dump(p_vm, stdout);
-		fflush(stdout);
-
-		break;
-
-	case OP_PRT: STACK_ARGS_COUNT(1);
-		printf("%i\n", (int)p_vm->stack[-- p_vm->sp].i64);
-
-		break;
-
-	case OP_FPR: STACK_ARGS_COUNT(1);
-		printf("%f\n", (float)p_vm->stack[-- p_vm->sp].f64);
-
-		break;
-
-	case OP_HLT: STACK_ARGS_COUNT(1);
-		p_vm->ex   = p_vm->stack[-- p_vm->sp].u64;
-		p_vm->halt = true;
+			vm_panic(p_vm, ret);
 
-		break;
+		if (vm_has_target(p_vm->ops[ip]) && p_vm->ip != ip + 1)
+			++ profile->taken[ip];
 
-	default: return ERR_INVALID_INST;
-	};
+		profile_peaks(profile, p_vm->sp, p_vm->cs);
 
-	++ p_vm->ip;
-
-	return ERR_OK;
+		if (p_vm->ops[ip] == OP_CAL)
+			profile_call(profile, p_vm->ip);
+		else if (p_vm->ops[ip] == OP_RET)
+			profile_return(profile);
+	}
 }
 
-void vm_load_from_mem(struct vm *p_vm, struct inst *p_program, word_t p_size, word_t p_ep) {
-	p_vm->program      = p_program;
-	p_vm->program_size = p_size;
-	p_vm->ip           = p_ep;
+void vm_run_counted(struct vm *p_vm) {
+	vm_run_profiled(p_vm);
 }
 
-void vm_run(struct vm *p_vm) {
-	while (p_vm->ip < p_vm->program_size && !p_vm->halt) {
+void vm_run_traced(struct vm *p_vm) {
+	struct trace *trace = p_vm->trace;
+
+	while (p_vm->ip < p_vm->program_size && !VM_HALT(p_vm)) {
+		struct trace_entry *entry = &trace->entries[trace->recorded ++ & trace->mask];
+		entry->ip_op = (uint64_t)p_vm->ip << 8 | p_vm->ops[p_vm->ip];
+		entry->tos   = p_vm->sp > 0? p_vm->stack[p_vm->sp - 1].u64 : 0;
+
 		int ret = vm_exec_next_inst(p_vm);
 		if (ret != ERR_OK)
 			vm_panic(p_vm, ret);
 	}
 }
+#endif
 
 void vm_dump(struct vm *p_vm, FILE *p_file) {
 	vm_dump_regs(p_vm, p_file);
@@ -849,7 +578,11 @@ void vm_dump_call_stack(struct vm *p_vm, FILE *p_file) {
 		fputs("from ", p_file);
 
 		set_fg_color(COLOR_DEFAULT, p_file);
-		fprintf(p_file, "0x%"FMT_HEX"\n", AS_FMT_HEX(p_vm->call_stack[i]));
+		fprintf(p_file, "0x%"FMT_HEX, AS_FMT_HEX(p_vm->call_stack[i].ip));
+
+		/* The return address is after the call, which is in the caller */
+		vm_print_symbol(p_vm, p_file, p_vm->call_stack[i].ip - 1);
+		fputc('\n', p_file);
 	}
 }
 
@@ -863,10 +596,25 @@ void vm_dump_at(struct vm *p_vm, FILE *p_file) {
 	fprintf(p_file, "0x%"FMT_HEX, AS_FMT_HEX(p_vm->ip));
 	set_fg_color(COLOR_DEFAULT, p_file);
 	set_bg_color(COLOR_DEFAULT, p_file);
+	vm_print_symbol(p_vm, p_file, p_vm->ip);
 	fputc('\n', p_file);
 }
 
 void vm_panic(struct vm *p_vm, enum err p_err) {
+	/* The stats are written at exit, or after the run of an embedded vm */
+	if (p_vm->stats != NULL)
+		p_vm->stats->panic = p_err;
+
+	/* The interpreters stop on the halt */
+	if (p_vm->embedded) {
+		p_vm->error.err = p_err;
+		p_vm->error.ip  = p_vm->ip;
+		snprintf(p_vm->error.msg, sizeof(p_vm->error.msg), "%s", err_to_str[p_err]);
+
+		VM_SET_HALT(p_vm, HALT_PANIC);
+		return;
+	}
+
 	fputc('\n', stderr);
 	VM_ERROR(stderr, err_to_str[p_err]);
 	vm_dump_at(p_vm, stderr);
@@ -877,6 +625,21 @@ void vm_panic(struct vm *p_vm, enum err p_err) {
 	exit(p_err);
 }
 
+enum err vm_fail(struct vm *p_vm, enum err p_err, const char *p_fmt, ...) {
+	PARSE_FMT_INTO(p_fmt, msg, VM_ERROR_MSG_SIZE);
+
+	if (!p_vm->embedded) {
+		VM_ERROR(stderr, "%s", msg);
+		exit(EXIT_FAILURE);
+	}
+
+	p_vm->error.err = p_err;
+	p_vm->error.ip  = p_vm->ip;
+	memcpy(p_vm->error.msg, msg, sizeof(msg));
+
+	return p_err;
+}
+
 void log_colored(FILE *p_file, enum color p_color, const char *p_fmt, ...) {
 	PARSE_FMT_INTO(p_fmt, msg, 256);
 
@@ -898,8 +661,7 @@ enum err vm_read16(struct vm *p_vm, uint16_t *p_data, word_t p_addr) {
 	if (!vm_is_chunk_valid(p_vm, p_addr, sizeof(uint16_t)))
 		return ERR_INVALID_MEM_ACCESS;
 
-	*p_data = ((uint16_t)p_vm->memory[p_addr] << 010) |
-	           (uint16_t)p_vm->memory[p_addr + 1];
+	*p_data = bytes_load(&p_vm->memory[p_addr], sizeof(uint16_t), p_vm->little_endian);
 
 	return ERR_OK;
 }
@@ -908,10 +670,7 @@ enum err vm_read32(struct vm *p_vm, uint32_t *p_data, word_t p_addr) {
 	if (!vm_is_chunk_valid(p_vm, p_addr, sizeof(uint32_t)))
 		return ERR_INVALID_MEM_ACCESS;
 
-	*p_data = ((uint32_t)p_vm->memory[p_addr]     << 030) |
-	          ((uint32_t)p_vm->memory[p_addr + 1] << 020) |
-	          ((uint32_t)p_vm->memory[p_addr + 2] << 010) |
-	           (uint32_t)p_vm->memory[p_addr + 3];
+	*p_data = bytes_load(&p_vm->memory[p_addr], sizeof(uint32_t), p_vm->little_endian);
 
 	return ERR_OK;
 }
@@ -920,14 +679,7 @@ enum err vm_read64(struct vm *p_vm, uint64_t *p_data, word_t p_addr) {
 	if (!vm_is_chunk_valid(p_vm, p_addr, sizeof(uint64_t)))
 		return ERR_INVALID_MEM_ACCESS;
 
-	*p_data = ((uint64_t)p_vm->memory[p_addr]     << 070) |
-	          ((uint64_t)p_vm->memory[p_addr + 1] << 060) |
-	          ((uint64_t)p_vm->memory[p_addr + 2] << 050) |
-	          ((uint64_t)p_vm->memory[p_addr + 3] << 040) |
-	          ((uint64_t)p_vm->memory[p_addr + 4] << 030) |
-	          ((uint64_t)p_vm->memory[p_addr + 5] << 020) |
-	          ((uint64_t)p_vm->memory[p_addr + 6] << 010) |
-	           (uint64_t)p_vm->memory[p_addr + 7];
+	*p_data = bytes_load(&p_vm->memory[p_addr], sizeof(uint64_t), p_vm->little_endian);
 
 	return ERR_OK;
 }
@@ -945,8 +697,7 @@ enum err vm_write16(struct vm *p_vm, uint16_t p_data, word_t p_addr) {
 	if (!vm_is_chunk_valid(p_vm, p_addr, sizeof(uint16_t)))
 		return ERR_INVALID_MEM_ACCESS;
 
-	p_vm->memory[p_addr]     = (p_data & 0xFF00) >> 010;
-	p_vm->memory[p_addr + 1] =  p_data & 0x00FF;
+	bytes_store(&p_vm->memory[p_addr], p_data, sizeof(uint16_t), p_vm->little_endian);
 
 	return ERR_OK;
 }
@@ -955,10 +706,7 @@ enum err vm_write32(struct vm *p_vm, uint32_t p_data, word_t p_addr) {
 	if (!vm_is_chunk_valid(p_vm, p_addr, sizeof(uint32_t)))
 		return ERR_INVALID_MEM_ACCESS;
 
-	p_vm->memory[p_addr]     = (p_data & 0xFF000000) >> 030;
-	p_vm->memory[p_addr + 1] = (p_data & 0x00FF0000) >> 020;
-	p_vm->memory[p_addr + 2] = (p_data & 0x0000FF00) >> 010;
-	p_vm->memory[p_addr + 3] =  p_data & 0x000000FF;
+	bytes_store(&p_vm->memory[p_addr], p_data, sizeof(uint32_t), p_vm->little_endian);
 
 	return ERR_OK;
 }
@@ -967,45 +715,11 @@ enum err vm_write64(struct vm *p_vm, uint64_t p_data, word_t p_addr) {
 	if (!vm_is_chunk_valid(p_vm, p_addr, sizeof(uint64_t)))
 		return ERR_INVALID_MEM_ACCESS;
 
-	p_vm->memory[p_addr]     = (p_data & 0xFF00000000000000) >> 070;
-	p_vm->memory[p_addr + 1] = (p_data & 0x00FF000000000000) >> 060;
-	p_vm->memory[p_addr + 2] = (p_data & 0x0000FF0000000000) >> 050;
-	p_vm->memory[p_addr + 3] = (p_data & 0x000000FF00000000) >> 040;
-	p_vm->memory[p_addr + 4] = (p_data & 0x00000000FF000000) >> 030;
-	p_vm->memory[p_addr + 5] = (p_data & 0x0000000000FF0000) >> 020;
-	p_vm->memory[p_addr + 6] = (p_data & 0x000000000000FF00) >> 010;
-	p_vm->memory[p_addr + 7] =  p_data & 0x00000000000000FF;
+	bytes_store(&p_vm->memory[p_addr], p_data, sizeof(uint64_t), p_vm->little_endian);
 
 	return ERR_OK;
 }
 
-word_t vm_get_free_fd(struct vm *p_vm) {
-	for (word_t i = 0; i < MAX_OPEN_FILES; ++ i) {
-		if (p_vm->maps->files[i].file == NULL)
-			return i;
-	}
-
-	return INVALID_DESCRIPTOR;
-}
-
-word_t vm_get_free_ld(struct vm *p_vm) {
-	for (word_t i = 0; i < MAX_OPEN_LIBS; ++ i) {
-		if (p_vm->maps->libs[i].handle == NULL)
-			return i;
-	}
-
-	return INVALID_DESCRIPTOR;
-}
-
-word_t vm_get_free_fnd(struct vm *p_vm, word_t p_ld) {
-	for (word_t i = 0; i < MAX_LOADED_FUNCS; ++ i) {
-		if (p_vm->maps->libs[p_ld].funcs[i] == NULL)
-			return i;
-	}
-
-	return INVALID_DESCRIPTOR;
-}
-
 bool vm_get_str(struct vm *p_vm, char *p_buf, word_t p_addr, word_t p_size) {
 	if (!vm_is_chunk_valid(p_vm, p_addr, p_size))
 		return false;
@@ -1017,15 +731,16 @@ bool vm_get_str(struct vm *p_vm, char *p_buf, word_t p_addr, word_t p_size) {
 }
 
 bool vm_is_fd_valid(struct vm *p_vm, word_t p_fd) {
-	return p_fd < MAX_OPEN_FILES && p_vm->maps->files[p_fd].file != NULL;
+	return p_fd < p_vm->maps->files_size && p_vm->maps->files[p_fd].file != NULL;
 }
 
 bool vm_is_ld_valid(struct vm *p_vm, word_t p_ld) {
-	return p_ld < MAX_OPEN_LIBS && p_vm->maps->libs[p_ld].handle != NULL;
+	return p_ld < p_vm->maps->libs_size && p_vm->maps->libs[p_ld].handle != NULL;
 }
 
 bool vm_is_fnd_valid(struct vm *p_vm, word_t p_ld, word_t p_fnd) {
-	return p_fnd < MAX_LOADED_FUNCS && p_vm->maps->libs[p_ld].funcs[p_fnd] != NULL;
+	struct lib *lib = &p_vm->maps->libs[p_ld];
+	return p_fnd < lib->funcs_size && lib->funcs[p_fnd].func != NULL;
 }
 
 bool vm_is_chunk_valid(struct vm *p_vm, word_t p_addr, word_t p_size) {
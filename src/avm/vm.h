@@ -31,15 +31,32 @@
 #	define PACK(P_STRUCT) P_STRUCT __attribute__((__packed__))
 #endif
 
-#define STACK_SIZE_BYTES 0x10000
-#define STACK_CAPACITY   (STACK_SIZE_BYTES / sizeof(value_t))
+#if defined(COMPILER_GCC) || defined(COMPILER_CLANG)
+#	define UNLIKELY(P_COND) __builtin_expect(!!(P_COND), 0)
+#else
+#	define UNLIKELY(P_COND) (P_COND)
+#endif
 
+/* Labels as values are a GNU extension, other compilers use the switch dispatch.
+   Build with -DNO_COMPUTED_GOTO to force the switch dispatch */
+#if (defined(COMPILER_GCC) || defined(COMPILER_CLANG)) && !defined(NO_COMPUTED_GOTO)
+#	define USES_COMPUTED_GOTO
+#endif
+
+/* Executables are mapped instead of read, see loader.c */
+#if defined(PLATFORM_LINUX) || defined(PLATFORM_UNIX) || defined(PLATFORM_APPLE)
+#	define USES_MMAP
+
+#	include <sys/mman.h> /* mmap, munmap, mprotect */
+#endif
+
+/* Default sizes of the stacks, see vm_alloc_stacks. The call stack size counts
+   a word per entry, like the stack size sections */
+#define STACK_SIZE_BYTES      0x10000
 #define CALL_STACK_SIZE_BYTES 0x1000
-#define CALL_STACK_CAPACITY   (CALL_STACK_SIZE_BYTES / sizeof(word_t))
 
-#define MAX_OPEN_FILES   0x100
-#define MAX_OPEN_LIBS    0x80
-#define MAX_LOADED_FUNCS 0x80
+/* Largest stacks, in values and entries. The JIT compares with 32 bit immediates */
+#define MAX_STACK_CAPACITY 0x10000000
 
 #define INVALID_DESCRIPTOR (word_t)-1
 
@@ -57,6 +74,7 @@ typedef union {
 
 /* Asserts */
 static_assert(STACK_SIZE_BYTES % sizeof(word_t) == 0);
+static_assert(CALL_STACK_SIZE_BYTES % sizeof(word_t) == 0);
 static_assert(sizeof(word_t)  == 8);
 static_assert(sizeof(double)  == sizeof(word_t));
 static_assert(sizeof(value_t) == sizeof(word_t));
@@ -171,6 +189,19 @@ enum opcode {
 	OP_FPR = 0xF2,
 
 	OP_HLT = 0xFF,
+
+	/* Superinstructions, only created by vm_fuse and never valid in executables */
+	OP_LOOP_LES = 0xA0, /* INC, DUP 0, PSH, LES, JNZ */
+	OP_PSH_ADD  = 0xA1,
+	OP_PSH_SUB  = 0xA2,
+	OP_PSH_R64  = 0xA3,
+	OP_DUP_JNZ  = 0xA4,
+	OP_EQU_JNZ  = 0xA5,
+	OP_NEQ_JNZ  = 0xA6,
+	OP_GRT_JNZ  = 0xA7,
+	OP_GEQ_JNZ  = 0xA8,
+	OP_LES_JNZ  = 0xA9,
+	OP_LEQ_JNZ  = 0xAA,
 };
 
 enum err {
@@ -188,6 +219,11 @@ enum err {
 	ERR_INVALID_DESCRIPTOR   = 0x0b,
 	ERR_MAX_LIBS_OPEN        = 0x0d,
 	ERR_MAX_FUNCS_LOADED     = 0x0e,
+
+	/* Only from vm_fail, the program did not run */
+	ERR_OUT_OF_MEMORY        = 0x0f,
+	ERR_INVALID_EXECUTABLE   = 0x10,
+	ERR_CANNOT_READ          = 0x11,
 };
 
 const char *err_str(enum err p_err);
@@ -199,19 +235,27 @@ enum fmode {
 	FMODE_BINARY = 1 << 3,
 };
 
-char *fmode_to_str(enum fmode p_fmode);
+#define FMODE_STR_SIZE 4
 
-struct file {
-	FILE      *file;
-	enum fmode mode;
-};
+/* Writes the fopen mode into p_str, returns false if p_fmode is invalid */
+bool fmode_to_str(enum fmode p_fmode, char *p_str);
 
 struct vm;
+struct maps;
+struct profile;
+struct symbol;
+struct vm_stats;
+struct trace;
+struct large_memory;
 typedef enum err (*external_t)(struct vm*);
 
-struct lib {
-	void      *handle;
-	external_t funcs[MAX_LOADED_FUNCS];
+#define VM_ERROR_MSG_SIZE 256
+
+/* Error that stopped an embedded vm, see struct vm.embedded */
+struct vm_error {
+	enum err err;
+	word_t   ip;                     /* Of the instruction that panicked */
+	char     msg[VM_ERROR_MSG_SIZE];
 };
 
 PACK(struct inst {
@@ -219,24 +263,100 @@ PACK(struct inst {
 	value_t     data;
 });
 
-struct maps {
-	struct file files[MAX_OPEN_FILES];
-	struct lib  libs[MAX_OPEN_LIBS];
+/* Stack requirements of the code starting at an instruction, up to the next
+   control transfer. Computed by the verifier */
+struct stack_bounds {
+	uint32_t need; /* Values that must be on the stack */
+	uint32_t grow; /* How much the stack can grow */
 };
 
+/* Entry of the call stack. The operands of the return address are kept with it,
+   so that RET does not look them up in the operand map */
+struct frame {
+	word_t ip;      /* Return address */
+	word_t operand; /* vm_operand_index of ip, see layout.h */
+};
+
+static_assert(sizeof(struct frame) == 16); /* The JIT finds the entries with a shift */
+
 struct vm {
-	value_t *stack;
-	word_t  *call_stack;
-	word_t   ip, sp, cs, ex; /* Registers */
+	/* Polled by the interpreters after every instruction, a signal handler can
+	   stop them through it (see sampler.h). Only accessed with VM_HALT and
+	   VM_SET_HALT. It is first so that the poll needs no register besides the
+	   vm pointer */
+	uint8_t halt;
+
+	value_t      *stack;
+	struct frame *call_stack;
+	word_t        ip, sp, cs, ex; /* Registers */
+
+	word_t stack_capacity, call_stack_capacity; /* In values and in entries */
+
 	uint8_t *memory;
 	word_t   memory_size;
+	bool     little_endian; /* Byte order of the memory, see FILE_FLAG_LITTLE_ENDIAN */
+
+	void  *mapping;      /* File mapping the memory points into, NULL if the
+	                        memory was allocated */
+	size_t mapping_size;
+	bool   sandbox;      /* The mapping is a sandbox, see sandbox.h */
 
-	struct maps *maps;
+	const struct large_memory *large; /* Placement of the mapping, NULL if it is
+	                                     not a large memory. See large.h */
+
+	struct maps *maps; /* Open files and libraries, see maps.h */
 
 	struct inst *program;
 	word_t       program_size;
 
-	bool halt;
+	struct stack_bounds *bounds;
+	bool                 verified;
+
+	/* What the interpreters run, see layout.h */
+	uint8_t            *ops;         /* Opcodes of the program */
+	value_t            *operands;    /* Operands of the instructions that have one */
+	struct operand_map *operand_map; /* Operand index of every instruction */
+
+	uint8_t  *code;       /* What the fast interpreter runs, ops with
+	                         superinstructions (same length) */
+	uint32_t  fuse_rules; /* Superinstructions vm_fuse may create */
+
+	struct profile  *profile; /* Counters of vm_run_profiled, see profile.h */
+	struct vm_stats *stats;   /* Resource counters, NULL if they are not kept.
+	                             See stats.h */
+	struct trace    *trace;   /* Ring buffer of vm_run_traced, see trace.h */
+
+	struct symbol *symbols;       /* See symbols.h, NULL without a symbol section */
+	word_t         symbols_count;
+	char          *symbol_names;
+
+	void  *image;      /* Cached image the program, the bounds and the layout
+	                      are in, NULL if they were allocated. See cache.h */
+	size_t image_size;
+
+	/* Errors are kept in error instead of being written to stderr, and they
+	   stop the run or the load instead of exiting. See libavm.h */
+	bool            embedded;
+	struct vm_error error;
+};
+
+/* Relaxed atomic accesses of struct vm.halt, which signal handlers write. They
+   are plain moves, the other compilers get a volatile access */
+#if defined(COMPILER_GCC) || defined(COMPILER_CLANG)
+#	define VM_HALT(P_VM)             __atomic_load_n(&(P_VM)->halt, __ATOMIC_RELAXED)
+#	define VM_SET_HALT(P_VM, P_HALT) __atomic_store_n(&(P_VM)->halt, (P_HALT), __ATOMIC_RELAXED)
+#else
+#	define VM_HALT(P_VM)             (*(volatile uint8_t*)&(P_VM)->halt)
+#	define VM_SET_HALT(P_VM, P_HALT) (*(volatile uint8_t*)&(P_VM)->halt = (P_HALT))
+#endif
+
+/* Values of struct vm.halt */
+enum {
+	HALT_NONE = 0,
+	HALT_PROGRAM, /* HLT was executed */
+	HALT_SAMPLE,  /* The sampler is due for a sample, the program goes on after it */
+	HALT_TRACE,   /* The trace was requested, the program goes on after it is written */
+	HALT_PANIC,   /* An embedded vm panicked, see struct vm.error */
 };
 
 PACK(struct file_meta {
@@ -247,12 +367,77 @@ PACK(struct file_meta {
 	uint8_t entry_point[sizeof(word_t)];
 });
 
+/* Sectioned executables. The header is followed by a table of section_count
+ * sections. Section offsets are from the start of the file, shebang included,
+ * and aligned to FILE_SECTION_ALIGN so that they can be mapped as they are.
+ *
+ * The memory is the data section followed by the zero filled bss section,
+ * which only has a size and takes no space in the file. Sections of an
+ * unknown type are skipped.
+ */
+#define FILE_SECTION_ALIGN 0x1000
+
+enum section_type {
+	SECTION_CODE = 1,   /* Instructions, in the same format as in struct file_meta
+	                       executables */
+	SECTION_DATA,       /* Initialized memory */
+	SECTION_BSS,        /* Zero filled memory */
+	SECTION_SYMBOLS,    /* Function names, struct file_symbol entries */
+	SECTION_STACK,      /* Size of the stack in bytes, the default size is used
+	                       without it. Only has a size, like bss */
+	SECTION_CALL_STACK, /* Size of the call stack, same as the stack section */
+	SECTION_FLAGS,      /* enum file_flag bits, in the size. Only has a size, like
+	                       bss */
+};
+
+enum file_flag {
+	FILE_FLAG_LITTLE_ENDIAN = 1 << 0, /* The memory is little endian instead of big
+	                                     endian, the values are read and written
+	                                     without swapping their bytes */
+};
+
+#define FILE_FLAGS_KNOWN FILE_FLAG_LITTLE_ENDIAN
+
+PACK(struct file_header {
+	char    magic[3]; /* AVS */
+	uint8_t ver[3];   /* [0] = MAJOR, [1] = MINOR, [2] = PATCH */
+	uint8_t entry_point[sizeof(word_t)];
+	uint8_t section_count[sizeof(word_t)];
+});
+
+PACK(struct file_section {
+	uint8_t type[sizeof(word_t)];   /* enum section_type */
+	uint8_t offset[sizeof(word_t)]; /* Ignored for the bss section */
+	uint8_t size[sizeof(word_t)];   /* In bytes */
+});
+
+/* Followed by name_size bytes of name, without a terminating null */
+PACK(struct file_symbol {
+	uint8_t addr[sizeof(word_t)];      /* First instruction of the function */
+	uint8_t size[sizeof(word_t)];      /* Instructions in the function */
+	uint8_t name_size[sizeof(word_t)];
+});
+
 void vm_init(struct vm *p_vm);
-void vm_alloc_mem(struct vm *p_vm, word_t p_bytes);
 void vm_destroy(struct vm *p_vm);
 
-int  vm_exec_next_inst(struct vm *p_vm);
-void vm_load_from_mem(struct vm *p_vm, struct inst *p_program, word_t p_size, word_t p_ep);
+/* Same as vm_init, for an embedded vm. Nothing has to be destroyed if it fails */
+enum err vm_init_embedded(struct vm *p_vm);
+
+enum err vm_alloc_mem(struct vm *p_vm, word_t p_bytes);
+
+/* Same, with the old memory dropped and the new one zero filled. A sandbox or a
+   large memory gets a fresh mapping, without committing its pages */
+enum err vm_alloc_zeroed_mem(struct vm *p_vm, word_t p_bytes);
+
+/* Replaces the stacks with empty ones of p_capacity values and p_call_capacity
+   entries, up to MAX_STACK_CAPACITY. The old stacks stay if it fails.
+   Where mmap is available the stacks are reserved between guard pages, and
+   their pages only take memory once the program reaches them */
+enum err vm_alloc_stacks(struct vm *p_vm, word_t p_capacity, word_t p_call_capacity);
+
+int      vm_exec_next_inst(struct vm *p_vm);
+enum err vm_load_from_mem(struct vm *p_vm, struct inst *p_program, word_t p_size, word_t p_ep);
 void vm_run(struct vm *p_vm);
 
 void vm_dump(struct vm *p_vm, FILE *p_file);
@@ -265,6 +450,10 @@ void vm_dump_inst(struct vm *p_vm, FILE *p_file);
 
 void vm_panic(struct vm *p_vm, enum err p_err);
 
+/* Fails a load or an allocation with a message. Returns p_err if the vm is
+   embedded, otherwise the message is written to stderr and the process exits */
+enum err vm_fail(struct vm *p_vm, enum err p_err, const char *p_fmt, ...);
+
 void log_colored(FILE *p_file, enum color p_color, const char *p_fmt, ...);
 
 #define VM_ERROR(P_FILE, ...) log_colored(P_FILE, COLOR_BRIGHT_RED,    __VA_ARGS__)
@@ -281,9 +470,6 @@ enum err vm_write16(struct vm *p_vm, uint16_t p_data, word_t p_addr);
 enum err vm_write32(struct vm *p_vm, uint32_t p_data, word_t p_addr);
 enum err vm_write64(struct vm *p_vm, uint64_t p_data, word_t p_addr);
 
-word_t vm_get_free_fd(struct vm *p_vm);
-word_t vm_get_free_ld(struct vm *p_vm);
-word_t vm_get_free_fnd(struct vm *p_vm, word_t p_ld);
 
 bool vm_get_str(struct vm *p_vm, char *p_buf, word_t p_addr, word_t p_size);
 
@@ -0,0 +1,319 @@
+/* mkdir, getpid, fdopen */
+#define _DEFAULT_SOURCE
+
+#include "cache.h"
+
+#ifdef USES_MMAP
+#define CACHE_PATH_SIZE 4096
+#define IMAGE_ALIGN     16
+
+/* Parts of an image, in the order they are written */
+enum {
+	PART_PROGRAM = 0,
+	PART_BOUNDS,
+	PART_OPS,
+	PART_OPERANDS,
+	PART_OPERAND_MAP,
+	PART_CODE,
+
+	PARTS_COUNT,
+};
+
+/* Images are only read by the avm that wrote them, so they are in the native
+   byte order */
+struct image_header {
+	char     magic[4]; /* AVMC */
+	uint8_t  ver[3];
+	uint8_t  verified;
+	uint32_t fuse_rules;
+	uint32_t fused;    /* The code has superinstructions, it is not the ops */
+
+	struct cache_key key;
+	uint64_t         checksum; /* Of the parts, see parts_checksum */
+
+	uint64_t program_size, operands_count;
+	uint64_t offsets[PARTS_COUNT]; /* From the start of the image */
+};
+
+static uint64_t mix(uint64_t p_hash, uint64_t p_word) {
+	p_hash ^= p_word * 0x9E3779B97F4A7C15;
+	return (p_hash << 31 | p_hash >> 33) * 0xC2B2AE3D27D4EB4F;
+}
+
+/* Four independent lanes, so the multiplications of a lane do not wait for
+   the ones of the others */
+void cache_hash(struct cache_key *p_key, const uint8_t *p_file, size_t p_size) {
+	uint64_t lanes[4] = {1, 2, 3, 4};
+
+	size_t i = 0;
+	for (; i + sizeof(lanes) <= p_size; i += sizeof(lanes)) {
+		for (size_t j = 0; j < 4; ++ j) {
+			uint64_t word;
+			memcpy(&word, p_file + i + j * sizeof(word), sizeof(word));
+
+			lanes[j] = mix(lanes[j], word);
+		}
+	}
+
+	uint64_t hash = p_size;
+	for (size_t j = 0; j < 4; ++ j)
+		hash = mix(hash, lanes[j]);
+
+	for (; i < p_size; ++ i)
+		hash = mix(hash, p_file[i]);
+
+	p_key->hash      = hash ^ hash >> 29;
+	p_key->file_size = p_size;
+}
+
+static void part_sizes(struct image_header *p_header, uint64_t *p_sizes) {
+	uint64_t size = p_header->program_size;
+
+	p_sizes[PART_PROGRAM]     = size * sizeof(struct inst);
+	p_sizes[PART_BOUNDS]      = p_header->verified? (size + 1) * sizeof(struct stack_bounds) : 0;
+	p_sizes[PART_OPS]         = size + 1;
+	p_sizes[PART_OPERANDS]    = (p_header->operands_count + 1) * sizeof(value_t);
+	p_sizes[PART_OPERAND_MAP] = (size / OPERAND_MAP_SPAN + 1) * sizeof(struct operand_map);
+	p_sizes[PART_CODE]        = p_header->fused? size + 1 : 0;
+}
+
+/* The image is run without checking the program again, its verifier bounds and
+   operand indices included, so a damaged one must not be used */
+static uint64_t parts_checksum(const uint8_t *const *p_parts, const uint64_t *p_sizes) {
+	uint64_t checksum = PARTS_COUNT;
+	for (size_t i = 0; i < PARTS_COUNT; ++ i) {
+		struct cache_key key;
+		cache_hash(&key, p_parts[i], p_sizes[i]);
+
+		checksum = mix(checksum, key.hash);
+	}
+
+	return checksum;
+}
+
+/* Creates every directory on the path, failures show up when the image is
+   written */
+static void make_dirs(char *p_path) {
+	for (char *ch = p_path + 1; *ch != '\0'; ++ ch) {
+		if (*ch != '/')
+			continue;
+
+		*ch = '\0';
+		mkdir(p_path, 0755);
+		*ch = '/';
+	}
+
+	mkdir(p_path, 0755);
+}
+
+/* Images with other superinstruction rules have their own file, so that runs
+   with different options do not replace each other's image */
+static bool image_path(struct vm *p_vm, char *p_path, size_t p_size, struct cache_key *p_key,
+                       bool p_create) {
+	const char *dir = getenv("AVM_CACHE"), *sub = "";
+	if (dir == NULL || *dir == '\0') {
+		dir = getenv("XDG_CACHE_HOME");
+		sub = "/avm";
+	}
+
+	if (dir == NULL || *dir == '\0') {
+		dir = getenv("HOME");
+		sub = "/.cache/avm";
+	}
+
+	if (dir == NULL || *dir == '\0')
+		return false;
+
+	int len = snprintf(p_path, p_size, "%s%s", dir, sub);
+	if (len < 0 || (size_t)len >= p_size)
+		return false;
+
+	if (p_create)
+		make_dirs(p_path);
+
+	len = snprintf(p_path, p_size, "%s%s/%016llx-%x.avc", dir, sub,
+	               (unsigned long long)p_key->hash, (unsigned)p_vm->fuse_rules);
+	return len >= 0 && (size_t)len < p_size;
+}
+
+/* Images can be truncated or from another avm, everything is checked */
+static bool image_valid(struct vm *p_vm, struct image_header *p_header, size_t p_size,
+                        struct cache_key *p_key) {
+	if (memcmp(p_header->magic, "AVMC", 4) != 0 ||
+	    p_header->ver[0] != VERSION_MAJOR || p_header->ver[1] != VERSION_MINOR ||
+	    p_header->ver[2] != VERSION_PATCH || p_header->fuse_rules != p_vm->fuse_rules ||
+	    p_header->key.hash != p_key->hash || p_header->key.file_size != p_key->file_size)
+		return false;
+
+	/* Keeps the part sizes from overflowing */
+	if (p_header->program_size > p_size || p_header->operands_count > p_size)
+		return false;
+
+	uint64_t sizes[PARTS_COUNT];
+	part_sizes(p_header, sizes);
+
+	for (size_t i = 0; i < PARTS_COUNT; ++ i) {
+		uint64_t offset = p_header->offsets[i];
+		if (offset % IMAGE_ALIGN != 0 || offset > p_size || sizes[i] > p_size - offset)
+			return false;
+	}
+
+	const uint8_t *parts[PARTS_COUNT];
+	for (size_t i = 0; i < PARTS_COUNT; ++ i)
+		parts[i] = (const uint8_t*)p_header + p_header->offsets[i];
+
+	return parts_checksum(parts, sizes) == p_header->checksum;
+}
+
+bool cache_load(struct vm *p_vm, struct cache_key *p_key, word_t p_ep) {
+	char path[CACHE_PATH_SIZE];
+	if (!image_path(p_vm, path, sizeof(path), p_key, false))
+		return false;
+
+	int fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return false;
+
+	/* Images that someone else could have written are not trusted */
+	struct stat st;
+	if (fstat(fd, &st) == -1 || st.st_size < (off_t)sizeof(struct image_header) ||
+	    st.st_uid != geteuid() || (st.st_mode & (S_IWGRP | S_IWOTH)) != 0) {
+		close(fd);
+		return false;
+	}
+
+	size_t   size  = st.st_size;
+	uint8_t *image = (uint8_t*)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if (image == MAP_FAILED)
+		return false;
+
+	struct image_header *header = (struct image_header*)image;
+	if (!image_valid(p_vm, header, size, p_key)) {
+		munmap(image, size);
+		return false;
+	}
+
+	uint64_t *offsets = header->offsets;
+
+	p_vm->program      = (struct inst*)(image + offsets[PART_PROGRAM]);
+	p_vm->program_size = header->program_size;
+	p_vm->ip           = p_ep;
+
+	p_vm->verified = header->verified;
+	p_vm->bounds   = header->verified? (struct stack_bounds*)(image + offsets[PART_BOUNDS]) : NULL;
+
+	p_vm->ops         = image + offsets[PART_OPS];
+	p_vm->operands    = (value_t*)(image + offsets[PART_OPERANDS]);
+	p_vm->operand_map = (struct operand_map*)(image + offsets[PART_OPERAND_MAP]);
+
+#ifdef USES_COMPUTED_GOTO
+	p_vm->code = header->fused? image + offsets[PART_CODE] : p_vm->ops;
+#else
+	p_vm->code = p_vm->ops;
+#endif
+
+	p_vm->image      = image;
+	p_vm->image_size = size;
+
+	return true;
+}
+
+void cache_store(struct vm *p_vm, struct cache_key *p_key) {
+	if (p_vm->program_size < CACHE_MIN_INSTS)
+		return;
+
+	char path[CACHE_PATH_SIZE], tmp[CACHE_PATH_SIZE];
+	if (!image_path(p_vm, path, sizeof(path), p_key, true))
+		return;
+
+	/* Written to a temporary file first, so that runs started at the same time
+	   never map a partial image */
+	int len = snprintf(tmp, sizeof(tmp), "%s.%li.tmp", path, (long)getpid());
+	if (len < 0 || (size_t)len >= sizeof(tmp))
+		return;
+
+	struct image_header header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, "AVMC", 4);
+
+	header.ver[0]         = VERSION_MAJOR;
+	header.ver[1]         = VERSION_MINOR;
+	header.ver[2]         = VERSION_PATCH;
+	header.verified       = p_vm->verified;
+	header.fuse_rules     = p_vm->fuse_rules;
+	header.fused          = p_vm->code != p_vm->ops;
+	header.key            = *p_key;
+	header.program_size   = p_vm->program_size;
+	header.operands_count = vm_operand_index(p_vm, p_vm->program_size);
+
+	const uint8_t *parts[PARTS_COUNT] = {
+		[PART_PROGRAM]     = (const uint8_t*)p_vm->program,
+		[PART_BOUNDS]      = (const uint8_t*)p_vm->bounds,
+		[PART_OPS]         = p_vm->ops,
+		[PART_OPERANDS]    = (const uint8_t*)p_vm->operands,
+		[PART_OPERAND_MAP] = (const uint8_t*)p_vm->operand_map,
+		[PART_CODE]        = p_vm->code,
+	};
+
+	uint64_t sizes[PARTS_COUNT];
+	part_sizes(&header, sizes);
+
+	header.checksum = parts_checksum(parts, sizes);
+
+	uint64_t at = sizeof(header);
+	for (size_t i = 0; i < PARTS_COUNT; ++ i) {
+		at = (at + IMAGE_ALIGN - 1) / IMAGE_ALIGN * IMAGE_ALIGN;
+
+		header.offsets[i] = at;
+		at += sizes[i];
+	}
+
+	/* Not writable by the group even with a umask of 002, or cache_load would
+	   not trust it */
+	int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd == -1)
+		return;
+
+	FILE *file = fdopen(fd, "wb");
+	if (file == NULL) {
+		close(fd);
+		remove(tmp);
+		return;
+	}
+
+	static const uint8_t padding[IMAGE_ALIGN] = {0};
+
+	bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+	at = sizeof(header);
+	for (size_t i = 0; i < PARTS_COUNT && ok; ++ i) {
+		ok = fwrite(padding, 1, header.offsets[i] - at, file) == header.offsets[i] - at &&
+		     (sizes[i] == 0 || fwrite(parts[i], 1, sizes[i], file) == sizes[i]);
+
+		at = header.offsets[i] + sizes[i];
+	}
+
+	if (fclose(file) != 0)
+		ok = false;
+
+	if (!ok || rename(tmp, path) != 0)
+		remove(tmp);
+}
+#else
+void cache_hash(struct cache_key *p_key, const uint8_t *p_file, size_t p_size) {
+	(void)p_file;
+
+	p_key->hash      = 0;
+	p_key->file_size = p_size;
+}
+
+bool cache_load(struct vm *p_vm, struct cache_key *p_key, word_t p_ep) {
+	(void)p_vm; (void)p_key; (void)p_ep;
+	return false;
+}
+
+void cache_store(struct vm *p_vm, struct cache_key *p_key) {
+	(void)p_vm; (void)p_key;
+}
+#endif
@@ -0,0 +1,54 @@
+#ifndef CACHE_H__HEADER_GUARD__
+#define CACHE_H__HEADER_GUARD__
+
+#include <stdint.h>  /* uint8_t, uint32_t, uint64_t */
+#include <stdbool.h> /* bool, true, false */
+#include <stdio.h>   /* FILE, fdopen, fclose, fwrite, snprintf, rename, remove */
+#include <stdlib.h>  /* getenv */
+#include <string.h>  /* memcpy, memcmp, strlen */
+
+#include "avm/vm.h"
+#include "avm/layout.h"
+
+#ifdef USES_MMAP
+#	include <sys/stat.h>  /* fstat, mkdir, struct stat, S_IWGRP, S_IWOTH */
+#	include <sys/types.h> /* pid_t */
+#	include <fcntl.h>     /* open, O_RDONLY, O_WRONLY, O_CREAT, O_TRUNC */
+#	include <unistd.h>    /* close, getpid, geteuid */
+#endif
+
+/* Cache of decoded program images. An image has everything vm_load_from_mem
+ * derives from the program: the decoded instructions, the verifier stack
+ * bounds, the opcode stream, the operands and the superinstruction code. A
+ * cached executable is mapped and run without any of that work.
+ *
+ * Images are keyed by a hash of the whole executable, the avm version and the
+ * superinstruction rules. They are kept in $AVM_CACHE, $XDG_CACHE_HOME/avm or
+ * $HOME/.cache/avm, in that order. Programs shorter than CACHE_MIN_INSTS load
+ * faster than their image would, so they are not cached.
+ *
+ * An image is run without verifying the program again, so it has a checksum of
+ * its parts, and images not owned by the user or writable by others are
+ * ignored.
+ */
+
+#ifndef CACHE_MIN_INSTS
+#	define CACHE_MIN_INSTS 0x1000
+#endif
+
+struct cache_key {
+	uint64_t hash;
+	uint64_t file_size;
+};
+
+/* Hashes the executable */
+void cache_hash(struct cache_key *p_key, const uint8_t *p_file, size_t p_size);
+
+/* Maps the cached image into the vm, see struct vm.image. Returns false if there
+   is none */
+bool cache_load(struct vm *p_vm, struct cache_key *p_key, word_t p_ep);
+
+/* Writes the image of the program loaded in the vm, failures are ignored */
+void cache_store(struct vm *p_vm, struct cache_key *p_key);
+
+#endif
@@ -99,15 +99,17 @@ const char *op_to_str[] = {
 	[OP_HLT] = "HLT",
 };
 
-static void dump_inst(FILE *p_file, struct inst *p_inst) {
-	if (p_inst == NULL) {
+static void dump_inst(struct vm *p_vm, FILE *p_file, word_t p_ip) {
+	if (p_ip >= p_vm->program_size) {
 		VM_NOTE(p_file, "End of program");
 		return;
 	}
 
-	VM_NOTE(p_file, "0x%"FMT_HEX" (%s): 0x%"FMT_HEX" (%f | %lli)", AS_FMT_HEX(p_inst->op),
-	        op_to_str[p_inst->op], AS_FMT_HEX(p_inst->data.i64),
-	        p_inst->data.f64, (long long)p_inst->data.i64);
+	uint8_t op   = p_vm->ops[p_ip];
+	value_t data = vm_operand(p_vm, p_ip);
+
+	VM_NOTE(p_file, "0x%"FMT_HEX" (%s): 0x%"FMT_HEX" (%f | %lli)", AS_FMT_HEX(op),
+	        op_to_str[op], AS_FMT_HEX(data.i64), data.f64, (long long)data.i64);
 }
 
 void vm_debug(struct vm *p_vm) {
@@ -118,7 +120,7 @@ void vm_debug(struct vm *p_vm) {
 	char in[256] = {0};
 #endif
 
-	while (p_vm->ip < p_vm->program_size && !p_vm->halt) {
+	while (p_vm->ip < p_vm->program_size && !VM_HALT(p_vm)) {
 #ifdef USES_READLINE
 		char *in = readline(PROMPT);
 		if (in == NULL) {
@@ -140,8 +142,7 @@ void vm_debug(struct vm *p_vm) {
 		}
 #endif
 
-		char        *cmd  = strtrim(in);
-		struct inst *inst = &p_vm->program[p_vm->ip];
+		char *cmd = strtrim(in);
 
 		if (strcmp(cmd, "halt") == 0)
 			break;
@@ -175,9 +176,9 @@ void vm_debug(struct vm *p_vm) {
 		else if (strcmp(cmd, "at") == 0)
 			vm_dump_at(p_vm, stdout);
 		else if (strcmp(cmd, "inst") == 0)
-			dump_inst(stdout, inst);
+			dump_inst(p_vm, stdout, p_vm->ip);
 		else if (strcmp(cmd, "next") == 0)
-			dump_inst(stdout, p_vm->ip + 1 >= p_vm->program_size? NULL : inst + 1);
+			dump_inst(p_vm, stdout, p_vm->ip + 1);
 		else
 			VM_ERROR(stderr, "Unknown command '%s'", cmd);
 
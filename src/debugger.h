@@ -5,6 +5,7 @@
 #include <stdlib.h>  /* free */
 
 #include "avm/vm.h"
+#include "avm/layout.h"
 
 #ifdef PLATFORM_LINUX
 #	define USES_READLINE
@@ -18,6 +19,8 @@
 #	define PROMPT RL_ESC_SEQ("\x1b[94m")"(help) "RL_ESC_SEQ("\x1b[95m")"> "RL_ESC_SEQ("\x1b[0m")
 #endif
 
+extern const char *op_to_str[0x100];
+
 void vm_debug(struct vm *p_vm);
 
 #endif
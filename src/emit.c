@@ -0,0 +1,350 @@
+#include "emit.h"
+
+/* Instructions that translate to a single runtime macro */
+struct simple {
+	const char *macro, *type, *op;
+	uint8_t     need;
+};
+
+#define SIMPLE(P_MACRO, P_TYPE, P_OP, P_NEED) \
+	{.macro = P_MACRO, .type = P_TYPE, .op = P_OP, .need = P_NEED}
+
+static const struct simple simples[0x100] = {
+	[OP_ADD] = SIMPLE("AOT_BINARY", "u64", "+",  2),
+	[OP_SUB] = SIMPLE("AOT_BINARY", "u64", "-",  2),
+	[OP_MUL] = SIMPLE("AOT_BINARY", "u64", "*",  2),
+	[OP_BAN] = SIMPLE("AOT_BINARY", "u64", "&",  2),
+	[OP_BOR] = SIMPLE("AOT_BINARY", "u64", "|",  2),
+	[OP_BSR] = SIMPLE("AOT_BINARY", "u64", ">>", 2),
+	[OP_BSL] = SIMPLE("AOT_BINARY", "u64", "<<", 2),
+
+	[OP_FAD] = SIMPLE("AOT_BINARY", "f64", "+", 2),
+	[OP_FSB] = SIMPLE("AOT_BINARY", "f64", "-", 2),
+	[OP_FMU] = SIMPLE("AOT_BINARY", "f64", "*", 2),
+	[OP_FDI] = SIMPLE("AOT_BINARY", "f64", "/", 2),
+
+	[OP_AND] = SIMPLE("AOT_COMPARE", "u64", "&&", 2),
+	[OP_ORR] = SIMPLE("AOT_COMPARE", "u64", "||", 2),
+
+	[OP_EQU] = SIMPLE("AOT_COMPARE", "i64", "==", 2),
+	[OP_NEQ] = SIMPLE("AOT_COMPARE", "i64", "!=", 2),
+	[OP_GRT] = SIMPLE("AOT_COMPARE", "i64", ">",  2),
+	[OP_GEQ] = SIMPLE("AOT_COMPARE", "i64", ">=", 2),
+	[OP_LES] = SIMPLE("AOT_COMPARE", "i64", "<",  2),
+	[OP_LEQ] = SIMPLE("AOT_COMPARE", "i64", "<=", 2),
+
+	[OP_UEQ] = SIMPLE("AOT_COMPARE", "u64", "==", 2),
+	[OP_UNE] = SIMPLE("AOT_COMPARE", "u64", "!=", 2),
+	[OP_UGR] = SIMPLE("AOT_COMPARE", "u64", ">",  2),
+	[OP_UGQ] = SIMPLE("AOT_COMPARE", "u64", ">=", 2),
+	[OP_ULE] = SIMPLE("AOT_COMPARE", "u64", "==", 2), /* Same as in handlers.h */
+	[OP_ULQ] = SIMPLE("AOT_COMPARE", "u64", "<=", 2),
+
+	[OP_FEQ] = SIMPLE("AOT_COMPARE", "f64", "==", 2),
+	[OP_FNE] = SIMPLE("AOT_COMPARE", "f64", "!=", 2),
+	[OP_FGR] = SIMPLE("AOT_COMPARE", "f64", ">",  2),
+	[OP_FGQ] = SIMPLE("AOT_COMPARE", "f64", ">=", 2),
+	[OP_FLE] = SIMPLE("AOT_COMPARE", "f64", "<",  2),
+	[OP_FLQ] = SIMPLE("AOT_COMPARE", "f64", "<=", 2),
+};
+
+enum leader {
+	LEADER_NONE  = 0,
+	LEADER_LABEL = 1 << 0, /* Jumped to, needs a label */
+	LEADER_CHECK = 1 << 1, /* Stack bounds have to be checked again */
+};
+
+/* Instructions that control can be transferred to */
+static uint8_t *find_leaders(struct vm *p_vm, bool p_has_ret) {
+	uint8_t *leaders = (uint8_t*)malloc(p_vm->program_size + 1);
+	if (leaders == NULL) {
+		VM_ERROR(stderr, "malloc() fail near "__FILE__":%i", __LINE__);
+		exit(EXIT_FAILURE);
+	}
+
+	memset(leaders, LEADER_NONE, p_vm->program_size + 1);
+	if (p_vm->ip < p_vm->program_size)
+		leaders[p_vm->ip] = LEADER_LABEL | LEADER_CHECK;
+
+	for (word_t i = 0; i < p_vm->program_size; ++ i) {
+		struct inst *inst   = &p_vm->program[i];
+		bool         target = inst->data.u64 < p_vm->program_size;
+
+		switch (inst->op) {
+		case OP_JMP: case OP_JNZ:
+			if (target)
+				leaders[inst->data.u64] = LEADER_LABEL | LEADER_CHECK;
+			break;
+
+		/* Only programs with returns come back to the instruction after a call */
+		case OP_CAL:
+			if (target) {
+				leaders[inst->data.u64] = LEADER_LABEL | LEADER_CHECK;
+				if (p_has_ret)
+					leaders[i + 1] = LEADER_LABEL | LEADER_CHECK;
+			}
+			break;
+
+		/* External functions can do anything to the stack */
+		case OP_CLF: leaders[i + 1] |= LEADER_CHECK; break;
+
+		default: break;
+		}
+	}
+
+	return leaders;
+}
+
+static void emit_memory(struct vm *p_vm, FILE *p_file) {
+	fprintf(p_file, "static const uint8_t memory[%llu] = {",
+	        (long long unsigned)(p_vm->memory_size > 0? p_vm->memory_size : 1));
+
+	for (word_t i = 0; i < p_vm->memory_size; ++ i) {
+		if (i % 16 == 0)
+			fputs("\n\t", p_file);
+
+		fprintf(p_file, "0x%02X,", p_vm->memory[i]);
+	}
+
+	/* Empty initializers are not allowed */
+	if (p_vm->memory_size == 0)
+		fputs("\n\t0x00,", p_file);
+
+	fputs("\n};\n\n", p_file);
+}
+
+/* Still needed by the interpreter for the fallbacks, dumps and external code */
+static void emit_program(struct vm *p_vm, FILE *p_file) {
+	fprintf(p_file, "static struct inst program[%llu] = {\n",
+	        (long long unsigned)(p_vm->program_size > 0? p_vm->program_size : 1));
+
+	for (word_t i = 0; i < p_vm->program_size; ++ i)
+		fprintf(p_file, "\t{0x%02X, {.u64 = 0x%"FMT_HEX"}},\n",
+		        p_vm->program[i].op, AS_FMT_HEX(p_vm->program[i].data.u64));
+
+	if (p_vm->program_size == 0)
+		fputs("\t{0x00, {.u64 = 0}},\n", p_file);
+
+	fputs("};\n\n", p_file);
+}
+
+static void emit_inst(struct vm *p_vm, FILE *p_file, word_t p_ip) {
+	struct inst *inst    = &p_vm->program[p_ip];
+	word_t       data    = inst->data.u64;
+	bool         checked = !p_vm->verified;
+	bool         target  = data < p_vm->program_size;
+
+	long long unsigned ip = p_ip;
+
+	const struct simple *simple = &simples[inst->op];
+	if (simple->macro != NULL) {
+		if (checked)
+			fprintf(p_file, "\tAOT_NEED(%llu, %i);\n", ip, simple->need);
+
+		fprintf(p_file, "\t%s(%s, %s);\n", simple->macro, simple->type, simple->op);
+		return;
+	}
+
+	/* Big operands are left to the checks of the interpreter */
+	switch (inst->op) {
+	case OP_DUP: case OP_SWP:
+		if (data > UINT32_MAX)
+			goto interpret;
+		break;
+
+	default: break;
+	}
+
+	if (checked) {
+		switch (inst->op) {
+		case OP_POP: case OP_INC: case OP_DEC: case OP_FIN: case OP_FDE:
+		case OP_NEG: case OP_NOT: case OP_JNZ: case OP_HLT:
+		case OP_R08: case OP_R16: case OP_R32: case OP_R64:
+			fprintf(p_file, "\tAOT_NEED(%llu, 1);\n", ip);
+			break;
+
+		case OP_DIV: case OP_MOD:
+		case OP_W08: case OP_W16: case OP_W32: case OP_W64:
+			fprintf(p_file, "\tAOT_NEED(%llu, 2);\n", ip);
+			break;
+
+		case OP_DUP: fprintf(p_file, "\tAOT_NEED(%llu, %llu);\n", ip, (long long unsigned)data + 1); break;
+		case OP_SWP: fprintf(p_file, "\tAOT_NEED(%llu, %llu);\n", ip, (long long unsigned)data + 2); break;
+
+		default: break;
+		}
+
+		switch (inst->op) {
+		case OP_PSH: case OP_DUP: case OP_EMP:
+			fprintf(p_file, "\tAOT_ROOM(%llu);\n", ip);
+			break;
+
+		default: break;
+		}
+	}
+
+	switch (inst->op) {
+	case OP_NOP: break;
+
+	case OP_PSH: fprintf(p_file, "\tAOT_PUSH(0x%"FMT_HEX");\n", AS_FMT_HEX(data)); break;
+	case OP_EMP: fputs("\tAOT_PUSH(0);\n", p_file); break;
+	case OP_POP: fputs("\t-- sp;\n", p_file); break;
+
+	case OP_DIV: fprintf(p_file, "\tAOT_DIVISION(%llu, /);\n", ip); break;
+	case OP_MOD: fprintf(p_file, "\tAOT_DIVISION(%llu, %%);\n", ip); break;
+
+	case OP_INC: fputs("\t++ AOT_TOP(0).u64;\n", p_file); break;
+	case OP_DEC: fputs("\t-- AOT_TOP(0).u64;\n", p_file); break;
+	case OP_FIN: fputs("\t++ AOT_TOP(0).f64;\n", p_file); break;
+	case OP_FDE: fputs("\t-- AOT_TOP(0).f64;\n", p_file); break;
+	case OP_NEG: fputs("\tAOT_TOP(0).u64 = -AOT_TOP(0).u64;\n", p_file); break;
+	case OP_NOT: fputs("\tAOT_TOP(0).u64 = !AOT_TOP(0).u64;\n", p_file); break;
+
+	case OP_JMP:
+		if (target)
+			fprintf(p_file, "\tgoto L%llu;\n", (long long unsigned)data);
+		else
+			fprintf(p_file, "\tAOT_FALLBACK(%llu);\n", ip);
+		break;
+
+	case OP_JNZ:
+		if (target)
+			fprintf(p_file, "\tif (stack[-- sp].u64)\n\t\tgoto L%llu;\n", (long long unsigned)data);
+		else
+			fprintf(p_file, "\tif (AOT_TOP(0).u64)\n\t\tAOT_FALLBACK(%llu);\n\n\t-- sp;\n", ip);
+		break;
+
+	case OP_CAL:
+		if (target)
+			fprintf(p_file, "\tAOT_CALL(%llu, %llu, L%llu);\n", ip,
+			        (long long unsigned)vm_operand_index(p_vm, ip + 1), (long long unsigned)data);
+		else
+			fprintf(p_file, "\tAOT_FALLBACK(%llu);\n", ip);
+		break;
+
+	case OP_RET: fprintf(p_file, "\tAOT_RET(%llu);\n", ip); break;
+
+	case OP_DUP: fprintf(p_file, "\tAOT_DUP(%llu);\n",  (long long unsigned)data); break;
+	case OP_SWP: fprintf(p_file, "\tAOT_SWAP(%llu);\n", (long long unsigned)data + 1); break;
+
+	case OP_R08: fprintf(p_file, "\tAOT_READ(%llu, 1);\n", ip); break;
+	case OP_R16: fprintf(p_file, "\tAOT_READ(%llu, 2);\n", ip); break;
+	case OP_R32: fprintf(p_file, "\tAOT_READ(%llu, 4);\n", ip); break;
+	case OP_R64: fprintf(p_file, "\tAOT_READ(%llu, 8);\n", ip); break;
+
+	case OP_W08: fprintf(p_file, "\tAOT_WRITE(%llu, 1);\n", ip); break;
+	case OP_W16: fprintf(p_file, "\tAOT_WRITE(%llu, 2);\n", ip); break;
+	case OP_W32: fprintf(p_file, "\tAOT_WRITE(%llu, 4);\n", ip); break;
+	case OP_W64: fprintf(p_file, "\tAOT_WRITE(%llu, 8);\n", ip); break;
+
+	case OP_HLT: fprintf(p_file, "\tAOT_HALT(%llu);\n", ip); break;
+
+	/* Memory chunks, file IO, shared libraries and debug output */
+	default:
+	interpret:
+		fprintf(p_file, "\tAOT_INTERPRET(%llu);\n", ip);
+	}
+}
+
+static void emit_run(struct vm *p_vm, FILE *p_file) {
+	bool has_ret = false;
+	for (word_t i = 0; i < p_vm->program_size; ++ i) {
+		if (p_vm->program[i].op == OP_RET)
+			has_ret = true;
+	}
+
+	uint8_t *leaders = find_leaders(p_vm, has_ret);
+
+	fputs("static void run(struct vm *p_vm) {\n"
+	      "\tAOT_REGS;\n", p_file);
+	if (has_ret)
+		fputs("\tword_t ret_ip;\n", p_file);
+
+	if (p_vm->ip < p_vm->program_size)
+		fprintf(p_file, "\n\tgoto L%llu;\n\n", (long long unsigned)p_vm->ip);
+	else
+		fprintf(p_file, "\n\tAOT_END(%llu);\n\n", (long long unsigned)p_vm->ip);
+
+	for (word_t i = 0; i < p_vm->program_size; ++ i) {
+		long long unsigned ip = i;
+
+		if (leaders[i] & LEADER_LABEL)
+			fprintf(p_file, "L%llu:\n", ip);
+
+		/* Verified programs are only checked where control is transferred to */
+		if (p_vm->verified && leaders[i] & LEADER_CHECK) {
+			if (p_vm->bounds[i].need > 0)
+				fprintf(p_file, "\tAOT_NEED(%llu, %lu);\n", ip, (long unsigned)p_vm->bounds[i].need);
+
+			if (p_vm->bounds[i].grow > 0)
+				fprintf(p_file, "\tAOT_GROW(%llu, %lu);\n", ip, (long unsigned)p_vm->bounds[i].grow);
+		}
+
+		const char *name = op_to_str[p_vm->program[i].op];
+		fprintf(p_file, "\t/* %llu: %s 0x%"FMT_HEX" */\n", ip, name == NULL? "???" : name,
+		        AS_FMT_HEX(p_vm->program[i].data.u64));
+
+		emit_inst(p_vm, p_file, i);
+	}
+
+	long long unsigned size = p_vm->program_size;
+	if (leaders[p_vm->program_size] & LEADER_LABEL)
+		fprintf(p_file, "L%llu:\n", size);
+
+	fprintf(p_file, "\tAOT_END(%llu);\n", size);
+
+	if (!has_ret) {
+		fputs("}\n\n", p_file);
+
+		free(leaders);
+		return;
+	}
+
+	/* Returns can only go back to the instruction after a call */
+	fputs("\nret:\n\tswitch (ret_ip) {\n", p_file);
+	for (word_t i = 0; i < p_vm->program_size; ++ i) {
+		struct inst *inst = &p_vm->program[i];
+		if (inst->op == OP_CAL && inst->data.u64 < p_vm->program_size)
+			fprintf(p_file, "\tcase %llu: goto L%llu;\n",
+			        (long long unsigned)i + 1, (long long unsigned)i + 1);
+	}
+
+	fputs("\tdefault: p_vm->ip = ret_ip; p_vm->sp = sp; vm_run(p_vm);\n"
+	      "\t}\n"
+	      "}\n\n", p_file);
+
+	free(leaders);
+}
+
+bool vm_emit_c(struct vm *p_vm, const char *p_source, const char *p_path) {
+	FILE *file = fopen(p_path, "w");
+	if (file == NULL)
+		return false;
+
+	fprintf(file, "/* Generated by "APP_NAME" %i.%i.%i from '%s', do not edit */\n\n"
+	              "#include \"avm/aot.h\"\n\n",
+	        VERSION_MAJOR, VERSION_MINOR, VERSION_PATCH, p_source);
+
+	emit_memory(p_vm, file);
+	emit_program(p_vm, file);
+	emit_run(p_vm, file);
+
+	fprintf(file, "int main(void) {\n"
+	              "\tstruct vm vm;\n"
+	              "\tvm_init(&vm);\n"
+	              "\tvm_alloc_stacks(&vm, %lluu, %lluu);\n\n"
+	              "\taot_load(&vm, memory, %lluu, program, %lluu, %lluu);\n"
+	              "\tvm.little_endian = %s;\n"
+	              "\trun(&vm);\n\n"
+	              "\tvm_destroy(&vm);\n\n"
+	              "\treturn vm.ex;\n"
+	              "}\n",
+	        (long long unsigned)p_vm->stack_capacity, (long long unsigned)p_vm->call_stack_capacity,
+	        (long long unsigned)p_vm->memory_size, (long long unsigned)p_vm->program_size,
+	        (long long unsigned)p_vm->ip, p_vm->little_endian? "true" : "false");
+
+	bool ok = !ferror(file);
+	fclose(file);
+
+	return ok;
+}
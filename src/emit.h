@@ -0,0 +1,18 @@
+#ifndef EMIT_H__HEADER_GUARD__
+#define EMIT_H__HEADER_GUARD__
+
+#include <stdio.h>   /* FILE, fopen, fclose, fprintf, fputs */
+#include <stdbool.h> /* bool, true, false */
+#include <stdlib.h>  /* malloc, free, exit, EXIT_FAILURE */
+#include <string.h>  /* memset */
+
+#include "avm/vm.h"
+#include "debugger.h"
+
+/* Translates the program loaded in the vm to C, with a label for every jump
+   target and the memory segment as a static array. The output includes
+   "avm/aot.h" and has to be compiled with -Isrc and linked with the vm sources
+   (the .c files in src/avm) and -ldl. p_source is only used in a comment */
+bool vm_emit_c(struct vm *p_vm, const char *p_source, const char *p_path);
+
+#endif
@@ -0,0 +1,101 @@
+/* fmemopen */
+#define _POSIX_C_SOURCE 200809L
+
+#include "libavm.h"
+
+static void clear_error(struct vm *p_vm) {
+	p_vm->error.err    = ERR_OK;
+	p_vm->error.ip     = 0;
+	p_vm->error.msg[0] = '\0';
+}
+
+/* The program of a vm loaded without the cache is always allocated. The files
+   and libraries the previous program opened stay open */
+static void reset(struct vm *p_vm) {
+	free(p_vm->program);
+
+	p_vm->program      = NULL;
+	p_vm->program_size = 0;
+
+	p_vm->sp   = 0;
+	p_vm->cs   = 0;
+	p_vm->ex   = 0;
+	VM_SET_HALT(p_vm, HALT_NONE);
+
+	clear_error(p_vm);
+}
+
+enum err libavm_init(struct vm *p_vm) {
+	return vm_init_embedded(p_vm);
+}
+
+void libavm_destroy(struct vm *p_vm) {
+	free(p_vm->program);
+	vm_destroy(p_vm);
+}
+
+enum err libavm_load_file(struct vm *p_vm, const char *p_path) {
+	reset(p_vm);
+
+	struct inst *program;
+	return vm_load_file(p_vm, p_path, false, false, &program);
+}
+
+enum err libavm_load_mem(struct vm *p_vm, const uint8_t *p_bytes, size_t p_size) {
+	reset(p_vm);
+
+#ifdef USES_FMEMOPEN
+	FILE *file = fmemopen((void*)p_bytes, p_size, "rb");
+	if (file == NULL)
+		return vm_fail(p_vm, ERR_OUT_OF_MEMORY, "fmemopen() fail near "__FILE__":%i", __LINE__);
+
+	struct inst *program;
+	enum err     err = vm_load_stream(p_vm, file, "<memory>", false, &program);
+
+	fclose(file);
+	return err;
+#else
+	(void)p_bytes; (void)p_size;
+	return vm_fail(p_vm, ERR_CANNOT_READ, "Loading from memory is not supported on this platform");
+#endif
+}
+
+enum err libavm_load_builder(struct vm *p_vm, const struct builder *p_builder) {
+	reset(p_vm);
+
+	if (p_builder->err != ERR_OK)
+		return vm_fail(p_vm, p_builder->err, "The program could not be built: %s",
+		               err_str(p_builder->err));
+
+	/* Copied, so that the vm owns its program like after the other loads */
+	word_t       size    = p_builder->size;
+	struct inst *program = (struct inst*)malloc(sizeof(struct inst) * (size > 0? size : 1));
+	if (program == NULL)
+		return vm_fail(p_vm, ERR_OUT_OF_MEMORY, "malloc() fail near "__FILE__":%i", __LINE__);
+
+	memcpy(program, p_builder->program, sizeof(struct inst) * size);
+
+	enum err err = builder_load_program(p_builder, p_vm, program);
+	if (err != ERR_OK) {
+		free(program);
+		p_vm->program      = NULL;
+		p_vm->program_size = 0;
+	}
+
+	return err;
+}
+
+enum err libavm_run(struct vm *p_vm) {
+	/* A panicked program can not go on */
+	if (VM_HALT(p_vm) == HALT_PANIC)
+		return p_vm->error.err;
+
+	clear_error(p_vm);
+	vm_run(p_vm);
+
+	return p_vm->error.err;
+}
+
+const struct vm_error *libavm_error(struct vm *p_vm) {
+	return &p_vm->error;
+}
@@ -0,0 +1,61 @@
+#ifndef LIBAVM_H__HEADER_GUARD__
+#define LIBAVM_H__HEADER_GUARD__
+
+#include <stdint.h> /* uint8_t */
+#include <stddef.h> /* size_t */
+#include <stdio.h>  /* FILE, fmemopen, fclose */
+#include <stdlib.h> /* malloc, free */
+#include <string.h> /* memcpy */
+
+#include "avm/vm.h"
+#include "avm/builder.h"
+#include "loader.h"
+
+#if defined(PLATFORM_LINUX) || defined(PLATFORM_UNIX) || defined(PLATFORM_APPLE)
+#	define USES_FMEMOPEN
+#endif
+
+/* Embedding API, built into bin/libavm.a and bin/libavm.so by `make lib`.
+ *
+ * The vms it creates are embedded (see struct vm.embedded): nothing is written
+ * to stderr and nothing exits the process. Loads and runs return an enum err,
+ * and the details (the message, the instruction of a panic) are kept in the vm
+ * until the next call. A vm holds all of its state, so different vms can be
+ * used at the same time from different threads. One vm is not thread safe.
+ *
+ * The programs still share the process: their files 0, 1 and 2 are its stdin,
+ * stdout and stderr, and the external functions they load run unchecked.
+ *
+ *   struct vm vm;
+ *   if (libavm_init(&vm) != ERR_OK)
+ *       return;
+ *
+ *   if (libavm_load_file(&vm, "program.avm") == ERR_OK && libavm_run(&vm) == ERR_OK)
+ *       printf("exited with %llu\n", (long long unsigned)vm.ex);
+ *   else
+ *       printf("error: %s\n", libavm_error(&vm)->msg);
+ *
+ *   libavm_destroy(&vm);
+ */
+
+/* Nothing has to be destroyed if it fails */
+enum err libavm_init(struct vm *p_vm);
+void     libavm_destroy(struct vm *p_vm);
+
+/* Loads an executable, replacing the program of the vm. Programs are not
+   cached (see cache.h) and there are no version warnings */
+enum err libavm_load_file(struct vm *p_vm, const char *p_path);
+enum err libavm_load_mem(struct vm *p_vm, const uint8_t *p_bytes, size_t p_size);
+
+/* Loads a copy of the program and the memory of a builder (see avm/builder.h),
+   the builder can be freed or reused right after */
+enum err libavm_load_builder(struct vm *p_vm, const struct builder *p_builder);
+
+/* Runs the program on the fast interpreter until it ends, halts or panics.
+   Returns the panic error, or ERR_OK with the exit code in p_vm->ex */
+enum err libavm_run(struct vm *p_vm);
+
+/* Error of the last failed call */
+const struct vm_error *libavm_error(struct vm *p_vm);
+
+#endif
@@ -1,6 +1,10 @@
+/* madvise */
+#define _DEFAULT_SOURCE
+
 #include "loader.h"
 
-static word_t bytes_to_word(uint8_t *p_bytes) {
+/* GCC and Clang turn this into a load and a bswap */
+static word_t bytes_to_word(const uint8_t *p_bytes) {
 	return (word_t)p_bytes[0] << 070 |
 	       (word_t)p_bytes[1] << 060 |
 	       (word_t)p_bytes[2] << 050 |
@@ -11,85 +15,735 @@ static word_t bytes_to_word(uint8_t *p_bytes) {
 	       (word_t)p_bytes[7];
 }
 
-void vm_exec_from_file(struct vm *p_vm, const char *p_path, bool p_warnings, bool p_debug) {
-	FILE *file = fopen(p_path, "rb");
-	if (file == NULL) {
-		VM_ERROR(stderr, "Failed to open file '%s': %s", p_path, strerror(errno));
-		exit(EXIT_FAILURE);
+static void check_version(const uint8_t *p_ver, const char *p_path, bool p_warnings) {
+	if (p_ver[0] != VERSION_MAJOR && p_warnings)
+		VM_WARN(stderr, "'%s' major version is %i, your avm major version is %i",
+		        p_path, p_ver[0], VERSION_MAJOR);
+	else if (p_ver[1] > VERSION_MINOR && p_warnings)
+		VM_WARN(stderr, "'%s' minor version is %i, greater than your avm minor version which is %i",
+		        p_path, p_ver[1], VERSION_MINOR);
+
+	// Ignore the patch version
+}
+
+static enum err check_meta(struct vm *p_vm, struct file_meta *p_meta, const char *p_path,
+                           bool p_warnings) {
+	assert(sizeof(p_meta->magic) == 3);
+	if (strncmp(p_meta->magic, "AVM", 3) != 0)
+		return vm_fail(p_vm, ERR_INVALID_EXECUTABLE, "'%s' is not an executable AVM binary", p_path);
+
+	check_version(p_meta->ver, p_path, p_warnings);
+	return ERR_OK;
+}
+
+/* p_bytes holds p_size instructions in the file format */
+static enum err decode_program(struct vm *p_vm, const uint8_t *p_bytes, word_t p_size,
+                               struct inst **p_program) {
+	struct inst *program = (struct inst*)malloc(sizeof(struct inst) * p_size);
+	if (program == NULL)
+		return vm_fail(p_vm, ERR_OUT_OF_MEMORY, "malloc() fail");
+
+	for (word_t i = 0; i < p_size; ++ i) {
+		const uint8_t *inst = p_bytes + i * sizeof(struct inst);
+
+		program[i].op       = (enum opcode)inst[0];
+		program[i].data.u64 = bytes_to_word(inst + 1);
 	}
 
-	/* skip the shebang */
-	char ch = fgetc(file);
-	if (ch == '#')
-		while (fgetc(file) != '\n');
-	else
-		ungetc(ch, file);
+	*p_program = program;
+	return ERR_OK;
+}
 
-	struct file_meta meta;
-	size_t ret = fread(&meta, sizeof(meta), 1, file);
-	if (ret < 1) {
-		VM_ERROR(stderr, "Error while reading '%s' metadata: %s", p_path, strerror(errno));
-		exit(EXIT_FAILURE);
+/* Loads the decoded program into the vm, freeing it if that fails */
+static enum err load_program(struct vm *p_vm, struct inst *p_program, word_t p_size, word_t p_ep,
+                             struct inst **p_loaded) {
+	enum err err = vm_load_from_mem(p_vm, p_program, p_size, p_ep);
+	if (err != ERR_OK) {
+		free(p_program);
+		p_vm->program      = NULL;
+		p_vm->program_size = 0;
+
+		return err;
 	}
 
-	assert(sizeof(meta.magic) == 3);
-	if (strncmp(meta.magic, "AVM", 3) != 0) {
-		VM_ERROR(stderr, "'%s' is not an executable AVM binary", p_path);
-		exit(EXIT_FAILURE);
+	*p_loaded = p_program;
+	return ERR_OK;
+}
+
+struct sections {
+	word_t code_offset, code_size; /* code_size is in instructions */
+	word_t data_offset, data_size;
+	word_t bss_size;
+	word_t symbols_offset, symbols_size;
+	word_t stack_size, call_stack_size; /* 0 for the default */
+	word_t flags;                       /* enum file_flag */
+};
+
+static enum err read_section(struct vm *p_vm, struct sections *p_sections,
+                             struct file_section *p_section, const char *p_path) {
+	word_t offset = bytes_to_word(p_section->offset);
+	word_t size   = bytes_to_word(p_section->size);
+
+	switch (bytes_to_word(p_section->type)) {
+	case SECTION_CODE:
+		if (size % sizeof(struct inst) != 0)
+			return vm_fail(p_vm, ERR_INVALID_EXECUTABLE,
+			               "'%s' incompatible instruction format in the code section", p_path);
+
+		p_sections->code_offset = offset;
+		p_sections->code_size   = size / sizeof(struct inst);
+		break;
+
+	case SECTION_DATA:
+		p_sections->data_offset = offset;
+		p_sections->data_size   = size;
+		break;
+
+	case SECTION_BSS: p_sections->bss_size = size; break;
+
+	case SECTION_SYMBOLS:
+		p_sections->symbols_offset = offset;
+		p_sections->symbols_size   = size;
+		break;
+
+	case SECTION_STACK:      p_sections->stack_size      = size; break;
+	case SECTION_CALL_STACK: p_sections->call_stack_size = size; break;
+	case SECTION_FLAGS:      p_sections->flags           = size; break;
+
+	default: break; /* From a newer version */
 	}
 
-	if (meta.ver[0] != VERSION_MAJOR && p_warnings)
-		VM_WARN(stderr, "'%s' major version is %i, your avm major version is %i",
-		        p_path, meta.ver[0], VERSION_MAJOR);
-	else if (meta.ver[1] > VERSION_MINOR && p_warnings)
-		VM_WARN(stderr, "'%s' minor version is %i, greater than your avm minor version which is %i",
-		        p_path, meta.ver[1], VERSION_MINOR);
+	return ERR_OK;
+}
 
-	// Ignore the patch version
+static enum err load_symbols(struct vm *p_vm, const uint8_t *p_bytes, word_t p_size,
+                             const char *p_path) {
+	enum err err = vm_load_symbols(p_vm, p_bytes, p_size);
+	if (err == ERR_INVALID_EXECUTABLE)
+		return vm_fail(p_vm, err, "'%s' invalid symbol section", p_path);
+
+	return err;
+}
+
+static enum err sections_memory_size(struct vm *p_vm, struct sections *p_sections,
+                                     const char *p_path, word_t *p_size) {
+	if (p_sections->bss_size > (word_t)-1 - p_sections->data_size)
+		return vm_fail(p_vm, ERR_INVALID_EXECUTABLE, "'%s' memory segment is too big", p_path);
+
+	*p_size = p_sections->data_size + p_sections->bss_size;
+	return ERR_OK;
+}
+
+static enum err sections_stacks(struct vm *p_vm, struct sections *p_sections,
+                                const char *p_path) {
+	if (p_sections->stack_size == 0 && p_sections->call_stack_size == 0)
+		return ERR_OK;
+
+	word_t capacity      = p_sections->stack_size / sizeof(value_t);
+	word_t call_capacity = p_sections->call_stack_size / sizeof(word_t);
+	if (capacity > MAX_STACK_CAPACITY || call_capacity > MAX_STACK_CAPACITY ||
+	    (p_sections->stack_size > 0 && capacity == 0) ||
+	    (p_sections->call_stack_size > 0 && call_capacity == 0))
+		return vm_fail(p_vm, ERR_INVALID_EXECUTABLE, "'%s' invalid stack size", p_path);
+
+	return vm_alloc_stacks(p_vm, capacity > 0? capacity : p_vm->stack_capacity,
+	                       call_capacity > 0? call_capacity : p_vm->call_stack_capacity);
+}
+
+/* A flag from a newer version could change what the program means */
+static enum err sections_flags(struct vm *p_vm, struct sections *p_sections,
+                               const char *p_path) {
+	if (p_sections->flags & ~(word_t)FILE_FLAGS_KNOWN)
+		return vm_fail(p_vm, ERR_INVALID_EXECUTABLE, "'%s' unsupported flags 0x%llx", p_path,
+		               (long long unsigned)(p_sections->flags & ~(word_t)FILE_FLAGS_KNOWN));
+
+	p_vm->little_endian = p_sections->flags & FILE_FLAG_LITTLE_ENDIAN;
+	return ERR_OK;
+}
+
+#ifdef USES_MMAP
+struct region {
+	word_t      offset, size;
+	const char *name;
+};
+
+static int by_region_offset(const void *p_a, const void *p_b) {
+	const struct region *a = (const struct region*)p_a, *b = (const struct region*)p_b;
+	return a->offset < b->offset? -1 : a->offset > b->offset;
+}
+
+/* Same rule as the stream reads, a section starts after the section table and
+   after the end of the previous one. The sections are in the file already */
+static enum err check_overlaps(struct vm *p_vm, struct sections *p_sections, word_t p_at,
+                               const char *p_path) {
+	struct region regions[] = {
+		{p_sections->code_offset,    p_sections->code_size * sizeof(struct inst), "code"},
+		{p_sections->data_offset,    p_sections->data_size,                       "data"},
+		{p_sections->symbols_offset, p_sections->symbols_size,                    "symbols"},
+	};
+
+	qsort(regions, sizeof(regions) / sizeof(regions[0]), sizeof(regions[0]), by_region_offset);
+	for (size_t i = 0; i < sizeof(regions) / sizeof(regions[0]); ++ i) {
+		if (regions[i].size == 0)
+			continue;
+
+		if (regions[i].offset < p_at)
+			return vm_fail(p_vm, ERR_INVALID_EXECUTABLE,
+			               "'%s' %s section overlaps the previous data", p_path, regions[i].name);
+
+		p_at = regions[i].offset + regions[i].size;
+	}
+
+	return ERR_OK;
+}
+
+static bool in_file(word_t p_offset, word_t p_size, size_t p_file_size) {
+	return p_offset <= p_file_size && p_size <= p_file_size - p_offset;
+}
+
+/* Drops the whole pages of a part of a file mapping that was read */
+static void drop_pages(const uint8_t *p_start, size_t p_size) {
+	uintptr_t page  = sysconf(_SC_PAGESIZE);
+	uintptr_t start = ((uintptr_t)p_start + page - 1) / page * page;
+	uintptr_t end   = ((uintptr_t)p_start + p_size) / page * page;
+
+	if (start < end)
+		madvise((void*)start, end - start, MADV_DONTNEED);
+}
+
+/* Key of the executable if its program is worth caching, NULL otherwise */
+static struct cache_key *program_key(struct cache_key *p_key, const uint8_t *p_file,
+                                     size_t p_size, word_t p_program_size, bool p_cache) {
+	if (!p_cache || p_program_size < CACHE_MIN_INSTS)
+		return NULL;
+
+	cache_hash(p_key, p_file, p_size);
+	return p_key;
+}
+
+/* Decodes the program at p_bytes in the file mapping and loads it, or maps its
+   cached image if p_key is not NULL. The program is NULL if it is in the image */
+static enum err load_mapped_program(struct vm *p_vm, const uint8_t *p_bytes, word_t p_size,
+                                    word_t p_ep, struct cache_key *p_key,
+                                    struct inst **p_program) {
+	*p_program = NULL;
+	if (p_key != NULL && cache_load(p_vm, p_key, p_ep))
+		return ERR_OK;
+
+	struct inst *program = NULL;
+	enum err     err     = decode_program(p_vm, p_bytes, p_size, &program);
+
+	/* The encoded program is not needed anymore */
+	drop_pages(p_bytes, p_size * sizeof(struct inst));
+
+	if (err == ERR_OK)
+		err = load_program(p_vm, program, p_size, p_ep, p_program);
+
+	if (err == ERR_OK && p_key != NULL)
+		cache_store(p_vm, p_key);
+
+	return err;
+}
+
+/* Replaces the vm memory with a mapped one */
+static void set_mapped_memory(struct vm *p_vm, uint8_t *p_memory, word_t p_size,
+                              void *p_mapping, size_t p_mapping_size) {
+	if (p_vm->mapping != NULL)
+		munmap(p_vm->mapping, p_vm->mapping_size);
+	else if (p_vm->memory != NULL)
+		free(p_vm->memory);
+
+	p_vm->memory       = p_memory;
+	p_vm->memory_size  = p_size;
+	p_vm->mapping      = p_mapping;
+	p_vm->mapping_size = p_mapping_size;
+	p_vm->sandbox      = false;
+	p_vm->large        = NULL;
+}
+
+/* The memory segment is used in place, in the mapping of the whole file. The
+   vm owns the mapping once the memory segment is found */
+static enum err load_flat_mapped(struct vm *p_vm, uint8_t *p_bytes, size_t p_size, size_t p_at,
+                                 const char *p_path, bool p_warnings, bool p_cache,
+                                 struct inst **p_program) {
+	struct file_meta meta;
+	if (p_size - p_at < sizeof(meta))
+		return vm_fail(p_vm, ERR_INVALID_EXECUTABLE, "'%s' unexpected EOF during metadata", p_path);
+
+	memcpy(&meta, p_bytes + p_at, sizeof(meta));
+	p_at += sizeof(meta);
+
+	enum err err = check_meta(p_vm, &meta, p_path, p_warnings);
+	if (err != ERR_OK)
+		return err;
 
 	word_t program_size = bytes_to_word(meta.program_size);
 	word_t memory_size  = bytes_to_word(meta.memory_size);
 	word_t entry_point  = bytes_to_word(meta.entry_point);
 
-	vm_alloc_mem(p_vm, memory_size);
+	/* Both sizes are checked before anything is read */
+	if (memory_size > p_size - p_at)
+		return vm_fail(p_vm, ERR_INVALID_EXECUTABLE,
+		               "'%s' unexpected EOF during memory segment", p_path);
 
-	for (word_t i = 0; i < memory_size; ++ i) {
-		int byte = fgetc(file);
-		if (byte == EOF) {
-			VM_ERROR(stderr, "'%s' unexpected EOF during memory segment", p_path);
-			exit(EXIT_FAILURE);
-		}
+	word_t insts = (p_size - p_at - memory_size) / sizeof(struct inst);
+	if (program_size > insts)
+		return vm_fail(p_vm, ERR_INVALID_EXECUTABLE,
+		               "'%s' incompatible instruction format at instruction %zu",
+		               p_path, (size_t)insts + 1);
+
+	/* Flat executables have no flags */
+	p_vm->little_endian = false;
+	set_mapped_memory(p_vm, p_bytes + p_at, memory_size, p_bytes, p_size);
+
+	struct cache_key key;
+	return load_mapped_program(p_vm, p_bytes + p_at + memory_size, program_size, entry_point,
+	                           program_key(&key, p_bytes, p_size, program_size, p_cache),
+	                           p_program);
+}
+
+/* The memory is an anonymous mapping, so the bss pages cost nothing until they
+   are written. An aligned data section is mapped over its start */
+static enum err load_sectioned_mapped(struct vm *p_vm, int p_fd, uint8_t *p_bytes, size_t p_size,
+                                      size_t p_at, const char *p_path, bool p_warnings,
+                                      bool p_cache, struct inst **p_program) {
+	struct file_header header;
+	if (p_size - p_at < sizeof(header))
+		return vm_fail(p_vm, ERR_INVALID_EXECUTABLE, "'%s' unexpected EOF during header", p_path);
+
+	memcpy(&header, p_bytes + p_at, sizeof(header));
+	p_at += sizeof(header);
+
+	check_version(header.ver, p_path, p_warnings);
+
+	word_t count = bytes_to_word(header.section_count);
+	if (count > (p_size - p_at) / sizeof(struct file_section))
+		return vm_fail(p_vm, ERR_INVALID_EXECUTABLE,
+		               "'%s' unexpected EOF during section table", p_path);
+
+	enum err        err;
+	struct sections sections = {0};
+	for (word_t i = 0; i < count; ++ i) {
+		struct file_section section;
+		memcpy(&section, p_bytes + p_at + i * sizeof(section), sizeof(section));
+
+		if ((err = read_section(p_vm, &sections, &section, p_path)) != ERR_OK)
+			return err;
+	}
+
+	if (!in_file(sections.code_offset, sections.code_size * sizeof(struct inst), p_size))
+		return vm_fail(p_vm, ERR_INVALID_EXECUTABLE,
+		               "'%s' unexpected EOF during code section", p_path);
+
+	if (!in_file(sections.data_offset, sections.data_size, p_size))
+		return vm_fail(p_vm, ERR_INVALID_EXECUTABLE,
+		               "'%s' unexpected EOF during data section", p_path);
+
+	if (!in_file(sections.symbols_offset, sections.symbols_size, p_size))
+		return vm_fail(p_vm, ERR_INVALID_EXECUTABLE,
+		               "'%s' unexpected EOF during symbols section", p_path);
+
+	err = check_overlaps(p_vm, &sections, p_at + count * sizeof(struct file_section), p_path);
+	if (err != ERR_OK)
+		return err;
+
+	if (sections.symbols_size > 0) {
+		err = load_symbols(p_vm, p_bytes + sections.symbols_offset, sections.symbols_size, p_path);
+		if (err != ERR_OK)
+			return err;
+	}
+
+	if ((err = sections_flags(p_vm, &sections, p_path)) != ERR_OK)
+		return err;
+
+	if ((err = sections_stacks(p_vm, &sections, p_path)) != ERR_OK)
+		return err;
+
+	word_t memory_size = 0;
+	if ((err = sections_memory_size(p_vm, &sections, p_path, &memory_size)) != ERR_OK)
+		return err;
+
+	size_t   page         = sysconf(_SC_PAGESIZE);
+	size_t   mapping_size = (memory_size + page - 1) / page * page;
+	uint8_t *memory       = NULL;
+	if (memory_size > 0) {
+		memory = (uint8_t*)mmap(NULL, mapping_size, PROT_READ | PROT_WRITE,
+		                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (memory == MAP_FAILED)
+			return vm_fail(p_vm, ERR_OUT_OF_MEMORY, "mmap() fail near "__FILE__":%i", __LINE__);
 
-		p_vm->memory[i] = byte;
+		word_t data_size = sections.data_size;
+		if (data_size > 0 && sections.data_offset % page == 0) {
+			if (mmap(memory, data_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED,
+			         p_fd, sections.data_offset) == MAP_FAILED) {
+				munmap(memory, mapping_size);
+				return vm_fail(p_vm, ERR_OUT_OF_MEMORY, "mmap() fail near "__FILE__":%i", __LINE__);
+			}
+
+			/* The rest of the last data page has the following bytes of the file */
+			size_t end = (data_size + page - 1) / page * page;
+			if (end > data_size)
+				memset(memory + data_size, 0, end - data_size);
+		} else
+			memcpy(memory, p_bytes + sections.data_offset, data_size);
+	}
+
+	set_mapped_memory(p_vm, memory, memory_size, memory, mapping_size);
+
+	struct cache_key key;
+	return load_mapped_program(p_vm, p_bytes + sections.code_offset, sections.code_size,
+	                           bytes_to_word(header.entry_point),
+	                           program_key(&key, p_bytes, p_size, sections.code_size, p_cache),
+	                           p_program);
+}
+
+/* Returns false if the file can not be mapped */
+static bool load_mapped(struct vm *p_vm, const char *p_path, bool p_warnings, bool p_cache,
+                        struct inst **p_program, enum err *p_err) {
+	int fd = open(p_path, O_RDONLY);
+	if (fd == -1)
+		return false;
+
+	struct stat st;
+	if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || st.st_size <= 0) {
+		close(fd);
+		return false;
 	}
 
-	struct inst *program = (struct inst*)malloc(sizeof(struct inst) * program_size);
-	if (program == NULL) {
-		VM_ERROR(stderr, "malloc() fail");
-		exit(EXIT_FAILURE);
+	size_t   size  = st.st_size;
+	uint8_t *bytes = (uint8_t*)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	if (bytes == MAP_FAILED) {
+		close(fd);
+		return false;
 	}
 
-	for (word_t i = 0; i < program_size; ++ i) {
-		uint8_t inst[sizeof(struct inst)];
+	/* skip the shebang */
+	size_t at = 0;
+	if (bytes[0] == '#') {
+		uint8_t *end = (uint8_t*)memchr(bytes, '\n', size);
+		at = end == NULL? size : (size_t)(end - bytes) + 1;
+	}
+
+	if (size - at >= 3 && memcmp(bytes + at, "AVS", 3) == 0) {
+		*p_err = load_sectioned_mapped(p_vm, fd, bytes, size, at, p_path, p_warnings, p_cache,
+		                               p_program);
+
+		/* Everything was read from the file mapping */
+		munmap(bytes, size);
+	} else {
+		*p_err = load_flat_mapped(p_vm, bytes, size, at, p_path, p_warnings, p_cache, p_program);
+
+		/* Unless it became the memory mapping */
+		if (p_vm->mapping != bytes)
+			munmap(bytes, size);
+	}
 
-		ret = fread(&inst, sizeof(inst), 1, file);
-		if (ret < 1) {
-			VM_ERROR(stderr, "'%s' incompatible instruction format at instruction %zu",
-			         p_path, i + 1);
-			exit(EXIT_FAILURE);
+	close(fd);
+	return true;
+}
+#endif
+
+/* A short read is a truncated executable, unless the stream failed */
+static enum err read_fail(struct vm *p_vm, FILE *p_file, const char *p_path, const char *p_what) {
+	if (ferror(p_file))
+		return vm_fail(p_vm, ERR_CANNOT_READ, "Error while reading '%s' %s: %s",
+		               p_path, p_what, strerror(errno));
+
+	return vm_fail(p_vm, ERR_INVALID_EXECUTABLE, "'%s' unexpected EOF during %s", p_path, p_what);
+}
+
+/* The buffers of the stream reads start at this size and double, up to the
+   size the header gives */
+#define STREAM_CHUNK 0x10000
+
+/* Reads up to p_size bytes into a buffer that grows with what was read, so that
+   a size from a corrupted header runs into the end of the stream instead of
+   being allocated. *p_read is less than p_size at the end of the stream. The
+   caller frees *p_bytes, also when it fails */
+static enum err read_stream_bytes(struct vm *p_vm, FILE *p_file, word_t p_size,
+                                  uint8_t **p_bytes, word_t *p_read) {
+	uint8_t *bytes    = NULL;
+	word_t   capacity = 0, read = 0;
+
+	*p_bytes = NULL;
+	*p_read  = 0;
+	while (read < p_size) {
+		if (read == capacity) {
+			word_t grow = capacity > 0? capacity : STREAM_CHUNK;
+			capacity = grow < p_size - capacity? capacity + grow : p_size;
+			if (capacity > (size_t)-1)
+				return vm_fail(p_vm, ERR_OUT_OF_MEMORY, "malloc() fail");
+
+			uint8_t *grown = (uint8_t*)realloc(bytes, capacity);
+			if (grown == NULL)
+				return vm_fail(p_vm, ERR_OUT_OF_MEMORY, "malloc() fail");
+
+			*p_bytes = bytes = grown;
 		}
 
-		program[i].op       = (enum opcode)inst[0];
-		program[i].data.u64 = bytes_to_word(inst + 1);
+		size_t want = capacity - read;
+		size_t size = fread(bytes + read, 1, want, p_file);
+
+		*p_read = read += size;
+		if (size < want)
+			break;
+	}
+
+	return ERR_OK;
+}
+
+struct stream_section {
+	word_t      offset;
+	uint8_t    *dest;
+	uint8_t   **grown; /* Instead of dest, for a buffer grown while reading */
+	word_t      size;
+	const char *name;
+};
+
+static int by_offset(const void *p_a, const void *p_b) {
+	const struct stream_section *a = (const struct stream_section*)p_a;
+	const struct stream_section *b = (const struct stream_section*)p_b;
+
+	return a->offset < b->offset? -1 : a->offset > b->offset;
+}
+
+/* Streams can only be read forward, p_at is the position in the file */
+static enum err read_stream_section(struct vm *p_vm, FILE *p_file, word_t *p_at,
+                                    struct stream_section *p_section, const char *p_path) {
+	if (p_section->size == 0)
+		return ERR_OK;
+
+	if (p_section->offset < *p_at)
+		return vm_fail(p_vm, ERR_INVALID_EXECUTABLE, "'%s' %s section overlaps the previous data",
+		               p_path, p_section->name);
+
+	uint8_t skip[256];
+	while (*p_at < p_section->offset) {
+		size_t size = p_section->offset - *p_at < sizeof(skip)?
+		              p_section->offset - *p_at : sizeof(skip);
+		if (fread(skip, 1, size, p_file) < size)
+			return vm_fail(p_vm, ERR_INVALID_EXECUTABLE, "'%s' unexpected EOF before %s section",
+			               p_path, p_section->name);
+
+		*p_at += size;
+	}
+
+	word_t read = 0;
+	if (p_section->grown == NULL)
+		read = fread(p_section->dest, 1, p_section->size, p_file);
+	else {
+		enum err err = read_stream_bytes(p_vm, p_file, p_section->size, p_section->grown, &read);
+		if (err != ERR_OK)
+			return err;
+	}
+
+	if (read < p_section->size)
+		return vm_fail(p_vm, ERR_INVALID_EXECUTABLE, "'%s' unexpected EOF during %s section",
+		               p_path, p_section->name);
+
+	*p_at += p_section->size;
+	return ERR_OK;
+}
+
+/* The code and the symbols are read into grown buffers, *p_bytes and *p_symbols,
+   that the caller frees */
+static enum err read_stream_sections(struct vm *p_vm, FILE *p_file, word_t p_at,
+                                     struct sections *p_sections, uint8_t **p_bytes,
+                                     uint8_t **p_symbols, const char *p_path) {
+	struct stream_section reads[] = {
+		{p_sections->code_offset,    NULL,         p_bytes,   p_sections->code_size * sizeof(struct inst), "code"},
+		{p_sections->data_offset,    p_vm->memory, NULL,      p_sections->data_size,                       "data"},
+		{p_sections->symbols_offset, NULL,         p_symbols, p_sections->symbols_size,                    "symbols"},
+	};
+
+	/* In the order of the offsets */
+	qsort(reads, sizeof(reads) / sizeof(reads[0]), sizeof(reads[0]), by_offset);
+	for (size_t i = 0; i < sizeof(reads) / sizeof(reads[0]); ++ i) {
+		enum err err = read_stream_section(p_vm, p_file, &p_at, &reads[i], p_path);
+		if (err != ERR_OK)
+			return err;
+	}
+
+	if (p_sections->symbols_size > 0)
+		return load_symbols(p_vm, *p_symbols, p_sections->symbols_size, p_path);
+
+	return ERR_OK;
+}
+
+static enum err load_sectioned_stream(struct vm *p_vm, FILE *p_file, word_t p_at,
+                                      const char *p_path, bool p_warnings,
+                                      struct inst **p_program) {
+	struct file_header header;
+	memcpy(header.magic, "AVS", 3);
+
+	/* The magic was already read */
+	if (fread((uint8_t*)&header + 3, sizeof(header) - 3, 1, p_file) < 1)
+		return read_fail(p_vm, p_file, p_path, "header");
+
+	p_at += sizeof(header) - 3;
+
+	check_version(header.ver, p_path, p_warnings);
+
+	enum err        err;
+	struct sections sections = {0};
+	word_t          count    = bytes_to_word(header.section_count);
+	for (word_t i = 0; i < count; ++ i) {
+		struct file_section section;
+		if (fread(&section, sizeof(section), 1, p_file) < 1)
+			return vm_fail(p_vm, ERR_INVALID_EXECUTABLE,
+			               "'%s' unexpected EOF during section table", p_path);
+
+		p_at += sizeof(section);
+		if ((err = read_section(p_vm, &sections, &section, p_path)) != ERR_OK)
+			return err;
 	}
 
+	if ((err = sections_flags(p_vm, &sections, p_path)) != ERR_OK)
+		return err;
+
+	if ((err = sections_stacks(p_vm, &sections, p_path)) != ERR_OK)
+		return err;
+
+	word_t memory_size = 0;
+	if ((err = sections_memory_size(p_vm, &sections, p_path, &memory_size)) != ERR_OK)
+		return err;
+
+	/* The bss section is the zeros after the data */
+	if ((err = vm_alloc_zeroed_mem(p_vm, memory_size)) != ERR_OK)
+		return err;
+
+	uint8_t *bytes = NULL, *symbols = NULL;
+	err = read_stream_sections(p_vm, p_file, p_at, &sections, &bytes, &symbols, p_path);
+
+	struct inst *program = NULL;
+	if (err == ERR_OK)
+		err = decode_program(p_vm, bytes, sections.code_size, &program);
+
+	free(symbols);
+	free(bytes);
+
+	if (err != ERR_OK)
+		return err;
+
+	return load_program(p_vm, program, sections.code_size, bytes_to_word(header.entry_point),
+	                    p_program);
+}
+
+static enum err load_flat_stream(struct vm *p_vm, FILE *p_file, const char *p_path,
+                                 bool p_warnings, struct inst **p_program) {
+	struct file_meta meta;
+	memcpy(meta.magic, "AVM", 3);
+
+	/* The magic was already read */
+	if (fread((uint8_t*)&meta + 3, sizeof(meta) - 3, 1, p_file) < 1)
+		return read_fail(p_vm, p_file, p_path, "metadata");
+
+	check_version(meta.ver, p_path, p_warnings);
+
+	word_t program_size = bytes_to_word(meta.program_size);
+	word_t memory_size  = bytes_to_word(meta.memory_size);
+	word_t entry_point  = bytes_to_word(meta.entry_point);
+
+	/* Flat executables have no flags */
+	p_vm->little_endian = false;
+
+	enum err err = vm_alloc_mem(p_vm, memory_size);
+	if (err != ERR_OK)
+		return err;
+
+	if (fread(p_vm->memory, 1, memory_size, p_file) < memory_size)
+		return vm_fail(p_vm, ERR_INVALID_EXECUTABLE,
+		               "'%s' unexpected EOF during memory segment", p_path);
+
+	if (program_size > (word_t)-1 / sizeof(struct inst))
+		return vm_fail(p_vm, ERR_INVALID_EXECUTABLE, "'%s' program is too big", p_path);
+
+	uint8_t *bytes = NULL;
+	word_t   read  = 0;
+	if ((err = read_stream_bytes(p_vm, p_file, sizeof(struct inst) * program_size, &bytes,
+	                             &read)) != ERR_OK) {
+		free(bytes);
+		return err;
+	}
+
+	if (read < sizeof(struct inst) * program_size) {
+		free(bytes);
+		return vm_fail(p_vm, ERR_INVALID_EXECUTABLE,
+		               "'%s' incompatible instruction format at instruction %zu",
+		               p_path, (size_t)(read / sizeof(struct inst)) + 1);
+	}
+
+	struct inst *program = NULL;
+	err = decode_program(p_vm, bytes, program_size, &program);
+	free(bytes);
+
+	if (err != ERR_OK)
+		return err;
+
+	return load_program(p_vm, program, program_size, entry_point, p_program);
+}
+
+enum err vm_load_stream(struct vm *p_vm, FILE *p_file, const char *p_path, bool p_warnings,
+                        struct inst **p_program) {
+	/* skip the shebang, the section offsets count it */
+	word_t at = 0;
+	int    ch = fgetc(p_file);
+	if (ch == '#') {
+		do
+			++ at;
+		while ((ch = fgetc(p_file)) != '\n' && ch != EOF);
+
+		if (ch == '\n')
+			++ at;
+	} else
+		ungetc(ch, p_file);
+
+	char magic[3];
+	if (fread(magic, sizeof(magic), 1, p_file) < 1)
+		return read_fail(p_vm, p_file, p_path, "metadata");
+
+	if (strncmp(magic, "AVS", 3) == 0)
+		return load_sectioned_stream(p_vm, p_file, at + sizeof(magic), p_path, p_warnings,
+		                             p_program);
+	else if (strncmp(magic, "AVM", 3) == 0)
+		return load_flat_stream(p_vm, p_file, p_path, p_warnings, p_program);
+
+	return vm_fail(p_vm, ERR_INVALID_EXECUTABLE, "'%s' is not an executable AVM binary", p_path);
+}
+
+/* Reads the file through stdio, for files that can not be mapped */
+static enum err load_stream(struct vm *p_vm, const char *p_path, bool p_warnings,
+                            struct inst **p_program) {
+	FILE *file = fopen(p_path, "rb");
+	if (file == NULL)
+		return vm_fail(p_vm, ERR_CANNOT_READ, "Failed to open file '%s': %s",
+		               p_path, strerror(errno));
+
+	enum err err = vm_load_stream(p_vm, file, p_path, p_warnings, p_program);
+
 	fclose(file);
+	return err;
+}
+
+enum err vm_load_file(struct vm *p_vm, const char *p_path, bool p_warnings, bool p_cache,
+                      struct inst **p_program) {
+	*p_program = NULL;
+
+#ifdef USES_MMAP
+	enum err err;
+	if (load_mapped(p_vm, p_path, p_warnings, p_cache, p_program, &err))
+		return err;
+#else
+	(void)p_cache;
+#endif
+
+	return load_stream(p_vm, p_path, p_warnings, p_program);
+}
 
-	vm_load_from_mem(p_vm, program, program_size, entry_point);
-	if (p_debug)
-		vm_debug(p_vm);
-	else
-		vm_run(p_vm);
+struct inst *vm_load_from_file(struct vm *p_vm, const char *p_path, bool p_warnings, bool p_cache) {
+	/* Only an embedded vm returns from a failure */
+	struct inst *program = NULL;
+	vm_load_file(p_vm, p_path, p_warnings, p_cache, &program);
 
-	free(program);
+	return program;
 }
@@ -4,12 +4,34 @@
 #include <string.h>  /* strncmp, strerror */
 #include <errno.h>   /* errno */
 #include <assert.h>  /* assert */
-#include <stdlib.h>  /* free, malloc, exit, EXIT_FAILURE */
+#include <stdlib.h>  /* free, malloc, realloc, qsort, exit, EXIT_FAILURE */
 #include <stdio.h>   /* stderr, FILE, fopen, fclose, fread, fgetc, ungetc */
+#include <stdint.h>  /* uint8_t, uintptr_t */
 
 #include "avm/vm.h"
-#include "debugger.h"
+#include "avm/symbols.h"
+#include "cache.h"
 
-void vm_exec_from_file(struct vm *p_vm, const char *p_path, bool p_warnings, bool p_debug);
+#ifdef USES_MMAP
+#	include <sys/stat.h> /* fstat, struct stat, S_ISREG */
+#	include <fcntl.h>    /* open, O_RDONLY */
+#	include <unistd.h>   /* close, sysconf, _SC_PAGESIZE */
+#endif
+
+/* Loads an executable, flat (struct file_meta) or sectioned (struct
+   file_header), into the vm. The returned program has to be freed after the vm
+   is done with it, it is NULL if the program is in a cached image (see cache.h,
+   p_cache). Regular files are mapped and the memory is used from the (private)
+   mapping, see struct vm.mapping */
+struct inst *vm_load_from_file(struct vm *p_vm, const char *p_path, bool p_warnings, bool p_cache);
+
+/* Same as vm_load_from_file, for an embedded vm (see struct vm.embedded). The
+   program is in p_program, a failed load leaves nothing to free but the vm */
+enum err vm_load_file(struct vm *p_vm, const char *p_path, bool p_warnings, bool p_cache,
+                      struct inst **p_program);
+
+/* Loads an executable from a stream, p_path only names it in the errors */
+enum err vm_load_stream(struct vm *p_vm, FILE *p_file, const char *p_path, bool p_warnings,
+                        struct inst **p_program);
 
 #endif
@@ -31,10 +31,56 @@ void usage(void) {
 	       "Github: "GITHUB_LINK"\n"
 	       "Usage: "APP_NAME" [FILE] [OPTIONS]\n"
 	       "Options:\n"
-	       "  -h, --help     Show this message\n"
-	       "  -v, --version  Print the version\n"
-	       "  --noW          Dont show warnings\n"
-	       "  -d, --debug    Enable debug mode\n",
+	       "  -h, --help            Show this message\n"
+	       "  -v, --version         Print the version\n"
+	       "  --noW                 Dont show warnings\n"
+	       "  -d, --debug           Enable debug mode\n"
+	       "  --noFuse              Dont use superinstructions\n"
+	       "  --noCache             Dont use or write the decoded program cache\n"
+	       "  --jit                 Compile the program to machine code (x86-64)\n"
+	       "  --ir                  Run on the register IR\n"
+	       "  --sandbox             Run with the memory in a sandbox of guard pages,\n"
+	       "                        without checking the addresses of the accesses\n"
+	       "  --large-memory        Reserve the memory with mmap and only commit the\n"
+	       "                        pages that are used, with transparent huge pages\n"
+	       "  --huge-pages=MODE     transparent, explicit (the reserved huge pages) or\n"
+	       "                        none, for --large-memory\n"
+	       "  --numa-bind=NODES     Place the large memory on the NUMA NODES, like 0,2-3\n"
+	       "  --numa-interleave=NODES\n"
+	       "                        Interleave the large memory over the NUMA NODES\n"
+	       "  --profile             Count the executions of every instruction and\n"
+	       "                        write a report to stderr at exit\n"
+	       "  --flamegraph FILE     Profile, and write the call stacks to FILE in\n"
+	       "                        the collapsed format of flamegraph tools\n"
+	       "  --perf-stats          Count cycles, host instructions, branch and cache\n"
+	       "                        misses of the run with perf_event_open and write\n"
+	       "                        them per executed instruction to stderr\n"
+	       "  --stats=json          Write the instruction count, times, peak stack\n"
+	       "                        sizes, memory and file use of the run to stderr\n"
+	       "  --sample=HZ           Sample the running program HZ times per second\n"
+	       "                        of CPU time instead, and write a report and the\n"
+	       "                        call stacks (or --flamegraph FILE) to stderr\n"
+	       "  --trace FILE          Keep the last executed instructions and write\n"
+	       "                        them to FILE on a panic or on SIGUSR1\n"
+	       "  --trace-size=N        Instructions --trace keeps, 65536 by default\n"
+	       "  --print-trace FILE    Decode the trace FILE, with the symbols of the\n"
+	       "                        program if it is given\n"
+	       "  --stack-size=N        Bytes of stack, 65536 by default or the size in\n"
+	       "                        the executable\n"
+	       "  --call-stack-size=N   Bytes of call stack, 4096 (512 calls) by default\n"
+	       "                        or the size in the executable\n"
+	       "  --max-files=N         Files the program can have open, 65536 by default\n"
+	       "  --max-libs=N          Libraries the program can have open, 1024 by\n"
+	       "                        default\n"
+	       "  --max-funcs=N         Functions the program can load from a library,\n"
+	       "                        4096 by default\n"
+	       "  --emit-c FILE         Translate the program to C, see src/emit.h\n"
+	       "  --record-pairs FILE   Write a histogram of the executed opcode pairs\n"
+	       "  --fuse-from FILE      Only use the superinstructions that are hot in\n"
+	       "                        the opcode pair histogram FILE\n\n"
+	       "Only one of --debug, --jit, --ir, --profile (or --flamegraph), --sample,\n"
+	       "--perf-stats, --stats=json, --trace, --record-pairs, --emit-c and\n"
+	       "--print-trace can be used, --flamegraph also goes with --sample\n",
 	       VERSION_MAJOR, VERSION_MINOR, VERSION_PATCH);
 
 	exit(EXIT_SUCCESS);
@@ -62,10 +108,199 @@ void try(const char *p_flag) {
 	fprintf(stderr, "Try '"APP_NAME" %s'\n", p_flag);
 }
 
+static const char *option_arg(int p_argc, char **p_argv, int *p_i) {
+	if (*p_i + 1 >= p_argc) {
+		error("Option '%s' expects an argument", p_argv[*p_i]);
+		try("-h");
+
+		exit(EXIT_FAILURE);
+	}
+
+	return p_argv[++ *p_i];
+}
+
+/* A panic exits from inside the interpreter, the report is written anyway */
+static struct vm   *profiled   = NULL;
+static FILE        *flamegraph = NULL;
+static int          sample_hz  = 0; /* 0 for the exact profiler */
+static struct perf *perf_run   = NULL;
+
+static struct resources *resources = NULL;
+
+static struct vm  *traced     = NULL;
+static const char *trace_path = NULL;
+
+static void profile_finish(void) {
+	if (profiled == NULL)
+		return;
+
+	if (sample_hz == 0)
+		profile_report(profiled, stderr);
+	else
+		profile_report_samples(profiled, stderr, sample_hz);
+
+	if (flamegraph != NULL) {
+		profile_flamegraph(profiled, flamegraph);
+		if (flamegraph != stderr)
+			fclose(flamegraph);
+
+		flamegraph = NULL;
+	}
+
+	profiled = NULL;
+}
+
+/* A program that exits from inside the run did not finish it */
+static void stats_finish(bool p_finished) {
+	if (resources == NULL)
+		return;
+
+	resources_write_json(resources, profiled, stderr, p_finished);
+
+	resources = NULL;
+	profiled  = NULL;
+}
+
+static void stats_at_exit(void) {
+	stats_finish(false);
+}
+
+/* Only called by atexit if the run did not finish */
+static void trace_finish(void) {
+	if (traced == NULL)
+		return;
+
+	if (trace_write(traced, trace_path))
+		fprintf(stderr, "Trace of the last %llu instructions written to '%s'\n",
+		        (long long unsigned)trace_length(traced->trace), trace_path);
+	else
+		error("Could not write the trace to '%s': %s", trace_path, strerror(errno));
+
+	traced = NULL;
+}
+
+static void perf_finish(void) {
+	if (perf_run == NULL)
+		return;
+
+	perf_stop(perf_run);
+	perf_report(perf_run, profiled, stderr);
+	perf_close(perf_run);
+
+	perf_run = NULL;
+	profiled = NULL;
+}
+
+static pairs_t *alloc_pairs(void) {
+	pairs_t *pairs = (pairs_t*)calloc(1, sizeof(pairs_t));
+	if (pairs == NULL) {
+		error("calloc() fail");
+		exit(EXIT_FAILURE);
+	}
+
+	return pairs;
+}
+
+/* Value of a --max-*=N option, p_arg is after the = */
+static word_t limit_option(const char *p_arg, const char *p_name) {
+	char *end;
+	long  limit = strtol(p_arg, &end, 10);
+	if (*end != '\0' || limit <= 0 || limit > MAPS_MAX_LIMIT) {
+		error("Option '%s' expects a limit from 1 to %i", p_name, MAPS_MAX_LIMIT);
+		exit(EXIT_FAILURE);
+	}
+
+	return limit;
+}
+
+/* Value of a --*stack-size=N option, p_arg is after the = */
+static word_t stack_size_option(const char *p_arg, const char *p_name) {
+	char *end;
+	long  size = strtol(p_arg, &end, 10);
+	if (*end != '\0' || size < (long)sizeof(word_t) ||
+	    size / sizeof(word_t) > MAX_STACK_CAPACITY) {
+		error("Option '%s' expects a size from %i to %llu bytes", p_name, (int)sizeof(word_t),
+		      (long long unsigned)MAX_STACK_CAPACITY * sizeof(word_t));
+		exit(EXIT_FAILURE);
+	}
+
+	return size;
+}
+
+/* The options that pick how the program is run, NULL for the ones that are not
+   given. At most one can be given */
+static void check_modes(const char **p_modes, size_t p_count) {
+	const char *mode = NULL;
+	for (size_t i = 0; i < p_count; ++ i) {
+		if (p_modes[i] == NULL)
+			continue;
+
+		if (mode != NULL) {
+			error("Options '%s' and '%s' can not be used together", mode, p_modes[i]);
+			try("-h");
+
+			exit(EXIT_FAILURE);
+		}
+
+		mode = p_modes[i];
+	}
+}
+
+/* Nodes of a --numa-*=NODES option, p_arg is after the =. A list of nodes and
+   ranges, like 0,2-3 */
+static uint64_t nodes_option(const char *p_arg, const char *p_name) {
+	uint64_t    nodes = 0;
+	const char *at    = p_arg;
+	do {
+		char *end;
+		long  first = strtol(at, &end, 10), last = first;
+		if (end != at && *end == '-') {
+			at   = end + 1;
+			last = strtol(at, &end, 10);
+		}
+
+		if (end == at || (*end != ',' && *end != '\0') || first < 0 || last < first ||
+		    last >= LARGE_MAX_NODES) {
+			error("Option '%s' expects nodes from 0 to %i, like 0,2-3", p_name, LARGE_MAX_NODES - 1);
+			exit(EXIT_FAILURE);
+		}
+
+		for (long node = first; node <= last; ++ node)
+			nodes |= (uint64_t)1 << node;
+
+		at = end + 1;
+	} while (at[-1] == ',');
+
+	return nodes;
+}
+
 int main(int p_argc, char **p_argv) {
-	const char *path     = NULL;
-	bool        warnings = true;
-	bool        debug    = false;
+	const char *path         = NULL;
+	const char *record_pairs = NULL;
+	const char *fuse_from    = NULL;
+	const char *emit_c       = NULL;
+	const char *stacks       = NULL;
+	const char *print_trace  = NULL;
+	word_t      trace_size   = TRACE_DEFAULT_SIZE;
+	word_t      stack_size   = 0; /* 0 for the size in the executable */
+	word_t      call_size    = 0;
+	word_t      max_files    = DEFAULT_MAX_FILES;
+	word_t      max_libs     = DEFAULT_MAX_LIBS;
+	word_t      max_funcs    = DEFAULT_MAX_FUNCS;
+	bool        warnings     = true;
+	bool        debug        = false;
+	bool        fuse         = true;
+	bool        cache        = true;
+	bool        jit          = false;
+	bool        ir           = false;
+	bool        sandbox      = false;
+	bool        large_memory = false;
+	bool        profile      = false;
+	bool        perf_stats   = false;
+	bool        stats        = false;
+
+	/* Outlives the vm, see vm_large_memory */
+	struct large_memory large = {.huge_pages = HUGE_PAGES_TRANSPARENT};
 
 	for (int i = 1; i < p_argc; ++ i) {
 		if (strcmp(p_argv[i], "-h") == 0 || strcmp(p_argv[i], "--help") == 0)
@@ -76,6 +311,87 @@ int main(int p_argc, char **p_argv) {
 			debug = true;
 		else if (strcmp(p_argv[i], "--noW") == 0)
 			warnings = false;
+		else if (strcmp(p_argv[i], "--noFuse") == 0)
+			fuse = false;
+		else if (strcmp(p_argv[i], "--noCache") == 0)
+			cache = false;
+		else if (strcmp(p_argv[i], "--jit") == 0)
+			jit = true;
+		else if (strcmp(p_argv[i], "--ir") == 0)
+			ir = true;
+		else if (strcmp(p_argv[i], "--sandbox") == 0)
+			sandbox = true;
+		else if (strcmp(p_argv[i], "--large-memory") == 0)
+			large_memory = true;
+		else if (strncmp(p_argv[i], "--huge-pages=", 13) == 0) {
+			const char *mode = p_argv[i] + 13;
+			if (strcmp(mode, "transparent") == 0)
+				large.huge_pages = HUGE_PAGES_TRANSPARENT;
+			else if (strcmp(mode, "explicit") == 0)
+				large.huge_pages = HUGE_PAGES_EXPLICIT;
+			else if (strcmp(mode, "none") == 0)
+				large.huge_pages = HUGE_PAGES_NONE;
+			else {
+				error("Option '--huge-pages' expects transparent, explicit or none");
+				exit(EXIT_FAILURE);
+			}
+
+			large_memory = true;
+		} else if (strncmp(p_argv[i], "--numa-bind=", 12) == 0) {
+			large.numa   = NUMA_BIND;
+			large.nodes  = nodes_option(p_argv[i] + 12, "--numa-bind");
+			large_memory = true;
+		} else if (strncmp(p_argv[i], "--numa-interleave=", 18) == 0) {
+			large.numa   = NUMA_INTERLEAVE;
+			large.nodes  = nodes_option(p_argv[i] + 18, "--numa-interleave");
+			large_memory = true;
+		}
+		else if (strcmp(p_argv[i], "--profile") == 0)
+			profile = true;
+		else if (strcmp(p_argv[i], "--stats=json") == 0)
+			stats = true;
+		else if (strcmp(p_argv[i], "--perf-stats") == 0)
+			perf_stats = true;
+		else if (strcmp(p_argv[i], "--flamegraph") == 0)
+			stacks = option_arg(p_argc, p_argv, &i);
+		else if (strncmp(p_argv[i], "--sample=", 9) == 0) {
+			char *end;
+			long  hz = strtol(p_argv[i] + 9, &end, 10);
+			if (*end != '\0' || hz <= 0 || hz > SAMPLE_MAX_HZ) {
+				error("Option '--sample' expects a rate from 1 to %i Hz", SAMPLE_MAX_HZ);
+				exit(EXIT_FAILURE);
+			}
+
+			sample_hz = hz;
+		} else if (strcmp(p_argv[i], "--trace") == 0)
+			trace_path = option_arg(p_argc, p_argv, &i);
+		else if (strncmp(p_argv[i], "--trace-size=", 13) == 0) {
+			char *end;
+			long  size = strtol(p_argv[i] + 13, &end, 10);
+			if (*end != '\0' || size <= 0 || size > TRACE_MAX_SIZE) {
+				error("Option '--trace-size' expects a size from 1 to %i", TRACE_MAX_SIZE);
+				exit(EXIT_FAILURE);
+			}
+
+			trace_size = size;
+		} else if (strncmp(p_argv[i], "--stack-size=", 13) == 0)
+			stack_size = stack_size_option(p_argv[i] + 13, "--stack-size");
+		else if (strncmp(p_argv[i], "--call-stack-size=", 18) == 0)
+			call_size = stack_size_option(p_argv[i] + 18, "--call-stack-size");
+		else if (strncmp(p_argv[i], "--max-files=", 12) == 0)
+			max_files = limit_option(p_argv[i] + 12, "--max-files");
+		else if (strncmp(p_argv[i], "--max-libs=", 11) == 0)
+			max_libs = limit_option(p_argv[i] + 11, "--max-libs");
+		else if (strncmp(p_argv[i], "--max-funcs=", 12) == 0)
+			max_funcs = limit_option(p_argv[i] + 12, "--max-funcs");
+		else if (strcmp(p_argv[i], "--print-trace") == 0)
+			print_trace = option_arg(p_argc, p_argv, &i);
+		else if (strcmp(p_argv[i], "--emit-c") == 0)
+			emit_c = option_arg(p_argc, p_argv, &i);
+		else if (strcmp(p_argv[i], "--record-pairs") == 0)
+			record_pairs = option_arg(p_argc, p_argv, &i);
+		else if (strcmp(p_argv[i], "--fuse-from") == 0)
+			fuse_from = option_arg(p_argc, p_argv, &i);
 		else if (path != NULL) {
 			error("Unexpected argument '%s'", p_argv[i]);
 			try("-h");
@@ -85,6 +401,28 @@ int main(int p_argc, char **p_argv) {
 			path = p_argv[i];
 	}
 
+	/* Without --sample, --flamegraph is the exact profiler */
+	bool        flame   = stacks != NULL && !profile && sample_hz == 0;
+	const char *modes[] = {
+		print_trace != NULL?  "--print-trace"  : NULL,
+		emit_c != NULL?       "--emit-c"       : NULL,
+		debug?                "--debug"        : NULL,
+		record_pairs != NULL? "--record-pairs" : NULL,
+		trace_path != NULL?   "--trace"        : NULL,
+		stats?                "--stats=json"   : NULL,
+		perf_stats?           "--perf-stats"   : NULL,
+		profile?              "--profile"      : NULL,
+		flame?                "--flamegraph"   : NULL,
+		sample_hz > 0?        "--sample"       : NULL,
+		jit?                  "--jit"          : NULL,
+		ir?                   "--ir"           : NULL,
+	};
+	check_modes(modes, ARRAY_SIZE(modes));
+
+	/* Decoded offline, the program is only needed for its symbols */
+	if (print_trace != NULL && path == NULL)
+		return trace_print(print_trace, stdout, NULL)? EXIT_SUCCESS : EXIT_FAILURE;
+
 	if (path == NULL) {
 		error("No input file specified");
 		try("-h");
@@ -94,7 +432,153 @@ int main(int p_argc, char **p_argv) {
 
 	struct vm vm;
 	vm_init(&vm);
-	vm_exec_from_file(&vm, path, warnings, debug);
+
+	vm.maps->max_files = max_files;
+	vm.maps->max_libs  = max_libs;
+	vm.maps->max_funcs = max_funcs;
+
+	if (!fuse)
+		vm.fuse_rules = FUSE_NONE;
+	else if (fuse_from != NULL) {
+		pairs_t *pairs = alloc_pairs();
+		if (!pairs_read(pairs, fuse_from)) {
+			error("Could not read opcode pairs from '%s': %s", fuse_from, strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+
+		vm.fuse_rules = fuse_rules_from_pairs(pairs);
+		free(pairs);
+	}
+
+	/* The loads that allocate the memory reserve it right away, the ones that map
+	   it are moved after */
+	if (large_memory)
+		vm.large = &large;
+
+	struct inst *program = vm_load_from_file(&vm, path, warnings, cache);
+
+	/* The options win over the sizes in the executable */
+	if (stack_size > 0 || call_size > 0)
+		vm_alloc_stacks(&vm, stack_size > 0? stack_size / sizeof(value_t) : vm.stack_capacity,
+		                call_size > 0? call_size / sizeof(word_t) : vm.call_stack_capacity);
+
+	if (large_memory)
+		vm_large_memory(&vm, &large);
+
+	if (sandbox)
+		vm_sandbox(&vm);
+
+	if (print_trace != NULL) {
+		if (!trace_print(print_trace, stdout, &vm))
+			exit(EXIT_FAILURE);
+	} else if (emit_c != NULL) {
+		if (!vm_emit_c(&vm, path, emit_c)) {
+			error("Could not write '%s': %s", emit_c, strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+	} else if (debug)
+		vm_debug(&vm);
+	else if (record_pairs != NULL) {
+		pairs_t *pairs = alloc_pairs();
+		vm_run_recording_pairs(&vm, pairs);
+
+		if (!pairs_write(pairs, record_pairs)) {
+			error("Could not write opcode pairs to '%s': %s", record_pairs, strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+
+		free(pairs);
+	} else if (trace_path != NULL) {
+		struct trace trace;
+		trace_init(&trace, trace_size);
+
+		vm.trace = &trace;
+		traced   = &vm;
+		atexit(trace_finish);
+
+		trace_run(&vm, trace_path);
+		traced = NULL;
+
+		trace_free(&trace);
+		vm.trace = NULL;
+	} else if (stats) {
+		struct profile counters;
+		profile_init(&counters, vm.program_size);
+
+		struct vm_stats vm_stats;
+		memset(&vm_stats, 0, sizeof(vm_stats));
+
+		struct resources usage;
+		resources_start(&usage);
+
+		vm.profile = &counters;
+		vm.stats   = &vm_stats;
+		profiled   = &vm;
+		resources  = &usage;
+		atexit(stats_at_exit);
+
+		vm_run_counted(&vm);
+		stats_finish(true);
+
+		profile_free(&counters);
+		vm.profile = NULL;
+		vm.stats   = NULL;
+	} else if (perf_stats) {
+		struct profile counters;
+		profile_init(&counters, vm.program_size);
+
+		struct perf perf;
+		perf_open(&perf);
+
+		vm.profile = &counters;
+		profiled   = &vm;
+		perf_run   = &perf;
+		atexit(perf_finish);
+
+		perf_start(&perf);
+		vm_run_counted(&vm);
+		perf_finish();
+
+		profile_free(&counters);
+		vm.profile = NULL;
+	} else if (profile || stacks != NULL || sample_hz > 0) {
+		struct profile counters;
+		profile_init(&counters, vm.program_size);
+
+		if (stacks != NULL) {
+			flamegraph = fopen(stacks, "w");
+			if (flamegraph == NULL) {
+				error("Could not write '%s': %s", stacks, strerror(errno));
+				exit(EXIT_FAILURE);
+			}
+		} else if (sample_hz > 0)
+			flamegraph = stderr;
+
+		vm.profile = &counters;
+		profiled   = &vm;
+		atexit(profile_finish);
+
+		if (sample_hz == 0)
+			vm_run_profiled(&vm);
+		else if (!vm_run_sampled(&vm, sample_hz)) {
+			profiled = NULL;
+
+			error("Could not start the sampling timer");
+			exit(EXIT_FAILURE);
+		}
+
+		profile_finish();
+
+		profile_free(&counters);
+		vm.profile = NULL;
+	} else if (jit)
+		vm_run_jit(&vm);
+	else if (ir)
+		vm_run_ir(&vm);
+	else
+		vm_run(&vm);
+
+	free(program);
 	vm_destroy(&vm);
 
 	return vm.ex;
@@ -1,13 +1,27 @@
 #ifndef MAIN_H__HEADER_GUARD__
 #define MAIN_H__HEADER_GUARD__
 
-#include <stdio.h>   /* printf, puts */
-#include <stdlib.h>  /* exit, EXIT_SUCCESS, EXIT_FAILURE */
-#include <string.h>  /* strcmp */
+#include <stdio.h>   /* printf, puts, fopen, fclose */
+#include <stdlib.h>  /* exit, atexit, calloc, free, strtol, EXIT_SUCCESS, EXIT_FAILURE */
+#include <string.h>  /* strcmp, strncmp, strerror */
 #include <stdbool.h> /* bool, true, false */
+#include <errno.h>   /* errno */
 
 #include "avm/vm.h"
+#include "avm/fuse.h"
+#include "avm/jit.h"
+#include "avm/ir.h"
+#include "avm/maps.h"
+#include "avm/sandbox.h"
+#include "avm/large.h"
 #include "loader.h"
+#include "debugger.h"
+#include "profiler.h"
+#include "sampler.h"
+#include "perf.h"
+#include "resources.h"
+#include "tracer.h"
+#include "emit.h"
 
 void usage(void);
 void version(void);
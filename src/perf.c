@@ -0,0 +1,205 @@
+/* syscall */
+#define _DEFAULT_SOURCE
+
+#include "perf.h"
+
+static const char *names[PERF_COUNTERS_COUNT] = {
+	[PERF_TASK_CLOCK]    = "task-clock",
+	[PERF_CYCLES]        = "cycles",
+	[PERF_INSTRUCTIONS]  = "instructions",
+	[PERF_BRANCHES]      = "branches",
+	[PERF_BRANCH_MISSES] = "branch-misses",
+	[PERF_L1D_MISSES]    = "L1d-read-misses",
+	[PERF_LLC_MISSES]    = "LLC-misses",
+};
+
+#ifdef USES_PERF_EVENTS
+#define CACHE_CONFIG(P_CACHE, P_OP, P_RESULT) \
+	((P_CACHE) | (P_OP) << 8 | (P_RESULT) << 16)
+
+static const struct {
+	uint32_t type;
+	uint64_t config;
+} events[PERF_COUNTERS_COUNT] = {
+	[PERF_TASK_CLOCK]    = {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK},
+	[PERF_CYCLES]        = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+	[PERF_INSTRUCTIONS]  = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+	[PERF_BRANCHES]      = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_INSTRUCTIONS},
+	[PERF_BRANCH_MISSES] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+	[PERF_L1D_MISSES]    = {PERF_TYPE_HW_CACHE, CACHE_CONFIG(PERF_COUNT_HW_CACHE_L1D,
+	                                                         PERF_COUNT_HW_CACHE_OP_READ,
+	                                                         PERF_COUNT_HW_CACHE_RESULT_MISS)},
+	[PERF_LLC_MISSES]    = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+};
+
+void perf_open(struct perf *p_perf) {
+	memset(p_perf, 0, sizeof(*p_perf));
+
+	for (size_t i = 0; i < PERF_COUNTERS_COUNT; ++ i) {
+		struct perf_event_attr attr;
+		memset(&attr, 0, sizeof(attr));
+
+		attr.size           = sizeof(attr);
+		attr.type           = events[i].type;
+		attr.config         = events[i].config;
+		attr.disabled       = 1;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv     = 1;
+		attr.read_format    = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+		p_perf->fds[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+		if (p_perf->fds[i] == -1)
+			p_perf->errors[i] = errno;
+	}
+}
+
+void perf_close(struct perf *p_perf) {
+	for (size_t i = 0; i < PERF_COUNTERS_COUNT; ++ i) {
+		if (p_perf->fds[i] != -1)
+			close(p_perf->fds[i]);
+
+		p_perf->fds[i] = -1;
+	}
+}
+
+void perf_start(struct perf *p_perf) {
+	for (size_t i = 0; i < PERF_COUNTERS_COUNT; ++ i) {
+		if (p_perf->fds[i] != -1)
+			ioctl(p_perf->fds[i], PERF_EVENT_IOC_RESET, 0);
+	}
+
+	/* Enabled last to first, so the opening of the others is not counted in the
+	   hardware counters */
+	for (size_t i = PERF_COUNTERS_COUNT; i -- > 0;) {
+		if (p_perf->fds[i] != -1)
+			ioctl(p_perf->fds[i], PERF_EVENT_IOC_ENABLE, 0);
+	}
+}
+
+void perf_stop(struct perf *p_perf) {
+	for (size_t i = 0; i < PERF_COUNTERS_COUNT; ++ i) {
+		if (p_perf->fds[i] != -1)
+			ioctl(p_perf->fds[i], PERF_EVENT_IOC_DISABLE, 0);
+	}
+
+	for (size_t i = 0; i < PERF_COUNTERS_COUNT; ++ i) {
+		if (p_perf->fds[i] == -1)
+			continue;
+
+		/* Value, time enabled, time running */
+		uint64_t data[3];
+		if (read(p_perf->fds[i], data, sizeof(data)) != sizeof(data)) {
+			p_perf->errors[i] = errno;
+			close(p_perf->fds[i]);
+			p_perf->fds[i] = -1;
+
+			continue;
+		}
+
+		p_perf->values[i] = data[0];
+		if (data[2] > 0 && data[2] < data[1]) {
+			p_perf->values[i] = (uint64_t)((double)data[0] * data[1] / data[2]);
+			p_perf->scaled[i] = true;
+		}
+	}
+}
+#else
+void perf_open(struct perf *p_perf) {
+	memset(p_perf, 0, sizeof(*p_perf));
+
+	for (size_t i = 0; i < PERF_COUNTERS_COUNT; ++ i) {
+		p_perf->fds[i]    = -1;
+		p_perf->errors[i] = ENOSYS;
+	}
+}
+
+void perf_close(struct perf *p_perf) {
+	(void)p_perf;
+}
+
+void perf_start(struct perf *p_perf) {
+	(void)p_perf;
+}
+
+void perf_stop(struct perf *p_perf) {
+	(void)p_perf;
+}
+#endif
+
+static double ratio(uint64_t p_a, uint64_t p_b) {
+	return p_b > 0? (double)p_a / p_b : 0;
+}
+
+static const char *reason(int p_err) {
+	switch (p_err) {
+	case ENOENT: case EOPNOTSUPP:
+		return "not supported by the CPU or the virtual machine";
+
+	case EACCES: case EPERM:
+		return "not permitted, see /proc/sys/kernel/perf_event_paranoid";
+
+	case ENOSYS:
+		return "not supported on this platform";
+
+	default: return strerror(p_err);
+	}
+}
+
+static bool available(struct perf *p_perf, enum perf_counter p_counter) {
+	return p_perf->fds[p_counter] != -1;
+}
+
+void perf_report(struct perf *p_perf, struct vm *p_vm, FILE *p_file) {
+	uint64_t insts      = p_vm->profile->steps;
+	uint64_t dispatches = insts - p_vm->profile->fused;
+
+	fprintf(p_file, "\nPerformance counters: %llu instructions executed in %llu dispatches\n\n",
+	        (long long unsigned)insts, (long long unsigned)dispatches);
+
+	for (size_t i = 0; i < PERF_COUNTERS_COUNT; ++ i) {
+		fprintf(p_file, "%-16s ", names[i]);
+		if (!available(p_perf, i)) {
+			fprintf(p_file, "%20s  (%s)\n", "not available", reason(p_perf->errors[i]));
+			continue;
+		}
+
+		uint64_t value = p_perf->values[i];
+		if (i == PERF_TASK_CLOCK)
+			fprintf(p_file, "%17.3f ms", value / 1000000.0);
+		else
+			fprintf(p_file, "%20llu", (long long unsigned)value);
+
+		switch (i) {
+		case PERF_TASK_CLOCK:
+			fprintf(p_file, "  %10.3f ns per instruction", ratio(value, insts));
+			break;
+
+		case PERF_CYCLES:
+		case PERF_INSTRUCTIONS:
+			fprintf(p_file, "  %10.3f per instruction, %.3f per dispatch",
+			        ratio(value, insts), ratio(value, dispatches));
+			break;
+
+		case PERF_BRANCH_MISSES:
+			fprintf(p_file, "  %10.3f per dispatch", ratio(value, dispatches));
+			if (available(p_perf, PERF_BRANCHES))
+				fprintf(p_file, ", %.2f%% of branches",
+				        ratio(value, p_perf->values[PERF_BRANCHES]) * 100);
+			break;
+
+		default:
+			fprintf(p_file, "  %10.3f per instruction", ratio(value, insts));
+		}
+
+		if (p_perf->scaled[i])
+			fputs(" (scaled)", p_file);
+
+		fputc('\n', p_file);
+	}
+
+	if (available(p_perf, PERF_CYCLES) && available(p_perf, PERF_INSTRUCTIONS))
+		fprintf(p_file, "\n%.3f host instructions per cycle\n",
+		        ratio(p_perf->values[PERF_INSTRUCTIONS], p_perf->values[PERF_CYCLES]));
+
+	fprintf(p_file, "\nCounting the instructions adds about one host instruction per dispatch\n");
+}
@@ -0,0 +1,58 @@
+#ifndef PERF_H__HEADER_GUARD__
+#define PERF_H__HEADER_GUARD__
+
+#include <stdint.h>  /* uint64_t */
+#include <stdbool.h> /* bool, true, false */
+#include <stdio.h>   /* FILE, fprintf, fputs, fputc */
+#include <string.h>  /* memset, strerror */
+#include <errno.h>   /* errno, ENOENT, EOPNOTSUPP, EACCES, EPERM, ENOSYS */
+
+#include "avm/vm.h"
+#include "avm/profile.h"
+
+#ifdef PLATFORM_LINUX
+#	define USES_PERF_EVENTS
+
+#	include <linux/perf_event.h> /* struct perf_event_attr, PERF_* */
+#	include <sys/syscall.h>      /* SYS_perf_event_open */
+#	include <sys/ioctl.h>        /* ioctl */
+#	include <unistd.h>           /* syscall, read, close */
+#endif
+
+/* Hardware counters around a run, from perf_event_open. Every counter is opened
+ * on its own, so the ones the machine (or a virtual machine, or
+ * perf_event_paranoid) does not allow are reported as unavailable and the
+ * others still work. Only user space is counted.
+ */
+
+enum perf_counter {
+	PERF_TASK_CLOCK = 0, /* Nanoseconds, a software counter */
+	PERF_CYCLES,
+	PERF_INSTRUCTIONS,
+	PERF_BRANCHES,
+	PERF_BRANCH_MISSES,
+	PERF_L1D_MISSES,
+	PERF_LLC_MISSES,
+
+	PERF_COUNTERS_COUNT,
+};
+
+struct perf {
+	int      fds[PERF_COUNTERS_COUNT];    /* -1 if the counter could not be opened */
+	int      errors[PERF_COUNTERS_COUNT]; /* errno of the failed open */
+	uint64_t values[PERF_COUNTERS_COUNT];
+	bool     scaled[PERF_COUNTERS_COUNT]; /* Shared the hardware with other
+	                                         counters, the value is an estimate */
+};
+
+void perf_open(struct perf *p_perf);
+void perf_close(struct perf *p_perf);
+
+void perf_start(struct perf *p_perf);
+void perf_stop(struct perf *p_perf);
+
+/* Writes the counters next to the instructions and the dispatches counted in
+   p_vm->profile by vm_run_counted */
+void perf_report(struct perf *p_perf, struct vm *p_vm, FILE *p_file);
+
+#endif
@@ -0,0 +1,357 @@
+#include "profiler.h"
+
+struct entry {
+	word_t   key; /* Opcode or instruction address */
+	uint64_t count;
+};
+
+static int by_count(const void *p_a, const void *p_b) {
+	const struct entry *a = (const struct entry*)p_a, *b = (const struct entry*)p_b;
+
+	if (a->count != b->count)
+		return a->count < b->count? 1 : -1;
+
+	return a->key < b->key? -1 : a->key > b->key;
+}
+
+static struct entry *alloc_entries(word_t p_count) {
+	struct entry *entries = (struct entry*)malloc(sizeof(struct entry) * (p_count + 1));
+	if (entries == NULL) {
+		VM_ERROR(stderr, "malloc() fail near "__FILE__":%i", __LINE__);
+		exit(EXIT_FAILURE);
+	}
+
+	return entries;
+}
+
+static double percent(uint64_t p_count, uint64_t p_total) {
+	return p_total > 0? (double)p_count / p_total * 100 : 0;
+}
+
+/* Invalid opcodes are counted too, before the panic */
+static const char *op_name(uint8_t p_op) {
+	return op_to_str[p_op] == NULL? "???" : op_to_str[p_op];
+}
+
+static void print_inst(struct vm *p_vm, FILE *p_file, word_t p_ip) {
+	uint8_t op = p_vm->ops[p_ip];
+	fputs(op_name(op), p_file);
+
+	if (vm_operand_count(op) == 0)
+		return;
+
+	value_t data = vm_operand(p_vm, p_ip);
+	if (vm_has_target(op))
+		fprintf(p_file, " 0x%"FMT_HEX, AS_FMT_HEX(data.u64));
+	else
+		fprintf(p_file, " %lli", (long long)data.i64);
+}
+
+static void print_func(struct vm *p_vm, FILE *p_file, word_t p_addr) {
+	const struct symbol *symbol = vm_symbol_at(p_vm, p_addr);
+
+	if (symbol == NULL)
+		fprintf(p_file, "fn_0x%"FMT_HEX, AS_FMT_HEX(p_addr));
+	else if (symbol->addr == p_addr)
+		fputs(symbol->name, p_file);
+	else
+		fprintf(p_file, "%s+0x%llX", symbol->name, (long long unsigned)(p_addr - symbol->addr));
+}
+
+/* Depth first walk of the calling context tree. The children are linked, so
+   the walk needs no stack of its own, even for deep recursion */
+typedef void (*visit_t)(struct profile *p_profile, word_t p_node, bool p_enter, void *p_data);
+
+static void walk_calls(struct profile *p_profile, visit_t p_visit, void *p_data) {
+	struct call_node *nodes = p_profile->nodes;
+
+	word_t node = CALL_ROOT;
+	p_visit(p_profile, node, true, p_data);
+
+	while (true) {
+		if (nodes[node].child != CALL_ROOT) {
+			node = nodes[node].child;
+			p_visit(p_profile, node, true, p_data);
+			continue;
+		}
+
+		while (node != CALL_ROOT && nodes[node].sibling == CALL_ROOT) {
+			p_visit(p_profile, node, false, p_data);
+			node = nodes[node].parent;
+		}
+
+		p_visit(p_profile, node, false, p_data);
+		if (node == CALL_ROOT)
+			return;
+
+		node = nodes[node].sibling;
+		p_visit(p_profile, node, true, p_data);
+	}
+}
+
+struct func {
+	word_t   addr;
+	uint64_t inclusive, self, calls;
+	word_t   active; /* Nodes of the function on the walked chain */
+};
+
+struct funcs {
+	struct func *funcs;
+	word_t       count;
+	word_t      *of;    /* Function of each node */
+	uint64_t    *total; /* Instructions executed in each node and its callees */
+};
+
+static int by_addr(const void *p_a, const void *p_b) {
+	const struct func *a = (const struct func*)p_a, *b = (const struct func*)p_b;
+	return a->addr < b->addr? -1 : a->addr > b->addr;
+}
+
+static int by_inclusive(const void *p_a, const void *p_b) {
+	const struct func *a = (const struct func*)p_a, *b = (const struct func*)p_b;
+
+	if (a->inclusive != b->inclusive)
+		return a->inclusive < b->inclusive? 1 : -1;
+
+	return a->addr < b->addr? -1 : a->addr > b->addr;
+}
+
+static word_t find_func(struct funcs *p_funcs, word_t p_addr) {
+	word_t low = 0, high = p_funcs->count;
+	while (high - low > 1) {
+		word_t mid = low + (high - low) / 2;
+
+		if (p_funcs->funcs[mid].addr <= p_addr)
+			low = mid;
+		else
+			high = mid;
+	}
+
+	return low;
+}
+
+/* A recursive function is only counted in its outermost node, so that its
+   inclusive count is never more than the total */
+static void add_inclusive(struct profile *p_profile, word_t p_node, bool p_enter, void *p_data) {
+	(void)p_profile;
+
+	struct funcs *funcs = (struct funcs*)p_data;
+	struct func  *func  = &funcs->funcs[funcs->of[p_node]];
+
+	if (!p_enter)
+		-- func->active;
+	else if (func->active ++ == 0)
+		func->inclusive += funcs->total[p_node];
+}
+
+static void *alloc_report(size_t p_size) {
+	void *ptr = malloc(p_size);
+	if (ptr == NULL) {
+		VM_ERROR(stderr, "malloc() fail near "__FILE__":%i", __LINE__);
+		exit(EXIT_FAILURE);
+	}
+
+	return ptr;
+}
+
+/* Samples do not see the calls, only the stacks */
+static void report_funcs(struct vm *p_vm, FILE *p_file, uint64_t p_total, bool p_calls) {
+	struct profile *profile = p_vm->profile;
+	word_t          count   = profile->nodes_count;
+
+	struct funcs funcs = {
+		.funcs = (struct func*)alloc_report(sizeof(struct func) * count),
+		.count = 0,
+		.of    = (word_t*)alloc_report(sizeof(word_t) * count),
+		.total = (uint64_t*)alloc_report(sizeof(uint64_t) * count),
+	};
+
+	for (word_t i = 0; i < count; ++ i)
+		funcs.funcs[i] = (struct func){.addr = profile->nodes[i].func};
+
+	qsort(funcs.funcs, count, sizeof(struct func), by_addr);
+	for (word_t i = 0; i < count; ++ i) {
+		if (funcs.count == 0 || funcs.funcs[funcs.count - 1].addr != funcs.funcs[i].addr)
+			funcs.funcs[funcs.count ++] = funcs.funcs[i];
+	}
+
+	/* Children are always added after their parent */
+	for (word_t i = 0; i < count; ++ i) {
+		struct func *func = &funcs.funcs[find_func(&funcs, profile->nodes[i].func)];
+		func->self  += profile->nodes[i].self;
+		func->calls += profile->nodes[i].calls;
+
+		funcs.of[i]    = func - funcs.funcs;
+		funcs.total[i] = profile->nodes[i].self;
+	}
+
+	for (word_t i = count; i -- > 1;)
+		funcs.total[profile->nodes[i].parent] += funcs.total[i];
+
+	walk_calls(profile, add_inclusive, &funcs);
+	qsort(funcs.funcs, funcs.count, sizeof(struct func), by_inclusive);
+
+	fprintf(p_file, "\n%-18s %20s %8s %20s %8s %14s  %s\n",
+	        "Function", "Inclusive", "%", "Self", "%", "Calls", "Name");
+	for (word_t i = 0; i < funcs.count && i < PROFILE_TOP; ++ i) {
+		struct func *func = &funcs.funcs[i];
+		fprintf(p_file, "0x%"FMT_HEX" %20llu %7.2f%% %20llu %7.2f%% ",
+		        AS_FMT_HEX(func->addr), (long long unsigned)func->inclusive,
+		        percent(func->inclusive, p_total), (long long unsigned)func->self,
+		        percent(func->self, p_total));
+
+		if (p_calls)
+			fprintf(p_file, "%14llu  ", (long long unsigned)func->calls);
+		else
+			fprintf(p_file, "%14s  ", "-");
+
+		print_func(p_vm, p_file, func->addr);
+		fputc('\n', p_file);
+	}
+
+	free(funcs.funcs);
+	free(funcs.of);
+	free(funcs.total);
+}
+
+struct chain {
+	word_t    *nodes; /* The walked chain */
+	word_t     depth;
+	FILE      *file;
+	struct vm *vm;
+};
+
+static void write_stack(struct profile *p_profile, word_t p_node, bool p_enter, void *p_data) {
+	struct chain *chain = (struct chain*)p_data;
+	if (!p_enter) {
+		-- chain->depth;
+		return;
+	}
+
+	chain->nodes[chain->depth ++] = p_node;
+
+	uint64_t self = p_profile->nodes[p_node].self;
+	if (self == 0)
+		return;
+
+	for (word_t i = 0; i < chain->depth; ++ i) {
+		if (i > 0)
+			fputc(';', chain->file);
+
+		print_func(chain->vm, chain->file, p_profile->nodes[chain->nodes[i]].func);
+	}
+
+	fprintf(chain->file, " %llu\n", (long long unsigned)self);
+}
+
+void profile_flamegraph(struct vm *p_vm, FILE *p_file) {
+	struct profile *profile = p_vm->profile;
+	profile_flush(profile);
+
+	/* No chain is deeper than the node count */
+	struct chain chain = {
+		.nodes = (word_t*)alloc_report(sizeof(word_t) * profile->nodes_count),
+		.depth = 0,
+		.file  = p_file,
+		.vm    = p_vm,
+	};
+
+	walk_calls(profile, write_stack, &chain);
+	free(chain.nodes);
+}
+
+/* p_hz is 0 for the exact counters */
+static void report(struct vm *p_vm, FILE *p_file, int p_hz) {
+	struct profile *profile = p_vm->profile;
+	profile_flush(profile);
+
+	uint64_t ops[0x100] = {0}, total = 0;
+	word_t   executed = 0, branches = 0;
+	for (word_t i = 0; i < profile->size; ++ i) {
+		ops[p_vm->ops[i]] += profile->counts[i];
+		total             += profile->counts[i];
+
+		if (profile->counts[i] > 0) {
+			++ executed;
+
+			if (p_vm->ops[i] == OP_JNZ)
+				++ branches;
+		}
+	}
+
+	if (p_hz == 0)
+		fprintf(p_file, "\nProfile: %llu instructions executed, %llu of %llu instructions reached\n",
+		        (long long unsigned)total, (long long unsigned)executed,
+		        (long long unsigned)profile->size);
+	else
+		fprintf(p_file, "\nProfile: %llu samples at %i Hz, %llu of %llu instructions sampled\n",
+		        (long long unsigned)total, p_hz, (long long unsigned)executed,
+		        (long long unsigned)profile->size);
+
+	/* Opcodes */
+	struct entry *entries = alloc_entries(executed > 0x100? executed : 0x100);
+	word_t        count   = 0;
+	for (word_t op = 0; op < 0x100; ++ op) {
+		if (ops[op] > 0)
+			entries[count ++] = (struct entry){.key = op, .count = ops[op]};
+	}
+
+	qsort(entries, count, sizeof(struct entry), by_count);
+
+	fprintf(p_file, "\n%-8s %20s %8s\n", "Opcode", "Count", "%");
+	for (word_t i = 0; i < count; ++ i)
+		fprintf(p_file, "%-8s %20llu %7.2f%%\n", op_name(entries[i].key),
+		        (long long unsigned)entries[i].count, percent(entries[i].count, total));
+
+	/* Functions */
+	report_funcs(p_vm, p_file, total, p_hz == 0);
+
+	/* Instructions */
+	count = 0;
+	for (word_t i = 0; i < profile->size; ++ i) {
+		if (profile->counts[i] > 0)
+			entries[count ++] = (struct entry){.key = i, .count = profile->counts[i]};
+	}
+
+	qsort(entries, count, sizeof(struct entry), by_count);
+
+	fprintf(p_file, "\n%-18s %20s %8s  %s\n", "Address", "Count", "%", "Instruction");
+	for (word_t i = 0; i < count && i < PROFILE_TOP; ++ i) {
+		fprintf(p_file, "0x%"FMT_HEX" %20llu %7.2f%%  ", AS_FMT_HEX(entries[i].key),
+		        (long long unsigned)entries[i].count, percent(entries[i].count, total));
+
+		print_inst(p_vm, p_file, entries[i].key);
+		fputc('\n', p_file);
+	}
+
+	/* Branches, the instruction list is still sorted */
+	if (branches > 0 && p_hz == 0) {
+		fprintf(p_file, "\n%-18s %20s %20s %20s %8s\n",
+		        "JNZ", "Executed", "Taken", "Not taken", "Taken %");
+
+		word_t listed = 0;
+		for (word_t i = 0; i < count && listed < PROFILE_TOP; ++ i) {
+			word_t ip = entries[i].key;
+			if (p_vm->ops[ip] != OP_JNZ)
+				continue;
+
+			uint64_t taken = profile->taken[ip];
+			fprintf(p_file, "0x%"FMT_HEX" %20llu %20llu %20llu %7.2f%%\n", AS_FMT_HEX(ip),
+			        (long long unsigned)entries[i].count, (long long unsigned)taken,
+			        (long long unsigned)(entries[i].count - taken),
+			        percent(taken, entries[i].count));
+
+			++ listed;
+		}
+	}
+
+	free(entries);
+}
+
+void profile_report(struct vm *p_vm, FILE *p_file) {
+	report(p_vm, p_file, 0);
+}
+
+void profile_report_samples(struct vm *p_vm, FILE *p_file, int p_hz) {
+	report(p_vm, p_file, p_hz);
+}
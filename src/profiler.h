@@ -0,0 +1,29 @@
+#ifndef PROFILER_H__HEADER_GUARD__
+#define PROFILER_H__HEADER_GUARD__
+
+#include <stdio.h>   /* FILE, fprintf, fputc, fputs */
+#include <stdlib.h>  /* malloc, free, qsort, exit, EXIT_FAILURE */
+#include <stdbool.h> /* bool, true, false */
+
+#include "avm/vm.h"
+#include "avm/layout.h"
+#include "avm/profile.h"
+#include "avm/symbols.h"
+#include "debugger.h"
+
+#define PROFILE_TOP 32 /* Functions, instructions and branches listed in the report */
+
+/* Writes the counters of p_vm->profile: the executions of each opcode, the
+   inclusive and exclusive instruction counts of the hottest functions, the
+   hottest instructions and the taken/not taken counts of the hottest JNZs */
+void profile_report(struct vm *p_vm, FILE *p_file);
+
+/* Same report for the counters of the sampler (see sampler.h), in samples */
+void profile_report_samples(struct vm *p_vm, FILE *p_file, int p_hz);
+
+/* Writes the calling context tree of p_vm->profile as collapsed stacks, one
+   "entry;caller;callee COUNT" line per call chain, which flamegraph.pl and
+   similar tools read. Functions are named by the symbol section, or fn_0xADDR */
+void profile_flamegraph(struct vm *p_vm, FILE *p_file);
+
+#endif
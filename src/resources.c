@@ -0,0 +1,119 @@
+/* clock_gettime */
+#define _POSIX_C_SOURCE 199309L
+
+#include "resources.h"
+
+static double seconds(struct timespec *p_ts) {
+	return p_ts->tv_sec + p_ts->tv_nsec / 1000000000.0;
+}
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return seconds(&ts);
+}
+
+#ifdef USES_RUSAGE
+static double timeval_seconds(struct timeval *p_tv) {
+	return p_tv->tv_sec + p_tv->tv_usec / 1000000.0;
+}
+
+static void cpu_times(double *p_user, double *p_system) {
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+
+	*p_user   = timeval_seconds(&usage.ru_utime);
+	*p_system = timeval_seconds(&usage.ru_stime);
+}
+
+/* Largest resident set of the process */
+static uint64_t max_rss(void) {
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+
+#ifdef PLATFORM_APPLE
+	return usage.ru_maxrss; /* Bytes */
+#else
+	return (uint64_t)usage.ru_maxrss * 1024; /* Kilobytes */
+#endif
+}
+#else
+static void cpu_times(double *p_user, double *p_system) {
+	*p_user   = 0;
+	*p_system = 0;
+}
+
+static uint64_t max_rss(void) {
+	return 0;
+}
+#endif
+
+void resources_start(struct resources *p_resources) {
+	double user, system;
+	cpu_times(&user, &system);
+
+	p_resources->start     = now();
+	p_resources->cpu_start = user + system;
+}
+
+static const char *end_of(struct vm *p_vm, bool p_finished) {
+	if (p_vm->stats->panic != ERR_OK)
+		return "panic";
+	else if (!p_finished)
+		return "exit";
+	else if (VM_HALT(p_vm) == HALT_PROGRAM)
+		return "halt";
+	else
+		return "end";
+}
+
+void resources_write_json(struct resources *p_resources, struct vm *p_vm, FILE *p_file,
+                          bool p_finished) {
+	struct vm_stats *stats   = p_vm->stats;
+	struct profile  *profile = p_vm->profile;
+	profile_flush(profile);
+
+	double user, system;
+	cpu_times(&user, &system);
+
+	fprintf(p_file, "{\n");
+	fprintf(p_file, "  \"end\": \"%s\",\n", end_of(p_vm, p_finished));
+	if (stats->panic != ERR_OK)
+		fprintf(p_file, "  \"error\": \"%s\",\n", err_str(stats->panic));
+
+	/* vm_panic exits with the error */
+	word_t code = stats->panic != ERR_OK? (word_t)stats->panic : p_vm->ex;
+	fprintf(p_file, "  \"exit_code\": %llu,\n", (long long unsigned)code);
+	fprintf(p_file, "  \"instructions\": %llu,\n", (long long unsigned)profile->steps);
+	fprintf(p_file, "  \"wall_seconds\": %.6f,\n", now() - p_resources->start);
+	fprintf(p_file, "  \"cpu_seconds\": %.6f,\n", user + system - p_resources->cpu_start);
+
+	fprintf(p_file, "  \"stack\": {\"peak\": %llu, \"capacity\": %llu},\n",
+	        (long long unsigned)profile->peak_sp, (long long unsigned)p_vm->stack_capacity);
+	fprintf(p_file, "  \"call_stack\": {\"peak\": %llu, \"capacity\": %llu},\n",
+	        (long long unsigned)profile->peak_cs, (long long unsigned)p_vm->call_stack_capacity);
+	fprintf(p_file, "  \"memory\": {\"size\": %llu, \"host_max_rss\": %llu},\n",
+	        (long long unsigned)p_vm->memory_size, (long long unsigned)max_rss());
+
+	/* Descriptors that were never read or written are left out */
+	fputs("  \"files\": [", p_file);
+	bool first = true;
+	for (word_t fd = 0; fd < p_vm->maps->files_size; ++ fd) {
+		struct file *f = &p_vm->maps->files[fd];
+		if (f->read == 0 && f->written == 0)
+			continue;
+
+		fprintf(p_file, "%s\n    {\"descriptor\": %llu, \"read\": %llu, \"written\": %llu}",
+		        first? "" : ",", (long long unsigned)fd, (long long unsigned)f->read,
+		        (long long unsigned)f->written);
+		first = false;
+	}
+	fputs(first? "],\n" : "\n  ],\n", p_file);
+
+	fprintf(p_file, "  \"external\": {\"opens\": %llu, \"library_loads\": %llu, "
+	                "\"calls\": %llu, \"call_seconds\": %.6f}\n",
+	        (long long unsigned)stats->opens, (long long unsigned)stats->loads,
+	        (long long unsigned)stats->calls, stats->call_ns / 1000000000.0);
+	fprintf(p_file, "}\n");
+}
@@ -0,0 +1,38 @@
+#ifndef RESOURCES_H__HEADER_GUARD__
+#define RESOURCES_H__HEADER_GUARD__
+
+#include <stdint.h>  /* uint64_t */
+#include <stdbool.h> /* bool, true, false */
+#include <stdio.h>   /* FILE, fprintf, fputs */
+#include <string.h>  /* memset */
+#include <time.h>    /* clock_gettime, struct timespec, CLOCK_MONOTONIC */
+
+#include "avm/vm.h"
+#include "avm/profile.h"
+#include "avm/stats.h"
+#include "avm/maps.h"
+
+#if defined(PLATFORM_LINUX) || defined(PLATFORM_UNIX) || defined(PLATFORM_APPLE)
+#	define USES_RUSAGE
+
+#	include <sys/resource.h> /* getrusage, struct rusage, RUSAGE_SELF */
+#endif
+
+/* Resource statistics of a run, for --stats=json. The instructions and the
+ * peak stack sizes come from p_vm->profile (see vm_run_counted), the file and
+ * library counters from p_vm->stats, the times and the host memory from the
+ * system.
+ */
+struct resources {
+	double start;     /* Seconds on the monotonic clock */
+	double cpu_start; /* User and system seconds of the process */
+};
+
+void resources_start(struct resources *p_resources);
+
+/* Writes one JSON object. p_finished is false if the program exits from
+   inside the run, through vm_panic or an external function */
+void resources_write_json(struct resources *p_resources, struct vm *p_vm, FILE *p_file,
+                          bool p_finished);
+
+#endif
@@ -0,0 +1,83 @@
+/* setitimer, sigaction */
+#define _DEFAULT_SOURCE
+
+#include "sampler.h"
+
+#ifdef USES_SIGPROF
+static struct vm *sampled = NULL;
+
+/* Runs on the interpreter's thread, so the check and the write are never
+   interleaved with the HLT handler's write */
+static void on_sigprof(int p_sig) {
+	(void)p_sig;
+
+	if (sampled != NULL && VM_HALT(sampled) == HALT_NONE)
+		VM_SET_HALT(sampled, HALT_SAMPLE);
+}
+
+static bool set_timer(long p_usec) {
+	struct itimerval timer;
+	timer.it_interval.tv_sec  = p_usec / 1000000;
+	timer.it_interval.tv_usec = p_usec % 1000000;
+	timer.it_value            = timer.it_interval;
+
+	return setitimer(ITIMER_PROF, &timer, NULL) == 0;
+}
+
+static void take_sample(struct vm *p_vm) {
+	struct profile *profile = p_vm->profile;
+	++ profile->counts[p_vm->ip];
+
+	/* The functions are the targets of the calls the return addresses are after */
+	word_t node = CALL_ROOT;
+	for (word_t i = 0; i < p_vm->cs; ++ i)
+		node = profile_child(profile, node, vm_operand(p_vm, p_vm->call_stack[i].ip - 1).u64);
+
+	++ profile->nodes[node].self;
+}
+
+bool vm_run_sampled(struct vm *p_vm, int p_hz) {
+	/* The signal still interrupts the file instructions and the external
+	   functions. SA_RESTART only restarts most of the system calls it interrupts,
+	   instead of them failing with EINTR */
+	struct sigaction action;
+	action.sa_handler = on_sigprof;
+	action.sa_flags   = SA_RESTART;
+	sigemptyset(&action.sa_mask);
+
+	if (sigaction(SIGPROF, &action, NULL) != 0)
+		return false;
+
+	p_vm->profile->nodes[CALL_ROOT].func = p_vm->ip;
+
+	sampled = p_vm;
+	if (!set_timer(1000000 / p_hz)) {
+		sampled = NULL;
+		return false;
+	}
+
+	while (true) {
+		vm_run(p_vm);
+
+		if (VM_HALT(p_vm) != HALT_SAMPLE || p_vm->ip >= p_vm->program_size)
+			break;
+
+		take_sample(p_vm);
+		VM_SET_HALT(p_vm, HALT_NONE);
+	}
+
+	set_timer(0);
+	sampled = NULL;
+
+	/* A sample can come after the end */
+	if (VM_HALT(p_vm) == HALT_SAMPLE)
+		VM_SET_HALT(p_vm, HALT_NONE);
+
+	return true;
+}
+#else
+bool vm_run_sampled(struct vm *p_vm, int p_hz) {
+	(void)p_vm; (void)p_hz;
+	return false;
+}
+#endif
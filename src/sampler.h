@@ -0,0 +1,33 @@
+#ifndef SAMPLER_H__HEADER_GUARD__
+#define SAMPLER_H__HEADER_GUARD__
+
+#include <stdbool.h> /* bool, true, false */
+#include <signal.h>  /* sigaction, struct sigaction, sigemptyset, SIGPROF, SA_RESTART */
+
+#include "avm/vm.h"
+#include "avm/layout.h"
+#include "avm/profile.h"
+
+#if defined(PLATFORM_LINUX) || defined(PLATFORM_UNIX) || defined(PLATFORM_APPLE)
+#	define USES_SIGPROF
+
+#	include <sys/time.h> /* setitimer, struct itimerval, ITIMER_PROF */
+#endif
+
+/* Sampling profiler. A SIGPROF timer sets p_vm->halt to HALT_SAMPLE, which the
+ * fast interpreter polls after every instruction and every taken jump, so it
+ * stops with its registers written back. The sample (the ip and the functions
+ * on the call stack) is then taken outside of the signal handler, into
+ * p_vm->profile: the counts of the instructions and the self counts of the
+ * calling context tree. The run goes on from the same instruction.
+ *
+ * The cost is the poll of the jumps and one stop per sample.
+ */
+
+#define SAMPLE_MAX_HZ 100000
+
+/* Runs the program on vm_run, sampling p_hz times per second of CPU time.
+   Returns false if the platform has no profiling timer */
+bool vm_run_sampled(struct vm *p_vm, int p_hz);
+
+#endif
@@ -0,0 +1,150 @@
+/* sigaction */
+#define _DEFAULT_SOURCE
+
+#include "tracer.h"
+
+static void put_word(uint8_t *p_bytes, uint64_t p_word) {
+	for (int i = 7; i >= 0; -- i) {
+		p_bytes[i] = p_word & 0xFF;
+		p_word >>= 8;
+	}
+}
+
+static uint64_t get_word(const uint8_t *p_bytes) {
+	uint64_t word = 0;
+	for (int i = 0; i < 8; ++ i)
+		word = word << 8 | p_bytes[i];
+
+	return word;
+}
+
+#ifdef USES_SIGUSR1
+static struct vm *traced = NULL;
+
+static void on_sigusr1(int p_sig) {
+	(void)p_sig;
+
+	if (traced != NULL && VM_HALT(traced) == HALT_NONE)
+		VM_SET_HALT(traced, HALT_TRACE);
+}
+
+void trace_run(struct vm *p_vm, const char *p_path) {
+	struct sigaction action;
+	action.sa_handler = on_sigusr1;
+	action.sa_flags   = SA_RESTART;
+	sigemptyset(&action.sa_mask);
+
+	traced = p_vm;
+	if (sigaction(SIGUSR1, &action, NULL) != 0) {
+		traced = NULL;
+		VM_WARN(stderr, "Could not handle SIGUSR1, the trace is only written on a panic");
+	}
+
+	while (true) {
+		vm_run_traced(p_vm);
+
+		if (VM_HALT(p_vm) != HALT_TRACE || p_vm->ip >= p_vm->program_size)
+			break;
+
+		if (!trace_write(p_vm, p_path))
+			VM_WARN(stderr, "Could not write the trace to '%s'", p_path);
+
+		VM_SET_HALT(p_vm, HALT_NONE);
+	}
+
+	traced = NULL;
+	signal(SIGUSR1, SIG_DFL);
+
+	/* The request can come after the end */
+	if (VM_HALT(p_vm) == HALT_TRACE)
+		VM_SET_HALT(p_vm, HALT_NONE);
+}
+#else
+void trace_run(struct vm *p_vm, const char *p_path) {
+	(void)p_path;
+	vm_run_traced(p_vm);
+}
+#endif
+
+bool trace_write(struct vm *p_vm, const char *p_path) {
+	struct trace *trace = p_vm->trace;
+	word_t        len   = trace_length(trace);
+
+	FILE *file = fopen(p_path, "wb");
+	if (file == NULL)
+		return false;
+
+	uint8_t header[TRACE_HEADER_SIZE] = {'A', 'V', 'M', 'T', VERSION_MAJOR, VERSION_MINOR, VERSION_PATCH};
+	put_word(header + 8,  len);
+	put_word(header + 16, trace->recorded);
+
+	bool ok = fwrite(header, sizeof(header), 1, file) == 1;
+	for (word_t i = 0; i < len && ok; ++ i) {
+		struct trace_entry *entry = trace_at(trace, i);
+
+		uint8_t bytes[TRACE_ENTRY_SIZE];
+		put_word(bytes,     entry->ip_op);
+		put_word(bytes + 8, entry->tos);
+
+		ok = fwrite(bytes, sizeof(bytes), 1, file) == 1;
+	}
+
+	if (fclose(file) != 0)
+		ok = false;
+
+	return ok;
+}
+
+bool trace_print(const char *p_path, FILE *p_file, struct vm *p_vm) {
+	FILE *file = fopen(p_path, "rb");
+	if (file == NULL) {
+		VM_ERROR(stderr, "Could not open '%s'", p_path);
+		return false;
+	}
+
+	uint8_t header[TRACE_HEADER_SIZE];
+	if (fread(header, sizeof(header), 1, file) != 1 || memcmp(header, "AVMT", 4) != 0) {
+		VM_ERROR(stderr, "'%s' is not an avm trace", p_path);
+
+		fclose(file);
+		return false;
+	}
+
+	uint64_t len = get_word(header + 8), recorded = get_word(header + 16);
+	if (len > recorded) {
+		VM_ERROR(stderr, "'%s' is not an avm trace", p_path);
+
+		fclose(file);
+		return false;
+	}
+
+	fprintf(p_file, "Trace of avm %i.%i.%i, the last %llu of %llu executed instructions\n",
+	        header[4], header[5], header[6], (long long unsigned)len, (long long unsigned)recorded);
+	fprintf(p_file, "%20s  %-18s  %-3s  %s\n", "#", "ip", "op", "top of stack");
+
+	uint64_t i = 0;
+	for (uint8_t bytes[TRACE_ENTRY_SIZE]; i < len && fread(bytes, sizeof(bytes), 1, file) == 1; ++ i) {
+		uint64_t ip_op = get_word(bytes), tos = get_word(bytes + 8);
+		uint8_t  op    = ip_op & 0xFF;
+		word_t   ip    = ip_op >> 8;
+
+		fprintf(p_file, "%20llu  0x%"FMT_HEX"  %-3s  0x%"FMT_HEX" (%lli)",
+		        (long long unsigned)(recorded - len + i), AS_FMT_HEX(ip),
+		        op_to_str[op] == NULL? "???" : op_to_str[op], AS_FMT_HEX(tos), (long long)tos);
+
+		if (p_vm != NULL)
+			vm_print_symbol(p_vm, p_file, ip);
+
+		fputc('\n', p_file);
+	}
+
+	fclose(file);
+
+	if (i < len) {
+		VM_ERROR(stderr, "'%s' is truncated, %llu of %llu entries", p_path,
+		         (long long unsigned)i, (long long unsigned)len);
+		return false;
+	}
+
+	return true;
+}
@@ -0,0 +1,48 @@
+#ifndef TRACER_H__HEADER_GUARD__
+#define TRACER_H__HEADER_GUARD__
+
+#include <stdint.h>  /* uint8_t, uint64_t */
+#include <stdbool.h> /* bool, true, false */
+#include <stdio.h>   /* FILE, fopen, fclose, fread, fwrite, fprintf */
+#include <string.h>  /* memcmp */
+#include <signal.h>  /* sigaction, signal, struct sigaction, sigemptyset, SIGUSR1, SA_RESTART */
+
+#include "avm/vm.h"
+#include "avm/trace.h"
+#include "avm/symbols.h"
+#include "debugger.h"
+
+#if defined(PLATFORM_LINUX) || defined(PLATFORM_UNIX) || defined(PLATFORM_APPLE)
+#	define USES_SIGUSR1
+#endif
+
+/* Execution traces. The program runs on vm_run_traced, which keeps the last
+ * instructions in a ring buffer (see trace.h). The buffer is written to a file
+ * when the program panics, and every time the process gets SIGUSR1, which stops
+ * the interpreter through p_vm->halt like the sampler does. The file is
+ * decoded offline with trace_print.
+ *
+ * A trace file is a header followed by the entries, oldest first. Everything
+ * is big endian, like the executables:
+ *
+ *   "AVMT", version (3 bytes), 0, entry count (8 bytes), executed
+ *   instructions (8 bytes), then per entry: ip << 8 | opcode (8 bytes) and
+ *   the top of the stack (8 bytes)
+ */
+
+#define TRACE_HEADER_SIZE 24
+#define TRACE_ENTRY_SIZE  16
+
+/* Runs the program on vm_run_traced, writing the trace to p_path on SIGUSR1.
+   The run goes on from the same instruction */
+void trace_run(struct vm *p_vm, const char *p_path);
+
+/* Writes p_vm->trace to p_path. Returns false on error, with errno set */
+bool trace_write(struct vm *p_vm, const char *p_path);
+
+/* Decodes the trace file p_path, one instruction per line. p_vm has the symbols
+   of the traced program, or is NULL. Returns false if the file can not be read
+   or is not a trace, with a message on stderr */
+bool trace_print(const char *p_path, FILE *p_file, struct vm *p_vm);
+
+#endif
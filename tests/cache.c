@@ -0,0 +1,254 @@
+/* setenv, chmod */
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h> /* setenv, malloc, free */
+#include <string.h> /* strlen, strcmp */
+
+#include "test.h"
+#include "cache.h"
+#include "loader.h"
+#include "avm/bytes.h"
+#include "avm/fuse.h"
+
+#ifdef USES_MMAP
+#	include <dirent.h>   /* opendir, readdir, closedir */
+#	include <sys/stat.h> /* chmod */
+#	include <unistd.h>   /* ftruncate, rmdir */
+#endif
+
+/* Images of the cache (see cache.h) in the temporary directory. A hit must run
+   like the executable it was made from, and an image that can not be trusted
+   must be ignored */
+
+#ifdef USES_MMAP
+/* Sums the pushes into the data word, fused into PSH_ADD superinstructions */
+#define CACHED_PUSHES CACHE_MIN_INSTS
+#define CACHED_DATA   0x1000000000
+#define CACHED_EX     (CACHED_DATA + (word_t)CACHED_PUSHES * (CACHED_PUSHES - 1) / 2)
+
+static word_t cached_data = CACHED_DATA;
+
+static void build_cached(struct builder *p_b) {
+	uint8_t data[sizeof(word_t)];
+	bytes_store(data, cached_data, sizeof(data), false);
+	builder_set_memory(p_b, data, sizeof(data));
+
+	builder_emit(p_b, OP_PSH, 0);
+	builder_emit(p_b, OP_R64, 0);
+	for (word_t i = 0; i < CACHED_PUSHES; ++ i) {
+		builder_emit(p_b, OP_PSH, i);
+		builder_emit(p_b, OP_ADD, 0);
+	}
+
+	builder_emit(p_b, OP_HLT, 0);
+}
+
+static void build_short(struct builder *p_b) {
+	builder_emit(p_b, OP_PSH, 7);
+	builder_emit(p_b, OP_HLT, 0);
+}
+
+static char cache_dir[PATH_SIZE];
+
+static bool write_executable(const char *p_path, void (*p_build)(struct builder*)) {
+	struct builder builder;
+	builder_init(&builder);
+	p_build(&builder);
+
+	FILE *file = fopen(p_path, "wb");
+	bool  ok   = file != NULL && builder_write(&builder, file);
+	if (file != NULL && fclose(file) != 0)
+		ok = false;
+
+	builder_free(&builder);
+	return ok;
+}
+
+/* Counts the images, p_last gets the path of the last one found */
+static int images(char *p_last) {
+	DIR *dir = opendir(cache_dir);
+	if (dir == NULL)
+		return 0;
+
+	int            count = 0;
+	struct dirent *entry;
+	while ((entry = readdir(dir)) != NULL) {
+		size_t len = strlen(entry->d_name);
+		if (len < 4 || strcmp(entry->d_name + len - 4, ".avc") != 0)
+			continue;
+
+		if (p_last != NULL &&
+		    snprintf(p_last, PATH_SIZE, "%s/%s", cache_dir, entry->d_name) >= PATH_SIZE)
+			continue;
+
+		++ count;
+	}
+
+	closedir(dir);
+	return count;
+}
+
+/* Loads through the cache like avm does and runs on the mode. Returns whether
+   the program came from an image */
+static bool run_cached(const char *p_path, enum mode p_mode, word_t *p_ex) {
+	struct vm vm;
+	if (!CHECK(vm_init_embedded(&vm) == ERR_OK))
+		return false;
+
+	if (p_mode == MODE_NO_FUSE)
+		vm.fuse_rules = FUSE_NONE;
+
+	struct inst *program = NULL;
+	bool         cached  = false;
+	if (CHECK(vm_load_file(&vm, p_path, false, true, &program) == ERR_OK)) {
+		cached = vm.image != NULL;
+		CHECK(cached == (program == NULL));
+
+		run_vm(&vm, p_mode);
+		CHECK(vm.error.err == ERR_OK);
+
+		*p_ex = vm.ex;
+	}
+
+	vm_destroy(&vm);
+	free(program);
+
+	return cached;
+}
+
+/* Writes over the image at p_at, or truncates it there if p_byte is negative */
+static bool damage(const char *p_image, long p_at, int p_byte) {
+	FILE *file = fopen(p_image, "r+b");
+	if (file == NULL)
+		return false;
+
+	bool ok;
+	if (p_byte >= 0) {
+		fseek(file, p_at, SEEK_SET);
+		ok = fputc(p_byte, file) != EOF;
+	} else
+		ok = ftruncate(fileno(file), p_at) == 0;
+
+	return fclose(file) == 0 && ok;
+}
+
+static void test_hits(const char *p_path) {
+	word_t ex = 0;
+	CHECK(!run_cached(p_path, MODE_INTERPRETER, &ex) && ex == CACHED_EX);
+	CHECK(images(NULL) == 1);
+
+	/* Every mode runs the image */
+	for (int mode = 0; mode < MODES_COUNT; ++ mode) {
+		if (mode == MODE_NO_FUSE || mode == MODE_SANDBOX)
+			continue;
+
+		ex = 0;
+		if (!CHECK(run_cached(p_path, (enum mode)mode, &ex) && ex == CACHED_EX))
+			fprintf(stderr, "  cached %s: ex 0x%llx\n", mode_names[mode], (long long unsigned)ex);
+	}
+
+	/* Other superinstruction rules have their own image */
+	CHECK(!run_cached(p_path, MODE_NO_FUSE, &ex) && ex == CACHED_EX);
+	CHECK(run_cached(p_path, MODE_NO_FUSE, &ex) && ex == CACHED_EX);
+	CHECK(images(NULL) == 2);
+}
+
+/* An image that can not be used is replaced by the next load */
+static void test_untrusted(const char *p_path) {
+	static const struct {
+		const char *name;
+		long        at;
+		int         byte; /* Truncated if negative */
+	} damages[] = {
+		{"magic",     0,     'X'},
+		{"program",   0x200, 0x55}, /* Past the header, in the decoded instructions */
+		{"truncated", 0x200, -1},
+	};
+
+	char image[PATH_SIZE];
+	for (size_t i = 0; i < ARRAY_SIZE(damages); ++ i) {
+		cached_data = CACHED_DATA;
+		if (!CHECK(write_executable(p_path, build_cached)))
+			return;
+
+		word_t ex = 0;
+		run_cached(p_path, MODE_INTERPRETER, &ex);
+
+		images(image);
+		if (!CHECK(damage(image, damages[i].at, damages[i].byte)))
+			continue;
+
+		bool ok = CHECK(!run_cached(p_path, MODE_INTERPRETER, &ex) && ex == CACHED_EX) &&
+		          CHECK(run_cached(p_path, MODE_INTERPRETER, &ex) && ex == CACHED_EX);
+		if (!ok)
+			fprintf(stderr, "  damaged %s\n", damages[i].name);
+
+		remove(image);
+	}
+
+	/* Writable by others */
+	word_t ex = 0;
+	run_cached(p_path, MODE_INTERPRETER, &ex);
+
+	images(image);
+	if (CHECK(chmod(image, 0666) == 0)) {
+		CHECK(!run_cached(p_path, MODE_INTERPRETER, &ex) && ex == CACHED_EX);
+		CHECK(run_cached(p_path, MODE_INTERPRETER, &ex) && ex == CACHED_EX);
+	}
+
+	remove(image);
+}
+
+/* A changed executable does not get the image of the old one */
+static void test_changed(const char *p_path) {
+	word_t ex = 0;
+	run_cached(p_path, MODE_INTERPRETER, &ex);
+
+	cached_data = CACHED_DATA + 1;
+	if (CHECK(write_executable(p_path, build_cached))) {
+		CHECK(!run_cached(p_path, MODE_INTERPRETER, &ex) && ex == CACHED_EX + 1);
+		CHECK(run_cached(p_path, MODE_INTERPRETER, &ex) && ex == CACHED_EX + 1);
+		CHECK(images(NULL) == 2);
+	}
+
+	cached_data = CACHED_DATA;
+}
+
+static void clear_images(void) {
+	char image[PATH_SIZE];
+	while (images(image) > 0)
+		remove(image);
+}
+#endif
+
+void test_cache(void) {
+#ifdef USES_MMAP
+	temp_path(cache_dir, "images");
+	if (!CHECK(setenv("AVM_CACHE", cache_dir, 1) == 0))
+		return;
+
+	char path[PATH_SIZE];
+	temp_path(path, "cached.avs");
+
+	/* Too short to be cached */
+	word_t ex = 0;
+	if (CHECK(write_executable(path, build_short))) {
+		CHECK(!run_cached(path, MODE_INTERPRETER, &ex) && ex == 7);
+		CHECK(images(NULL) == 0);
+	}
+
+	if (!CHECK(write_executable(path, build_cached)))
+		return;
+
+	test_hits(path);
+	clear_images();
+
+	test_untrusted(path);
+	clear_images();
+
+	test_changed(path);
+	clear_images();
+
+	rmdir(cache_dir);
+#endif
+}
@@ -0,0 +1,131 @@
+/* getcwd */
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdarg.h>   /* va_list, va_start, va_end */
+#include <stdlib.h>   /* system */
+#include <string.h>   /* strstr, memcmp */
+#include <unistd.h>   /* getcwd, access, R_OK */
+#include <sys/wait.h> /* WIFEXITED, WEXITSTATUS */
+
+#include "test.h"
+#include "libavm.h"
+#include "emit.h"
+
+/* The C of `avm --emit-c`, built with the C compiler of the system and linked
+   with the vm sources like emit.h asks. Every program of modes.c must give its
+   results and exit with the exit code of avm. Skipped if there is no compiler
+   or the sources are not found, the tests run from the root of the repository */
+
+#define COMMAND_SIZE 0x400
+
+#define CC_FLAGS "-std=c11 -O1 -Wall -Wextra -Werror -pedantic -Wno-deprecated-declarations"
+
+#ifdef USES_COMPUTED_GOTO
+#	define RUNTIME_FLAGS CC_FLAGS
+#else
+#	define RUNTIME_FLAGS CC_FLAGS " -DNO_COMPUTED_GOTO"
+#endif
+
+#ifdef PLATFORM_LINUX
+#	define CC_LIBS "-ldl"
+#else
+#	define CC_LIBS ""
+#endif
+
+static char src_dir[PATH_SIZE];
+static char runtime_dir[PATH_SIZE];
+
+/* Runs a shell command, returns its exit code or -1 */
+static int shell(const char *p_fmt, ...) {
+	static char command[COMMAND_SIZE];
+
+	va_list args;
+	va_start(args, p_fmt);
+	int len = vsnprintf(command, sizeof(command), p_fmt, args);
+	va_end(args);
+
+	if (len < 0 || len >= (int)sizeof(command))
+		return -1;
+
+	int status = system(command);
+	return status != -1 && WIFEXITED(status)? WEXITSTATUS(status) : -1;
+}
+
+/* Builds the vm sources once into objects of the temporary directory, which
+   is removed with them */
+static bool build_runtime(void) {
+	char cwd[PATH_SIZE];
+	if (getcwd(cwd, sizeof(cwd)) == NULL ||
+	    snprintf(src_dir, sizeof(src_dir), "%s/src", cwd) >= (int)sizeof(src_dir))
+		return false;
+
+	char aot[PATH_SIZE];
+	if (snprintf(aot, sizeof(aot), "%s/avm/aot.h", src_dir) >= (int)sizeof(aot) ||
+	    access(aot, R_OK) != 0 || shell("cc --version > /dev/null 2>&1") != 0)
+		return false;
+
+	/* The objects are named after their sources, in the current directory */
+	temp_path(runtime_dir, "");
+	return CHECK(shell("cd '%s' && cc -c " RUNTIME_FLAGS " -I'%s' '%s'/avm/*.c", runtime_dir,
+	                   src_dir, src_dir) == 0);
+}
+
+static bool read_text(const char *p_path, char *p_text, size_t p_size, size_t *p_len) {
+	FILE *file = fopen(p_path, "rb");
+	if (file == NULL)
+		return false;
+
+	bool ok = file_text(file, p_text, p_size);
+	*p_len  = strlen(p_text);
+
+	fclose(file);
+	return ok;
+}
+
+static void test_translated(const struct program *p_program) {
+	static char output[OUTPUT_SIZE], errors[OUTPUT_SIZE];
+
+	char source[PATH_SIZE], binary[PATH_SIZE], output_path[PATH_SIZE], errors_path[PATH_SIZE];
+	temp_path(source,      "translated.c");
+	temp_path(binary,      "translated");
+	temp_path(output_path, "translated.out");
+	temp_path(errors_path, "translated.err");
+
+	struct vm vm;
+	bool      ok = CHECK(load_builder(&vm, p_program->build, MODE_INTERPRETER)) &&
+	               CHECK(vm_emit_c(&vm, p_program->name, source));
+	libavm_destroy(&vm);
+
+	if (!ok || !CHECK(shell("cc " CC_FLAGS " -I'%s' '%s' '%s'/*.o " CC_LIBS " -o '%s'", src_dir,
+	                        source, runtime_dir, binary) == 0)) {
+		fprintf(stderr, "  %s: not translated\n", p_program->name);
+		return;
+	}
+
+	/* A panic exits with the error, a halt with the exit code */
+	int code = shell("'%s' > '%s' 2> '%s'", binary, output_path, errors_path);
+	int ex   = p_program->err != ERR_OK? (int)p_program->err : (int)(p_program->ex & 0xFF);
+
+	/* A panic dumps the stacks after its message, only their start is kept */
+	size_t output_size = 0, errors_size = 0;
+	read_text(errors_path, errors, sizeof(errors), &errors_size);
+
+	ok = CHECK(read_text(output_path, output, sizeof(output), &output_size)) &&
+	     CHECK(code == ex && output_size == strlen(p_program->output) &&
+	           memcmp(output, p_program->output, output_size) == 0) &&
+	     CHECK(p_program->err == ERR_OK? errors_size == 0 :
+	                                      strstr(errors, err_str(p_program->err)) != NULL);
+	if (!ok)
+		fprintf(stderr, "  %s: exit code %i, output \"%s\", errors \"%.80s\"\n",
+		        p_program->name, code, output, errors);
+
+	remove(binary);
+}
+
+void test_emit(void) {
+	if (!build_runtime())
+		return;
+
+	for (size_t i = 0; i < programs_count; ++ i)
+		test_translated(&programs[i]);
+}
@@ -0,0 +1,87 @@
+#include <string.h> /* strlen */
+#include <stdlib.h> /* calloc, free */
+#include <unistd.h> /* access, W_OK */
+
+#include "test.h"
+#include "avm/fuse.h"
+
+/* Histogram files of --record-pairs and --fuse-from */
+
+static bool read_text(pairs_t *p_pairs, const char *p_text) {
+	char path[PATH_SIZE];
+	temp_path(path, "pairs");
+
+	return CHECK(write_file(path, p_text, strlen(p_text))) && pairs_read(p_pairs, path);
+}
+
+static void test_round_trip(pairs_t *p_pairs, pairs_t *p_read) {
+	(*p_pairs)[OP_DUP][OP_JNZ] = 1000;
+	(*p_pairs)[OP_PSH][OP_ADD] = 3;
+	(*p_pairs)[0xFF][0x00]     = (uint64_t)-1;
+
+	char path[PATH_SIZE];
+	temp_path(path, "written");
+
+	CHECK(pairs_write(p_pairs, path));
+	CHECK(pairs_read(p_read, path));
+	CHECK(memcmp(p_pairs, p_read, sizeof(pairs_t)) == 0);
+
+	/* The counts are added, like histograms that are concatenated */
+	CHECK(pairs_read(p_read, path));
+	CHECK((*p_read)[OP_DUP][OP_JNZ] == 2000 && (*p_read)[OP_PSH][OP_ADD] == 6);
+}
+
+static void test_malformed(pairs_t *p_pairs) {
+	CHECK(read_text(p_pairs, ""));
+	CHECK(read_text(p_pairs, "01 02 3\n\n  04 05 6  \n"));
+	CHECK((*p_pairs)[0x01][0x02] == 3 && (*p_pairs)[0x04][0x05] == 6);
+
+	static const char *malformed[] = {
+		"01 02 3\nnot a pair\n04 05 6\n", /* In the middle */
+		"01 02 3\n04 05\n",               /* Truncated */
+		"01 02 3\n04\n",
+		"100 02 3\n",                     /* Not opcodes */
+		"01 1FF 3\n",
+		"01 02 x\n",
+	};
+
+	for (size_t i = 0; i < ARRAY_SIZE(malformed); ++ i) {
+		errno = 0;
+		if (!CHECK(!read_text(p_pairs, malformed[i]) && errno == EINVAL))
+			fprintf(stderr, "  read \"%s\"\n", malformed[i]);
+	}
+
+	char path[PATH_SIZE];
+	temp_path(path, "missing");
+	CHECK(!pairs_read(p_pairs, path));
+}
+
+static void test_write_errors(pairs_t *p_pairs) {
+	(*p_pairs)[OP_PSH][OP_ADD] = 1;
+
+	char path[PATH_SIZE];
+	temp_path(path, "missing/pairs");
+	CHECK(!pairs_write(p_pairs, path));
+
+	/* Every write fails, the buffered ones only when the file is closed */
+	if (access("/dev/full", W_OK) == 0)
+		CHECK(!pairs_write(p_pairs, "/dev/full"));
+}
+
+void test_fuse(void) {
+	pairs_t *pairs = (pairs_t*)calloc(1, sizeof(pairs_t));
+	pairs_t *read  = (pairs_t*)calloc(1, sizeof(pairs_t));
+	if (!CHECK(pairs != NULL && read != NULL))
+		return;
+
+	test_round_trip(pairs, read);
+
+	memset(pairs, 0, sizeof(pairs_t));
+	test_malformed(pairs);
+
+	memset(pairs, 0, sizeof(pairs_t));
+	test_write_errors(pairs);
+
+	free(pairs);
+	free(read);
+}
@@ -0,0 +1,274 @@
+#include <string.h> /* memcmp, memcpy, strcmp */
+#include <stdlib.h> /* malloc, free */
+
+#include "test.h"
+#include "libavm.h"
+#include "avm/symbols.h"
+
+/* Sectioned executables written by builder_write, loaded from a mapped file
+   and from a stream. Both loaders must agree on what is valid */
+
+#define DATA_SIZE       4
+#define BSS_SIZE        0x2000
+#define STACK_SIZE      0x800
+#define CALL_STACK_SIZE 0x400
+
+static const uint8_t data[DATA_SIZE] = {0x01, 0x02, 0x03, 0x04};
+
+/* Reads the data little endian and the last bss byte, the sum is the exit code */
+static void build_sectioned(struct builder *p_b) {
+	builder_emit(p_b, OP_PSH, 0);
+	builder_emit(p_b, OP_R16, 0);
+	builder_emit(p_b, OP_PSH, DATA_SIZE + BSS_SIZE - 1);
+	builder_emit(p_b, OP_R08, 0);
+	builder_emit(p_b, OP_ADD, 0);
+	builder_emit(p_b, OP_HLT, 0);
+
+	builder_set_memory(p_b, data, sizeof(data));
+	builder_set_bss(p_b, BSS_SIZE);
+	builder_set_stack_sizes(p_b, STACK_SIZE, CALL_STACK_SIZE);
+	builder_set_little_endian(p_b, true);
+	builder_add_symbol(p_b, "main", 0, 6);
+}
+
+#define SECTIONED_EX 0x0201
+
+/* Offsets in the written file: the header, then the code, data, symbols, bss,
+   stack, call stack and flags entries, then the sections on their own pages */
+#define TABLE_AT(P_ENTRY) (sizeof(struct file_header) + (P_ENTRY) * sizeof(struct file_section))
+#define ENTRY_TYPE(P_ENTRY)   TABLE_AT(P_ENTRY)
+#define ENTRY_OFFSET(P_ENTRY) (TABLE_AT(P_ENTRY) + sizeof(word_t))
+#define ENTRY_SIZE(P_ENTRY)   (TABLE_AT(P_ENTRY) + 2 * sizeof(word_t))
+
+enum {
+	ENTRY_CODE = 0,
+	ENTRY_DATA,
+	ENTRY_SYMBOLS,
+	ENTRY_BSS,
+	ENTRY_STACK,
+	ENTRY_CALL_STACK,
+	ENTRY_FLAGS,
+};
+
+#define CODE_AT    FILE_SECTION_ALIGN
+#define DATA_AT    (2 * FILE_SECTION_ALIGN)
+#define SYMBOLS_AT (3 * FILE_SECTION_ALIGN)
+
+/* Returns the written file, that the caller frees */
+static uint8_t *write_sectioned(size_t *p_size) {
+	struct builder builder;
+	builder_init(&builder);
+	build_sectioned(&builder);
+
+	char path[PATH_SIZE];
+	temp_path(path, "sectioned");
+
+	uint8_t *bytes = NULL;
+	FILE    *file  = fopen(path, "w+b");
+	if (CHECK(file != NULL) && CHECK(builder_write(&builder, file))) {
+		*p_size = ftell(file);
+		rewind(file);
+
+		bytes = (uint8_t*)malloc(*p_size);
+		if (!CHECK(bytes != NULL && fread(bytes, 1, *p_size, file) == *p_size)) {
+			free(bytes);
+			bytes = NULL;
+		}
+	}
+
+	if (file != NULL)
+		fclose(file);
+
+	builder_free(&builder);
+	return bytes;
+}
+
+static void store_word(uint8_t *p_bytes, size_t p_at, word_t p_word) {
+	bytes_store(p_bytes + p_at, p_word, sizeof(word_t), false);
+}
+
+enum load {
+	LOAD_FILE = 0,
+	LOAD_STREAM,
+	LOAD_BUILDER,
+
+	LOADS_COUNT,
+};
+
+static const char *load_names[LOADS_COUNT] = {
+	[LOAD_FILE]    = "file",
+	[LOAD_STREAM]  = "stream",
+	[LOAD_BUILDER] = "builder",
+};
+
+static enum err load(struct vm *p_vm, enum load p_load, const uint8_t *p_bytes, size_t p_size) {
+	enum err err = libavm_init(p_vm);
+	if (err != ERR_OK)
+		return err;
+
+	char path[PATH_SIZE];
+	temp_path(path, "patched");
+
+	switch (p_load) {
+	case LOAD_FILE:
+		if (!CHECK(write_file(path, p_bytes, p_size)))
+			return ERR_CANNOT_READ;
+
+		return libavm_load_file(p_vm, path);
+
+	case LOAD_STREAM: return libavm_load_mem(p_vm, p_bytes, p_size);
+
+	default: {
+		struct builder builder;
+		builder_init(&builder);
+		build_sectioned(&builder);
+
+		err = libavm_load_builder(p_vm, &builder);
+		builder_free(&builder);
+
+		return err;
+	}
+	}
+}
+
+static void test_valid(const uint8_t *p_bytes, size_t p_size) {
+	for (int i = 0; i < LOADS_COUNT; ++ i) {
+#ifndef USES_FMEMOPEN
+		if (i == LOAD_STREAM)
+			continue;
+#endif
+
+		struct vm vm;
+		if (CHECK(load(&vm, (enum load)i, p_bytes, p_size) == ERR_OK)) {
+			const struct symbol *symbol = vm_symbol_at(&vm, 5);
+
+			bool ok = CHECK(vm.memory_size == DATA_SIZE + BSS_SIZE) &&
+			          CHECK(memcmp(vm.memory, data, DATA_SIZE) == 0) &&
+			          CHECK(vm.memory[DATA_SIZE] == 0 && vm.memory[vm.memory_size - 1] == 0) &&
+			          CHECK(vm.little_endian) &&
+			          CHECK(vm.stack_capacity == STACK_SIZE / sizeof(value_t) &&
+			                vm.call_stack_capacity == CALL_STACK_SIZE / sizeof(word_t)) &&
+			          CHECK(symbol != NULL && strcmp(symbol->name, "main") == 0 &&
+			                symbol->addr == 0 && symbol->size == 6) &&
+			          CHECK(vm_symbol_at(&vm, 6) == NULL) &&
+			          CHECK(libavm_run(&vm) == ERR_OK && vm.ex == SECTIONED_EX);
+			if (!ok)
+				fprintf(stderr, "  valid %s: %s\n", load_names[i], libavm_error(&vm)->msg);
+		}
+
+		libavm_destroy(&vm);
+	}
+}
+
+/* Every mode runs the mapped file */
+static void test_run_modes(void) {
+	char path[PATH_SIZE];
+	temp_path(path, "sectioned");
+
+	for (int i = 0; i < MODES_COUNT; ++ i) {
+		struct run run;
+		if (!CHECK(run_file(&run, path, (enum mode)i) && run.ex == SECTIONED_EX &&
+		           run.err == ERR_OK))
+			fprintf(stderr, "  sectioned %s: ex %llu, %s\n", mode_names[i],
+			        (unsigned long long)run.ex, err_str(run.err));
+	}
+}
+
+/* p_bytes is a copy of the written file to be patched, both loaders must
+   refuse it */
+static void check_invalid(const char *p_name, const uint8_t *p_bytes, size_t p_size) {
+	for (int i = 0; i < LOAD_BUILDER; ++ i) {
+#ifndef USES_FMEMOPEN
+		if (i == LOAD_STREAM)
+			continue;
+#endif
+
+		struct vm vm;
+		if (!CHECK(load(&vm, (enum load)i, p_bytes, p_size) == ERR_INVALID_EXECUTABLE))
+			fprintf(stderr, "  %s %s: %s\n", p_name, load_names[i], libavm_error(&vm)->msg);
+
+		libavm_destroy(&vm);
+	}
+}
+
+static void test_truncated(const uint8_t *p_bytes) {
+	static const struct {
+		const char *name;
+		size_t      size;
+	} truncated[] = {
+		{"header",  sizeof(struct file_header) - 1},
+		{"table",   TABLE_AT(ENTRY_FLAGS) + 1},
+		{"padding", CODE_AT - 1},
+		{"code",    CODE_AT + sizeof(struct inst) * 3},
+		{"data",    DATA_AT + DATA_SIZE / 2},
+		{"symbols", SYMBOLS_AT + sizeof(struct file_symbol)},
+	};
+
+	for (size_t i = 0; i < ARRAY_SIZE(truncated); ++ i)
+		check_invalid(truncated[i].name, p_bytes, truncated[i].size);
+}
+
+static void test_patched(const uint8_t *p_bytes, size_t p_size) {
+	uint8_t *patched = (uint8_t*)malloc(p_size);
+	if (!CHECK(patched != NULL))
+		return;
+
+	static const struct {
+		const char *name;
+		size_t      at;
+		word_t      word;
+	} patches[] = {
+		{"data-over-code",    ENTRY_OFFSET(ENTRY_DATA),        CODE_AT},
+		{"code-over-data",    ENTRY_OFFSET(ENTRY_CODE),        DATA_AT - sizeof(struct inst)},
+		{"data-over-symbols", ENTRY_OFFSET(ENTRY_DATA),        SYMBOLS_AT + DATA_SIZE},
+		{"code-over-table",   ENTRY_OFFSET(ENTRY_CODE),        TABLE_AT(ENTRY_FLAGS)},
+		{"code-size",         ENTRY_SIZE(ENTRY_CODE),          sizeof(struct inst) * 6 + 1},
+		{"unknown-flags",     ENTRY_SIZE(ENTRY_FLAGS),         FILE_FLAG_LITTLE_ENDIAN | 2},
+		{"stack-size",        ENTRY_SIZE(ENTRY_STACK),         sizeof(value_t) - 1},
+		{"huge-call-stack",   ENTRY_SIZE(ENTRY_CALL_STACK),    (word_t)-1},
+		{"symbol-name-size",  SYMBOLS_AT + 2 * sizeof(word_t), 5},
+	};
+
+	for (size_t i = 0; i < ARRAY_SIZE(patches); ++ i) {
+		memcpy(patched, p_bytes, p_size);
+		store_word(patched, patches[i].at, patches[i].word);
+
+		check_invalid(patches[i].name, patched, p_size);
+	}
+
+	/* A section of a newer version is skipped, the call stack gets the default size */
+	memcpy(patched, p_bytes, p_size);
+	store_word(patched, ENTRY_TYPE(ENTRY_CALL_STACK), 0x100);
+
+	char path[PATH_SIZE];
+	temp_path(path, "patched");
+
+	struct vm vm;
+	if (CHECK(write_file(path, patched, p_size)) &&
+	    CHECK(libavm_init(&vm) == ERR_OK)) {
+		CHECK(libavm_load_file(&vm, path) == ERR_OK &&
+		      vm.call_stack_capacity == CALL_STACK_SIZE_BYTES / sizeof(word_t) &&
+		      libavm_run(&vm) == ERR_OK && vm.ex == SECTIONED_EX);
+
+		libavm_destroy(&vm);
+	}
+
+	free(patched);
+}
+
+void test_loader(void) {
+	size_t   size  = 0;
+	uint8_t *bytes = write_sectioned(&size);
+	if (bytes == NULL)
+		return;
+
+	CHECK(size == SYMBOLS_AT + sizeof(struct file_symbol) + 4);
+	CHECK(memcmp(bytes, "AVS", 3) == 0);
+
+	test_valid(bytes, size);
+	test_run_modes();
+	test_truncated(bytes);
+	test_patched(bytes, size);
+
+	free(bytes);
+}
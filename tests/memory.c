@@ -0,0 +1,384 @@
+/* mincore */
+#define _DEFAULT_SOURCE
+
+#include <string.h> /* memcmp, memcpy, memset */
+
+#include "test.h"
+#include "libavm.h"
+#include "avm/bytes.h"
+#include "avm/sandbox.h"
+#include "avm/large.h"
+#include "debugger.h"
+
+#ifdef USES_LARGE_MEMORY
+#	include <sys/mman.h> /* mincore */
+#	include <unistd.h>   /* sysconf, _SC_PAGESIZE */
+#endif
+
+/* The byte order of the memory and the bounds of the accesses. Every mode must
+   write the same bytes, at any alignment, and stop at the same invalid access */
+
+#define LAYOUT_SIZE 24
+
+static void build_layout(struct builder *p_b) {
+	static const uint8_t memory[LAYOUT_SIZE] = {0};
+	builder_set_memory(p_b, memory, sizeof(memory));
+
+	builder_emit(p_b, OP_PSH, 1);
+	builder_emit(p_b, OP_PSH, 0x0102);
+	builder_emit(p_b, OP_W16, 0);
+	builder_emit(p_b, OP_PSH, 3);
+	builder_emit(p_b, OP_PSH, 0x01020304);
+	builder_emit(p_b, OP_W32, 0);
+	builder_emit(p_b, OP_PSH, 9);
+	builder_emit(p_b, OP_PSH, 0x0102030405060708);
+	builder_emit(p_b, OP_W64, 0);
+	builder_emit(p_b, OP_PSH, 2);
+	builder_emit(p_b, OP_R16, 0);
+	builder_emit(p_b, OP_HLT, 0);
+}
+
+static void build_layout_le(struct builder *p_b) {
+	build_layout(p_b);
+	builder_set_little_endian(p_b, true);
+}
+
+static const struct {
+	const char *name;
+	void      (*build)(struct builder*);
+	word_t      ex;
+	uint8_t     memory[LAYOUT_SIZE];
+} layouts[] = {
+	{"big",    build_layout,    0x0201,
+	 {0, 1, 2, 1, 2, 3, 4, 0, 0, 1, 2, 3, 4, 5, 6, 7, 8}},
+	{"little", build_layout_le, 0x0401,
+	 {0, 2, 1, 4, 3, 2, 1, 0, 0, 8, 7, 6, 5, 4, 3, 2, 1}},
+};
+
+static void test_layouts(void) {
+	for (size_t i = 0; i < ARRAY_SIZE(layouts); ++ i) {
+		for (int mode = 0; mode < MODES_COUNT; ++ mode) {
+			struct vm vm;
+			if (CHECK(load_builder(&vm, layouts[i].build, (enum mode)mode))) {
+				run_vm(&vm, (enum mode)mode);
+
+				if (!CHECK(libavm_error(&vm)->err == ERR_OK && vm.ex == layouts[i].ex &&
+				           memcmp(vm.memory, layouts[i].memory, LAYOUT_SIZE) == 0))
+					fprintf(stderr, "  %s %s: ex 0x%llX\n", layouts[i].name, mode_names[mode],
+					        (long long unsigned)vm.ex);
+			}
+
+			libavm_destroy(&vm);
+		}
+	}
+}
+
+static void test_bytes(void) {
+	static const uint8_t big[8]    = {1, 2, 3, 4, 5, 6, 7, 8};
+	static const uint8_t little[8] = {8, 7, 6, 5, 4, 3, 2, 1};
+
+	static const int sizes[] = {1, 2, 4, 8};
+	for (size_t i = 0; i < ARRAY_SIZE(sizes); ++ i) {
+		int      size  = sizes[i];
+		uint64_t mask  = size == 8? (uint64_t)-1 : ((uint64_t)1 << size * 8) - 1;
+		uint64_t value = 0x0102030405060708 & mask;
+
+		/* Unaligned */
+		uint8_t bytes[9] = {0};
+		bytes_store(bytes + 1, value, size, false);
+		CHECK(memcmp(bytes + 1, big + 8 - size, size) == 0 && bytes[0] == 0);
+		CHECK(bytes_load(bytes + 1, size, false) == value);
+
+		bytes_store(bytes + 1, value, size, true);
+		CHECK(memcmp(bytes + 1, little, size) == 0 && bytes[0] == 0);
+		CHECK(bytes_load(bytes + 1, size, true) == value);
+
+		/* Only the low bytes are stored */
+		memset(bytes, 0, sizeof(bytes));
+		bytes_store(bytes, (uint64_t)-1, size, true);
+		CHECK(bytes_load(bytes, 8, true) == mask);
+	}
+}
+
+/* A flat executable has no flags, it is big endian after a little endian one */
+static void test_flat(void) {
+	static const struct inst program[] = {
+		{OP_PSH, {.u64 = 1}}, {OP_PSH, {.u64 = 0x0102}}, {OP_W16, {0}},
+		{OP_PSH, {.u64 = 0}}, {OP_HLT, {0}},
+	};
+
+	struct file_meta meta;
+	memcpy(meta.magic, "AVM", 3);
+	meta.ver[0] = VERSION_MAJOR;
+	meta.ver[1] = VERSION_MINOR;
+	meta.ver[2] = VERSION_PATCH;
+	bytes_store(meta.program_size, ARRAY_SIZE(program), sizeof(word_t), false);
+	bytes_store(meta.memory_size,  LAYOUT_SIZE,         sizeof(word_t), false);
+	bytes_store(meta.entry_point,  0,                   sizeof(word_t), false);
+
+	uint8_t file[sizeof(meta) + LAYOUT_SIZE + sizeof(program)] = {0};
+	memcpy(file, &meta, sizeof(meta));
+	for (size_t i = 0; i < ARRAY_SIZE(program); ++ i) {
+		uint8_t *inst = file + sizeof(meta) + LAYOUT_SIZE + i * sizeof(struct inst);
+
+		inst[0] = program[i].op;
+		bytes_store(inst + 1, program[i].data.u64, sizeof(word_t), false);
+	}
+
+	char path[PATH_SIZE];
+	temp_path(path, "flat.avm");
+
+	struct vm vm;
+	if (CHECK(load_builder(&vm, build_layout_le, MODE_INTERPRETER)) &&
+	    CHECK(write_file(path, file, sizeof(file)))) {
+		CHECK(vm.little_endian);
+
+		if (CHECK(libavm_load_file(&vm, path) == ERR_OK)) {
+			CHECK(!vm.little_endian);
+			CHECK(libavm_run(&vm) == ERR_OK && vm.memory[1] == 1 && vm.memory[2] == 2);
+		}
+	}
+
+	libavm_destroy(&vm);
+}
+
+/* Not a multiple of the page size, the sandbox ends the memory at its guard
+   pages */
+#define ACCESS_SIZE 100
+
+static word_t      access_addr;
+static enum opcode access_op;
+
+/* Reads or writes at access_addr, the access is at ip 1 for a read and 2 for
+   a write */
+static void build_access(struct builder *p_b) {
+	static const uint8_t memory[ACCESS_SIZE] = {0};
+	builder_set_memory(p_b, memory, sizeof(memory));
+
+	bool write = access_op >= OP_W08;
+	builder_emit(p_b, OP_PSH, access_addr);
+	if (write)
+		builder_emit(p_b, OP_PSH, 0x55);
+
+	builder_emit(p_b, access_op, 0);
+	if (write)
+		builder_emit(p_b, OP_PSH, 0);
+
+	builder_emit(p_b, OP_HLT, 0);
+}
+
+static void test_bounds(void) {
+	static const word_t addrs[] = {
+		0, ACCESS_SIZE - 8, ACCESS_SIZE - 2, ACCESS_SIZE - 1, ACCESS_SIZE, ACCESS_SIZE + 0x1000,
+		SANDBOX_SPAN - 8, SANDBOX_SPAN - 1, SANDBOX_SPAN, (word_t)-8, (word_t)-1,
+	};
+
+	static const struct {
+		enum opcode op;
+		word_t      size;
+	} ops[] = {
+		{OP_R08, 1}, {OP_R16, 2}, {OP_R32, 4}, {OP_R64, 8},
+		{OP_W08, 1}, {OP_W16, 2}, {OP_W32, 4}, {OP_W64, 8},
+	};
+
+	for (size_t i = 0; i < ARRAY_SIZE(addrs); ++ i) {
+		for (size_t j = 0; j < ARRAY_SIZE(ops); ++ j) {
+			access_addr = addrs[i];
+			access_op   = ops[j].op;
+
+			bool     write = ops[j].op >= OP_W08;
+			bool     valid = addrs[i] <= ACCESS_SIZE - ops[j].size;
+			enum err err   = valid? ERR_OK : ERR_INVALID_MEM_ACCESS;
+			word_t   ip    = write? 2 : 1;
+
+			for (int mode = 0; mode < MODES_COUNT; ++ mode) {
+				struct run run;
+				if (!CHECK(run_builder(&run, build_access, (enum mode)mode) &&
+				           run.err == err && run.ip == (valid? 0 : ip)))
+					fprintf(stderr, "  %s 0x%llX %s: %s at %llu\n", op_to_str[ops[j].op],
+					        (long long unsigned)addrs[i], mode_names[mode], err_str(run.err),
+					        (long long unsigned)run.ip);
+			}
+		}
+	}
+}
+
+#ifdef USES_SANDBOX
+/* The memory is kept, a fault does not break the vm, a new program gets a new
+   sandbox */
+static void test_sandbox(void) {
+	struct vm vm;
+	if (!CHECK(load_builder(&vm, build_layout, MODE_SANDBOX))) {
+		libavm_destroy(&vm);
+		return;
+	}
+
+	CHECK(vm.sandbox && vm.memory_size == LAYOUT_SIZE);
+	CHECK(vm_sandbox(&vm) == ERR_OK && vm.sandbox);
+
+	vm_run(&vm);
+	CHECK(memcmp(vm.memory, layouts[0].memory, LAYOUT_SIZE) == 0);
+
+	access_addr = ACCESS_SIZE;
+	access_op   = OP_R64;
+
+	struct builder builder;
+	builder_init(&builder);
+	build_access(&builder);
+
+	if (CHECK(libavm_load_builder(&vm, &builder) == ERR_OK) && CHECK(vm_sandbox(&vm) == ERR_OK)) {
+		vm_run(&vm);
+		CHECK(libavm_error(&vm)->err == ERR_INVALID_MEM_ACCESS && libavm_error(&vm)->ip == 1);
+
+		/* Past the fault */
+		access_addr = ACCESS_SIZE - 8;
+		builder_free(&builder);
+		build_access(&builder);
+
+		CHECK(libavm_load_builder(&vm, &builder) == ERR_OK && vm_sandbox(&vm) == ERR_OK &&
+		      libavm_run(&vm) == ERR_OK);
+	}
+
+	builder_free(&builder);
+
+	/* Not reserved */
+	CHECK(sandbox_resize(&vm, SANDBOX_SPAN + 1) == ERR_OUT_OF_MEMORY && vm.sandbox &&
+	      vm.memory_size == ACCESS_SIZE);
+
+	libavm_destroy(&vm);
+}
+#endif
+
+#ifdef USES_LARGE_MEMORY
+/* Declares LARGE_SIZE bytes and only touches the last word */
+#define LARGE_SIZE ((word_t)1 << 28)
+#define LARGE_EX   0x55
+
+static void build_large(struct builder *p_b) {
+	builder_set_bss(p_b, LARGE_SIZE);
+
+	builder_emit(p_b, OP_PSH, LARGE_SIZE - 8);
+	builder_emit(p_b, OP_PSH, LARGE_EX);
+	builder_emit(p_b, OP_W64, 0);
+	builder_emit(p_b, OP_PSH, LARGE_SIZE - 8);
+	builder_emit(p_b, OP_R64, 0);
+	builder_emit(p_b, OP_HLT, 0);
+}
+
+/* Like the command line, the memory is reserved by the load */
+static bool load_large(struct vm *p_vm, const struct large_memory *p_large, enum mode p_mode) {
+	if (libavm_init(p_vm) != ERR_OK)
+		return false;
+
+	p_vm->large = p_large;
+
+	struct builder builder;
+	builder_init(&builder);
+	build_large(&builder);
+
+	enum err err = libavm_load_builder(p_vm, &builder);
+	builder_free(&builder);
+
+#ifdef USES_SANDBOX
+	if (err == ERR_OK && p_mode == MODE_SANDBOX)
+		err = vm_sandbox(p_vm);
+#else
+	(void)p_mode;
+#endif
+
+	return err == ERR_OK;
+}
+
+/* Bytes of the memory in RAM */
+static size_t resident(const struct vm *p_vm) {
+	static unsigned char pages[LARGE_SIZE / 0x1000];
+
+	size_t page  = sysconf(_SC_PAGESIZE);
+	size_t count = (p_vm->memory_size + page - 1) / page;
+	if (count > sizeof(pages) || mincore(p_vm->memory, count * page, pages) != 0)
+		return (size_t)-1;
+
+	size_t size = 0;
+	for (size_t i = 0; i < count; ++ i)
+		size += (pages[i] & 1) * page;
+
+	return size;
+}
+
+/* The declared size is reserved but not committed, on every mode */
+static void test_large_modes(void) {
+	static const struct large_memory large = {.huge_pages = HUGE_PAGES_TRANSPARENT};
+
+	for (int mode = 0; mode < MODES_COUNT; ++ mode) {
+		struct vm vm;
+		if (CHECK(load_large(&vm, &large, (enum mode)mode))) {
+			CHECK(vm.mapping != NULL && vm.memory_size == LARGE_SIZE);
+			run_vm(&vm, (enum mode)mode);
+
+			size_t size = resident(&vm);
+			if (!CHECK(libavm_error(&vm)->err == ERR_OK && vm.ex == LARGE_EX &&
+			           size > 0 && size < LARGE_SIZE / 64))
+				fprintf(stderr, "  large %s: %s, %llu bytes resident\n", mode_names[mode],
+				        err_str(libavm_error(&vm)->err), (long long unsigned)size);
+		}
+
+		libavm_destroy(&vm);
+	}
+}
+
+static void test_large(void) {
+	static const struct large_memory plain    = {.huge_pages = HUGE_PAGES_NONE};
+	static const struct large_memory explicit = {.huge_pages = HUGE_PAGES_EXPLICIT};
+	static const struct large_memory no_node  = {
+		.numa  = NUMA_BIND,
+		.nodes = (uint64_t)1 << (LARGE_MAX_NODES - 1),
+	};
+
+	/* Moved into a reservation after the load, keeping the memory */
+	struct vm vm;
+	if (CHECK(load_builder(&vm, build_layout, MODE_INTERPRETER)) &&
+	    CHECK(vm_large_memory(&vm, &plain) == ERR_OK)) {
+		CHECK(vm.large == &plain && vm.mapping != NULL && vm.memory_size == LAYOUT_SIZE);
+
+		vm_run(&vm);
+		CHECK(memcmp(vm.memory, layouts[0].memory, LAYOUT_SIZE) == 0);
+
+		/* Grows in place of the reservation */
+		if (CHECK(vm_alloc_mem(&vm, LARGE_SIZE) == ERR_OK)) {
+			CHECK(vm.large == &plain && vm.memory_size == LARGE_SIZE);
+			CHECK(memcmp(vm.memory, layouts[0].memory, LAYOUT_SIZE) == 0);
+			CHECK(vm.memory[LARGE_SIZE - 1] == 0 && resident(&vm) < LARGE_SIZE / 64);
+		}
+
+		/* A failed placement keeps the memory and the previous options */
+		uint8_t *memory = vm.memory;
+		CHECK(vm_large_memory(&vm, &no_node) == ERR_OUT_OF_MEMORY);
+		CHECK(vm.large == &plain && vm.memory == memory && vm.memory_size == LARGE_SIZE);
+
+		/* Without huge pages reserved in the system, the memory is kept too */
+		enum err err = vm_large_memory(&vm, &explicit);
+		CHECK((err == ERR_OK && vm.large == &explicit) ||
+		      (err == ERR_OUT_OF_MEMORY && vm.large == &plain && vm.memory == memory));
+		CHECK(memcmp(vm.memory, layouts[0].memory, LAYOUT_SIZE) == 0);
+	}
+
+	libavm_destroy(&vm);
+
+	test_large_modes();
+}
+#endif
+
+void test_memory(void) {
+	test_bytes();
+	test_layouts();
+	test_flat();
+	test_bounds();
+
+#ifdef USES_SANDBOX
+	test_sandbox();
+#endif
+
+#ifdef USES_LARGE_MEMORY
+	test_large();
+#endif
+}
@@ -0,0 +1,343 @@
+#include <string.h> /* strrchr, memcmp */
+
+#include "test.h"
+#include "libavm.h"
+#include "avm/layout.h"
+
+/* Programs with known results, the modes must all give the expected exit code,
+   output and panic */
+
+static void build_arith(struct builder *p_b) {
+	builder_emit(p_b, OP_PSH, 10);
+	builder_emit(p_b, OP_PSH, 3);
+	builder_emit(p_b, OP_SUB, 0);
+	builder_emit(p_b, OP_PSH, 7);
+	builder_emit(p_b, OP_MUL, 0);
+	builder_emit(p_b, OP_DUP, 0);
+	builder_emit(p_b, OP_PRT, 0);
+	builder_emit(p_b, OP_PSH, 5);
+	builder_emit(p_b, OP_DIV, 0);
+	builder_emit(p_b, OP_DUP, 0);
+	builder_emit(p_b, OP_PRT, 0);
+	builder_emit(p_b, OP_PSH, 4);
+	builder_emit(p_b, OP_MOD, 0);
+	builder_emit(p_b, OP_NEG, 0);
+	builder_emit(p_b, OP_DUP, 0);
+	builder_emit(p_b, OP_PRT, 0);
+	builder_emit(p_b, OP_INC, 0);
+	builder_emit(p_b, OP_PSH, 1);
+	builder_emit(p_b, OP_PSH, 62);
+	builder_emit(p_b, OP_BSL, 0);
+	builder_emit(p_b, OP_PSH, 60);
+	builder_emit(p_b, OP_BSR, 0);
+	builder_emit(p_b, OP_PSH, 6);
+	builder_emit(p_b, OP_BOR, 0);
+	builder_emit(p_b, OP_PSH, 5);
+	builder_emit(p_b, OP_BAN, 0);
+	builder_emit(p_b, OP_ADD, 0);
+	builder_emit(p_b, OP_HLT, 0);
+}
+
+static void build_compare(struct builder *p_b) {
+	static const enum opcode ops[] = {
+		OP_EQU, OP_NEQ, OP_GRT, OP_GEQ, OP_LES, OP_LEQ,
+		OP_UEQ, OP_UNE, OP_UGR, OP_UGQ, OP_ULE, OP_ULQ,
+	};
+
+	/* -1 against 1 differs between the signed and the unsigned comparisons */
+	for (size_t i = 0; i < sizeof(ops) / sizeof(*ops); ++ i) {
+		builder_emit(p_b, OP_PSH, -1);
+		builder_emit(p_b, OP_PSH, 1);
+		builder_emit(p_b, ops[i], 0);
+		builder_emit(p_b, OP_PRT, 0);
+	}
+
+	builder_emit(p_b, OP_PSH, 0);
+	builder_emit(p_b, OP_NOT, 0);
+	builder_emit(p_b, OP_PSH, 0);
+	builder_emit(p_b, OP_AND, 0);
+	builder_emit(p_b, OP_PSH, 2);
+	builder_emit(p_b, OP_ORR, 0);
+	builder_emit(p_b, OP_PRT, 0);
+}
+
+/* Sum of 0 to 9999, with the counter under the accumulator */
+static void build_loop(struct builder *p_b) {
+	builder_emit(p_b, OP_PSH, 0);
+	builder_emit(p_b, OP_PSH, 10000);
+
+	word_t loop = builder_emit(p_b, OP_DEC, 0);
+	builder_emit(p_b, OP_DUP, 0);
+	builder_emit(p_b, OP_SWP, 1);
+	builder_emit(p_b, OP_ADD, 0);
+	builder_emit(p_b, OP_SWP, 0);
+	builder_emit(p_b, OP_DUP, 0);
+	builder_emit(p_b, OP_JNZ, loop);
+
+	builder_emit(p_b, OP_POP, 0);
+	builder_emit(p_b, OP_DUP, 0);
+	builder_emit(p_b, OP_PRT, 0);
+	builder_emit(p_b, OP_HLT, 0);
+}
+
+static void build_fib(struct builder *p_b) {
+	word_t jump = builder_emit(p_b, OP_JMP, 0);
+
+	/* n -> fib(n) */
+	word_t fib = builder_emit(p_b, OP_DUP, 0);
+	builder_emit(p_b, OP_PSH, 2);
+	builder_emit(p_b, OP_LES, 0);
+	word_t base = builder_emit(p_b, OP_JNZ, 0);
+	builder_emit(p_b, OP_DUP, 0);
+	builder_emit(p_b, OP_DEC, 0);
+	builder_emit(p_b, OP_CAL, fib);
+	builder_emit(p_b, OP_SWP, 0);
+	builder_emit(p_b, OP_PSH, 2);
+	builder_emit(p_b, OP_SUB, 0);
+	builder_emit(p_b, OP_CAL, fib);
+	builder_emit(p_b, OP_ADD, 0);
+	builder_emit(p_b, OP_RET, 0);
+	builder_patch(p_b, base, builder_emit(p_b, OP_RET, 0));
+
+	builder_patch(p_b, jump, builder_emit(p_b, OP_PSH, 20));
+	builder_emit(p_b, OP_CAL, fib);
+	builder_emit(p_b, OP_DUP, 0);
+	builder_emit(p_b, OP_PRT, 0);
+	builder_emit(p_b, OP_HLT, 0);
+}
+
+/* Leibniz series for pi, 1/d - 1/(d + 2) at each iteration */
+static void build_float(struct builder *p_b) {
+	builder_emit_f64(p_b, OP_PSH, 0);
+	builder_emit_f64(p_b, OP_PSH, 1);
+	builder_emit(p_b, OP_PSH, 500);
+
+	word_t loop = builder_emit_f64(p_b, OP_PSH, 1);
+	builder_emit(p_b, OP_DUP, 2);
+	builder_emit(p_b, OP_FDI, 0);
+	builder_emit_f64(p_b, OP_PSH, 1);
+	builder_emit(p_b, OP_DUP, 3);
+	builder_emit_f64(p_b, OP_PSH, 2);
+	builder_emit(p_b, OP_FAD, 0);
+	builder_emit(p_b, OP_FDI, 0);
+	builder_emit(p_b, OP_FSB, 0);
+	builder_emit(p_b, OP_DUP, 3);
+	builder_emit(p_b, OP_FAD, 0);
+	builder_emit(p_b, OP_SWP, 2);
+	builder_emit(p_b, OP_POP, 0);
+	builder_emit(p_b, OP_SWP, 0);
+	builder_emit_f64(p_b, OP_PSH, 4);
+	builder_emit(p_b, OP_FAD, 0);
+	builder_emit(p_b, OP_FIN, 0);
+	builder_emit(p_b, OP_FDE, 0);
+	builder_emit(p_b, OP_SWP, 0);
+	builder_emit(p_b, OP_DEC, 0);
+	builder_emit(p_b, OP_DUP, 0);
+	builder_emit(p_b, OP_JNZ, loop);
+
+	builder_emit(p_b, OP_POP, 0);
+	builder_emit(p_b, OP_POP, 0);
+	builder_emit_f64(p_b, OP_PSH, 4);
+	builder_emit(p_b, OP_FMU, 0);
+	builder_emit(p_b, OP_DUP, 0);
+	builder_emit(p_b, OP_FPR, 0);
+	builder_emit_f64(p_b, OP_PSH, 3.14);
+	builder_emit(p_b, OP_FGR, 0);
+	builder_emit(p_b, OP_HLT, 0);
+}
+
+static void build_memory(struct builder *p_b) {
+	static const uint8_t memory[32] = {0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77, 0x88};
+	builder_set_memory(p_b, memory, sizeof(memory));
+
+	builder_emit(p_b, OP_PSH, 0);
+	builder_emit(p_b, OP_R64, 0);
+	builder_emit(p_b, OP_PRT, 0);
+	builder_emit(p_b, OP_PSH, 2);
+	builder_emit(p_b, OP_R16, 0);
+	builder_emit(p_b, OP_PRT, 0);
+	builder_emit(p_b, OP_PSH, 8);
+	builder_emit(p_b, OP_PSH, 0xDEADBEEF);
+	builder_emit(p_b, OP_W32, 0);
+	builder_emit(p_b, OP_PSH, 8);
+	builder_emit(p_b, OP_R08, 0);
+	builder_emit(p_b, OP_PRT, 0);
+	builder_emit(p_b, OP_PSH, 16);
+	builder_emit(p_b, OP_PSH, 7);
+	builder_emit(p_b, OP_PSH, 8);
+	builder_emit(p_b, OP_SET, 0);
+	builder_emit(p_b, OP_PSH, 24);
+	builder_emit(p_b, OP_PSH, 4);
+	builder_emit(p_b, OP_PSH, 8);
+	builder_emit(p_b, OP_CPY, 0);
+	builder_emit(p_b, OP_PSH, 24);
+	builder_emit(p_b, OP_R64, 0);
+	builder_emit(p_b, OP_PRT, 0);
+	builder_emit(p_b, OP_PSH, 30);
+	builder_emit(p_b, OP_PSH, 0x0102);
+	builder_emit(p_b, OP_W16, 0);
+	builder_emit(p_b, OP_PSH, 24);
+	builder_emit(p_b, OP_R64, 0);
+	builder_emit(p_b, OP_HLT, 0);
+}
+
+static void build_memory_le(struct builder *p_b) {
+	build_memory(p_b);
+	builder_set_little_endian(p_b, true);
+}
+
+static void build_div_by_zero(struct builder *p_b) {
+	builder_emit(p_b, OP_PSH, 3);
+	builder_emit(p_b, OP_PRT, 0);
+	builder_emit(p_b, OP_PSH, 3);
+
+	word_t loop = builder_emit(p_b, OP_PSH, 60);
+	builder_emit(p_b, OP_DUP, 1);
+	builder_emit(p_b, OP_DIV, 0);
+	builder_emit(p_b, OP_PRT, 0);
+	builder_emit(p_b, OP_DEC, 0);
+	builder_emit(p_b, OP_JMP, loop);
+}
+
+static void build_mem_out_of_bounds(struct builder *p_b) {
+	static const uint8_t memory[16] = {0};
+	builder_set_memory(p_b, memory, sizeof(memory));
+
+	builder_emit(p_b, OP_PSH, 0);
+
+	word_t loop = builder_emit(p_b, OP_DUP, 0);
+	builder_emit(p_b, OP_DUP, 0);
+	builder_emit(p_b, OP_W08, 0);
+	builder_emit(p_b, OP_INC, 0);
+	builder_emit(p_b, OP_JMP, loop);
+}
+
+static void build_call_stack_overflow(struct builder *p_b) {
+	word_t self = builder_emit(p_b, OP_PSH, 1);
+	builder_emit(p_b, OP_POP, 0);
+	builder_emit(p_b, OP_CAL, self);
+}
+
+static void build_call_stack_underflow(struct builder *p_b) {
+	builder_emit(p_b, OP_PSH, 9);
+	builder_emit(p_b, OP_PRT, 0);
+	builder_emit(p_b, OP_RET, 0);
+}
+
+/* Runs off the end of the program, so it exits with 0 */
+static void build_fall_through(struct builder *p_b) {
+	builder_emit(p_b, OP_PSH, 4);
+	word_t skip = builder_emit(p_b, OP_JNZ, 0);
+	builder_emit(p_b, OP_PSH, 5);
+	builder_emit(p_b, OP_PRT, 0);
+	builder_patch(p_b, skip, builder_emit(p_b, OP_PSH, 6));
+	builder_emit(p_b, OP_PRT, 0);
+	builder_emit(p_b, OP_NOP, 0);
+}
+
+const struct program programs[] = {
+	{"arith",                build_arith,                4,        ERR_OK, 0, "49\n9\n-1\n"},
+	{"compare",              build_compare,              0,        ERR_OK, 0,
+	 "0\n1\n0\n0\n1\n1\n0\n1\n1\n1\n0\n0\n1\n"},
+	{"loop",                 build_loop,                 49995000, ERR_OK, 0, "49995000\n"},
+	{"fib",                  build_fib,                  6765,     ERR_OK, 0, "6765\n"},
+	{"float",                build_float,                1,        ERR_OK, 0, "3.140593\n"},
+	{"memory",               build_memory,               0x55667788DEAD0102, ERR_OK, 0,
+	 "1432778632\n13124\n222\n-559038737\n"},
+	{"memory-le",            build_memory_le,            0x0102BEEF88776655, ERR_OK, 0,
+	 "1144201745\n17459\n239\n-2005440939\n"},
+	{"div-by-zero",          build_div_by_zero,          0, ERR_DIV_BY_ZERO,          5, "3\n20\n30\n60\n"},
+	{"mem-out-of-bounds",    build_mem_out_of_bounds,    0, ERR_INVALID_MEM_ACCESS,   3, ""},
+	{"call-stack-overflow",  build_call_stack_overflow,  0, ERR_CALL_STACK_OVERFLOW,  2, ""},
+	{"call-stack-underflow", build_call_stack_underflow, 0, ERR_CALL_STACK_UNDERFLOW, 2, "9\n"},
+	{"fall-through",         build_fall_through,         0, ERR_OK,                   0, "6\n"},
+};
+
+const size_t programs_count = ARRAY_SIZE(programs);
+
+static void print_run(const char *p_name, enum mode p_mode, const struct run *p_run) {
+	fprintf(stderr, "  %s %-12s ex %llu, %s at 0x%016llX, output \"%.*s\"\n", p_name,
+	        mode_names[p_mode], (unsigned long long)p_run->ex, err_str(p_run->err),
+	        (unsigned long long)p_run->ip, (int)p_run->output_size, p_run->output);
+}
+
+static bool same(const struct run *p_a, const struct run *p_b) {
+	return p_a->ex == p_b->ex && p_a->err == p_b->err && p_a->ip == p_b->ip &&
+	       p_a->output_size == p_b->output_size &&
+	       memcmp(p_a->output, p_b->output, p_a->output_size) == 0;
+}
+
+void test_program(const struct program *p_program) {
+	for (int i = 0; i < MODES_COUNT; ++ i) {
+		struct run run;
+		bool ok = CHECK(run_builder(&run, p_program->build, (enum mode)i)) &&
+		          CHECK(run.ex == p_program->ex && run.err == p_program->err &&
+		                run.ip == p_program->ip && output_is(&run, p_program->output));
+		if (!ok)
+			print_run(p_program->name, (enum mode)i, &run);
+	}
+}
+
+/* Halts two calls deep, so the call stack is left as the mode built it */
+static void build_halt_in_call(struct builder *p_b) {
+	word_t call = builder_emit(p_b, OP_CAL, 0);
+	builder_emit(p_b, OP_HLT, 0);
+
+	builder_patch(p_b, call, builder_emit(p_b, OP_PSH, 1));
+	word_t inner = builder_emit(p_b, OP_CAL, 0);
+	builder_emit(p_b, OP_RET, 0);
+
+	builder_patch(p_b, inner, builder_emit(p_b, OP_HLT, 0));
+}
+
+/* RET takes the operands of the return address from the call stack, every mode
+   must store the right ones */
+static void test_call_frames(void) {
+	for (int i = 0; i < MODES_COUNT; ++ i) {
+		struct vm vm;
+		if (CHECK(load_builder(&vm, build_halt_in_call, (enum mode)i))) {
+			run_vm(&vm, (enum mode)i);
+
+			bool ok = CHECK(vm.cs == 2) &&
+			          CHECK(vm.call_stack[0].ip == 1 && vm.call_stack[1].ip == 4) &&
+			          CHECK(vm.call_stack[0].operand == vm_operand_index(&vm, 1) &&
+			                vm.call_stack[1].operand == vm_operand_index(&vm, 4));
+			if (!ok)
+				fprintf(stderr, "  call-frames %s\n", mode_names[i]);
+		}
+
+		libavm_destroy(&vm);
+	}
+}
+
+/* No expected results, the modes only have to agree with the interpreter */
+static void test_file(const char *p_path) {
+	const char *name = strrchr(p_path, '/');
+	name = name == NULL? p_path : name + 1;
+
+	static struct run runs[MODES_COUNT];
+	for (int i = 0; i < MODES_COUNT; ++ i) {
+		if (!CHECK(run_file(&runs[i], p_path, (enum mode)i))) {
+			fprintf(stderr, "  %s: %s\n", name, err_str(runs[i].err));
+			return;
+		}
+	}
+
+	CHECK(runs[MODE_INTERPRETER].err == ERR_OK);
+	for (int i = 1; i < MODES_COUNT; ++ i) {
+		if (!CHECK(same(&runs[MODE_INTERPRETER], &runs[i]))) {
+			print_run(name, MODE_INTERPRETER, &runs[MODE_INTERPRETER]);
+			print_run(name, (enum mode)i, &runs[i]);
+		}
+	}
+}
+
+void test_modes(void) {
+	for (size_t i = 0; i < programs_count; ++ i)
+		test_program(&programs[i]);
+
+	test_call_frames();
+
+	for (int i = 0; i < test_files_count; ++ i)
+		test_file(test_files[i]);
+}
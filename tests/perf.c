@@ -0,0 +1,140 @@
+#include <string.h> /* memset, strcmp, strstr */
+
+#include "test.h"
+#include "libavm.h"
+#include "perf.h"
+
+/* The --perf-stats report. The real counters depend on the machine, so their
+   report is only checked for every counter being either counted or explained,
+   the format is checked on counters with known values */
+
+#define LOOPS 1000
+
+static void build_loop(struct builder *p_b) {
+	builder_emit(p_b, OP_PSH, 0);
+	word_t loop = builder_emit(p_b, OP_INC, 0);
+	builder_emit(p_b, OP_DUP, 0);
+	builder_emit(p_b, OP_PSH, LOOPS);
+	builder_emit(p_b, OP_LES, 0);
+	builder_emit(p_b, OP_JNZ, loop);
+	builder_emit(p_b, OP_HLT, 0);
+}
+
+static void test_known(void) {
+	static char text[0x1000];
+
+	struct perf perf;
+	memset(&perf, 0, sizeof(perf));
+
+	static const struct {
+		int      err; /* Not available if not 0 */
+		uint64_t value;
+		bool     scaled;
+	} counters[PERF_COUNTERS_COUNT] = {
+		[PERF_TASK_CLOCK]    = {0,      2000000, false},
+		[PERF_CYCLES]        = {0,      5000,    true},
+		[PERF_INSTRUCTIONS]  = {0,      12000,   false},
+		[PERF_BRANCHES]      = {0,      3000,    false},
+		[PERF_BRANCH_MISSES] = {0,      30,      false},
+		[PERF_L1D_MISSES]    = {EACCES, 0,       false},
+		[PERF_LLC_MISSES]    = {ENOENT, 0,       false},
+	};
+
+	for (int i = 0; i < PERF_COUNTERS_COUNT; ++ i) {
+		perf.fds[i]    = counters[i].err != 0? -1 : 0;
+		perf.errors[i] = counters[i].err;
+		perf.values[i] = counters[i].value;
+		perf.scaled[i] = counters[i].scaled;
+	}
+
+	/* 1000 instructions, 200 of them fused into the previous ones */
+	struct profile profile;
+	profile_init(&profile, 1);
+	profile.steps = 1000;
+	profile.fused = 200;
+
+	struct vm vm;
+	memset(&vm, 0, sizeof(vm));
+	vm.profile = &profile;
+
+	FILE *file = tmpfile();
+	if (CHECK(file != NULL)) {
+		perf_report(&perf, &vm, file);
+
+		static const char expected[] =
+			"\n"
+			"Performance counters: 1000 instructions executed in 800 dispatches\n"
+			"\n"
+			"task-clock                   2.000 ms    2000.000 ns per instruction\n"
+			"cycles                           5000       5.000 per instruction, 6.250 per dispatch"
+			" (scaled)\n"
+			"instructions                    12000      12.000 per instruction, 15.000 per dispatch\n"
+			"branches                         3000       3.000 per instruction\n"
+			"branch-misses                      30       0.037 per dispatch, 1.00% of branches\n"
+			"L1d-read-misses         not available  (not permitted, see "
+			"/proc/sys/kernel/perf_event_paranoid)\n"
+			"LLC-misses              not available  (not supported by the CPU or the virtual machine)\n"
+			"\n"
+			"2.400 host instructions per cycle\n"
+			"\n"
+			"Counting the instructions adds about one host instruction per dispatch\n";
+
+		if (CHECK(file_text(file, text, sizeof(text))) && !CHECK(strcmp(text, expected) == 0))
+			fprintf(stderr, "%s", text);
+
+		fclose(file);
+	}
+
+	profile_free(&profile);
+}
+
+/* Whatever the machine allows, the run is counted and nothing is left out */
+static void test_run(void) {
+	static char text[0x1000];
+
+	struct vm vm;
+	if (CHECK(load_builder(&vm, build_loop, MODE_INTERPRETER))) {
+		struct profile counters;
+		profile_init(&counters, vm.program_size);
+		vm.profile = &counters;
+
+		struct perf perf;
+		perf_open(&perf);
+
+		perf_start(&perf);
+		vm_run_counted(&vm);
+		perf_stop(&perf);
+
+		CHECK(libavm_error(&vm)->err == ERR_OK && vm.ex == LOOPS);
+		CHECK(counters.steps == 2 + 5 * LOOPS);
+
+		for (int i = 0; i < PERF_COUNTERS_COUNT; ++ i)
+			CHECK(perf.fds[i] != -1 || perf.errors[i] != 0);
+
+		FILE *file = tmpfile();
+		if (CHECK(file != NULL)) {
+			perf_report(&perf, &vm, file);
+
+			if (CHECK(file_text(file, text, sizeof(text)))) {
+				CHECK(strstr(text, "Performance counters: 5002 instructions executed") != NULL);
+				CHECK(strstr(text, "task-clock ") != NULL && strstr(text, "LLC-misses ") != NULL);
+			}
+
+			fclose(file);
+		}
+
+		perf_close(&perf);
+		for (int i = 0; i < PERF_COUNTERS_COUNT; ++ i)
+			CHECK(perf.fds[i] == -1);
+
+		profile_free(&counters);
+		vm.profile = NULL;
+	}
+
+	libavm_destroy(&vm);
+}
+
+void test_perf(void) {
+	test_known();
+	test_run();
+}
@@ -0,0 +1,247 @@
+#include <string.h> /* strstr, strcmp, memcmp */
+
+#include "test.h"
+#include "libavm.h"
+#include "profiler.h"
+
+/* Exact counters of vm_run_profiled and vm_run_counted, and the report of
+   --profile and --flamegraph. The counts must not depend on the
+   superinstructions */
+
+/* Calls f three times, f returns right away */
+static void build_calls(struct builder *p_b) {
+	builder_emit(p_b, OP_PSH, 3);
+	word_t loop = builder_emit(p_b, OP_CAL, 6);
+	builder_emit(p_b, OP_DEC, 0);
+	builder_emit(p_b, OP_DUP, 0);
+	builder_emit(p_b, OP_JNZ, loop);
+	builder_emit(p_b, OP_HLT, 0);
+
+	builder_emit(p_b, OP_RET, 0);
+}
+
+#define CALLS_STEPS 17
+
+static const uint64_t calls_counts[] = {1, 3, 3, 3, 3, 1, 3};
+static const uint64_t calls_taken[]  = {0, 3, 0, 0, 2, 0, 0};
+
+/* Counted until the invalid opcode panics */
+static void build_invalid(struct builder *p_b) {
+	builder_emit(p_b, OP_PSH, 1);
+	builder_emit(p_b, (enum opcode)0x99, 0);
+	builder_emit(p_b, OP_HLT, 0);
+}
+
+/* main calls f twice and f calls g */
+static void build_chain(struct builder *p_b) {
+	builder_emit(p_b, OP_PSH, 2);
+	word_t loop = builder_emit(p_b, OP_CAL, 6);
+	builder_emit(p_b, OP_DEC, 0);
+	builder_emit(p_b, OP_DUP, 0);
+	builder_emit(p_b, OP_JNZ, loop);
+	builder_emit(p_b, OP_HLT, 0);
+
+	builder_emit(p_b, OP_CAL, 8);
+	builder_emit(p_b, OP_RET, 0);
+
+	builder_emit(p_b, OP_RET, 0);
+}
+
+static void build_chain_named(struct builder *p_b) {
+	build_chain(p_b);
+	builder_add_symbol(p_b, "main", 0, 6);
+	builder_add_symbol(p_b, "f",    6, 2);
+	builder_add_symbol(p_b, "g",    8, 1);
+}
+
+/* g is inside the lib symbol */
+static void build_chain_lib(struct builder *p_b) {
+	build_chain(p_b);
+	builder_add_symbol(p_b, "main", 0, 6);
+	builder_add_symbol(p_b, "lib",  6, 3);
+}
+
+static void build_overlapping_symbols(struct builder *p_b) {
+	build_chain_named(p_b);
+	builder_add_symbol(p_b, "h", 7, 2);
+}
+
+static const struct {
+	const char *name;
+	void      (*build)(struct builder*);
+	const char *stacks;
+} flamegraphs[] = {
+	{"named", build_chain_named, "main 10\nmain;f 4\nmain;f;g 2\n"},
+	{"lib",   build_chain_lib,   "main 10\nmain;lib 4\nmain;lib;lib+0x2 2\n"},
+	{"none",  build_chain,       "fn_0x0000000000000000 10\n"
+	                             "fn_0x0000000000000000;fn_0x0000000000000006 4\n"
+	                             "fn_0x0000000000000000;fn_0x0000000000000006;fn_0x0000000000000008 2\n"},
+};
+
+static const char *calls_report[] = {
+	"Profile: 17 instructions executed, 7 of 7 instructions reached\n",
+	"CAL                         3   17.65%\n",
+	"0x0000000000000000                   17  100.00%                   14   82.35%"
+	"              1  fn_0x0000000000000000\n",
+	"0x0000000000000006                    3   17.65%                    3   17.65%"
+	"              3  fn_0x0000000000000006\n",
+	"0x0000000000000004                    3   17.65%  JNZ 0x0000000000000001\n",
+	"0x0000000000000004                    3                    2                    1   66.67%\n",
+};
+
+static const char *invalid_report[] = {
+	"Profile: 2 instructions executed, 2 of 3 instructions reached\n",
+	"???                         1   50.00%\n",
+};
+
+/* Runs the program on vm_run_profiled, or vm_run_counted, into p_profile */
+static bool run_profiled(struct vm *p_vm, struct profile *p_profile,
+                         void (*p_build)(struct builder*), enum mode p_mode, bool p_counted) {
+	if (!CHECK(load_builder(p_vm, p_build, p_mode)))
+		return false;
+
+	profile_init(p_profile, p_vm->program_size);
+	p_vm->profile = p_profile;
+
+	if (p_counted)
+		vm_run_counted(p_vm);
+	else
+		vm_run_profiled(p_vm);
+
+	profile_flush(p_profile);
+	return true;
+}
+
+static void check_report(struct vm *p_vm, const char **p_lines, size_t p_count) {
+	static char report[OUTPUT_SIZE];
+
+	FILE *file = tmpfile();
+	if (!CHECK(file != NULL))
+		return;
+
+	profile_report(p_vm, file);
+	if (CHECK(file_text(file, report, sizeof(report)))) {
+		for (size_t i = 0; i < p_count; ++ i) {
+			if (!CHECK(strstr(report, p_lines[i]) != NULL))
+				fprintf(stderr, "  missing \"%s\" in the report:\n%s", p_lines[i], report);
+		}
+	}
+
+	fclose(file);
+}
+
+static void test_calls(enum mode p_mode) {
+	struct vm      vm;
+	struct profile profile;
+	if (run_profiled(&vm, &profile, build_calls, p_mode, false)) {
+		bool ok = CHECK(profile.steps == CALLS_STEPS) &&
+		          CHECK(memcmp(profile.counts, calls_counts, sizeof(calls_counts)) == 0) &&
+		          CHECK(memcmp(profile.taken, calls_taken, sizeof(calls_taken)) == 0);
+
+		/* The entry point and f */
+		ok = ok && CHECK(profile.nodes_count == 2) &&
+		     CHECK(profile.nodes[CALL_ROOT].self == CALLS_STEPS - 3 &&
+		           profile.nodes[CALL_ROOT].calls == 1) &&
+		     CHECK(profile.nodes[1].func == 6 && profile.nodes[1].parent == CALL_ROOT &&
+		           profile.nodes[1].self == 3 && profile.nodes[1].calls == 3) &&
+		     CHECK(profile.peak_sp == 2 && profile.peak_cs == 1);
+		if (!ok)
+			fprintf(stderr, "  profiled %s\n", mode_names[p_mode]);
+
+		check_report(&vm, calls_report, ARRAY_SIZE(calls_report));
+
+		vm.profile = NULL;
+		profile_free(&profile);
+	}
+
+	libavm_destroy(&vm);
+
+	/* Only the steps, superinstructions count as the instructions they replace.
+	   The switch build has none */
+	if (run_profiled(&vm, &profile, build_calls, p_mode, true)) {
+		if (!CHECK(profile.steps == CALLS_STEPS && vm.ex == 0 &&
+		           (p_mode != MODE_NO_FUSE || profile.fused == 0)))
+			fprintf(stderr, "  counted %s: %llu steps, %llu fused\n", mode_names[p_mode],
+			        (long long unsigned)profile.steps, (long long unsigned)profile.fused);
+
+		vm.profile = NULL;
+		profile_free(&profile);
+	}
+
+	libavm_destroy(&vm);
+}
+
+static void test_invalid(void) {
+	struct vm      vm;
+	struct profile profile;
+	if (run_profiled(&vm, &profile, build_invalid, MODE_INTERPRETER, false)) {
+		CHECK(libavm_error(&vm)->err == ERR_INVALID_INST);
+		CHECK(profile.counts[0] == 1 && profile.counts[1] == 1 && profile.counts[2] == 0);
+
+		check_report(&vm, invalid_report, ARRAY_SIZE(invalid_report));
+
+		vm.profile = NULL;
+		profile_free(&profile);
+	}
+
+	libavm_destroy(&vm);
+}
+
+static void test_flamegraph(void) {
+	static char stacks[OUTPUT_SIZE];
+
+	for (size_t i = 0; i < ARRAY_SIZE(flamegraphs); ++ i) {
+		struct vm      vm;
+		struct profile profile;
+		if (!run_profiled(&vm, &profile, flamegraphs[i].build, MODE_INTERPRETER, false)) {
+			libavm_destroy(&vm);
+			continue;
+		}
+
+		FILE *file = tmpfile();
+		if (CHECK(file != NULL)) {
+			profile_flamegraph(&vm, file);
+
+			if (!CHECK(file_text(file, stacks, sizeof(stacks)) &&
+			           strcmp(stacks, flamegraphs[i].stacks) == 0))
+				fprintf(stderr, "  flamegraph %s:\n%s", flamegraphs[i].name, stacks);
+
+			fclose(file);
+		}
+
+		vm.profile = NULL;
+		profile_free(&profile);
+		libavm_destroy(&vm);
+	}
+
+	/* The report names the functions too */
+	static const char *named_report[] = {
+		"0x0000000000000006                    6   37.50%                    4   25.00%"
+		"              2  f\n",
+		"0x0000000000000008                    2   12.50%                    2   12.50%"
+		"              2  g\n",
+	};
+
+	struct vm      vm;
+	struct profile profile;
+	if (run_profiled(&vm, &profile, build_chain_named, MODE_INTERPRETER, false)) {
+		check_report(&vm, named_report, ARRAY_SIZE(named_report));
+
+		vm.profile = NULL;
+		profile_free(&profile);
+	}
+
+	libavm_destroy(&vm);
+
+	/* A symbol section with overlapping functions is not loaded */
+	CHECK(!load_builder(&vm, build_overlapping_symbols, MODE_INTERPRETER) &&
+	      libavm_error(&vm)->err == ERR_INVALID_EXECUTABLE);
+	libavm_destroy(&vm);
+}
+
+void test_profile(void) {
+	test_calls(MODE_INTERPRETER);
+	test_calls(MODE_NO_FUSE);
+	test_invalid();
+	test_flamegraph();
+}
@@ -0,0 +1,166 @@
+#include <stdio.h>  /* sscanf */
+#include <string.h> /* strchr, strncmp, strstr */
+
+#include "test.h"
+#include "sampler.h"
+#include "profiler.h"
+#include "libavm.h"
+
+/* The timer is in CPU time, the loop runs for about a tenth of a second */
+#define LOOPS 200000000
+#define HZ    1000
+
+/* Fused into one LOOP_LES that jumps to itself, the interpreter only polls halt
+   on its jump */
+static void build_fused_loop(struct builder *p_b) {
+	builder_emit(p_b, OP_PSH, 0);
+	word_t loop = builder_emit(p_b, OP_INC, 0);
+	builder_emit(p_b, OP_DUP, 0);
+	builder_emit(p_b, OP_PSH, LOOPS);
+	builder_emit(p_b, OP_LES, 0);
+	builder_emit(p_b, OP_JNZ, loop);
+	builder_emit(p_b, OP_HLT, 0);
+}
+
+/* Without computed gotos nothing is fused, and the loop is about ten times
+   slower */
+#ifdef USES_COMPUTED_GOTO
+#	define SPIN_LOOPS LOOPS
+#else
+#	define SPIN_LOOPS (LOOPS / 8)
+#endif
+
+/* The same loop in a function, main only calls it */
+static void build_spin(struct builder *p_b) {
+	builder_emit(p_b, OP_CAL, 2);
+	builder_emit(p_b, OP_HLT, 0);
+
+	builder_emit(p_b, OP_PSH, 0);
+	word_t loop = builder_emit(p_b, OP_INC, 0);
+	builder_emit(p_b, OP_DUP, 0);
+	builder_emit(p_b, OP_PSH, SPIN_LOOPS);
+	builder_emit(p_b, OP_LES, 0);
+	builder_emit(p_b, OP_JNZ, loop);
+	builder_emit(p_b, OP_RET, 0);
+
+	builder_add_symbol(p_b, "main", 0, 2);
+	builder_add_symbol(p_b, "spin", 2, 7);
+}
+
+#ifdef USES_SIGPROF
+static void test_fused_loop(void) {
+	struct vm vm;
+	if (!CHECK(load_builder(&vm, build_fused_loop, MODE_INTERPRETER))) {
+		libavm_destroy(&vm);
+		return;
+	}
+
+	struct profile profile;
+	profile_init(&profile, vm.program_size);
+	vm.profile = &profile;
+
+	CHECK(vm_run_sampled(&vm, HZ));
+	CHECK(libavm_error(&vm)->err == ERR_OK);
+
+	/* The loop would have no sample if its jumps did not poll halt. Without
+	   computed gotos nothing is fused, the samples are in all of the loop */
+	uint64_t total = 0, loop = 0;
+	for (word_t i = 0; i < profile.size; ++ i) {
+		total += profile.counts[i];
+		loop  += i >= 1 && i <= 5? profile.counts[i] : 0;
+	}
+
+	CHECK(loop > 10);
+	CHECK(loop == total);
+	CHECK(profile.nodes[CALL_ROOT].self == total);
+
+	vm.profile = NULL;
+	profile_free(&profile);
+	libavm_destroy(&vm);
+}
+
+/* The histogram and the collapsed stacks written at exit. Which instructions
+   get the samples changes from run to run, but they all add up */
+static void test_output(void) {
+	static char text[0x2000];
+
+	struct vm vm;
+	if (!CHECK(load_builder(&vm, build_spin, MODE_INTERPRETER))) {
+		libavm_destroy(&vm);
+		return;
+	}
+
+	struct profile profile;
+	profile_init(&profile, vm.program_size);
+	vm.profile = &profile;
+
+	/* Sampling does not change what the program does */
+	CHECK(vm_run_sampled(&vm, HZ));
+	CHECK(libavm_error(&vm)->err == ERR_OK && vm.ex == SPIN_LOOPS);
+
+	uint64_t total = 0;
+	for (word_t i = 0; i < profile.size; ++ i)
+		total += profile.counts[i];
+
+	FILE *file = tmpfile();
+	if (!CHECK(file != NULL) || !CHECK(total > 10)) {
+		if (file != NULL)
+			fclose(file);
+
+		vm.profile = NULL;
+		profile_free(&profile);
+		libavm_destroy(&vm);
+		return;
+	}
+
+	/* Every sample is in one stack, nearly all of them in spin */
+	profile_flamegraph(&vm, file);
+	if (CHECK(file_text(file, text, sizeof(text)))) {
+		uint64_t stacks = 0, spin = 0;
+		for (const char *line = text; *line != '\0';) {
+			const char *end = strchr(line, '\n');
+			if (!CHECK(end != NULL))
+				break;
+
+			long long unsigned count = 0;
+			const char        *space = strchr(line, ' ');
+			if (!CHECK(space != NULL && space < end && sscanf(space, " %llu", &count) == 1 &&
+			           (strncmp(line, "main ", 5) == 0 || strncmp(line, "main;spin ", 10) == 0)))
+				fprintf(stderr, "  stack %.*s\n", (int)(end - line), line);
+
+			stacks += count;
+			if (strncmp(line, "main;spin ", 10) == 0)
+				spin += count;
+
+			line = end + 1;
+		}
+
+		CHECK(stacks == total && spin * 10 >= total * 9);
+	}
+
+	/* Samples instead of counts, and no jump table since the jumps are not
+	   counted */
+	rewind(file);
+	profile_report_samples(&vm, file, HZ);
+	if (CHECK(file_text(file, text, sizeof(text)))) {
+		long long unsigned samples = 0;
+		int                hz      = 0;
+		CHECK(sscanf(text, "\nProfile: %llu samples at %i Hz", &samples, &hz) == 2 &&
+		      samples == total && hz == HZ);
+		CHECK(strstr(text, "spin") != NULL && strstr(text, "Taken") == NULL);
+	}
+
+	fclose(file);
+
+	vm.profile = NULL;
+	profile_free(&profile);
+	libavm_destroy(&vm);
+}
+#endif
+
+void test_sampler(void) {
+#ifdef USES_SIGPROF
+	test_fused_loop();
+	test_output();
+#endif
+}
@@ -0,0 +1,126 @@
+#include <string.h> /* strstr */
+
+#include "test.h"
+#include "libavm.h"
+#include "emit.h"
+
+/* Stack sizes from the executable, every mode must stop at the same depth */
+
+#define SMALL_STACK      32 /* Values */
+#define SMALL_CALL_STACK 8  /* Calls */
+#define DEEP             100000
+#define DEFAULT_STACK    (STACK_SIZE_BYTES / sizeof(value_t))
+
+static void build_push_forever(struct builder *p_b) {
+	word_t loop = builder_emit(p_b, OP_PSH, 1);
+	builder_emit(p_b, OP_JMP, loop);
+
+	builder_set_stack_sizes(p_b, SMALL_STACK * sizeof(value_t),
+	                        SMALL_CALL_STACK * sizeof(word_t));
+}
+
+static void build_call_forever(struct builder *p_b) {
+	builder_emit(p_b, OP_NOP, 0);
+	builder_emit(p_b, OP_CAL, 1);
+
+	builder_set_stack_sizes(p_b, SMALL_STACK * sizeof(value_t),
+	                        SMALL_CALL_STACK * sizeof(word_t));
+}
+
+/* Leaves DEEP, DEEP - 1, ... 1 on the stack and halts with 0. The stack peaks
+   at DEEP + 2 values, on the second DUP */
+static void build_deep(struct builder *p_b) {
+	builder_emit(p_b, OP_PSH, DEEP);
+	word_t loop = builder_emit(p_b, OP_DUP, 0);
+	builder_emit(p_b, OP_DEC, 0);
+	builder_emit(p_b, OP_DUP, 0);
+	builder_emit(p_b, OP_JNZ, loop);
+	builder_emit(p_b, OP_HLT, 0);
+}
+
+static void build_deep_sized(struct builder *p_b) {
+	build_deep(p_b);
+	builder_set_stack_sizes(p_b, (DEEP + 2) * sizeof(value_t), 0);
+}
+
+static const struct {
+	const char *name;
+	void      (*build)(struct builder*);
+	enum err    err;
+	word_t      ip;
+	word_t      sp, cs;
+} depths[] = {
+	{"push-forever", build_push_forever, ERR_STACK_OVERFLOW,      0, SMALL_STACK,   0},
+	{"call-forever", build_call_forever, ERR_CALL_STACK_OVERFLOW, 1, 0,             SMALL_CALL_STACK},
+	{"deep-sized",   build_deep_sized,   ERR_OK,                  0, DEEP,          0},
+	{"deep-default", build_deep,         ERR_STACK_OVERFLOW,      3, DEFAULT_STACK, 0},
+};
+
+static void test_depths(void) {
+	for (size_t i = 0; i < ARRAY_SIZE(depths); ++ i) {
+		for (int mode = 0; mode < MODES_COUNT; ++ mode) {
+			struct vm vm;
+			if (CHECK(load_builder(&vm, depths[i].build, (enum mode)mode))) {
+				run_vm(&vm, (enum mode)mode);
+
+				const struct vm_error *error = libavm_error(&vm);
+				if (!CHECK(error->err == depths[i].err &&
+				           (error->err == ERR_OK || error->ip == depths[i].ip) &&
+				           vm.sp == depths[i].sp && vm.cs == depths[i].cs))
+					fprintf(stderr, "  %s %s: %s at %llu, sp %llu, cs %llu\n", depths[i].name,
+					        mode_names[mode], err_str(error->err),
+					        (long long unsigned)error->ip, (long long unsigned)vm.sp,
+					        (long long unsigned)vm.cs);
+			}
+
+			libavm_destroy(&vm);
+		}
+	}
+}
+
+/* Like the options of the command line, which win over the executable */
+static void test_realloc(void) {
+	struct vm vm;
+	if (CHECK(load_builder(&vm, build_push_forever, MODE_INTERPRETER))) {
+		CHECK(vm.stack_capacity == SMALL_STACK && vm.call_stack_capacity == SMALL_CALL_STACK);
+		CHECK(vm_alloc_stacks(&vm, 2 * SMALL_STACK, vm.call_stack_capacity) == ERR_OK);
+
+		vm_run(&vm);
+		CHECK(libavm_error(&vm)->err == ERR_STACK_OVERFLOW && vm.sp == 2 * SMALL_STACK);
+
+		/* The old stacks stay */
+		CHECK(vm_alloc_stacks(&vm, MAX_STACK_CAPACITY + 1, 1) == ERR_INVALID_EXECUTABLE);
+		CHECK(vm_alloc_stacks(&vm, 1, 0) == ERR_INVALID_EXECUTABLE);
+		CHECK(vm.stack_capacity == 2 * SMALL_STACK && vm.call_stack_capacity == SMALL_CALL_STACK);
+	}
+
+	libavm_destroy(&vm);
+}
+
+/* The translated program allocates the stacks of the executable */
+static void test_emit_c(void) {
+	static char source[0x10000];
+
+	char path[PATH_SIZE];
+	temp_path(path, "stacks.c");
+
+	struct vm vm;
+	if (CHECK(load_builder(&vm, build_call_forever, MODE_INTERPRETER)) &&
+	    CHECK(vm_emit_c(&vm, "stacks.avm", path))) {
+		FILE *file = fopen(path, "r");
+		if (CHECK(file != NULL)) {
+			CHECK(file_text(file, source, sizeof(source)) &&
+			      strstr(source, "vm_alloc_stacks(&vm, 32u, 8u);") != NULL);
+
+			fclose(file);
+		}
+	}
+
+	libavm_destroy(&vm);
+}
+
+void test_stacks(void) {
+	test_depths();
+	test_realloc();
+	test_emit_c();
+}
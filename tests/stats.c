@@ -0,0 +1,185 @@
+#include <string.h> /* strlen, strncmp, strchr, memcpy */
+
+#include "test.h"
+#include "libavm.h"
+#include "resources.h"
+
+/* The --stats=json report of resources_write_json. The times and the resident
+   size of the process change from run to run, only their keys are checked */
+
+#define PATH_AT   0x000
+#define DATA_AT   0x100
+#define READ_AT   0x110
+#define FILE_SIZE 5
+
+static char stats_path[PATH_SIZE];
+
+/* Writes FILE_SIZE bytes to stats_path, reads them back and exits with the
+   first one */
+static void build_files(struct builder *p_b) {
+	static uint8_t memory[0x200];
+	word_t         len = strlen(stats_path);
+	memcpy(memory + PATH_AT, stats_path, len);
+	memcpy(memory + DATA_AT, "hello", FILE_SIZE);
+	builder_set_memory(p_b, memory, sizeof(memory));
+
+	static const enum fmode  modes[] = {FMODE_WRITE | FMODE_BINARY, FMODE_READ | FMODE_BINARY};
+	static const enum opcode ops[]   = {OP_WRF, OP_RDF};
+	static const word_t      at[]    = {DATA_AT, READ_AT};
+
+	for (size_t i = 0; i < ARRAY_SIZE(modes); ++ i) {
+		builder_emit(p_b, OP_PSH, PATH_AT);
+		builder_emit(p_b, OP_PSH, len);
+		builder_emit(p_b, OP_PSH, modes[i]);
+		builder_emit(p_b, OP_OPE, 0);
+		builder_emit(p_b, OP_PSH, at[i]);
+		builder_emit(p_b, OP_PSH, FILE_SIZE + 3 * i); /* Past the end for the read */
+		builder_emit(p_b, OP_DUP, 2);
+		builder_emit(p_b, ops[i], 0);
+		builder_emit(p_b, OP_POP, 0);
+		builder_emit(p_b, OP_CLO, 0);
+	}
+
+	builder_emit(p_b, OP_PSH, READ_AT);
+	builder_emit(p_b, OP_R08, 0);
+	builder_emit(p_b, OP_HLT, 0);
+}
+
+/* Loads a library that does not exist, then divides by zero */
+static void build_panic(struct builder *p_b) {
+	static const char name[] = "libavm-test-missing.so";
+	builder_set_memory(p_b, (const uint8_t*)name, sizeof(name) - 1);
+
+	builder_emit(p_b, OP_PSH, 0);
+	builder_emit(p_b, OP_PSH, sizeof(name) - 1);
+	builder_emit(p_b, OP_LOL, 0);
+	builder_emit(p_b, OP_PSH, 0);
+	builder_emit(p_b, OP_CAL, 5);
+	builder_emit(p_b, OP_DIV, 0);
+}
+
+/* Runs off the end of the program */
+static void build_end(struct builder *p_b) {
+	builder_emit(p_b, OP_PSH, 1);
+	builder_emit(p_b, OP_POP, 0);
+}
+
+/* The report of a counted run. p_finished is passed to resources_write_json */
+static bool report(char *p_json, size_t p_size, void (*p_build)(struct builder*),
+                   bool p_finished) {
+	struct vm vm;
+	bool      ok = false;
+	if (load_builder(&vm, p_build, MODE_INTERPRETER)) {
+		struct profile counters;
+		profile_init(&counters, vm.program_size);
+
+		struct vm_stats stats;
+		memset(&stats, 0, sizeof(stats));
+
+		struct resources usage;
+		resources_start(&usage);
+
+		vm.profile = &counters;
+		vm.stats   = &stats;
+		vm_run_counted(&vm);
+
+		FILE *file = tmpfile();
+		if (file != NULL) {
+			resources_write_json(&usage, &vm, file, p_finished);
+			ok = file_text(file, p_json, p_size);
+
+			fclose(file);
+		}
+
+		profile_free(&counters);
+		vm.profile = NULL;
+		vm.stats   = NULL;
+	}
+
+	libavm_destroy(&vm);
+	return ok;
+}
+
+/* Compares line by line, an expected line ending with '*' only has to start
+   the line of the report */
+static bool json_is(const char *p_json, const char *p_expected) {
+	while (*p_expected != '\0') {
+		const char *end = strchr(p_expected, '\n');
+		size_t      len = end != NULL? (size_t)(end - p_expected) : strlen(p_expected);
+
+		bool prefix = len > 0 && p_expected[len - 1] == '*';
+		if (strncmp(p_json, p_expected, prefix? len - 1 : len) != 0)
+			return false;
+
+		const char *line_end = strchr(p_json, '\n');
+		if (!prefix && line_end != p_json + len)
+			return false;
+
+		p_json     = line_end != NULL? line_end + 1 : p_json + strlen(p_json);
+		p_expected = end != NULL? end + 1 : p_expected + len;
+	}
+
+	return *p_json == '\0';
+}
+
+void test_stats(void) {
+	static char json[0x1000], expected[0x1000];
+
+	temp_path(stats_path, "stats.txt");
+
+	snprintf(expected, sizeof(expected),
+	         "{\n"
+	         "  \"end\": \"halt\",\n"
+	         "  \"exit_code\": 104,\n"
+	         "  \"instructions\": 23,\n"
+	         "  \"wall_seconds\": *\n"
+	         "  \"cpu_seconds\": *\n"
+	         "  \"stack\": {\"peak\": 4, \"capacity\": %llu},\n"
+	         "  \"call_stack\": {\"peak\": 0, \"capacity\": %llu},\n"
+	         "  \"memory\": {\"size\": 512, \"host_max_rss\": *\n"
+	         "  \"files\": [\n"
+	         "    {\"descriptor\": 3, \"read\": 5, \"written\": 5}\n"
+	         "  ],\n"
+	         "  \"external\": {\"opens\": 2, \"library_loads\": 0, \"calls\": 0, "
+	         "\"call_seconds\": 0.000000}\n"
+	         "}\n",
+	         (long long unsigned)(STACK_SIZE_BYTES / sizeof(value_t)),
+	         (long long unsigned)(CALL_STACK_SIZE_BYTES / sizeof(word_t)));
+
+	if (CHECK(report(json, sizeof(json), build_files, true)) && !CHECK(json_is(json, expected)))
+		fprintf(stderr, "%s", json);
+
+	/* The error is the exit code of a panic */
+	snprintf(expected, sizeof(expected),
+	         "{\n"
+	         "  \"end\": \"panic\",\n"
+	         "  \"error\": \"%s\",\n"
+	         "  \"exit_code\": %i,\n"
+	         "  \"instructions\": 6,\n"
+	         "*\n*\n"
+	         "  \"stack\": {\"peak\": 2, \"capacity\": *\n"
+	         "  \"call_stack\": {\"peak\": 1, \"capacity\": *\n"
+	         "  \"memory\": {\"size\": 22, \"host_max_rss\": *\n"
+	         "  \"files\": [],\n"
+	         "  \"external\": {\"opens\": 0, \"library_loads\": 1, *\n"
+	         "}\n",
+	         err_str(ERR_DIV_BY_ZERO), (int)ERR_DIV_BY_ZERO);
+
+	if (CHECK(report(json, sizeof(json), build_panic, true)) && !CHECK(json_is(json, expected)))
+		fprintf(stderr, "%s", json);
+
+	/* Past the last instruction, or exited from inside the run */
+	static const struct {
+		bool        finished;
+		const char *end;
+	} ends[] = {
+		{true,  "{\n  \"end\": \"end\",\n  \"exit_code\": 0,\n  \"instructions\": 2,\n*"},
+		{false, "{\n  \"end\": \"exit\",\n*"},
+	};
+
+	for (size_t i = 0; i < ARRAY_SIZE(ends); ++ i) {
+		if (CHECK(report(json, sizeof(json), build_end, ends[i].finished)) &&
+		    !CHECK(strncmp(json, ends[i].end, strlen(ends[i].end) - 1) == 0))
+			fprintf(stderr, "%s", json);
+	}
+}
@@ -0,0 +1,244 @@
+/* dup, dup2, fileno, mkdtemp */
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h> /* EXIT_SUCCESS, EXIT_FAILURE, mkdtemp, atexit */
+#include <string.h> /* strlen, memcmp */
+#include <unistd.h> /* dup, dup2, close, rmdir, unlink, STDOUT_FILENO */
+#include <dirent.h> /* opendir, readdir, closedir */
+
+#include "test.h"
+#include "libavm.h"
+#include "avm/fuse.h"
+#include "avm/jit.h"
+#include "avm/ir.h"
+#include "avm/sandbox.h"
+
+/* Runs the tests of every file, see test.h. The files given on the command line
+ * (the bench programs with `make test`) are run on every mode too.
+ *
+ * Usage: test [FILES...]
+ */
+
+void test_modes(void);
+void test_verify(void);
+void test_sampler(void);
+void test_fuse(void);
+void test_loader(void);
+void test_profile(void);
+void test_stacks(void);
+void test_memory(void);
+void test_cache(void);
+void test_trace(void);
+void test_stats(void);
+void test_perf(void);
+void test_emit(void);
+
+struct suite {
+	const char *name;
+	void      (*run)(void);
+};
+
+static const struct suite suites[] = {
+	{"modes",   test_modes},
+	{"verify",  test_verify},
+	{"sampler", test_sampler},
+	{"fuse",    test_fuse},
+	{"loader",  test_loader},
+	{"profile", test_profile},
+	{"stacks",  test_stacks},
+	{"memory",  test_memory},
+	{"cache",   test_cache},
+	{"trace",   test_trace},
+	{"stats",   test_stats},
+	{"perf",    test_perf},
+	{"emit",    test_emit},
+};
+
+const char *mode_names[MODES_COUNT] = {
+	[MODE_INTERPRETER] = "interpreter",
+	[MODE_NO_FUSE]     = "--noFuse",
+	[MODE_JIT]         = "--jit",
+	[MODE_IR]          = "--ir",
+	[MODE_SANDBOX]     = "--sandbox",
+};
+
+const char **test_files;
+int          test_files_count;
+
+static int failed_checks = 0;
+
+bool test_check(bool p_ok, const char *p_file, int p_line, const char *p_what) {
+	if (!p_ok) {
+		fprintf(stderr, "%s:%i: check failed: %s\n", p_file, p_line, p_what);
+		++ failed_checks;
+	}
+
+	return p_ok;
+}
+
+static enum err load(struct vm *p_vm, void (*p_build)(struct builder*), const char *p_path,
+                     enum mode p_mode) {
+	enum err err = libavm_init(p_vm);
+	if (err != ERR_OK)
+		return err;
+
+	if (p_mode == MODE_NO_FUSE)
+		p_vm->fuse_rules = FUSE_NONE;
+
+	if (p_path != NULL)
+		err = libavm_load_file(p_vm, p_path);
+	else {
+		struct builder builder;
+		builder_init(&builder);
+		p_build(&builder);
+
+		err = libavm_load_builder(p_vm, &builder);
+		builder_free(&builder);
+	}
+
+	/* Without sandboxes, the mode is the interpreter */
+#ifdef USES_SANDBOX
+	if (err == ERR_OK && p_mode == MODE_SANDBOX)
+		err = vm_sandbox(p_vm);
+#endif
+
+	return err;
+}
+
+void run_vm(struct vm *p_vm, enum mode p_mode) {
+	switch (p_mode) {
+	case MODE_JIT: vm_run_jit(p_vm); break;
+	case MODE_IR:  vm_run_ir(p_vm);  break;
+
+	default: vm_run(p_vm);
+	}
+}
+
+/* The output goes to a temporary file, stdout is put back after the run */
+static bool run(struct run *p_run, void (*p_build)(struct builder*), const char *p_path,
+                enum mode p_mode) {
+	memset(p_run, 0, sizeof(*p_run));
+
+	struct vm vm;
+	if (load(&vm, p_build, p_path, p_mode) != ERR_OK) {
+		p_run->err = libavm_error(&vm)->err;
+		libavm_destroy(&vm);
+		return false;
+	}
+
+	FILE *output = tmpfile();
+	int   saved  = dup(STDOUT_FILENO);
+	if (output == NULL || saved == -1) {
+		fprintf(stderr, "Could not redirect the output\n");
+		exit(EXIT_FAILURE);
+	}
+
+	fflush(stdout);
+	dup2(fileno(output), STDOUT_FILENO);
+
+	run_vm(&vm, p_mode);
+
+	fflush(stdout);
+	dup2(saved, STDOUT_FILENO);
+	close(saved);
+
+	p_run->ex  = vm.ex;
+	p_run->err = libavm_error(&vm)->err;
+	p_run->ip  = p_run->err == ERR_OK? 0 : libavm_error(&vm)->ip;
+
+	rewind(output);
+	p_run->output_size = fread(p_run->output, 1, sizeof(p_run->output), output);
+
+	fclose(output);
+	libavm_destroy(&vm);
+
+	return true;
+}
+
+bool load_builder(struct vm *p_vm, void (*p_build)(struct builder*), enum mode p_mode) {
+	return load(p_vm, p_build, NULL, p_mode) == ERR_OK;
+}
+
+bool run_builder(struct run *p_run, void (*p_build)(struct builder*), enum mode p_mode) {
+	return run(p_run, p_build, NULL, p_mode);
+}
+
+bool run_file(struct run *p_run, const char *p_path, enum mode p_mode) {
+	return run(p_run, NULL, p_path, p_mode);
+}
+
+static char temp_dir[] = "/tmp/avm-test-XXXXXX";
+static bool temp_made = false;
+
+static void remove_temp_dir(void) {
+	DIR *dir = opendir(temp_dir);
+	if (dir == NULL)
+		return;
+
+	char           path[PATH_SIZE];
+	struct dirent *entry;
+	while ((entry = readdir(dir)) != NULL) {
+		temp_path(path, entry->d_name);
+		unlink(path);
+	}
+
+	closedir(dir);
+	rmdir(temp_dir);
+}
+
+void temp_path(char *p_path, const char *p_name) {
+	if (!temp_made) {
+		if (mkdtemp(temp_dir) == NULL) {
+			fprintf(stderr, "Could not create a temporary directory\n");
+			exit(EXIT_FAILURE);
+		}
+
+		temp_made = true;
+		atexit(remove_temp_dir);
+	}
+
+	snprintf(p_path, PATH_SIZE, "%s/%s", temp_dir, p_name);
+}
+
+bool write_file(const char *p_path, const void *p_data, size_t p_size) {
+	FILE *file = fopen(p_path, "wb");
+	if (file == NULL)
+		return false;
+
+	bool ok = fwrite(p_data, 1, p_size, file) == p_size;
+	return fclose(file) == 0 && ok;
+}
+
+bool file_text(FILE *p_file, char *p_text, size_t p_size) {
+	fflush(p_file);
+	rewind(p_file);
+
+	size_t size = fread(p_text, 1, p_size - 1, p_file);
+	p_text[size] = '\0';
+
+	return size < p_size - 1 || fgetc(p_file) == EOF;
+}
+
+bool output_is(const struct run *p_run, const char *p_output) {
+	size_t size = strlen(p_output);
+	return p_run->output_size == size && memcmp(p_run->output, p_output, size) == 0;
+}
+
+int main(int p_argc, char **p_argv) {
+	test_files       = (const char**)p_argv + 1;
+	test_files_count = p_argc - 1;
+
+	int failed = 0;
+	for (size_t i = 0; i < ARRAY_SIZE(suites); ++ i) {
+		int before = failed_checks;
+		suites[i].run();
+
+		bool ok = failed_checks == before;
+		failed += !ok;
+
+		printf("%-16s %s\n", suites[i].name, ok? "ok" : "FAILED");
+	}
+
+	printf("%i of %i test files passed\n", (int)ARRAY_SIZE(suites) - failed, (int)ARRAY_SIZE(suites));
+	return failed == 0? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,106 @@
+#ifndef TEST_H__HEADER_GUARD__
+#define TEST_H__HEADER_GUARD__
+
+#include <stdio.h>   /* FILE, printf, fprintf, stderr */
+#include <stdbool.h> /* bool, true, false */
+#include <stddef.h>  /* size_t */
+
+#include "avm/vm.h"
+#include "avm/builder.h"
+
+/* Tests, built into bin/test by `make test`. Each file has the tests of one part
+ * of avm, in a function listed in test.c:
+ *
+ *   void test_verify(void) {
+ *       struct run run;
+ *       run_builder(&run, build_program, MODE_INTERPRETER);
+ *
+ *       CHECK(run.err == ERR_STACK_UNDERFLOW);
+ *   }
+ *
+ * A failed CHECK is reported with its line and the test goes on, the run fails
+ * at the end if any check did.
+ */
+
+#define OUTPUT_SIZE 4096
+#define PATH_SIZE   256
+
+#define CHECK(P_COND) test_check(P_COND, __FILE__, __LINE__, #P_COND)
+
+/* Ways to run a program in the process */
+enum mode {
+	MODE_INTERPRETER = 0,
+	MODE_NO_FUSE,
+	MODE_JIT,
+	MODE_IR,
+	MODE_SANDBOX,
+
+	MODES_COUNT,
+};
+
+extern const char *mode_names[MODES_COUNT];
+
+/* Executables given on the command line */
+extern const char **test_files;
+extern int          test_files_count;
+
+/* What a program did, the ip is the one of the panic */
+struct run {
+	word_t   ex;
+	enum err err; /* ERR_OK if it did not panic */
+	word_t   ip;
+
+	char   output[OUTPUT_SIZE];
+	size_t output_size;
+};
+
+/* A program with known results, see test_program */
+struct program {
+	const char *name;
+	void      (*build)(struct builder*);
+
+	word_t      ex;
+	enum err    err;
+	word_t      ip; /* Of the panic */
+	const char *output;
+};
+
+/* The programs of modes.c, with their results on every mode */
+extern const struct program programs[];
+extern const size_t         programs_count;
+
+/* Returns p_ok, a false one is reported and fails the run */
+bool test_check(bool p_ok, const char *p_file, int p_line, const char *p_what);
+
+/* Loads the program of the builder into an embedded vm, to be run by the test.
+   Returns false if it could not be loaded, the vm must still be destroyed */
+bool load_builder(struct vm *p_vm, void (*p_build)(struct builder*), enum mode p_mode);
+
+/* Runs a loaded vm on the mode */
+void run_vm(struct vm *p_vm, enum mode p_mode);
+
+/* Runs the program of the builder in an embedded vm. Returns false if it could
+   not be loaded, with the error in p_run */
+bool run_builder(struct run *p_run, void (*p_build)(struct builder*), enum mode p_mode);
+
+/* Same for an executable */
+bool run_file(struct run *p_run, const char *p_path, enum mode p_mode);
+
+/* Writes the path of p_name, in a temporary directory that is removed with its
+   files at the end of the run, into p_path of PATH_SIZE bytes */
+void temp_path(char *p_path, const char *p_name);
+
+/* Creates or replaces a file */
+bool write_file(const char *p_path, const void *p_data, size_t p_size);
+
+/* Reads what was written to p_file from its start into p_text of p_size bytes,
+   null terminated. Returns false if it did not fit */
+bool file_text(FILE *p_file, char *p_text, size_t p_size);
+
+/* Compares the output with a string */
+bool output_is(const struct run *p_run, const char *p_output);
+
+/* Runs the program on every mode, they must all give its results */
+void test_program(const struct program *p_program);
+
+#endif
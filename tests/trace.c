@@ -0,0 +1,278 @@
+/* dup, dup2, fileno */
+#define _POSIX_C_SOURCE 200809L
+
+#include <string.h> /* strcmp, strstr, memcmp, memcpy */
+#include <unistd.h> /* dup, dup2, close, STDERR_FILENO */
+#include <fcntl.h>  /* open, O_WRONLY */
+
+#include "test.h"
+#include "libavm.h"
+#include "tracer.h"
+
+/* Traces of vm_run_traced, written by trace_write and decoded by trace_print */
+
+#define SMALL_TRACE 4 /* Entries, less than the instructions of the countdown */
+#define SMALL_FILE  (TRACE_HEADER_SIZE + SMALL_TRACE * TRACE_ENTRY_SIZE)
+
+/* 11 instructions: PSH, three times DEC, DUP, JNZ, then HLT */
+static void build_countdown(struct builder *p_b) {
+	builder_emit(p_b, OP_PSH, 3);
+	word_t loop = builder_emit(p_b, OP_DEC, 0);
+	builder_emit(p_b, OP_DUP, 0);
+	builder_emit(p_b, OP_JNZ, loop);
+	builder_emit(p_b, OP_HLT, 0);
+
+	builder_add_symbol(p_b, "loop", loop, 3);
+}
+
+#define COUNTDOWN_STEPS 11
+
+/* The ip, the opcode and the top of the stack before each instruction */
+static const struct trace_entry countdown[COUNTDOWN_STEPS] = {
+	{0 << 8 | OP_PSH, 0},
+	{1 << 8 | OP_DEC, 3}, {2 << 8 | OP_DUP, 2}, {3 << 8 | OP_JNZ, 2},
+	{1 << 8 | OP_DEC, 2}, {2 << 8 | OP_DUP, 1}, {3 << 8 | OP_JNZ, 1},
+	{1 << 8 | OP_DEC, 1}, {2 << 8 | OP_DUP, 0}, {3 << 8 | OP_JNZ, 0},
+	{4 << 8 | OP_HLT, 0},
+};
+
+#define INVALID_OP 0xEE
+
+/* Panics on its second instruction */
+static void build_invalid(struct builder *p_b) {
+	builder_emit(p_b, OP_PSH, 5);
+	builder_emit(p_b, (enum opcode)INVALID_OP, 0);
+	builder_emit(p_b, OP_HLT, 0);
+}
+
+static void build_div_by_zero(struct builder *p_b) {
+	builder_emit(p_b, OP_PSH, 5);
+	builder_emit(p_b, OP_PSH, 0);
+	builder_emit(p_b, OP_DIV, 0);
+	builder_emit(p_b, OP_HLT, 0);
+}
+
+/* Runs the program of p_build on a trace of p_size entries, which the caller
+   frees. The vm must be destroyed */
+static bool run_traced(struct vm *p_vm, struct trace *p_trace, void (*p_build)(struct builder*),
+                       word_t p_size) {
+	trace_init(p_trace, p_size);
+	if (!load_builder(p_vm, p_build, MODE_INTERPRETER))
+		return false;
+
+	p_vm->trace = p_trace;
+	vm_run_traced(p_vm);
+
+	return true;
+}
+
+static bool entry_is(struct trace *p_trace, word_t p_i, uint64_t p_ip_op, uint64_t p_tos) {
+	struct trace_entry *entry = trace_at(p_trace, p_i);
+	return entry->ip_op == p_ip_op && entry->tos == p_tos;
+}
+
+/* The whole run, then only its end once the buffer wraps */
+static void test_ring(void) {
+	static const word_t sizes[] = {0x10, SMALL_TRACE, 3, 1};
+
+	for (size_t i = 0; i < ARRAY_SIZE(sizes); ++ i) {
+		struct vm    vm;
+		struct trace trace;
+		if (CHECK(run_traced(&vm, &trace, build_countdown, sizes[i])) &&
+		    CHECK(libavm_error(&vm)->err == ERR_OK && vm.ex == 0)) {
+			/* Rounded up to a power of two */
+			word_t size = sizes[i] == 3? 4 : sizes[i];
+			word_t len  = size < COUNTDOWN_STEPS? size : COUNTDOWN_STEPS;
+
+			CHECK(trace.recorded == COUNTDOWN_STEPS && trace_length(&trace) == len);
+			for (word_t j = 0; j < len; ++ j) {
+				const struct trace_entry *step = &countdown[COUNTDOWN_STEPS - len + j];
+				if (!CHECK(entry_is(&trace, j, step->ip_op, step->tos)))
+					fprintf(stderr, "  size %llu, entry %llu\n", (long long unsigned)sizes[i],
+					        (long long unsigned)j);
+			}
+		}
+
+		libavm_destroy(&vm);
+		trace_free(&trace);
+	}
+}
+
+/* The failing instruction is the last entry */
+static void test_panics(void) {
+	static const struct {
+		const char *name;
+		void      (*build)(struct builder*);
+		enum err    err;
+		uint64_t    ip_op, tos;
+	} panics[] = {
+		{"invalid",     build_invalid,     ERR_INVALID_INST, 1 << 8 | INVALID_OP, 5},
+		{"div-by-zero", build_div_by_zero, ERR_DIV_BY_ZERO,  2 << 8 | OP_DIV,     0},
+	};
+
+	for (size_t i = 0; i < ARRAY_SIZE(panics); ++ i) {
+		struct vm    vm;
+		struct trace trace;
+		if (CHECK(run_traced(&vm, &trace, panics[i].build, SMALL_TRACE))) {
+			word_t len = trace_length(&trace);
+			if (!CHECK(libavm_error(&vm)->err == panics[i].err && len > 0 &&
+			           entry_is(&trace, len - 1, panics[i].ip_op, panics[i].tos)))
+				fprintf(stderr, "  %s: %s\n", panics[i].name, err_str(libavm_error(&vm)->err));
+		}
+
+		libavm_destroy(&vm);
+		trace_free(&trace);
+	}
+}
+
+/* trace_print of a file that is not a valid trace, its message goes nowhere */
+static bool print_quietly(const char *p_path, FILE *p_file) {
+	fflush(stderr);
+	int saved = dup(STDERR_FILENO), null = open("/dev/null", O_WRONLY);
+	if (saved != -1 && null != -1)
+		dup2(null, STDERR_FILENO);
+
+	bool ok = trace_print(p_path, p_file, NULL);
+
+	fflush(stderr);
+	if (saved != -1 && null != -1)
+		dup2(saved, STDERR_FILENO);
+
+	if (saved != -1)
+		close(saved);
+
+	if (null != -1)
+		close(null);
+
+	return ok;
+}
+
+static void test_print(void) {
+	static char text[0x1000], expected[0x1000];
+
+	char path[PATH_SIZE];
+	temp_path(path, "countdown.avt");
+
+	struct vm    vm;
+	struct trace trace;
+	if (!CHECK(run_traced(&vm, &trace, build_countdown, SMALL_TRACE)) ||
+	    !CHECK(trace_write(&vm, path))) {
+		libavm_destroy(&vm);
+		trace_free(&trace);
+		return;
+	}
+
+	snprintf(expected, sizeof(expected),
+	         "Trace of avm %i.%i.%i, the last 4 of 11 executed instructions\n"
+	         "                   #  ip                  op   top of stack\n"
+	         "                   7  0x0000000000000001  DEC  0x0000000000000001 (1) <loop>\n"
+	         "                   8  0x0000000000000002  DUP  0x0000000000000000 (0) <loop+0x1>\n"
+	         "                   9  0x0000000000000003  JNZ  0x0000000000000000 (0) <loop+0x2>\n"
+	         "                  10  0x0000000000000004  HLT  0x0000000000000000 (0)\n",
+	         VERSION_MAJOR, VERSION_MINOR, VERSION_PATCH);
+
+	FILE *output = tmpfile();
+	if (CHECK(output != NULL)) {
+		if (CHECK(trace_print(path, output, &vm)) && CHECK(file_text(output, text, sizeof(text))))
+			CHECK(strcmp(text, expected) == 0);
+
+		/* Without the symbols of the program */
+		rewind(output);
+		if (CHECK(trace_print(path, output, NULL)) && CHECK(file_text(output, text, sizeof(text))))
+			CHECK(strstr(text, "(1)\n") != NULL && strstr(text, "<loop") == NULL);
+
+		fclose(output);
+	}
+
+	libavm_destroy(&vm);
+	trace_free(&trace);
+
+	/* Malformed files */
+	uint8_t bytes[SMALL_FILE];
+
+	FILE *file = fopen(path, "rb");
+	if (!CHECK(file != NULL && fread(bytes, 1, SMALL_FILE, file) == SMALL_FILE &&
+	           fgetc(file) == EOF)) {
+		if (file != NULL)
+			fclose(file);
+
+		return;
+	}
+
+	fclose(file);
+
+	static const struct {
+		const char *name;
+		size_t      at;
+		uint8_t     byte;
+		size_t      size;
+	} malformed[] = {
+		{"magic",      0,                     'X', SMALL_FILE},
+		{"header",     0,                     'A', TRACE_HEADER_SIZE - 1},
+		{"over-count", TRACE_HEADER_SIZE - 1, 3,   SMALL_FILE}, /* Fewer executed than kept */
+		{"truncated",  0,                     'A', SMALL_FILE - TRACE_ENTRY_SIZE / 2},
+	};
+
+	char patched_path[PATH_SIZE];
+	temp_path(patched_path, "malformed.avt");
+
+	FILE *sink = fopen("/dev/null", "w");
+	for (size_t i = 0; i < ARRAY_SIZE(malformed) && CHECK(sink != NULL); ++ i) {
+		uint8_t patched[sizeof(bytes)];
+		memcpy(patched, bytes, sizeof(bytes));
+		patched[malformed[i].at] = malformed[i].byte;
+
+		if (CHECK(write_file(patched_path, patched, malformed[i].size)) &&
+		    !CHECK(!print_quietly(patched_path, sink)))
+			fprintf(stderr, "  malformed %s\n", malformed[i].name);
+	}
+
+	temp_path(patched_path, "missing.avt");
+	CHECK(sink == NULL || !print_quietly(patched_path, sink));
+
+	if (sink != NULL)
+		fclose(sink);
+}
+
+#ifdef USES_SIGUSR1
+/* A request before the first instruction writes an empty trace, then the
+   program runs to its end */
+static void test_request(void) {
+	char path[PATH_SIZE];
+	temp_path(path, "request.avt");
+
+	struct vm    vm;
+	struct trace trace;
+	trace_init(&trace, SMALL_TRACE);
+	if (CHECK(load_builder(&vm, build_countdown, MODE_INTERPRETER))) {
+		vm.trace = &trace;
+		VM_SET_HALT(&vm, HALT_TRACE);
+
+		trace_run(&vm, path);
+		CHECK(libavm_error(&vm)->err == ERR_OK && vm.ex == 0 && VM_HALT(&vm) == HALT_PROGRAM);
+		CHECK(trace.recorded == COUNTDOWN_STEPS);
+
+		uint8_t header[TRACE_HEADER_SIZE];
+		FILE   *file = fopen(path, "rb");
+		if (CHECK(file != NULL)) {
+			CHECK(fread(header, 1, sizeof(header), file) == sizeof(header) && fgetc(file) == EOF);
+			CHECK(memcmp(header, "AVMT", 4) == 0);
+
+			fclose(file);
+		}
+	}
+
+	libavm_destroy(&vm);
+	trace_free(&trace);
+}
+#endif
+
+void test_trace(void) {
+	test_ring();
+	test_panics();
+	test_print();
+
+#ifdef USES_SIGUSR1
+	test_request();
+#endif
+}
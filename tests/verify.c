@@ -0,0 +1,96 @@
+#include "test.h"
+
+/* Malformed programs. The verifier lets the unchecked interpreter run a program,
+   so it must not pass one that the checked interpreter stops */
+
+#define HUGE_OPERAND 0xC000000000000000 /* Negative as a signed word */
+#define MAX_OPERAND  ((word_t)-1)
+
+static void build_dup_huge(struct builder *p_b) {
+	builder_emit(p_b, OP_PSH, 1);
+	builder_emit(p_b, OP_DUP, HUGE_OPERAND);
+	builder_emit(p_b, OP_PRT, 0);
+	builder_emit(p_b, OP_HLT, 0);
+}
+
+/* + 1 wraps around to 0 */
+static void build_dup_max(struct builder *p_b) {
+	builder_emit(p_b, OP_PSH, 1);
+	builder_emit(p_b, OP_DUP, MAX_OPERAND);
+	builder_emit(p_b, OP_PRT, 0);
+}
+
+static void build_dup_2_32(struct builder *p_b) {
+	builder_emit(p_b, OP_PSH, 1);
+	builder_emit(p_b, OP_DUP, (word_t)1 << 32);
+	builder_emit(p_b, OP_PRT, 0);
+}
+
+static void build_swp_huge(struct builder *p_b) {
+	builder_emit(p_b, OP_PSH, 1);
+	builder_emit(p_b, OP_PSH, 2);
+	builder_emit(p_b, OP_SWP, HUGE_OPERAND);
+	builder_emit(p_b, OP_PRT, 0);
+}
+
+/* + 2 wraps around to 0 and to 1 */
+static void build_swp_max(struct builder *p_b) {
+	builder_emit(p_b, OP_PSH, 1);
+	builder_emit(p_b, OP_SWP, MAX_OPERAND - 1);
+	builder_emit(p_b, OP_SWP, MAX_OPERAND);
+}
+
+/* The bounds of the block after the jump come from the DUP */
+static void build_dup_huge_jump(struct builder *p_b) {
+	builder_emit(p_b, OP_PSH, 1);
+	word_t jump = builder_emit(p_b, OP_JMP, 0);
+	builder_emit(p_b, OP_HLT, 0);
+	builder_patch(p_b, jump, builder_emit(p_b, OP_PSH, 2));
+	builder_emit(p_b, OP_DUP, HUGE_OPERAND);
+	builder_emit(p_b, OP_PRT, 0);
+}
+
+static void build_invalid_opcode(struct builder *p_b) {
+	builder_emit(p_b, OP_PSH, 1);
+	builder_emit(p_b, OP_PRT, 0);
+	builder_emit(p_b, (enum opcode)0x99, 0);
+}
+
+static void build_jump_outside(struct builder *p_b) {
+	builder_emit(p_b, OP_PSH, 1);
+	builder_emit(p_b, OP_JNZ, 1000);
+}
+
+static void build_call_outside(struct builder *p_b) {
+	builder_emit(p_b, OP_NOP, 0);
+	builder_emit(p_b, OP_CAL, MAX_OPERAND);
+}
+
+static void build_stack_underflow(struct builder *p_b) {
+	builder_emit(p_b, OP_PSH, 1);
+	builder_emit(p_b, OP_ADD, 0);
+}
+
+static void build_stack_overflow(struct builder *p_b) {
+	word_t loop = builder_emit(p_b, OP_PSH, 1);
+	builder_emit(p_b, OP_JMP, loop);
+}
+
+static const struct program corpus[] = {
+	{"dup-huge",        build_dup_huge,        0, ERR_STACK_UNDERFLOW,     1, ""},
+	{"dup-max",         build_dup_max,         0, ERR_STACK_UNDERFLOW,     1, ""},
+	{"dup-2^32",        build_dup_2_32,        0, ERR_STACK_UNDERFLOW,     1, ""},
+	{"swp-huge",        build_swp_huge,        0, ERR_STACK_UNDERFLOW,     2, ""},
+	{"swp-max",         build_swp_max,         0, ERR_STACK_UNDERFLOW,     1, ""},
+	{"dup-huge-jump",   build_dup_huge_jump,   0, ERR_STACK_UNDERFLOW,     4, ""},
+	{"invalid-opcode",  build_invalid_opcode,  0, ERR_INVALID_INST,        2, "1\n"},
+	{"jump-outside",    build_jump_outside,    0, ERR_INVALID_INST_ACCESS, 1, ""},
+	{"call-outside",    build_call_outside,    0, ERR_INVALID_INST_ACCESS, 1, ""},
+	{"stack-underflow", build_stack_underflow, 0, ERR_STACK_UNDERFLOW,     1, ""},
+	{"stack-overflow",  build_stack_overflow,  0, ERR_STACK_OVERFLOW,      0, ""},
+};
+
+void test_verify(void) {
+	for (size_t i = 0; i < ARRAY_SIZE(corpus); ++ i)
+		test_program(&corpus[i]);
+}